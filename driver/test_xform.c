@@ -0,0 +1,109 @@
+// Transform kernels: every SIMD kernel the CPU runs must give the samples of the
+// scalar path, saturation edge values included. No board needed: built with the
+// library source to reach its static kernels (make check).
+
+#include "xpdma.c"
+
+#include <math.h>
+
+#define TEST_SAMPLES 67 // not a multiple of 16 or 8: the scalar tails run too
+
+static int failures;
+
+static void test_fill(float *f, int16_t *s, size_t n, unsigned int seed)
+{
+    static const float edges[] = {
+        INFINITY, -INFINITY, NAN, -NAN, 2147483648.0f, -2147483648.0f, 3e9f, -3e9f,
+        32767.0f, 32767.4f, 32767.5f, 32768.0f, -32768.0f, -32768.5f, -32769.0f,
+        0.5f, 1.5f, 2.5f, -0.5f, -1.5f, -2.5f, 0.0f, -0.0f
+    };
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        f[i] = (i < sizeof(edges) / sizeof(edges[0])) ? edges[i] : ((float)(int)(seed >> 8) / (1 << 10));
+        s[i] = (int16_t)(seed >> 12);
+    }
+}
+
+static void test_compare(const char *what, const void *got, const void *want, size_t bytes)
+{
+    if (memcmp(got, want, bytes)) {
+        fprintf(stderr, "FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static void test_kernels(const char *name, const struct xpdma_xform_kernels *k)
+{
+    static const float scales[] = {1.0f, 1.0f / 32768.0f, 32768.0f};
+    float f[TEST_SAMPLES], fGot[TEST_SAMPLES], fWant[TEST_SAMPLES];
+    int16_t s[TEST_SAMPLES], sGot[TEST_SAMPLES], sWant[TEST_SAMPLES];
+    char what[64];
+    unsigned int c;
+    int swap;
+
+    test_fill(f, s, TEST_SAMPLES, 1);
+
+    xpdma_swap16_scalar((uint16_t *)sWant, (const uint16_t *)s, TEST_SAMPLES);
+    k->swap16((uint16_t *)sGot, (const uint16_t *)s, TEST_SAMPLES);
+    snprintf(what, sizeof(what), "%s swap16", name);
+    test_compare(what, sGot, sWant, sizeof(sGot));
+
+    for (c = 0; c < sizeof(scales) / sizeof(scales[0]); ++c) {
+        for (swap = 0; swap < 2; ++swap) {
+            xpdma_f32ToS16_scalar(sWant, f, TEST_SAMPLES, swap, scales[c]);
+            k->f32ToS16(sGot, f, TEST_SAMPLES, swap, scales[c]);
+            snprintf(what, sizeof(what), "%s f32ToS16 scale %g swap %d", name, scales[c], swap);
+            test_compare(what, sGot, sWant, sizeof(sGot));
+
+            xpdma_s16ToF32_scalar(fWant, s, TEST_SAMPLES, swap, scales[c]);
+            k->s16ToF32(fGot, s, TEST_SAMPLES, swap, scales[c]);
+            snprintf(what, sizeof(what), "%s s16ToF32 scale %g swap %d", name, scales[c], swap);
+            test_compare(what, fGot, fWant, sizeof(fGot));
+        }
+    }
+}
+
+static void test_sat16(float v, int16_t want)
+{
+    if (xpdma_xform_sat16(v) != want) {
+        fprintf(stderr, "FAIL sat16(%g) = %d, want %d\n", v, xpdma_xform_sat16(v), want);
+        failures++;
+    }
+}
+
+int main(void)
+{
+    const struct xpdma_xform_kernels scalar = {xpdma_swap16_scalar, xpdma_s16ToF32_scalar, xpdma_f32ToS16_scalar};
+
+    test_sat16(INFINITY, 32767);
+    test_sat16(-INFINITY, -32768);
+    test_sat16(NAN, -32768);
+    test_sat16(3e9f, 32767);
+    test_sat16(-3e9f, -32768);
+#ifdef XPDMA_XFORM_X86
+    test_sat16(2.5f, 2);        // round to nearest even
+    test_sat16(-1.5f, -2);
+#endif
+
+    test_kernels("scalar", &scalar);
+#ifdef XPDMA_XFORM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        const struct xpdma_xform_kernels sse = {xpdma_swap16_sse, xpdma_s16ToF32_sse, xpdma_f32ToS16_sse};
+        test_kernels("sse4.1", &sse);
+    } else {
+        printf("sse4.1 not supported, skipped\n");
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        const struct xpdma_xform_kernels avx2 = {xpdma_swap16_avx2, xpdma_s16ToF32_avx2, xpdma_f32ToS16_avx2};
+        test_kernels("avx2", &avx2);
+    } else {
+        printf("avx2 not supported, skipped\n");
+    }
+#endif
+
+    printf("%s\n", failures ? "test_xform: FAILED" : "test_xform: passed");
+    return failures ? 1 : 0;
+}
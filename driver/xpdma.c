@@ -2,12 +2,22 @@
 // Created by user on 8/3/15.
 //
 
+#define _GNU_SOURCE // pthread_setaffinity_np
+
 #include <stddef.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 
 #include "xpdma.h"
 #include <stdio.h>
@@ -16,9 +26,19 @@
 #define CTR_REG_OFFSET 0x00004000 // TODO: temporary. For tests only
 #define CTR_REG_SIZE   (4<<10)    // 4 kB configuration memory
 
+struct xpdma_coalesce;
+struct xpdma_regcache;
+struct xpdma_stage;
+
 struct xpdma_t {
     int fd;
     int id;
+    struct xpdma_coalesce *wc; // write coalescing state, NULL if disabled
+    struct xpdma_regcache *rc; // zero copy registration cache, NULL if disabled
+    int numaBind;              // strict NUMA placement of buffers and internal threads
+    struct xpdma_stage *stage; // transform staging buffers, NULL until the first transform
+    unsigned int traceId;      // handle number in traces
+    uint64_t ddrSize;          // board DDR3 bytes (XPDMA_PARAM_DDR_SIZE), 0 until asked
 };
 
 static int gfd = -1; // global device file escriptor
@@ -39,220 +59,2491 @@ inline void logger(const char* data, const uint32_t addr)
     }
 }
 
-xpdma_t *xpdma_open(int id) 
-{
+/**
+ * Tracing: records are buffered and written XPDMA_TRACE_BATCH at a time under
+ * one lock. A traced call raises the per thread depth, so the calls it makes
+ * itself (and the stream worker threads it starts) are not recorded again.
+ */
+#define XPDMA_TRACE_BATCH   1024 // records per write
 
-    //logger("xpdma_open ", 0);
-    //if ((sem = sem_open(SEM_NAME, O_CREAT, 0666, 1)) == SEM_FAILED) {
-    //    perror("sem_open");
-    //    return NULL;
-    //}
+struct xpdma_trace {
+    pthread_mutex_t lock;
+    int fd;                     // trace file, -1 - not tracing
+    uint64_t base;              // CLOCK_MONOTONIC of the trace start, ns
+    unsigned int n;             // buffered records
+    xpdma_trace_rec_t recs[XPDMA_TRACE_BATCH];
+};
 
-    //sem_wait (sem); 
-    xpdma_t * device;
-    if (id >= XPDMA_NUM_MAX)
-        return NULL;
+// Traced call in progress
+struct xpdma_trace_op {
+    int state;                  // 0 - not traced, 1 - inside a traced call, 2 - recorded
+    xpdma_trace_rec_t rec;
+};
 
-    device = (xpdma_t *)malloc(sizeof(xpdma_t));
-    if (device == NULL)
-        return NULL;
+static struct xpdma_trace gTrace = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+static volatile int gTraceOn;           // checked without the lock on every call
+static __thread int gTraceDepth;        // traced calls active on this thread
+static unsigned int gTraceDevices;      // handle numbers given by xpdma_open
+static pthread_once_t gTraceEnvOnce = PTHREAD_ONCE_INIT;
+static pthread_once_t gTraceExitOnce = PTHREAD_ONCE_INIT;
 
-    if (gfd < 0) 
-        gfd = open("/dev/" DEVICE_NAME, O_RDWR | O_SYNC);
-    
-    if (gfd < 0) {
-        free(device);
-        ////logger("xpdma_open: failed\n");
-        return NULL;
+static uint64_t xpdma_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int xpdma_trace_writeLocked(const void *data, size_t size)
+{
+    const char *cur = (const char *)data;
+    ssize_t n;
+
+    while (size) {
+        n = write(gTrace.fd, cur, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        cur += n;
+        size -= n;
     }
+    return 0;
+}
 
-    device->id = id;
-    device->fd = gfd;
-    gOpenCount++;
-    //sem_post (sem);
-    
-    ////logger("xpdma_open: finish\n");
+static void xpdma_trace_exit(void)
+{
+    xpdma_traceStop();
+}
 
-    return device;
+static void xpdma_trace_atExit(void)
+{
+    atexit(xpdma_trace_exit);
 }
 
-void xpdma_close(xpdma_t * device) {
-    //logger("xpdma_close ", 0);
-    //sem_wait (sem); 
-    //printf ("free DEVICE\n");
-    if (device != NULL) {
-        free(device);
-        device = NULL;
-        ////logger("xpdma_close: free(device) \n");
+int xpdma_traceStart(const char *path)
+{
+    xpdma_trace_header_t header;
+    struct timespec now;
+    int result = -1;
+
+    if (path == NULL)
+        return -1;
+
+    pthread_mutex_lock(&gTrace.lock);
+    if (gTrace.fd < 0) {
+        gTrace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (gTrace.fd >= 0) {
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, XPDMA_TRACE_MAGIC, sizeof(header.magic));
+            header.version = XPDMA_TRACE_VERSION;
+            header.recordSize = sizeof(xpdma_trace_rec_t);
+            clock_gettime(CLOCK_REALTIME, &now);
+            header.startTime = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+            gTrace.base = xpdma_trace_now();
+            gTrace.n = 0;
+            result = xpdma_trace_writeLocked(&header, sizeof(header));
+            if (result) {
+                close(gTrace.fd);
+                gTrace.fd = -1;
+            }
+        }
     }
+    gTraceOn = gTrace.fd >= 0;
+    pthread_mutex_unlock(&gTrace.lock);
 
-    if (gOpenCount == 0) {
-        close(gfd);
-        gfd = -1;
-    } else {
-        gOpenCount--;
+    // buffered records of a trace still on at exit
+    if (result == 0)
+        pthread_once(&gTraceExitOnce, xpdma_trace_atExit);
+    return result;
+}
+
+int xpdma_traceStop(void)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&gTrace.lock);
+    gTraceOn = 0;
+    if (gTrace.fd >= 0) {
+        result = xpdma_trace_writeLocked(gTrace.recs, gTrace.n * sizeof(gTrace.recs[0]));
+        if (close(gTrace.fd))
+            result = -1;
     }
-    //sem_post (sem);
+    gTrace.fd = -1;
+    gTrace.n = 0;
+    pthread_mutex_unlock(&gTrace.lock);
+    return result;
+}
 
-    //sem_close(sem);
-    ////sem_unlink(//sem_NAME);
-    ////logger("xpdma_close: finish\n");
-    //printf ("end free DEVICE\n");
+static void xpdma_trace_env(void)
+{
+    const char *path = getenv("XPDMA_TRACE");
+
+    if (path != NULL && *path != 0 && xpdma_traceStart(path))
+        fprintf(stderr, "xpdma: can't write trace %s\n", path);
 }
 
-int xpdma_send(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
+// Internal thread of a traced call (stream worker): nothing it does is recorded
+static void xpdma_trace_internal(void)
 {
-    ////logger("xpdma_send ", addr);
-    if (fpga == NULL)
-        return -1;
+    gTraceDepth++;
+}
 
-    if ( addr % 4 )
+static void xpdma_trace_begin(struct xpdma_trace_op *op, xpdma_t *fpga, int code,
+                              uint64_t count, uint64_t addr, uint32_t flags)
+{
+    op->state = 0;
+    if (!gTraceOn)
+        return;
+
+    op->state = gTraceDepth++ ? 1 : 2;
+    if (op->state == 1)
+        return;
+
+    memset(&op->rec, 0, sizeof(op->rec));
+    op->rec.op = code;
+    op->rec.board = (fpga != NULL) ? fpga->id : -1;
+    op->rec.device = (fpga != NULL) ? fpga->traceId : 0;
+    op->rec.count = count;
+    op->rec.addr = addr;
+    op->rec.flags = flags;
+    op->rec.start = xpdma_trace_now();
+}
+
+static void xpdma_trace_end(struct xpdma_trace_op *op, int result)
+{
+    xpdma_trace_rec_t *rec = &op->rec;
+
+    if (op->state == 0)
+        return;
+    gTraceDepth--;
+    if (op->state == 1)
+        return;
+
+    rec->end = xpdma_trace_now();
+    rec->result = result ? -1 : 0;
+    rec->thread = (uint32_t)syscall(SYS_gettid);
+
+    pthread_mutex_lock(&gTrace.lock);
+    if (gTrace.fd >= 0) {
+        rec->start = (rec->start > gTrace.base) ? rec->start - gTrace.base : 0;
+        rec->end = (rec->end > gTrace.base) ? rec->end - gTrace.base : 0;
+        gTrace.recs[gTrace.n++] = *rec;
+        if (gTrace.n == XPDMA_TRACE_BATCH) {
+            if (xpdma_trace_writeLocked(gTrace.recs, sizeof(gTrace.recs))) {
+                // trace file full or gone: stop instead of failing transfers
+                gTraceOn = 0;
+                close(gTrace.fd);
+                gTrace.fd = -1;
+            }
+            gTrace.n = 0;
+        }
+    }
+    pthread_mutex_unlock(&gTrace.lock);
+}
+
+uint64_t xpdma_trace_packTransform(const xpdma_transform_t *tf)
+{
+    uint32_t scale;
+
+    memcpy(&scale, &tf->scale, sizeof(scale));
+    return (uint64_t)(tf->format & 0xff) | (uint64_t)(tf->hostFormat & 0xff) << 8 |
+           (uint64_t)(tf->swap & 0xff) << 16 | (uint64_t)(tf->channels & 0xff) << 24 |
+           (uint64_t)scale << 32;
+}
+
+void xpdma_trace_unpackTransform(uint64_t arg, xpdma_transform_t *tf)
+{
+    uint32_t scale = (uint32_t)(arg >> 32);
+
+    tf->format = arg & 0xff;
+    tf->hostFormat = (arg >> 8) & 0xff;
+    tf->swap = (arg >> 16) & 0xff;
+    tf->channels = (arg >> 24) & 0xff;
+    memcpy(&tf->scale, &scale, sizeof(tf->scale));
+}
+
+/**
+ * NUMA placement: the board node comes from the driver (XPDMA_PARAM_NUMA_NODE),
+ * its CPUs from sysfs. Buffers from xpdma_allocBuffer get a memory policy for
+ * that node before first touch; with xpdma_setNumaBind the policy is strict and
+ * the internal threads of the handle run on the node CPUs.
+ */
+#define XPDMA_NODE_MAX          1024 // nodes in the mbind mask
+#define XPDMA_MPOL_PREFERRED    1    // <numaif.h> values, libnuma is not needed
+#define XPDMA_MPOL_BIND         2
+
+static int xpdma_nodeCpuList(int node, char *list, size_t size)
+{
+    char path[64];
+    FILE *file;
+    char *line;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    file = fopen(path, "r");
+    if (file == NULL)
         return -1;
-    
-    cdmaBuffer_t buffer = {fpga->id, data, count, addr};
-    
-    ////logger("xpdma_send: lock\n");
-    //sem_wait (sem); 
-    ////logger("xpdma_send: ioctl", addr);
-    ioctl(fpga->fd, IOCTL_SEND, &buffer);
-    ////logger("xpdma_send: unlock", addr);
-    //sem_post (sem);
-    ////logger("xpdma_send: finish\n");
+    line = fgets(list, size, file);
+    fclose(file);
+    if (line == NULL)
+        return -1;
+
+    list[strcspn(list, "\n")] = '\0';
     return 0;
 }
 
-int xpdma_recv(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
+// Parse a cpulist ("0-7,16-23"), returns number of CPUs set
+static int xpdma_parseCpuList(const char *cur, cpu_set_t *set)
 {
-    //logger("xpdma_recv ", addr);
-    if (fpga == NULL)
+    int first;
+    int last;
+
+    CPU_ZERO(set);
+    while (sscanf(cur, "%d", &first) == 1) {
+        last = first;
+        while (*cur >= '0' && *cur <= '9')
+            cur++;
+        if (*cur == '-' && sscanf(++cur, "%d", &last) == 1)
+            while (*cur >= '0' && *cur <= '9')
+                cur++;
+        for (; first <= last && first < CPU_SETSIZE; ++first)
+            CPU_SET(first, set);
+        if (*cur != ',')
+            break;
+        cur++;
+    }
+
+    return CPU_COUNT(set);
+}
+
+int xpdma_getNumaNode(xpdma_t *fpga)
+{
+    uint64_t node;
+
+    if (xpdma_getParam(fpga, XPDMA_PARAM_NUMA_NODE, &node) || (int64_t)node < 0)
         return -1;
+    return (int)node;
+}
 
-    if ( addr % 4 )
+int xpdma_getLocalCpuList(xpdma_t *fpga, char *list, size_t size)
+{
+    int node = xpdma_getNumaNode(fpga);
+
+    if (node < 0 || list == NULL || size == 0)
         return -1;
+    return xpdma_nodeCpuList(node, list, size);
+}
 
-    cdmaBuffer_t buffer = {fpga->id, data, count, addr};
-    
-    ////logger("xpdma_recv: lock\n");
-    //sem_wait (sem); 
-    ////logger("xpdma_recv: ioctl\n");
-    ioctl(fpga->fd, IOCTL_RECV, &buffer);
-    ////logger("xpdma_recv: unlock\n");
-    //sem_post (sem);
-    ////logger("xpdma_recv: finish\n");
-    return 0;
+int xpdma_bindThread(xpdma_t *fpga)
+{
+    char list[1024];
+    cpu_set_t set;
+
+    if (xpdma_getLocalCpuList(fpga, list, sizeof(list)) || xpdma_parseCpuList(list, &set) == 0)
+        return -1;
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ? -1 : 0;
 }
 
-void xpdma_writeReg(xpdma_t *fpga, uint32_t addr, uint32_t value)
+int xpdma_setNumaBind(xpdma_t *fpga, int enable)
 {
-    ////logger("xpdma_writeReg ", addr);
     if (fpga == NULL)
-        return;
-    
-    cdmaReg_t data;
-    data.id = fpga->id;
-    data.reg = addr;
-    data.value = value;
-    
-    ////logger("xpdma_writeReg: lock\n");
-    //sem_wait (sem); 
-    //logger("xpdma_writeReg: ioctl", addr);
-    ioctl(fpga->fd, IOCTL_WRCDMAREG, &data);
-    //logger("xpdma_writeReg: unlock", addr);
-    //sem_post (sem);
-    ////logger("xpdma_writeReg: finish\n");
+        return -1;
+    fpga->numaBind = enable;
+    return 0;
 }
 
-uint32_t xpdma_readReg(xpdma_t *fpga, uint32_t addr)
+void *xpdma_allocBuffer(xpdma_t *fpga, size_t size)
 {
-    ////logger("xpdma_readReg ",addr);
-    if (fpga == NULL)
-        return 0;
+    unsigned long mask[XPDMA_NODE_MAX / (8 * sizeof(unsigned long))];
+    const unsigned int bits = 8 * sizeof(unsigned long);
+    void *ptr;
+    int node;
 
-    cdmaReg_t data;
-    data.id = fpga->id;
-    data.reg = addr;
-    data.value = 0;
-    
-    ////logger("xpdma_readReg: lock\n");
-    //sem_wait (sem); 
-    //logger("xpdma_readReg: ioctl", addr);
-    ioctl(fpga->fd, IOCTL_RDCDMAREG, &data);
-    //logger("xpdma_readReg: unlock", addr);
-    //sem_post (sem);
-    ////logger("xpdma_readReg: finish\n");
-    return data.value;
+    if (fpga == NULL || size == 0)
+        return NULL;
+
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+    node = xpdma_getNumaNode(fpga);
+    if (node >= 0 && node < XPDMA_NODE_MAX) {
+        memset(mask, 0, sizeof(mask));
+        mask[node / bits] |= 1UL << (node % bits);
+        // pages are allocated on first touch, under this policy
+        if (syscall(SYS_mbind, ptr, size, fpga->numaBind ? XPDMA_MPOL_BIND : XPDMA_MPOL_PREFERRED,
+                    mask, XPDMA_NODE_MAX + 1, 0) && fpga->numaBind) {
+            munmap(ptr, size);
+            return NULL;
+        }
+    }
+
+    return ptr;
 }
 
-void xpdma_read(xpdma_t *fpga, void *data, unsigned int count)
+int xpdma_freeBuffer(void *ptr, size_t size)
 {
-    printf("xpdma_read called!\n");
-    read(fpga->fd, data, count);
-    printf("xpdma_read: %u bytes have been read from fpga...\n", count);
+    return munmap(ptr, size);
 }
 
-void xpdma_write(xpdma_t *fpga, void *data, unsigned int count)
+/**
+ * Write coalescing: small sends to adjacent DDR addresses are staged per handle
+ * and sent as one DMA on size/age threshold, xpdma_flush(), before an overlapping
+ * receive or send on any handle of the board, and on close.
+ */
+struct xpdma_coalesce {
+    xpdma_t *fpga;
+    struct xpdma_coalesce *next; // next handle with coalescing (gWcLock)
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stop;
+    int error;              // result of a failed background flush, not reported yet
+    char *buffer;           // staging buffer, flushSize bytes
+    unsigned int maxWrite;  // sends smaller than this are staged
+    unsigned int flushSize; // flush when staged extent reaches this size
+    unsigned int maxAgeUs;  // flush when the oldest staged write is this old
+    unsigned int base;      // staged extent DDR address
+    unsigned int len;       // staged extent length (0 - empty)
+    struct timespec deadline;
+};
+
+static int xpdma_coalesce_flushLocked(xpdma_t *fpga)
 {
-    printf("xpdma_write called!\n");
-    write(fpga->fd, data, count);
-    printf("xpdma_write: %u bytes have been written to fpga...\n", count);
+    struct xpdma_coalesce *wc = fpga->wc;
+    int result;
+
+    if (wc->len == 0)
+        return 0;
+
+    // a failed send keeps the data staged, the next flush sends it again
+    cdmaBuffer_t buffer = {fpga->id, wc->buffer, wc->len, wc->base, 0};
+    result = ioctl(fpga->fd, IOCTL_SEND, &buffer);
+    if (result == 0)
+        wc->len = 0;
+    return result;
 }
 
-void xpdma_test_sg(xpdma_t *fpga, void *data, unsigned int count)
+static int xpdma_coalesce_overlaps(struct xpdma_coalesce *wc, unsigned int count, unsigned int addr)
 {
-    //logger("xpdma_test_sg: ", 0);
-    if (fpga == NULL)
-        return;
+    return wc->len && (addr < wc->base + wc->len) && (wc->base < addr + count);
+}
 
-    cdmaBuffer_t buffer;
-    buffer.id = fpga->id;
-    buffer.data = data;
-    buffer.count = count;
-    buffer.addr = 0x1;
+static pthread_mutex_t gWcLock = PTHREAD_MUTEX_INITIALIZER;
+static struct xpdma_coalesce *gWcList; // handles with coalescing, all boards
 
-    //sem_wait (sem); 
-    ioctl(fpga->fd, IOCTL_SEND, &buffer);
-    ioctl(fpga->fd, IOCTL_RECV, &buffer);
-    //sem_post (sem);
-    ////logger("xpdma_test_sg: finish\n");
+/**
+ * Send the staged data of the handles of board 'id' overlapping [addr, addr + count)
+ * ('count' 0 - all staged data), except 'skip': handles share the board DDR but
+ * not their staging buffers.
+ */
+static int xpdma_coalesce_flushBoard(int id, struct xpdma_coalesce *skip, unsigned int count, unsigned int addr)
+{
+    struct xpdma_coalesce *wc;
+    int result = 0;
+    int error;
+
+    pthread_mutex_lock(&gWcLock);
+    for (wc = gWcList; wc != NULL; wc = wc->next) {
+        if (wc == skip || wc->fpga->id != id)
+            continue;
+        pthread_mutex_lock(&wc->lock);
+        if (count ? xpdma_coalesce_overlaps(wc, count, addr) : (wc->len != 0)) {
+            error = xpdma_coalesce_flushLocked(wc->fpga);
+            if (result == 0)
+                result = error;
+        }
+        pthread_mutex_unlock(&wc->lock);
+    }
+    pthread_mutex_unlock(&gWcLock);
+    return result;
 }
 
-void xpdma_info(xpdma_t *fpga)
+static void *xpdma_coalesce_thread(void *arg)
 {
-    //logger("xpdma_info ",0);
-    if (fpga == NULL)
-        return;
+    xpdma_t *fpga = (xpdma_t *)arg;
+    struct xpdma_coalesce *wc = fpga->wc;
+    int result;
 
-    //sem_wait (sem); 
-    ioctl(fpga->fd, IOCTL_INFO, fpga->id);
-    //sem_post (sem);
-    ////logger("xpdma_info: finish\n");
-}
+    if (fpga->numaBind)
+        xpdma_bindThread(fpga);
 
+    pthread_mutex_lock(&wc->lock);
+    while (!wc->stop) {
+        // after a failure the data waits for the next write or xpdma_flush
+        if (wc->len == 0 || wc->error) {
+            pthread_cond_wait(&wc->cond, &wc->lock);
+            continue;
+        }
+        if (pthread_cond_timedwait(&wc->cond, &wc->lock, &wc->deadline) == ETIMEDOUT && wc->len) {
+            result = xpdma_coalesce_flushLocked(fpga);
+            if (result)
+                wc->error = result;
+        }
+    }
+    pthread_mutex_unlock(&wc->lock);
+    return NULL;
+}
 
-void xpdma_setCfgReg(xpdma_t *fpga, uint32_t regNumber, uint32_t data)
+/**
+ * Stage a small send, returns 1 if the data has been taken. 0 with '*result'
+ * set if it has not: a background flush failed, or the staged data it would
+ * replace can't be sent.
+ */
+static int xpdma_coalesce_write(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr, int *result)
 {
-    //logger("xpdma_setCfgReg ", regNumber);
-    if (fpga == NULL)
-        return;
+    struct xpdma_coalesce *wc = fpga->wc;
 
-    if (regNumber > CTR_REG_SIZE) {
-        printf("setCfgReg: Wrong reg number :%08X!\n", regNumber);
-        return;
+    *result = 0;
+    pthread_mutex_lock(&wc->lock);
+
+    if (wc->error) {
+        *result = wc->error;
+        wc->error = 0;
+        pthread_cond_signal(&wc->cond);
+        pthread_mutex_unlock(&wc->lock);
+        return 0;
     }
-    xpdma_writeReg(fpga, regNumber*4 + CTR_REG_OFFSET, data);
-    ////logger("xpdma_setCfgReg: finish\n");
+
+    if (count >= wc->maxWrite) {
+        // large send goes directly, staged data it overlaps is sent first
+        if (xpdma_coalesce_overlaps(wc, count, addr))
+            *result = xpdma_coalesce_flushLocked(fpga);
+        pthread_mutex_unlock(&wc->lock);
+        return 0;
+    }
+
+    // only appends and overwrites inside the staged extent are merged
+    if (wc->len && ((addr < wc->base) || (addr > wc->base + wc->len) || (addr + count - wc->base > wc->flushSize))) {
+        *result = xpdma_coalesce_flushLocked(fpga);
+        if (*result) {
+            pthread_mutex_unlock(&wc->lock);
+            return 0;
+        }
+    }
+
+    if (wc->len == 0) {
+        wc->base = addr;
+        clock_gettime(CLOCK_REALTIME, &wc->deadline);
+        wc->deadline.tv_sec += wc->maxAgeUs / 1000000;
+        wc->deadline.tv_nsec += (wc->maxAgeUs % 1000000) * 1000;
+        if (wc->deadline.tv_nsec >= 1000000000) {
+            wc->deadline.tv_sec++;
+            wc->deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_signal(&wc->cond);
+    }
+
+    memcpy(wc->buffer + (addr - wc->base), data, count);
+    if (addr + count - wc->base > wc->len)
+        wc->len = addr + count - wc->base;
+
+    // the write is staged either way, a failed send is reported by the next call
+    if (wc->len >= wc->flushSize)
+        wc->error = xpdma_coalesce_flushLocked(fpga);
+
+    pthread_mutex_unlock(&wc->lock);
+    return 1;
 }
 
-uint32_t xpdma_getCfgReg(xpdma_t *fpga, uint32_t regNumber)
+static int xpdma_coalesce_beforeRead(xpdma_t *fpga, unsigned int count, unsigned int addr)
 {
-    //logger("xpdma_getCfgReg ",regNumber);
+    struct xpdma_coalesce *wc = fpga->wc;
+    int result = 0;
+
+    pthread_mutex_lock(&wc->lock);
+    if (xpdma_coalesce_overlaps(wc, count, addr))
+        result = xpdma_coalesce_flushLocked(fpga);
+    pthread_mutex_unlock(&wc->lock);
+    return result;
+}
+
+int xpdma_flush(xpdma_t *fpga)
+{
+    struct xpdma_trace_op op;
+    struct xpdma_coalesce *wc;
+    int result;
+
     if (fpga == NULL)
+        return -1;
+
+    wc = fpga->wc;
+    if (wc == NULL)
         return 0;
 
-    if (regNumber > CTR_REG_SIZE) {
-        printf("getCfgReg: Wrong reg number :%08X!\n", regNumber);
+    xpdma_trace_begin(&op, fpga, XPDMA_OP_FLUSH, 0, 0, 0);
+    pthread_mutex_lock(&wc->lock);
+    op.rec.count = wc->len;
+    op.rec.addr = wc->base;
+    result = xpdma_coalesce_flushLocked(fpga);
+    if (result == 0)
+        result = wc->error;
+    wc->error = 0;
+    pthread_cond_signal(&wc->cond);
+    pthread_mutex_unlock(&wc->lock);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+// Staged data of every handle of the board, errors of this handle's background flushes too
+static int xpdma_coalesce_flushAll(xpdma_t *fpga)
+{
+    int result = 0;
+
+    if (fpga->wc != NULL)
+        result = xpdma_flush(fpga);
+    if (xpdma_coalesce_flushBoard(fpga->id, fpga->wc, 0, 0))
+        result = -1;
+    return result;
+}
+
+static int xpdma_coalesce_disable(xpdma_t *fpga)
+{
+    struct xpdma_coalesce *wc = fpga->wc;
+    struct xpdma_coalesce **prev;
+    int result;
+
+    if (wc == NULL)
         return 0;
-    }
+
+    result = xpdma_flush(fpga);
+
+    pthread_mutex_lock(&gWcLock);
+    for (prev = &gWcList; *prev != wc; prev = &(*prev)->next)
+        ;
+    *prev = wc->next;
+    pthread_mutex_unlock(&gWcLock);
+
+    pthread_mutex_lock(&wc->lock);
+    wc->stop = 1;
+    pthread_cond_signal(&wc->cond);
+    pthread_mutex_unlock(&wc->lock);
+    pthread_join(wc->thread, NULL);
+
+    pthread_cond_destroy(&wc->cond);
+    pthread_mutex_destroy(&wc->lock);
+    free(wc->buffer);
+    free(wc);
+    fpga->wc = NULL;
+    return result;
+}
+
+static int xpdma_coalesce_setup(xpdma_t *fpga, unsigned int maxWrite, unsigned int flushSize, unsigned int maxAgeUs)
+{
+    struct xpdma_coalesce *wc;
+    int result;
+
+    result = xpdma_coalesce_disable(fpga);
+    if (maxWrite == 0)
+        return result;
+
+    if (flushSize < maxWrite)
+        return -1;
+
+    wc = (struct xpdma_coalesce *)calloc(1, sizeof(*wc));
+    if (wc == NULL)
+        return -1;
+
+    wc->buffer = (char *)malloc(flushSize);
+    if (wc->buffer == NULL) {
+        free(wc);
+        return -1;
+    }
+
+    wc->maxWrite = maxWrite;
+    wc->flushSize = flushSize;
+    wc->maxAgeUs = maxAgeUs;
+    wc->fpga = fpga;
+    pthread_mutex_init(&wc->lock, NULL);
+    pthread_cond_init(&wc->cond, NULL);
+    fpga->wc = wc;
+
+    if (pthread_create(&wc->thread, NULL, xpdma_coalesce_thread, fpga)) {
+        pthread_cond_destroy(&wc->cond);
+        pthread_mutex_destroy(&wc->lock);
+        free(wc->buffer);
+        free(wc);
+        fpga->wc = NULL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&gWcLock);
+    wc->next = gWcList;
+    gWcList = wc;
+    pthread_mutex_unlock(&gWcLock);
+
+    return result;
+}
+
+int xpdma_setCoalescing(xpdma_t *fpga, unsigned int maxWrite, unsigned int flushSize, unsigned int maxAgeUs)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    if (fpga == NULL)
+        return -1;
+
+    xpdma_trace_begin(&op, fpga, XPDMA_OP_SET_COALESCING, maxWrite, flushSize, 0);
+    op.rec.arg = maxAgeUs;
+    result = xpdma_coalesce_setup(fpga, maxWrite, flushSize, maxAgeUs);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+/**
+ * Registration cache: buffers of XPDMA_FLAG_ZERO_COPY calls stay registered
+ * (pinned and IOMMU mapped by the driver) and are reused while they cover the
+ * transfer, the least recently used idle entry is replaced on a miss.
+ */
+struct xpdma_regcache_entry {
+    uintptr_t base;
+    size_t length;
+    uint32_t handle;    // 0 - free slot
+    unsigned int busy;  // calls using the handle now
+    uint64_t lastUse;
+};
+
+struct xpdma_regcache {
+    pthread_mutex_t lock;
+    unsigned int size;
+    uint64_t clock;
+    struct xpdma_regcache_entry entries[];
+};
+
+int xpdma_registerBuffer(xpdma_t *fpga, void *data, size_t length, uint32_t *handle)
+{
+    return xpdma_registerBufferEx(fpga, data, length, 0, handle);
+}
+
+int xpdma_registerBufferEx(xpdma_t *fpga, const void *data, size_t length, uint32_t access, uint32_t *handle)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    if (fpga == NULL || handle == NULL)
+        return -1;
+
+    xpdma_trace_begin(&op, fpga, XPDMA_OP_REGISTER, length, 0, 0);
+    cdmaRegister_t reg = {fpga->id, 0, (uintptr_t)data, length, access};
+    result = ioctl(fpga->fd, IOCTL_REGISTER, &reg);
+    *handle = reg.handle;
+    op.rec.reg = reg.handle;
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+int xpdma_unregisterBuffer(xpdma_t *fpga, uint32_t handle)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    if (fpga == NULL)
+        return -1;
+
+    xpdma_trace_begin(&op, fpga, XPDMA_OP_UNREGISTER, 0, 0, 0);
+    op.rec.reg = handle;
+    cdmaRegister_t reg = {fpga->id, handle, 0, 0, 0};
+    result = ioctl(fpga->fd, IOCTL_UNREGISTER, &reg);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+static int xpdma_regTransfer(xpdma_t *fpga, int send, uint32_t handle, size_t offset, unsigned int count, unsigned int addr, unsigned int flags)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    if (fpga == NULL)
+        return -1;
+
+    xpdma_trace_begin(&op, fpga, send ? XPDMA_OP_SEND_REG : XPDMA_OP_RECV_REG, count, addr, flags);
+    op.rec.reg = handle;
+    op.rec.arg = offset;
+    cdmaRegBuffer_t buffer = {handle, count, offset, addr, flags};
+    result = xpdma_coalesce_flushBoard(fpga->id, NULL, count, addr);
+    if (result == 0)
+        result = ioctl(fpga->fd, send ? IOCTL_SENDREG : IOCTL_RECVREG, &buffer);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+int xpdma_sendReg(xpdma_t *fpga, uint32_t handle, size_t offset, unsigned int count, unsigned int addr, unsigned int flags)
+{
+    return xpdma_regTransfer(fpga, 1, handle, offset, count, addr, flags);
+}
+
+int xpdma_recvReg(xpdma_t *fpga, uint32_t handle, size_t offset, unsigned int count, unsigned int addr, unsigned int flags)
+{
+    return xpdma_regTransfer(fpga, 0, handle, offset, count, addr, flags);
+}
+
+int xpdma_exportBuffer(xpdma_t *fpga, size_t length, int *fd)
+{
+    if (fpga == NULL || fd == NULL)
+        return -1;
+
+    cdmaDmaBuf_t buf = {fpga->id, -1, 0, length};
+    if (ioctl(fpga->fd, IOCTL_EXPORTBUF, &buf))
+        return -1;
+    *fd = buf.fd;
+    return 0;
+}
+
+int xpdma_importBuffer(xpdma_t *fpga, int fd, uint32_t *handle, size_t *length)
+{
+    if (fpga == NULL || handle == NULL)
+        return -1;
+
+    cdmaDmaBuf_t buf = {fpga->id, fd, 0, 0};
+    if (ioctl(fpga->fd, IOCTL_IMPORTBUF, &buf))
+        return -1;
+    *handle = buf.handle;
+    if (length != NULL)
+        *length = buf.length;
+    return 0;
+}
+
+// Find or register an entry covering the buffer and mark it busy, NULL if all entries are busy
+static struct xpdma_regcache_entry *xpdma_regcache_get(xpdma_t *fpga, uintptr_t data, size_t count)
+{
+    struct xpdma_regcache *rc = fpga->rc;
+    struct xpdma_regcache_entry *entry;
+    struct xpdma_regcache_entry *victim = NULL;
+    uint32_t handle;
+    unsigned int c;
+
+    pthread_mutex_lock(&rc->lock);
+    for (c = 0; c < rc->size; ++c) {
+        entry = &rc->entries[c];
+        if (entry->handle && entry->base <= data && data + count <= entry->base + entry->length)
+            goto found;
+        if (entry->busy == 0 && (victim == NULL || entry->handle == 0 || (victim->handle && entry->lastUse < victim->lastUse)))
+            victim = entry;
+    }
+
+    entry = victim;
+    if (entry == NULL) {
+        pthread_mutex_unlock(&rc->lock);
+        return NULL;
+    }
+
+    if (entry->handle)
+        xpdma_unregisterBuffer(fpga, entry->handle);
+    entry->handle = 0;
+
+    if (xpdma_registerBuffer(fpga, (void *)data, count, &handle)) {
+        pthread_mutex_unlock(&rc->lock);
+        return NULL;
+    }
+    entry->base = data;
+    entry->length = count;
+    entry->handle = handle;
+
+found:
+    entry->busy++;
+    entry->lastUse = ++rc->clock;
+    pthread_mutex_unlock(&rc->lock);
+    return entry;
+}
+
+static void xpdma_regcache_put(xpdma_t *fpga, struct xpdma_regcache_entry *entry, uint32_t handle, int stale)
+{
+    pthread_mutex_lock(&fpga->rc->lock);
+    entry->busy--;
+    // user memory was unmapped: the pinned pages are not the buffer any more
+    if (stale && entry->handle == handle) {
+        xpdma_unregisterBuffer(fpga, handle);
+        entry->handle = 0;
+    }
+    pthread_mutex_unlock(&fpga->rc->lock);
+}
+
+static int xpdma_regcache_transfer(xpdma_t *fpga, unsigned long cmd, void *data, unsigned int count, unsigned int addr, unsigned int flags)
+{
+    struct xpdma_regcache_entry *entry;
+    uint32_t handle;
+    int result = -1;
+    int retry;
+
+    for (retry = 0; retry < 2; ++retry) {
+        entry = xpdma_regcache_get(fpga, (uintptr_t)data, count);
+        if (entry == NULL) {
+            // no entry to reuse: the driver pins for this call only
+            cdmaBuffer_t buffer = {fpga->id, data, count, addr, flags};
+            return ioctl(fpga->fd, (cmd == IOCTL_SENDREG) ? IOCTL_SEND : IOCTL_RECV, &buffer);
+        }
+
+        handle = entry->handle;
+        cdmaRegBuffer_t buffer = {handle, count, (uintptr_t)data - entry->base, addr, flags & ~XPDMA_FLAG_ZERO_COPY};
+        result = ioctl(fpga->fd, cmd, &buffer);
+        xpdma_regcache_put(fpga, entry, handle, result && errno == ESTALE);
+        if (!(result && errno == ESTALE))
+            break;
+    }
+
+    return result;
+}
+
+static int xpdma_regcache_setup(xpdma_t *fpga, unsigned int entries)
+{
+    struct xpdma_regcache *rc;
+    unsigned int c;
+
+    if (fpga->rc != NULL) {
+        for (c = 0; c < fpga->rc->size; ++c)
+            if (fpga->rc->entries[c].handle)
+                xpdma_unregisterBuffer(fpga, fpga->rc->entries[c].handle);
+        pthread_mutex_destroy(&fpga->rc->lock);
+        free(fpga->rc);
+        fpga->rc = NULL;
+    }
+
+    if (entries == 0)
+        return 0;
+
+    rc = (struct xpdma_regcache *)calloc(1, sizeof(*rc) + entries * sizeof(rc->entries[0]));
+    if (rc == NULL)
+        return -1;
+
+    pthread_mutex_init(&rc->lock, NULL);
+    rc->size = entries;
+    fpga->rc = rc;
+    return 0;
+}
+
+int xpdma_setRegCache(xpdma_t *fpga, unsigned int entries)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    if (fpga == NULL)
+        return -1;
+
+    xpdma_trace_begin(&op, fpga, XPDMA_OP_SET_REGCACHE, entries, 0, 0);
+    result = xpdma_regcache_setup(fpga, entries);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+static void xpdma_stage_free(xpdma_t *fpga);
+
+xpdma_t *xpdma_open(int id) 
+{
+
+    //logger("xpdma_open ", 0);
+    //if ((sem = sem_open(SEM_NAME, O_CREAT, 0666, 1)) == SEM_FAILED) {
+    //    perror("sem_open");
+    //    return NULL;
+    //}
+
+    //sem_wait (sem); 
+    struct xpdma_trace_op op;
+    xpdma_t * device;
+    if (id >= XPDMA_NUM_MAX)
+        return NULL;
+
+    pthread_once(&gTraceEnvOnce, xpdma_trace_env);
+    xpdma_trace_begin(&op, NULL, XPDMA_OP_OPEN, 0, 0, 0);
+    op.rec.board = id;
+
+    device = (xpdma_t *)malloc(sizeof(xpdma_t));
+    if (device == NULL) {
+        xpdma_trace_end(&op, -1);
+        return NULL;
+    }
+
+    if (gfd < 0) 
+        gfd = open("/dev/" DEVICE_NAME, O_RDWR | O_SYNC);
+    
+    if (gfd < 0) {
+        free(device);
+        ////logger("xpdma_open: failed\n");
+        xpdma_trace_end(&op, -1);
+        return NULL;
+    }
+
+    device->id = id;
+    device->fd = gfd;
+    device->wc = NULL;
+    device->rc = NULL;
+    device->numaBind = 0;
+    device->stage = NULL;
+    device->ddrSize = 0;
+    device->traceId = __sync_add_and_fetch(&gTraceDevices, 1) & 0xffff;
+    gOpenCount++;
+    //sem_post (sem);
+    
+    ////logger("xpdma_open: finish\n");
+
+    op.rec.device = device->traceId;
+    xpdma_trace_end(&op, 0);
+    return device;
+}
+
+void xpdma_close(xpdma_t * device) {
+    //logger("xpdma_close ", 0);
+    //sem_wait (sem); 
+    //printf ("free DEVICE\n");
+    if (device != NULL) {
+        struct xpdma_trace_op op;
+
+        xpdma_trace_begin(&op, device, XPDMA_OP_CLOSE, 0, 0, 0);
+        xpdma_coalesce_disable(device);
+        xpdma_setRegCache(device, 0);
+        xpdma_stage_free(device);
+        free(device);
+        device = NULL;
+        xpdma_trace_end(&op, 0);
+        ////logger("xpdma_close: free(device) \n");
+    }
+
+    if (gOpenCount == 0) {
+        close(gfd);
+        gfd = -1;
+    } else {
+        gOpenCount--;
+    }
+    //sem_post (sem);
+
+    //sem_close(sem);
+    ////sem_unlink(//sem_NAME);
+    ////logger("xpdma_close: finish\n");
+    //printf ("end free DEVICE\n");
+}
+
+int xpdma_send(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
+{
+    return xpdma_sendEx(fpga, data, count, addr, 0);
+}
+
+int xpdma_recv(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
+{
+    return xpdma_recvEx(fpga, data, count, addr, 0);
+}
+
+static int xpdma_doSend(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr, unsigned int flags)
+{
+    ////logger("xpdma_send ", addr);
+    if (fpga == NULL)
+        return -1;
+
+    if ( addr % 4 )
+        return -1;
+
+    // staged data of the other handles under this send goes out first
+    if (xpdma_coalesce_flushBoard(fpga->id, fpga->wc, count, addr))
+        return -1;
+
+    if (fpga->wc != NULL) {
+        int result = 0;
+        if (flags == 0 && xpdma_coalesce_write(fpga, data, count, addr, &result))
+            return result;
+        // flagged or large send: staged data under it must go out first
+        if (result == 0 && flags != 0)
+            result = xpdma_coalesce_beforeRead(fpga, count, addr);
+        if (result)
+            return result;
+    }
+    
+    if ((flags & XPDMA_FLAG_ZERO_COPY) && fpga->rc != NULL)
+        return xpdma_regcache_transfer(fpga, IOCTL_SENDREG, data, count, addr, flags);
+
+    cdmaBuffer_t buffer = {fpga->id, data, count, addr, flags};
+    
+    return ioctl(fpga->fd, IOCTL_SEND, &buffer);
+}
+
+static int xpdma_doRecv(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr, unsigned int flags)
+{
+    //logger("xpdma_recv ", addr);
+    if (fpga == NULL)
+        return -1;
+
+    if ( addr % 4 )
+        return -1;
+
+    // read-after-write: staged data of every handle of the board must reach DDR first
+    if (xpdma_coalesce_flushBoard(fpga->id, NULL, count, addr))
+        return -1;
+
+    if ((flags & XPDMA_FLAG_ZERO_COPY) && fpga->rc != NULL)
+        return xpdma_regcache_transfer(fpga, IOCTL_RECVREG, data, count, addr, flags);
+
+    cdmaBuffer_t buffer = {fpga->id, data, count, addr, flags};
+    
+    return ioctl(fpga->fd, IOCTL_RECV, &buffer);
+}
+
+int xpdma_sendEx(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr, unsigned int flags)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    xpdma_trace_begin(&op, fpga, XPDMA_OP_SEND, count, addr, flags);
+    result = xpdma_doSend(fpga, data, count, addr, flags);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+int xpdma_recvEx(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr, unsigned int flags)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    xpdma_trace_begin(&op, fpga, XPDMA_OP_RECV, count, addr, flags);
+    result = xpdma_doRecv(fpga, data, count, addr, flags);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+// Vectored transfers are positional I/O on the device node, one syscall for all buffers
+static ssize_t xpdma_rwv(xpdma_t *fpga, const struct iovec *iov, int iovcnt, uint64_t addr, int write)
+{
+    struct xpdma_trace_op op;
+    ssize_t result;
+    int c;
+
+    if (fpga == NULL || iov == NULL || iovcnt <= 0)
+        return -1;
+
+    if ( addr % 4 )
+        return -1;
+
+    xpdma_trace_begin(&op, fpga, write ? XPDMA_OP_SENDV : XPDMA_OP_RECVV, 0, addr, 0);
+    if (op.state == 2) {
+        op.rec.arg = iovcnt;
+        for (c = 0; c < iovcnt; ++c)
+            op.rec.count += iov[c].iov_len;
+    }
+
+    // staged sends must reach DDR before anything else touches it
+    if (xpdma_coalesce_flushAll(fpga))
+        result = -1;
+    else if (write)
+        result = pwritev(fpga->fd, iov, iovcnt, XPDMA_FILE_OFFSET(fpga->id, addr));
+    else
+        result = preadv(fpga->fd, iov, iovcnt, XPDMA_FILE_OFFSET(fpga->id, addr));
+
+    xpdma_trace_end(&op, result < 0);
+    return result;
+}
+
+ssize_t xpdma_sendv(xpdma_t *fpga, const struct iovec *iov, int iovcnt, uint64_t addr)
+{
+    return xpdma_rwv(fpga, iov, iovcnt, addr, 1);
+}
+
+ssize_t xpdma_recvv(xpdma_t *fpga, const struct iovec *iov, int iovcnt, uint64_t addr)
+{
+    return xpdma_rwv(fpga, iov, iovcnt, addr, 0);
+}
+
+int xpdma_getStats(xpdma_t *fpga, xpdma_stats_t *stats)
+{
+    if (fpga == NULL || stats == NULL)
+        return -1;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->id = fpga->id;
+    return ioctl(fpga->fd, IOCTL_STATS, stats);
+}
+
+int xpdma_setLimit(xpdma_t *fpga, uint64_t rate, uint64_t burst, uint32_t weight)
+{
+    if (fpga == NULL)
+        return -1;
+
+    cdmaLimit_t limit = {rate, burst, weight};
+    return ioctl(fpga->fd, IOCTL_SETLIMIT, &limit);
+}
+
+int xpdma_getClientStats(xpdma_t *fpga, xpdma_client_stats_t *stats)
+{
+    if (fpga == NULL || stats == NULL)
+        return -1;
+
+    return ioctl(fpga->fd, IOCTL_CLIENTSTATS, stats);
+}
+
+int xpdma_ddrAlloc(xpdma_t *fpga, uint64_t length, uint64_t align, uint32_t *handle, unsigned int *addr)
+{
+    if (fpga == NULL || handle == NULL || addr == NULL)
+        return -1;
+
+    cdmaDdrAlloc_t region = {fpga->id, 0, length, align, 0};
+    if (ioctl(fpga->fd, IOCTL_DDRALLOC, &region))
+        return -1;
+
+    *handle = region.handle;
+    *addr = (unsigned int)region.addr;
+    return 0;
+}
+
+int xpdma_ddrFree(xpdma_t *fpga, uint32_t handle)
+{
+    if (fpga == NULL)
+        return -1;
+
+    cdmaDdrAlloc_t region = {fpga->id, handle, 0, 0, 0};
+    return ioctl(fpga->fd, IOCTL_DDRFREE, &region);
+}
+
+int xpdma_getDdrStats(xpdma_t *fpga, xpdma_ddr_stats_t *stats)
+{
+    if (fpga == NULL || stats == NULL)
+        return -1;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->id = fpga->id;
+    return ioctl(fpga->fd, IOCTL_DDRSTATS, stats);
+}
+
+int xpdma_irqOpen(xpdma_t *fpga, uint32_t mask)
+{
+    if (fpga == NULL)
+        return -1;
+
+    cdmaIrqOpen_t req = {fpga->id, mask, -1};
+    if (ioctl(fpga->fd, IOCTL_IRQOPEN, &req))
+        return -1;
+    return req.fd;
+}
+
+int xpdma_irqWait(int irqFd, int timeoutMs, xpdma_irq_events_t *events)
+{
+    struct pollfd pfd = {irqFd, POLLIN, 0};
+    xpdma_irq_events_t scratch;
+    int result;
+
+    do {
+        result = poll(&pfd, 1, timeoutMs);
+    } while (result < 0 && errno == EINTR);
+    if (result <= 0)
+        return result < 0 ? -1 : 1;
+
+    if (read(irqFd, events ? events : &scratch, sizeof(scratch)) != sizeof(scratch))
+        return -1;
+    return 0;
+}
+
+int xpdma_irqEventfd(xpdma_t *fpga, unsigned int vector, int efd)
+{
+    if (fpga == NULL)
+        return -1;
+
+    cdmaIrqEventfd_t req = {fpga->id, vector, efd};
+    return ioctl(fpga->fd, IOCTL_IRQEVENTFD, &req);
+}
+
+int xpdma_getIrqStats(xpdma_t *fpga, xpdma_irq_stats_t *stats)
+{
+    if (fpga == NULL || stats == NULL)
+        return -1;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->id = fpga->id;
+    return ioctl(fpga->fd, IOCTL_IRQSTATS, stats);
+}
+
+int xpdma_setParam(xpdma_t *fpga, uint32_t param, uint64_t value)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    if (fpga == NULL)
+        return -1;
+
+    xpdma_trace_begin(&op, fpga, XPDMA_OP_SET_PARAM, value, param, 0);
+    cdmaParam_t data = {fpga->id, param, value};
+    result = ioctl(fpga->fd, IOCTL_SETPARAM, &data);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+int xpdma_getParam(xpdma_t *fpga, uint32_t param, uint64_t *value)
+{
+    int result;
+
+    if (fpga == NULL || value == NULL)
+        return -1;
+
+    cdmaParam_t data = {fpga->id, param, 0};
+    result = ioctl(fpga->fd, IOCTL_GETPARAM, &data);
+    *value = data.value;
+    return result;
+}
+
+// Board DDR3 size from the driver (0 - unknown, every range is refused)
+static uint64_t xpdma_ddrSize(xpdma_t *fpga)
+{
+    uint64_t size;
+
+    if (fpga->ddrSize == 0 && xpdma_getParam(fpga, XPDMA_PARAM_DDR_SIZE, &size) == 0)
+        fpga->ddrSize = size;
+    return fpga->ddrSize;
+}
+
+void *xpdma_map(xpdma_t *fpga, unsigned int addr, size_t length)
+{
+    void *ptr;
+
+    if (fpga == NULL || (addr % sysconf(_SC_PAGESIZE)))
+        return NULL;
+
+    // the mapping caches DDR on its own: staged writes must be there before it reads
+    if (xpdma_coalesce_flushAll(fpga))
+        return NULL;
+
+    ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fpga->fd, XPDMA_MMAP_OFFSET(fpga->id, addr));
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+int xpdma_mapSync(void *ptr, size_t length)
+{
+    return msync(ptr, length, MS_SYNC);
+}
+
+int xpdma_unmap(void *ptr, size_t length)
+{
+    return munmap(ptr, length);
+}
+
+void xpdma_writeReg(xpdma_t *fpga, uint32_t addr, uint32_t value)
+{
+    ////logger("xpdma_writeReg ", addr);
+    if (fpga == NULL)
+        return;
+    
+    cdmaReg_t data;
+    data.id = fpga->id;
+    data.reg = addr;
+    data.value = value;
+    
+    ////logger("xpdma_writeReg: lock\n");
+    //sem_wait (sem); 
+    //logger("xpdma_writeReg: ioctl", addr);
+    ioctl(fpga->fd, IOCTL_WRCDMAREG, &data);
+    //logger("xpdma_writeReg: unlock", addr);
+    //sem_post (sem);
+    ////logger("xpdma_writeReg: finish\n");
+}
+
+uint32_t xpdma_readReg(xpdma_t *fpga, uint32_t addr)
+{
+    ////logger("xpdma_readReg ",addr);
+    if (fpga == NULL)
+        return 0;
+
+    cdmaReg_t data;
+    data.id = fpga->id;
+    data.reg = addr;
+    data.value = 0;
+    
+    ////logger("xpdma_readReg: lock\n");
+    //sem_wait (sem); 
+    //logger("xpdma_readReg: ioctl", addr);
+    ioctl(fpga->fd, IOCTL_RDCDMAREG, &data);
+    //logger("xpdma_readReg: unlock", addr);
+    //sem_post (sem);
+    ////logger("xpdma_readReg: finish\n");
+    return data.value;
+}
+
+void xpdma_read(xpdma_t *fpga, void *data, unsigned int count)
+{
+    printf("xpdma_read called!\n");
+    read(fpga->fd, data, count);
+    printf("xpdma_read: %u bytes have been read from fpga...\n", count);
+}
+
+void xpdma_write(xpdma_t *fpga, void *data, unsigned int count)
+{
+    printf("xpdma_write called!\n");
+    write(fpga->fd, data, count);
+    printf("xpdma_write: %u bytes have been written to fpga...\n", count);
+}
+
+void xpdma_test_sg(xpdma_t *fpga, void *data, unsigned int count)
+{
+    //logger("xpdma_test_sg: ", 0);
+    if (fpga == NULL)
+        return;
+
+    cdmaBuffer_t buffer;
+    buffer.id = fpga->id;
+    buffer.data = data;
+    buffer.count = count;
+    buffer.addr = 0x1;
+    buffer.flags = 0;
+
+    //sem_wait (sem); 
+    ioctl(fpga->fd, IOCTL_SEND, &buffer);
+    ioctl(fpga->fd, IOCTL_RECV, &buffer);
+    //sem_post (sem);
+    ////logger("xpdma_test_sg: finish\n");
+}
+
+void xpdma_info(xpdma_t *fpga)
+{
+    //logger("xpdma_info ",0);
+    if (fpga == NULL)
+        return;
+
+    //sem_wait (sem); 
+    ioctl(fpga->fd, IOCTL_INFO, &fpga->id);
+    //sem_post (sem);
+    ////logger("xpdma_info: finish\n");
+}
+
+
+void xpdma_setCfgReg(xpdma_t *fpga, uint32_t regNumber, uint32_t data)
+{
+    //logger("xpdma_setCfgReg ", regNumber);
+    if (fpga == NULL)
+        return;
+
+    if (regNumber > CTR_REG_SIZE) {
+        printf("setCfgReg: Wrong reg number :%08X!\n", regNumber);
+        return;
+    }
+    xpdma_writeReg(fpga, regNumber*4 + CTR_REG_OFFSET, data);
+    ////logger("xpdma_setCfgReg: finish\n");
+}
+
+uint32_t xpdma_getCfgReg(xpdma_t *fpga, uint32_t regNumber)
+{
+    //logger("xpdma_getCfgReg ",regNumber);
+    if (fpga == NULL)
+        return 0;
+
+    if (regNumber > CTR_REG_SIZE) {
+        printf("getCfgReg: Wrong reg number :%08X!\n", regNumber);
+        return 0;
+    }
     ////logger("xpdma_getCfgReg: finish\n");
     return xpdma_readReg(fpga, regNumber*4 + CTR_REG_OFFSET);
 }
+
+/**
+ * Board group: one logical DDR space striped over several boards. Stripe s of
+ * the logical space lives on board s % N at address (s / N) * stripeSize, so a
+ * logical transfer is split into per board stripe lists run in parallel by one
+ * worker thread per board (pinned to the CPUs of the board NUMA node).
+ */
+struct xpdma_group_worker {
+    xpdma_group_t *group;
+    xpdma_t *fpga;
+    int index;              // position in the group (stripe s % N)
+    pthread_t thread;
+    unsigned long seq;      // last job done
+    int result;
+};
+
+struct xpdma_group_t {
+    pthread_mutex_t lock;   // one logical transfer at a time
+    pthread_mutex_t jobLock;
+    pthread_cond_t jobCond;
+    pthread_cond_t doneCond;
+    int count;
+    unsigned int stripeSize;
+    int stop;
+    unsigned long seq;      // current job
+    int pending;            // workers still running the current job
+    int send;               // job: direction, buffer, logical range
+    char *data;
+    size_t length;
+    uint64_t addr;
+    unsigned int flags;
+    struct xpdma_group_worker workers[];
+};
+
+// Run the stripes of the current job that belong to this worker's board
+static int xpdma_group_run(xpdma_group_t *group, struct xpdma_group_worker *worker)
+{
+    uint64_t stripe = group->stripeSize;
+    uint64_t pos = group->addr;
+    uint64_t end = group->addr + group->length;
+    uint64_t s;
+    uint64_t boardAddr;
+    size_t btt;
+    int result;
+
+    // first stripe of this board at or after the start
+    s = pos / stripe;
+    s += (worker->index - s % group->count + group->count) % group->count;
+    if (s * stripe > pos)
+        pos = s * stripe;
+
+    for (; pos < end; s += group->count, pos = s * stripe) {
+        btt = ((s + 1) * stripe < end ? (s + 1) * stripe : end) - pos;
+        boardAddr = (s / group->count) * stripe + pos % stripe;
+        if (boardAddr + btt > xpdma_ddrSize(worker->fpga))
+            return -1;
+
+        if (group->send)
+            result = xpdma_sendEx(worker->fpga, group->data + (pos - group->addr), btt, boardAddr, group->flags);
+        else
+            result = xpdma_recvEx(worker->fpga, group->data + (pos - group->addr), btt, boardAddr, group->flags);
+        if (result)
+            return result;
+    }
+
+    return 0;
+}
+
+static void *xpdma_group_thread(void *arg)
+{
+    struct xpdma_group_worker *worker = (struct xpdma_group_worker *)arg;
+    xpdma_group_t *group = worker->group;
+    int result;
+
+    xpdma_bindThread(worker->fpga);
+
+    pthread_mutex_lock(&group->jobLock);
+    for (;;) {
+        while (!group->stop && worker->seq == group->seq)
+            pthread_cond_wait(&group->jobCond, &group->jobLock);
+        if (group->stop)
+            break;
+        worker->seq = group->seq;
+        pthread_mutex_unlock(&group->jobLock);
+
+        result = xpdma_group_run(group, worker);
+
+        pthread_mutex_lock(&group->jobLock);
+        worker->result = result;
+        if (--group->pending == 0)
+            pthread_cond_signal(&group->doneCond);
+    }
+    pthread_mutex_unlock(&group->jobLock);
+    return NULL;
+}
+
+xpdma_group_t *xpdma_group_open(const int *ids, int count, unsigned int stripeSize)
+{
+    xpdma_group_t *group;
+    int c;
+
+    if (ids == NULL || count <= 0 || count > XPDMA_NUM_MAX || stripeSize == 0 || (stripeSize % 4))
+        return NULL;
+
+    group = (xpdma_group_t *)calloc(1, sizeof(*group) + count * sizeof(group->workers[0]));
+    if (group == NULL)
+        return NULL;
+
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_mutex_init(&group->jobLock, NULL);
+    pthread_cond_init(&group->jobCond, NULL);
+    pthread_cond_init(&group->doneCond, NULL);
+    group->stripeSize = stripeSize;
+
+    for (c = 0; c < count; ++c) {
+        group->workers[c].group = group;
+        group->workers[c].index = c;
+        group->workers[c].fpga = xpdma_open(ids[c]);
+        if (group->workers[c].fpga == NULL)
+            break;
+        if (pthread_create(&group->workers[c].thread, NULL, xpdma_group_thread, &group->workers[c])) {
+            xpdma_close(group->workers[c].fpga);
+            break;
+        }
+        group->count++;
+    }
+
+    if (group->count != count) {
+        xpdma_group_close(group);
+        return NULL;
+    }
+
+    return group;
+}
+
+void xpdma_group_close(xpdma_group_t *group)
+{
+    int c;
+
+    if (group == NULL)
+        return;
+
+    pthread_mutex_lock(&group->jobLock);
+    group->stop = 1;
+    pthread_cond_broadcast(&group->jobCond);
+    pthread_mutex_unlock(&group->jobLock);
+
+    for (c = 0; c < group->count; ++c) {
+        pthread_join(group->workers[c].thread, NULL);
+        xpdma_close(group->workers[c].fpga);
+    }
+
+    pthread_cond_destroy(&group->doneCond);
+    pthread_cond_destroy(&group->jobCond);
+    pthread_mutex_destroy(&group->jobLock);
+    pthread_mutex_destroy(&group->lock);
+    free(group);
+}
+
+xpdma_t *xpdma_group_board(xpdma_group_t *group, int index)
+{
+    if (group == NULL || index < 0 || index >= group->count)
+        return NULL;
+    return group->workers[index].fpga;
+}
+
+static int xpdma_group_transfer(xpdma_group_t *group, int send, void *data, size_t count, uint64_t addr, unsigned int flags)
+{
+    int result = 0;
+    int c;
+
+    if (group == NULL || (addr % 4))
+        return -1;
+
+    if (count == 0)
+        return 0;
+
+    pthread_mutex_lock(&group->lock);
+
+    pthread_mutex_lock(&group->jobLock);
+    group->send = send;
+    group->data = (char *)data;
+    group->length = count;
+    group->addr = addr;
+    group->flags = flags;
+    group->pending = group->count;
+    group->seq++;
+    pthread_cond_broadcast(&group->jobCond);
+    while (group->pending)
+        pthread_cond_wait(&group->doneCond, &group->jobLock);
+    for (c = 0; c < group->count; ++c)
+        if (group->workers[c].result)
+            result = group->workers[c].result;
+    pthread_mutex_unlock(&group->jobLock);
+
+    pthread_mutex_unlock(&group->lock);
+    return result;
+}
+
+int xpdma_group_send(xpdma_group_t *group, void *data, size_t count, uint64_t addr, unsigned int flags)
+{
+    return xpdma_group_transfer(group, 1, data, count, addr, flags);
+}
+
+int xpdma_group_recv(xpdma_group_t *group, void *data, size_t count, uint64_t addr, unsigned int flags)
+{
+    return xpdma_group_transfer(group, 0, data, count, addr, flags);
+}
+
+/**
+ * Streaming: a producer stage on a worker thread and a consumer stage on the
+ * calling thread pass XPDMA_STREAM_DEPTH buffers of XPDMA_STREAM_CHUNK bytes to
+ * each other, so both run at the same time. Loads read the file (O_DIRECT) and
+ * send, dumps receive and write the file, staged board to board copies receive
+ * from one board and send to the other, transforms convert between a user
+ * buffer and cache sized chunks. The buffers are NUMA local and registered for
+ * zero copy DMA once per stream (bounce copies when registration is not
+ * available), transforms keep theirs in the handle.
+ */
+#define XPDMA_STREAM_CHUNK  (4 << 20)   // one bounce buffer, the driver chunk size
+#define XPDMA_STREAM_DEPTH  4           // buffers in the pipeline
+#define XPDMA_STREAM_ALIGN  4096        // O_DIRECT offset/length/buffer alignment
+
+enum {
+    XPDMA_STREAM_LOAD,          // file -> DDR
+    XPDMA_STREAM_DUMP,          // DDR -> file
+    XPDMA_STREAM_COPY,          // DDR -> DDR of the peer board
+    XPDMA_STREAM_RECV,          // DDR -> user buffer through a transform
+    XPDMA_STREAM_SEND,          // user buffer -> DDR through a transform
+};
+
+struct xpdma_stream {
+    xpdma_t *fpga;
+    xpdma_t *peer;              // copy destination
+    int mode;                   // XPDMA_STREAM_*
+    int fd;
+    int direct;                 // fd is O_DIRECT
+    uint64_t offset;            // file offset of the first byte
+    uint64_t count;
+    unsigned int addr;          // DDR address of the first byte
+    unsigned int peerAddr;
+    const xpdma_transform_t *tf; // transform and its user buffer
+    char *host;
+    uint64_t frames;            // frames of the whole transfer (planar channel stride)
+    size_t chunk;               // bytes per buffer, multiple of 4
+    int shared;                 // buffers belong to the handle stage
+    char *buffers[XPDMA_STREAM_DEPTH];
+    uint32_t handles[XPDMA_STREAM_DEPTH];
+    uint32_t peerHandles[XPDMA_STREAM_DEPTH];
+    int registered;
+    size_t lengths[XPDMA_STREAM_DEPTH];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t produced;          // chunks handed to the consumer
+    uint64_t consumed;          // chunks given back to the producer
+    int done;                   // producer finished
+    int error;
+    double produceSeconds;
+    double consumeSeconds;
+};
+
+static double xpdma_stream_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int xpdma_stream_read(struct xpdma_stream *st, char *buf, size_t count, uint64_t offset)
+{
+    // O_DIRECT needs whole blocks: the tail block is read in full and cut
+    size_t want = st->direct ? (count + XPDMA_STREAM_ALIGN - 1) & ~(size_t)(XPDMA_STREAM_ALIGN - 1) : count;
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < count) {
+        n = pread(st->fd, buf + done, want - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1; // error or file shorter than the transfer
+        done += n;
+    }
+    return 0;
+}
+
+static int xpdma_stream_write(struct xpdma_stream *st, const char *buf, size_t count, uint64_t offset)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    // unaligned tail: the rest of the file goes through the page cache
+    if (st->direct && (count % XPDMA_STREAM_ALIGN)) {
+        if (fcntl(st->fd, F_SETFL, fcntl(st->fd, F_GETFL) & ~O_DIRECT))
+            return -1;
+        st->direct = 0;
+    }
+
+    while (done < count) {
+        n = pwrite(st->fd, buf + done, count - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int xpdma_stream_dma(struct xpdma_stream *st, int send, int slot, size_t count, uint64_t pos)
+{
+    xpdma_t *fpga = (send && st->mode == XPDMA_STREAM_COPY) ? st->peer : st->fpga;
+    uint32_t handle = (fpga == st->peer) ? st->peerHandles[slot] : st->handles[slot];
+    unsigned int addr = ((fpga == st->peer) ? st->peerAddr : st->addr) + pos;
+
+    if (st->registered) {
+        if (send)
+            return xpdma_sendReg(fpga, handle, 0, count, addr, 0);
+        return xpdma_recvReg(fpga, handle, 0, count, addr, 0);
+    }
+    if (send)
+        return xpdma_sendEx(fpga, st->buffers[slot], count, addr, 0);
+    return xpdma_recvEx(fpga, st->buffers[slot], count, addr, 0);
+}
+
+static void xpdma_xform_recv(const xpdma_transform_t *tf, const uint8_t *board, size_t bytes, uint64_t pos, uint64_t frames, void *host);
+static void xpdma_xform_send(const xpdma_transform_t *tf, uint8_t *board, size_t bytes, uint64_t pos, uint64_t frames, const void *host);
+
+// Fill a buffer with the chunk at 'pos'
+static int xpdma_stream_produceOne(struct xpdma_stream *st, int slot, size_t count, uint64_t pos)
+{
+    if (st->mode == XPDMA_STREAM_LOAD)
+        return xpdma_stream_read(st, st->buffers[slot], count, st->offset + pos);
+    if (st->mode == XPDMA_STREAM_SEND) {
+        xpdma_xform_send(st->tf, (uint8_t *)st->buffers[slot], count, pos, st->frames, st->host);
+        return 0;
+    }
+    return xpdma_stream_dma(st, 0, slot, count, pos);
+}
+
+// Take the chunk at 'pos' out of a buffer
+static int xpdma_stream_consumeOne(struct xpdma_stream *st, int slot, size_t count, uint64_t pos)
+{
+    if (st->mode == XPDMA_STREAM_DUMP)
+        return xpdma_stream_write(st, st->buffers[slot], count, st->offset + pos);
+    if (st->mode == XPDMA_STREAM_RECV) {
+        xpdma_xform_recv(st->tf, (const uint8_t *)st->buffers[slot], count, pos, st->frames, st->host);
+        return 0;
+    }
+    return xpdma_stream_dma(st, 1, slot, count, pos);
+}
+
+static void *xpdma_stream_produce(void *arg)
+{
+    struct xpdma_stream *st = (struct xpdma_stream *)arg;
+    uint64_t pos;
+    uint64_t chunk = 0;
+    size_t count;
+    double start;
+    int slot;
+    int result = 0;
+
+    xpdma_trace_internal();
+    if (st->fpga->numaBind)
+        xpdma_bindThread(st->fpga);
+
+    for (pos = 0; pos < st->count && result == 0; pos += count, ++chunk) {
+        count = st->count - pos < st->chunk ? st->count - pos : st->chunk;
+        slot = chunk % XPDMA_STREAM_DEPTH;
+
+        pthread_mutex_lock(&st->lock);
+        while (!st->error && st->produced - st->consumed == XPDMA_STREAM_DEPTH)
+            pthread_cond_wait(&st->cond, &st->lock);
+        result = st->error;
+        pthread_mutex_unlock(&st->lock);
+        if (result)
+            break;
+
+        start = xpdma_stream_now();
+        result = xpdma_stream_produceOne(st, slot, count, pos);
+        st->produceSeconds += xpdma_stream_now() - start;
+
+        pthread_mutex_lock(&st->lock);
+        if (result)
+            st->error = -1;
+        st->lengths[slot] = count;
+        st->produced++;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    pthread_mutex_lock(&st->lock);
+    st->done = 1;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+// Runs until the producer is done and all buffers are consumed
+static void xpdma_stream_consume(struct xpdma_stream *st)
+{
+    uint64_t pos = 0;
+    size_t count;
+    double start;
+    int slot;
+    int result;
+
+    for (;;) {
+        pthread_mutex_lock(&st->lock);
+        while (!st->error && !st->done && st->consumed == st->produced)
+            pthread_cond_wait(&st->cond, &st->lock);
+        if (st->error || st->consumed == st->produced) {
+            pthread_mutex_unlock(&st->lock);
+            return;
+        }
+        slot = st->consumed % XPDMA_STREAM_DEPTH;
+        count = st->lengths[slot];
+        pthread_mutex_unlock(&st->lock);
+
+        start = xpdma_stream_now();
+        result = xpdma_stream_consumeOne(st, slot, count, pos);
+        st->consumeSeconds += xpdma_stream_now() - start;
+        pos += count;
+
+        pthread_mutex_lock(&st->lock);
+        if (result)
+            st->error = -1;
+        st->consumed++;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+}
+
+// Register the buffers of a stream for one board, 0 if not possible (all or none)
+static int xpdma_stream_register(struct xpdma_stream *st, xpdma_t *fpga, uint32_t *handles)
+{
+    int slot;
+
+    for (slot = 0; slot < XPDMA_STREAM_DEPTH; ++slot) {
+        if (xpdma_registerBuffer(fpga, st->buffers[slot], XPDMA_STREAM_CHUNK, &handles[slot])) {
+            while (slot-- > 0)
+                xpdma_unregisterBuffer(fpga, handles[slot]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void xpdma_stream_unregister(xpdma_t *fpga, uint32_t *handles)
+{
+    int slot;
+
+    for (slot = 0; slot < XPDMA_STREAM_DEPTH; ++slot)
+        xpdma_unregisterBuffer(fpga, handles[slot]);
+}
+
+// Run a prepared stream (fd, range and boards set), frees its buffers
+static int xpdma_stream_run(struct xpdma_stream *st)
+{
+    pthread_t thread;
+    int result = 0;
+    int slot;
+
+    // staged writes must reach DDR before the stream reads or overwrites it
+    if (xpdma_coalesce_flushAll(st->fpga))
+        return -1;
+    if (st->peer != NULL && xpdma_coalesce_flushAll(st->peer))
+        return -1;
+
+    if (st->chunk == 0)
+        st->chunk = XPDMA_STREAM_CHUNK;
+
+    for (slot = 0; !st->shared && slot < XPDMA_STREAM_DEPTH; ++slot) {
+        st->buffers[slot] = (char *)xpdma_allocBuffer(st->fpga, XPDMA_STREAM_CHUNK);
+        if (st->buffers[slot] == NULL) {
+            result = -1;
+            break;
+        }
+    }
+
+    // without registration (no zero copy support) the driver bounces the chunks
+    if (!st->shared)
+        st->registered = result == 0 && xpdma_stream_register(st, st->fpga, st->handles);
+    if (st->registered && st->peer != NULL && !xpdma_stream_register(st, st->peer, st->peerHandles)) {
+        xpdma_stream_unregister(st->fpga, st->handles);
+        st->registered = 0;
+    }
+
+    if (result == 0) {
+        pthread_mutex_init(&st->lock, NULL);
+        pthread_cond_init(&st->cond, NULL);
+
+        if (pthread_create(&thread, NULL, xpdma_stream_produce, st)) {
+            result = -1;
+        } else {
+            xpdma_stream_consume(st);
+            pthread_join(thread, NULL);
+            result = st->error;
+        }
+
+        pthread_cond_destroy(&st->cond);
+        pthread_mutex_destroy(&st->lock);
+    }
+
+    if (st->shared)
+        return result;
+
+    if (st->registered) {
+        xpdma_stream_unregister(st->fpga, st->handles);
+        if (st->peer != NULL)
+            xpdma_stream_unregister(st->peer, st->peerHandles);
+    }
+    for (slot = 0; slot < XPDMA_STREAM_DEPTH && st->buffers[slot] != NULL; ++slot)
+        xpdma_freeBuffer(st->buffers[slot], XPDMA_STREAM_CHUNK);
+
+    return result;
+}
+
+static int xpdma_stream_file(xpdma_t *fpga, int mode, const char *path, uint64_t offset, uint64_t count,
+                             unsigned int addr, xpdma_stream_stats_t *stats)
+{
+    struct xpdma_stream st;
+    struct stat sb;
+    double start = xpdma_stream_now();
+    int flags = (mode == XPDMA_STREAM_LOAD) ? O_RDONLY : (O_WRONLY | O_CREAT);
+    int direct;
+    int result;
+
+    if (fpga == NULL || path == NULL || (addr % 4))
+        return -1;
+
+    memset(&st, 0, sizeof(st));
+    st.fpga = fpga;
+    st.mode = mode;
+    st.offset = offset;
+    st.addr = addr;
+    st.direct = (offset % XPDMA_STREAM_ALIGN) == 0;
+
+    st.fd = st.direct ? open(path, flags | O_DIRECT, 0644) : -1;
+    if (st.fd < 0) {
+        // file systems without O_DIRECT (tmpfs) or an unaligned file offset
+        st.direct = 0;
+        st.fd = open(path, flags, 0644);
+        if (st.fd < 0)
+            return -1;
+    }
+    direct = st.direct;
+
+    if (mode == XPDMA_STREAM_LOAD && count == 0) {
+        if (fstat(st.fd, &sb) || (uint64_t)sb.st_size < offset) {
+            close(st.fd);
+            return -1;
+        }
+        count = sb.st_size - offset;
+    }
+    st.count = count;
+    if ((uint64_t)addr + count > xpdma_ddrSize(fpga)) {
+        close(st.fd);
+        return -1;
+    }
+
+    result = xpdma_stream_run(&st);
+
+    if (close(st.fd))
+        result = -1;
+
+    if (stats != NULL) {
+        stats->bytes = result ? 0 : count;
+        stats->seconds = xpdma_stream_now() - start;
+        stats->fileSeconds = (mode == XPDMA_STREAM_LOAD) ? st.produceSeconds : st.consumeSeconds;
+        stats->dmaSeconds = (mode == XPDMA_STREAM_LOAD) ? st.consumeSeconds : st.produceSeconds;
+        stats->direct = direct;
+        stats->zeroCopy = st.registered;
+    }
+
+    return result;
+}
+
+int xpdma_loadFile(xpdma_t *fpga, const char *path, uint64_t offset, uint64_t count,
+                   unsigned int addr, xpdma_stream_stats_t *stats)
+{
+    struct xpdma_trace_op op;
+    xpdma_stream_stats_t local;
+    int result;
+
+    // the record has the byte count of count 0 loads
+    if (stats == NULL)
+        stats = &local;
+
+    xpdma_trace_begin(&op, fpga, XPDMA_OP_LOAD_FILE, count, addr, 0);
+    op.rec.arg = offset;
+    result = xpdma_stream_file(fpga, XPDMA_STREAM_LOAD, path, offset, count, addr, stats);
+    op.rec.count = stats->bytes ? stats->bytes : count;
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+int xpdma_dumpFile(xpdma_t *fpga, const char *path, uint64_t offset, uint64_t count,
+                   unsigned int addr, xpdma_stream_stats_t *stats)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    xpdma_trace_begin(&op, fpga, XPDMA_OP_DUMP_FILE, count, addr, 0);
+    op.rec.arg = offset;
+    result = xpdma_stream_file(fpga, XPDMA_STREAM_DUMP, path, offset, count, addr, stats);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+static int xpdma_p2p_copy(xpdma_t *src, unsigned int srcAddr, xpdma_t *dst, unsigned int dstAddr, uint64_t count)
+{
+    struct xpdma_stream st;
+    int result;
+
+    if (!count)
+        return 0;
+
+    // staged sends to the source must land before its engine reads DDR,
+    // staged sends to the destination must not overwrite the copy later
+    if (xpdma_coalesce_flushAll(src) || xpdma_coalesce_flushAll(dst))
+        return -1;
+
+    cdmaCopy_t copy = {src->id, dst->id, srcAddr, dstAddr, count, 0};
+    result = ioctl(src->fd, IOCTL_COPYP2P, &copy);
+    if (result != -1 || errno != EOPNOTSUPP)
+        return result;
+
+    // no peer to peer path between the boards: receive and send in a pipeline
+    if (count > xpdma_ddrSize(src) || srcAddr > xpdma_ddrSize(src) - count ||
+        count > xpdma_ddrSize(dst) || dstAddr > xpdma_ddrSize(dst) - count)
+        return -1;
+
+    memset(&st, 0, sizeof(st));
+    st.fpga = src;
+    st.peer = dst;
+    st.mode = XPDMA_STREAM_COPY;
+    st.fd = -1;
+    st.count = count;
+    st.addr = srcAddr;
+    st.peerAddr = dstAddr;
+    return xpdma_stream_run(&st);
+}
+
+int xpdma_copyP2P(xpdma_t *src, unsigned int srcAddr, xpdma_t *dst, unsigned int dstAddr, uint64_t count)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    if (src == NULL || dst == NULL || (srcAddr % 4) || (dstAddr % 4))
+        return -1;
+
+    xpdma_trace_begin(&op, src, XPDMA_OP_COPY_P2P, count, srcAddr, 0);
+    op.rec.arg = dstAddr;
+    op.rec.peer = dst->traceId;
+    result = xpdma_p2p_copy(src, srcAddr, dst, dstAddr, count);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+/**
+ * Transform on copy: sample conversion fused with the transfer. Chunks of
+ * XPDMA_XFORM_CHUNK bytes are received into registered staging buffers (zero
+ * copy DMA, no CPU pass) and converted into the user buffer while they are
+ * still in cache, the next chunk is received meanwhile; sends convert into the
+ * staging buffers first. Contiguous conversions use AVX2 or SSE4.1 kernels
+ * picked at run time, 12 bit unpacking and channel (de)interleave are scalar
+ * but stay in the same pass.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XPDMA_XFORM_X86
+#endif
+
+#define XPDMA_XFORM_CHUNK   (256 << 10) // staging buffer, fits L2 with the destination
+
+struct xpdma_stage {
+    pthread_mutex_t lock;       // one transform at a time per handle
+    char *buffers[XPDMA_STREAM_DEPTH];
+    uint32_t handles[XPDMA_STREAM_DEPTH];
+    int registered;
+};
+
+struct xpdma_xform_kernels {
+    void (*swap16)(uint16_t *dst, const uint16_t *src, size_t n);
+    void (*s16ToF32)(float *dst, const int16_t *src, size_t n, int swap, float scale);
+    void (*f32ToS16)(int16_t *dst, const float *src, size_t n, int swap, float scale);
+};
+
+static struct xpdma_xform_kernels xpdma_kernels;
+static pthread_once_t xpdma_kernelsOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t gStageLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * float -> int16 with saturation, +-Inf saturate, NaN gives -32768. The SIMD
+ * kernels clamp before the conversion (cvtps gives 0x80000000 out of int32
+ * range) so every path gives the same samples.
+ */
+static inline int16_t xpdma_xform_sat16(float v)
+{
+    if (!(v > -32768.0f))       // NaN as the SIMD kernels: -32768
+        return -32768;
+    if (v > 32767.0f)
+        return 32767;
+#ifdef XPDMA_XFORM_X86
+    return (int16_t)_mm_cvt_ss2si(_mm_set_ss(v)); // round to nearest even as the SIMD kernels
+#else
+    return (int16_t)(v >= 0.0f ? v + 0.5f : v - 0.5f);
+#endif
+}
+
+static void xpdma_swap16_scalar(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+        dst[i] = __builtin_bswap16(src[i]);
+}
+
+static void xpdma_s16ToF32_scalar(float *dst, const int16_t *src, size_t n, int swap, float scale)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+        dst[i] = (int16_t)(swap ? __builtin_bswap16((uint16_t)src[i]) : (uint16_t)src[i]) * scale;
+}
+
+static void xpdma_f32ToS16_scalar(int16_t *dst, const float *src, size_t n, int swap, float scale)
+{
+    size_t i;
+    uint16_t v;
+    for (i = 0; i < n; ++i) {
+        v = (uint16_t)xpdma_xform_sat16(src[i] * scale);
+        dst[i] = (int16_t)(swap ? __builtin_bswap16(v) : v);
+    }
+}
+
+#ifdef XPDMA_XFORM_X86
+__attribute__((target("avx2")))
+static void xpdma_swap16_avx2(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + i)), mask));
+    xpdma_swap16_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void xpdma_s16ToF32_avx2(float *dst, const int16_t *src, size_t n, int swap, float scale)
+{
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m256 k = _mm256_set1_ps(scale);
+    __m128i v;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        v = _mm_loadu_si128((const __m128i *)(src + i));
+        if (swap)
+            v = _mm_shuffle_epi8(v, mask);
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v)), k));
+    }
+    xpdma_s16ToF32_scalar(dst + i, src + i, n - i, swap, scale);
+}
+
+__attribute__((target("avx2")))
+static void xpdma_f32ToS16_avx2(int16_t *dst, const float *src, size_t n, int swap, float scale)
+{
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m256 k = _mm256_set1_ps(scale);
+    const __m256 lo = _mm256_set1_ps(-32768.0f);
+    const __m256 hi = _mm256_set1_ps(32767.0f);
+    __m256i a, b, v;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        // max_ps returns its second operand for NaN: -32768 as xpdma_xform_sat16
+        a = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), k), lo), hi));
+        b = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i + 8), k), lo), hi));
+        // packs works per 128 bit lane: restore sample order
+        v = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        if (swap)
+            v = _mm256_shuffle_epi8(v, mask);
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    xpdma_f32ToS16_scalar(dst + i, src + i, n - i, swap, scale);
+}
+
+__attribute__((target("sse4.1")))
+static void xpdma_swap16_sse(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i)), mask));
+    xpdma_swap16_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void xpdma_s16ToF32_sse(float *dst, const int16_t *src, size_t n, int swap, float scale)
+{
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m128 k = _mm_set1_ps(scale);
+    __m128i v;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        v = _mm_loadu_si128((const __m128i *)(src + i));
+        if (swap)
+            v = _mm_shuffle_epi8(v, mask);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepi16_epi32(v)), k));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(v, 8))), k));
+    }
+    xpdma_s16ToF32_scalar(dst + i, src + i, n - i, swap, scale);
+}
+
+__attribute__((target("sse4.1")))
+static void xpdma_f32ToS16_sse(int16_t *dst, const float *src, size_t n, int swap, float scale)
+{
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m128 k = _mm_set1_ps(scale);
+    const __m128 lo = _mm_set1_ps(-32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f);
+    __m128i v;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        // max_ps returns its second operand for NaN: -32768 as xpdma_xform_sat16
+        v = _mm_packs_epi32(_mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + i), k), lo), hi)),
+                            _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), k), lo), hi)));
+        if (swap)
+            v = _mm_shuffle_epi8(v, mask);
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    xpdma_f32ToS16_scalar(dst + i, src + i, n - i, swap, scale);
+}
+#endif
+
+static void xpdma_xform_initKernels(void)
+{
+    xpdma_kernels.swap16 = xpdma_swap16_scalar;
+    xpdma_kernels.s16ToF32 = xpdma_s16ToF32_scalar;
+    xpdma_kernels.f32ToS16 = xpdma_f32ToS16_scalar;
+#ifdef XPDMA_XFORM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        xpdma_kernels.swap16 = xpdma_swap16_avx2;
+        xpdma_kernels.s16ToF32 = xpdma_s16ToF32_avx2;
+        xpdma_kernels.f32ToS16 = xpdma_f32ToS16_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        xpdma_kernels.swap16 = xpdma_swap16_sse;
+        xpdma_kernels.s16ToF32 = xpdma_s16ToF32_sse;
+        xpdma_kernels.f32ToS16 = xpdma_f32ToS16_sse;
+    }
+#endif
+}
+
+static inline unsigned int xpdma_xform_channels(const xpdma_transform_t *tf)
+{
+    return tf->channels ? tf->channels : 1;
+}
+
+// Board sample index of board byte offset 'pos' (pos at a sample group boundary)
+static inline uint64_t xpdma_xform_sample(const xpdma_transform_t *tf, uint64_t pos)
+{
+    return (tf->format == XPDMA_FMT_S12P) ? pos / 3 * 2 : pos / 2;
+}
+
+static inline int16_t xpdma_xform_get(const xpdma_transform_t *tf, const uint8_t *board, size_t j)
+{
+    const uint8_t *p;
+    uint16_t v;
+
+    if (tf->format == XPDMA_FMT_S12P) {
+        // two little endian 12 bit samples in three bytes
+        p = board + (j / 2) * 3;
+        v = (j & 1) ? (p[1] >> 4) | (p[2] << 4) : p[0] | ((p[1] & 0x0F) << 8);
+        return (int16_t)(v << 4) >> 4;
+    }
+    v = ((const uint16_t *)board)[j];
+    return (int16_t)(tf->swap ? __builtin_bswap16(v) : v);
+}
+
+static inline void xpdma_xform_put(const xpdma_transform_t *tf, uint8_t *board, size_t j, int16_t s)
+{
+    uint8_t *p;
+    uint16_t v;
+
+    if (tf->format == XPDMA_FMT_S12P) {
+        v = (uint16_t)(s < -2048 ? -2048 : (s > 2047 ? 2047 : s)) & 0x0FFF;
+        p = board + (j / 2) * 3;
+        if (j & 1) {
+            p[1] = (p[1] & 0x0F) | (uint8_t)(v << 4);
+            p[2] = (uint8_t)(v >> 4);
+        } else {
+            p[0] = (uint8_t)v;
+            p[1] = (p[1] & 0xF0) | (uint8_t)(v >> 8);
+        }
+        return;
+    }
+    ((uint16_t *)board)[j] = tf->swap ? __builtin_bswap16((uint16_t)s) : (uint16_t)s;
+}
+
+// Host element of board sample 's': planar channels when deinterleaving
+static inline uint64_t xpdma_xform_hostIndex(const xpdma_transform_t *tf, uint64_t s, uint64_t frames)
+{
+    unsigned int ch = xpdma_xform_channels(tf);
+    return (ch == 1) ? s : (s % ch) * frames + s / ch;
+}
+
+static void xpdma_xform_recv(const xpdma_transform_t *tf, const uint8_t *board, size_t bytes, uint64_t pos, uint64_t frames, void *host)
+{
+    uint64_t first = xpdma_xform_sample(tf, pos);
+    size_t n = xpdma_xform_sample(tf, bytes);
+    float scale = tf->scale != 0.0f ? tf->scale : 1.0f;
+    int16_t *h16 = (int16_t *)host;
+    float *h32 = (float *)host;
+    uint64_t h;
+    size_t j;
+
+    if (xpdma_xform_channels(tf) == 1 && tf->format == XPDMA_FMT_S16) {
+        if (tf->hostFormat == XPDMA_FMT_F32)
+            xpdma_kernels.s16ToF32(h32 + first, (const int16_t *)board, n, tf->swap, scale);
+        else if (tf->swap)
+            xpdma_kernels.swap16((uint16_t *)(h16 + first), (const uint16_t *)board, n);
+        else
+            memcpy(h16 + first, board, n * 2);
+        return;
+    }
+
+    for (j = 0; j < n; ++j) {
+        h = xpdma_xform_hostIndex(tf, first + j, frames);
+        if (tf->hostFormat == XPDMA_FMT_F32)
+            h32[h] = xpdma_xform_get(tf, board, j) * scale;
+        else
+            h16[h] = xpdma_xform_get(tf, board, j);
+    }
+}
+
+static void xpdma_xform_send(const xpdma_transform_t *tf, uint8_t *board, size_t bytes, uint64_t pos, uint64_t frames, const void *host)
+{
+    uint64_t first = xpdma_xform_sample(tf, pos);
+    size_t n = xpdma_xform_sample(tf, bytes);
+    float scale = 1.0f / (tf->scale != 0.0f ? tf->scale : 1.0f);
+    const int16_t *h16 = (const int16_t *)host;
+    const float *h32 = (const float *)host;
+    uint64_t h;
+    size_t j;
+
+    if (xpdma_xform_channels(tf) == 1 && tf->format == XPDMA_FMT_S16) {
+        if (tf->hostFormat == XPDMA_FMT_F32)
+            xpdma_kernels.f32ToS16((int16_t *)board, h32 + first, n, tf->swap, scale);
+        else if (tf->swap)
+            xpdma_kernels.swap16((uint16_t *)board, (const uint16_t *)(h16 + first), n);
+        else
+            memcpy(board, h16 + first, n * 2);
+        return;
+    }
+
+    for (j = 0; j < n; ++j) {
+        h = xpdma_xform_hostIndex(tf, first + j, frames);
+        xpdma_xform_put(tf, board, j, (tf->hostFormat == XPDMA_FMT_F32) ? xpdma_xform_sat16(h32[h] * scale) : h16[h]);
+    }
+}
+
+// Frames of 'count' board bytes, 0 if the transform or the size is not valid
+static uint64_t xpdma_xform_frames(const xpdma_transform_t *tf, size_t count)
+{
+    unsigned int ch;
+
+    if (tf == NULL || tf->channels > XPDMA_XFORM_CHANNELS_MAX)
+        return 0;
+    if ((tf->format != XPDMA_FMT_S16 && tf->format != XPDMA_FMT_S12P) ||
+        (tf->hostFormat != XPDMA_FMT_S16 && tf->hostFormat != XPDMA_FMT_F32))
+        return 0;
+
+    ch = xpdma_xform_channels(tf);
+    if (count % ((tf->format == XPDMA_FMT_S12P) ? 3 : 2))
+        return 0;
+    if (xpdma_xform_sample(tf, count) % ch)
+        return 0;
+    return xpdma_xform_sample(tf, count) / ch;
+}
+
+size_t xpdma_transformSize(const xpdma_transform_t *tf, size_t count)
+{
+    uint64_t frames = xpdma_xform_frames(tf, count);
+
+    if (frames == 0)
+        return 0;
+    return frames * xpdma_xform_channels(tf) * ((tf->hostFormat == XPDMA_FMT_F32) ? 4 : 2);
+}
+
+static void xpdma_stage_free(xpdma_t *fpga)
+{
+    struct xpdma_stage *stage = fpga->stage;
+    int slot;
+
+    if (stage == NULL)
+        return;
+
+    for (slot = 0; slot < XPDMA_STREAM_DEPTH; ++slot) {
+        if (stage->registered)
+            xpdma_unregisterBuffer(fpga, stage->handles[slot]);
+        xpdma_freeBuffer(stage->buffers[slot], XPDMA_XFORM_CHUNK);
+    }
+    pthread_mutex_destroy(&stage->lock);
+    free(stage);
+    fpga->stage = NULL;
+}
+
+// Staging buffers of the handle, allocated on the first transform
+static struct xpdma_stage *xpdma_stage_get(xpdma_t *fpga)
+{
+    struct xpdma_stage *stage = fpga->stage;
+    int slot;
+
+    if (stage != NULL)
+        return stage;
+
+    stage = (struct xpdma_stage *)calloc(1, sizeof(*stage));
+    if (stage == NULL)
+        return NULL;
+    pthread_mutex_init(&stage->lock, NULL);
+    fpga->stage = stage;
+
+    for (slot = 0; slot < XPDMA_STREAM_DEPTH; ++slot) {
+        stage->buffers[slot] = (char *)xpdma_allocBuffer(fpga, XPDMA_XFORM_CHUNK);
+        if (stage->buffers[slot] == NULL) {
+            while (slot-- > 0)
+                xpdma_freeBuffer(stage->buffers[slot], XPDMA_XFORM_CHUNK);
+            pthread_mutex_destroy(&stage->lock);
+            free(stage);
+            fpga->stage = NULL;
+            return NULL;
+        }
+    }
+
+    stage->registered = 1;
+    for (slot = 0; slot < XPDMA_STREAM_DEPTH; ++slot) {
+        if (xpdma_registerBuffer(fpga, stage->buffers[slot], XPDMA_XFORM_CHUNK, &stage->handles[slot])) {
+            while (slot-- > 0)
+                xpdma_unregisterBuffer(fpga, stage->handles[slot]);
+            stage->registered = 0;
+            break;
+        }
+    }
+
+    return stage;
+}
+
+static int xpdma_xform_run(xpdma_t *fpga, int mode, void *data, size_t count, unsigned int addr, const xpdma_transform_t *tf)
+{
+    struct xpdma_stream st;
+    struct xpdma_stage *stage;
+    unsigned int unit;
+    int result;
+
+    if (fpga == NULL || data == NULL || (addr % 4))
+        return -1;
+    if (count == 0)
+        return 0;
+    if (xpdma_xform_frames(tf, count) == 0 || (uint64_t)addr + count > xpdma_ddrSize(fpga))
+        return -1;
+
+    pthread_once(&xpdma_kernelsOnce, xpdma_xform_initKernels);
+
+    memset(&st, 0, sizeof(st));
+    st.fpga = fpga;
+    st.mode = mode;
+    st.fd = -1;
+    st.count = count;
+    st.addr = addr;
+    st.tf = tf;
+    st.host = (char *)data;
+    st.frames = xpdma_xform_frames(tf, count);
+
+    // chunks of whole frames and sample groups, DDR addresses stay word aligned
+    unit = ((tf->format == XPDMA_FMT_S12P) ? 3 : 2) * xpdma_xform_channels(tf) * 4;
+    st.chunk = (XPDMA_XFORM_CHUNK / unit) * unit;
+
+    // the staging buffers are shared by all transforms of the handle
+    pthread_mutex_lock(&gStageLock);
+    stage = xpdma_stage_get(fpga);
+    pthread_mutex_unlock(&gStageLock);
+    if (stage == NULL)
+        return -1;
+
+    pthread_mutex_lock(&stage->lock);
+    st.shared = 1;
+    st.registered = stage->registered;
+    memcpy(st.buffers, stage->buffers, sizeof(st.buffers));
+    memcpy(st.handles, stage->handles, sizeof(st.handles));
+    result = xpdma_stream_run(&st);
+    pthread_mutex_unlock(&stage->lock);
+
+    return result;
+}
+
+static int xpdma_xform_traced(xpdma_t *fpga, int mode, void *data, size_t count, unsigned int addr, const xpdma_transform_t *tf)
+{
+    struct xpdma_trace_op op;
+    int result;
+
+    xpdma_trace_begin(&op, fpga, (mode == XPDMA_STREAM_SEND) ? XPDMA_OP_SEND_TRANSFORM : XPDMA_OP_RECV_TRANSFORM,
+                      count, addr, 0);
+    if (op.state == 2 && tf != NULL)
+        op.rec.arg = xpdma_trace_packTransform(tf);
+    result = xpdma_xform_run(fpga, mode, data, count, addr, tf);
+    xpdma_trace_end(&op, result);
+    return result;
+}
+
+int xpdma_recvTransform(xpdma_t *fpga, void *data, size_t count, unsigned int addr, const xpdma_transform_t *tf)
+{
+    return xpdma_xform_traced(fpga, XPDMA_STREAM_RECV, data, count, addr, tf);
+}
+
+int xpdma_sendTransform(xpdma_t *fpga, const void *data, size_t count, unsigned int addr, const xpdma_transform_t *tf)
+{
+    return xpdma_xform_traced(fpga, XPDMA_STREAM_SEND, (void *)data, count, addr, tf);
+}
@@ -6,10 +6,19 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include "xpdma_driver.h"
 
 struct xpdma_t;
 typedef struct xpdma_t xpdma_t;
 
+typedef cdmaStats_t xpdma_stats_t;
+typedef cdmaClientStats_t xpdma_client_stats_t;
+typedef cdmaDdrStats_t xpdma_ddr_stats_t;
+typedef cdmaIrqEvents_t xpdma_irq_events_t;
+typedef cdmaIrqStats_t xpdma_irq_stats_t;
+
 /**
  * Open device with PCIe DMA
  */
@@ -30,6 +39,140 @@ int xpdma_send(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
  */
 int xpdma_recv(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr);
 
+/**
+ * Send data to DDR with transfer flags (XPDMA_FLAG_*), e.g. XPDMA_FLAG_PRIO_HIGH
+ * Returns 0 on success, negative value on error
+ */
+int xpdma_sendEx(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr, unsigned int flags);
+
+/**
+ * Receive data from DDR with transfer flags (XPDMA_FLAG_*)
+ * Returns 0 on success, negative value on error
+ */
+int xpdma_recvEx(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr, unsigned int flags);
+
+/**
+ * Vectored send/receive: the buffers of 'iov' go to/come from consecutive DDR
+ * addresses starting at 'addr' in one pwritev/preadv on the device node
+ * (file position XPDMA_FILE_OFFSET). Returns bytes transferred, -1 on error.
+ */
+ssize_t xpdma_sendv(xpdma_t *fpga, const struct iovec *iov, int iovcnt, uint64_t addr);
+ssize_t xpdma_recvv(xpdma_t *fpga, const struct iovec *iov, int iovcnt, uint64_t addr);
+
+/**
+ * Read board scheduler statistics (per priority class queue wait, bytes, requests)
+ */
+int xpdma_getStats(xpdma_t *fpga, xpdma_stats_t *stats);
+
+/**
+ * Limit bandwidth of this process (the opened device file) on all boards.
+ * rate - bytes per second (0 - unlimited), burst - token bucket depth in bytes
+ * (0 - one 4 MB chunk), weight - fair share weight among clients of the same
+ * priority class (XPDMA_WEIGHT_DEFAULT for equal share).
+ * Loosening the limit or raising the weight above XPDMA_WEIGHT_DEFAULT needs
+ * CAP_SYS_ADMIN.
+ */
+int xpdma_setLimit(xpdma_t *fpga, uint64_t rate, uint64_t burst, uint32_t weight);
+
+/**
+ * Read throughput counters of this process
+ */
+int xpdma_getClientStats(xpdma_t *fpga, xpdma_client_stats_t *stats);
+
+/**
+ * Board DDR3 regions for processes sharing a board: the driver hands out
+ * disjoint 'length' byte regions (rounded up to a power of two, at least 4 KB,
+ * aligned to 'align' when larger) and returns the DDR3 address for send/recv.
+ * Regions of a process are freed when its device file is closed (last
+ * xpdma_close or exit). Fails with errno ENOMEM when no free block is large
+ * enough. xpdma_getDdrStats reports usage and fragmentation (largest free block).
+ */
+int xpdma_ddrAlloc(xpdma_t *fpga, uint64_t length, uint64_t align, uint32_t *handle, unsigned int *addr);
+int xpdma_ddrFree(xpdma_t *fpga, uint32_t handle);
+int xpdma_getDdrStats(xpdma_t *fpga, xpdma_ddr_stats_t *stats);
+
+/**
+ * User logic interrupts (MSI vectors 0 .. XPDMA_IRQ_MAX-1, see the design
+ * wrapper). xpdma_irqOpen returns a file descriptor for poll()/epoll (POLLIN)
+ * and read() of xpdma_irq_events_t that reports vectors of 'mask' fired since
+ * the previous read; close it with close(). xpdma_irqWait waits on it for up
+ * to timeoutMs (-1 - forever) and returns 1 on timeout. xpdma_irqEventfd
+ * signals an eventfd on every interrupt of 'vector' (efd -1 removes), until
+ * the process closes the device. Fails with errno ENODEV when the board has
+ * no MSI vectors.
+ */
+int xpdma_irqOpen(xpdma_t *fpga, uint32_t mask);
+int xpdma_irqWait(int irqFd, int timeoutMs, xpdma_irq_events_t *events);
+int xpdma_irqEventfd(xpdma_t *fpga, unsigned int vector, int efd);
+int xpdma_getIrqStats(xpdma_t *fpga, xpdma_irq_stats_t *stats);
+
+/**
+ * Write/read board tunable (XPDMA_PARAM_*), e.g. programmed I/O size thresholds
+ * XPDMA_PARAM_PIO_SEND_MAX/XPDMA_PARAM_PIO_RECV_MAX used by xpdma_send/xpdma_recv
+ * to pick programmed I/O or DMA, or the completion polling mode XPDMA_PARAM_POLL_MODE.
+ * Tunables are board wide, writing them needs CAP_SYS_ADMIN.
+ */
+int xpdma_setParam(xpdma_t *fpga, uint32_t param, uint64_t value);
+int xpdma_getParam(xpdma_t *fpga, uint32_t param, uint64_t *value);
+
+/**
+ * Write coalescing: xpdma_send smaller than maxWrite bytes to an address inside or
+ * right after the staged extent is copied to a staging buffer and sent as one DMA
+ * when the extent reaches flushSize bytes or its first write is maxAgeUs old.
+ * Transfers overlapping staged data flush it first, on this or any other handle of
+ * the board. maxWrite 0 disables coalescing.
+ */
+int xpdma_setCoalescing(xpdma_t *fpga, unsigned int maxWrite, unsigned int flushSize, unsigned int maxAgeUs);
+
+/**
+ * Send staged writes now, returns error of a failed background flush if any
+ */
+int xpdma_flush(xpdma_t *fpga);
+
+/**
+ * Map 'length' bytes of board DDR from page aligned 'addr'. Pages are read by DMA
+ * when first touched (with readahead for sequential access) and kept in a host
+ * page cache bounded by the driver (module parameter mmap_cache_pages); modified
+ * pages are written back by xpdma_mapSync, on eviction and by xpdma_unmap.
+ * The cache is not coherent with xpdma_send/xpdma_recv to the same range, and
+ * mapped memory can't be the buffer of xpdma_send/xpdma_recv.
+ * Returns NULL on error.
+ */
+void *xpdma_map(xpdma_t *fpga, unsigned int addr, size_t length);
+int xpdma_mapSync(void *ptr, size_t length);
+int xpdma_unmap(void *ptr, size_t length);
+
+/**
+ * Zero copy: register a buffer once (pinned and IOMMU mapped for the board until
+ * unregistered or close) and send/receive parts of it by handle, 'offset' from
+ * the registered start. Calls fail with errno ESTALE once the buffer memory was
+ * unmapped or freed. xpdma_registerBuffer registers for both directions,
+ * xpdma_registerBufferEx with 'access' XPDMA_ACCESS_SEND only needs read access
+ * (const data, PROT_READ mappings), xpdma_recvReg then fails.
+ */
+int xpdma_registerBuffer(xpdma_t *fpga, void *data, size_t length, uint32_t *handle);
+int xpdma_registerBufferEx(xpdma_t *fpga, const void *data, size_t length, uint32_t access, uint32_t *handle);
+int xpdma_unregisterBuffer(xpdma_t *fpga, uint32_t handle);
+int xpdma_sendReg(xpdma_t *fpga, uint32_t handle, size_t offset, unsigned int count, unsigned int addr, unsigned int flags);
+int xpdma_recvReg(xpdma_t *fpga, uint32_t handle, size_t offset, unsigned int count, unsigned int addr, unsigned int flags);
+
+/**
+ * dma-buf sharing with other drivers. xpdma_exportBuffer allocates 'length' bytes
+ * (rounded up to pages) of host memory on the board NUMA node and returns a dma-buf
+ * descriptor for other devices (and mmap). xpdma_importBuffer maps any dma-buf
+ * (also one exported here) for the board and returns a registered buffer handle
+ * for xpdma_sendReg/xpdma_recvReg, released by xpdma_unregisterBuffer.
+ */
+int xpdma_exportBuffer(xpdma_t *fpga, size_t length, int *fd);
+int xpdma_importBuffer(xpdma_t *fpga, int fd, uint32_t *handle, size_t *length);
+
+/**
+ * Automatic registration of XPDMA_FLAG_ZERO_COPY buffers of xpdma_sendEx/xpdma_recvEx:
+ * up to 'entries' buffers stay registered (least recently used replaced), so
+ * reused buffers are pinned and mapped only once. 0 disables (driver pins per call).
+ */
+int xpdma_setRegCache(xpdma_t *fpga, unsigned int entries);
+
 /**
  *
  */
@@ -46,6 +189,167 @@ uint32_t xpdma_readReg(xpdma_t *fpga, uint32_t addr);
 void xpdma_read(xpdma_t *fpga, void *data, unsigned int count);
 void xpdma_write(xpdma_t *fpga, void *data, unsigned int count);
 
+/**
+ * NUMA node of the board (-1 - unknown) and its CPUs in sysfs cpulist format
+ * ("0-7,16-23"); xpdma_bindThread pins the calling thread to these CPUs.
+ */
+int xpdma_getNumaNode(xpdma_t *fpga);
+int xpdma_getLocalCpuList(xpdma_t *fpga, char *list, size_t size);
+int xpdma_bindThread(xpdma_t *fpga);
+
+/**
+ * Buffer on the board NUMA node (preferred, or strict with xpdma_setNumaBind),
+ * so bounce copies and zero copy DMA stay on the board socket. Free with xpdma_freeBuffer.
+ */
+void *xpdma_allocBuffer(xpdma_t *fpga, size_t size);
+int xpdma_freeBuffer(void *ptr, size_t size);
+
+/**
+ * Strict NUMA placement for this handle: xpdma_allocBuffer binds memory to the
+ * board node and internal worker threads (write coalescing) started afterwards
+ * run on its CPUs. Group workers always run on their board node.
+ */
+int xpdma_setNumaBind(xpdma_t *fpga, int enable);
+
+/**
+ * Board group: 'count' boards seen as one DDR space striped in 'stripeSize' byte
+ * stripes (stripe s on board ids[s % count]). xpdma_group_send/xpdma_group_recv
+ * run the stripes of every board in parallel on per board worker threads bound
+ * to the board NUMA node and return when all are done. 'flags' as xpdma_sendEx.
+ */
+typedef struct xpdma_group_t xpdma_group_t;
+
+xpdma_group_t *xpdma_group_open(const int *ids, int count, unsigned int stripeSize);
+void xpdma_group_close(xpdma_group_t *group);
+int xpdma_group_send(xpdma_group_t *group, void *data, size_t count, uint64_t addr, unsigned int flags);
+int xpdma_group_recv(xpdma_group_t *group, void *data, size_t count, uint64_t addr, unsigned int flags);
+
+/**
+ * Board handle of group member 'index' (owned by the group), e.g. for xpdma_setRegCache
+ */
+xpdma_t *xpdma_group_board(xpdma_group_t *group, int index);
+
+/**
+ * Pipelined file streaming: xpdma_loadFile copies 'count' bytes of the file from
+ * 'offset' to DDR at 'addr' (count 0 - up to the end of the file), xpdma_dumpFile
+ * writes DDR to the file (created if needed, not truncated). The file is read or
+ * written with O_DIRECT (when the file system and 'offset' allow it) on a worker
+ * thread while the previous chunks are transferred, so the transfer runs at the
+ * speed of the slower of disk and PCIe. 'stats' (may be NULL) gets the time spent
+ * in each stage.
+ */
+typedef struct {
+    uint64_t bytes;         // bytes transferred (0 on error)
+    double seconds;         // wall time of the whole transfer
+    double fileSeconds;     // time in file reads/writes
+    double dmaSeconds;      // time in board transfers
+    int direct;             // file opened with O_DIRECT
+    int zeroCopy;           // DMA from/to registered pipeline buffers
+} xpdma_stream_stats_t;
+
+int xpdma_loadFile(xpdma_t *fpga, const char *path, uint64_t offset, uint64_t count,
+                   unsigned int addr, xpdma_stream_stats_t *stats);
+int xpdma_dumpFile(xpdma_t *fpga, const char *path, uint64_t offset, uint64_t count,
+                   unsigned int addr, xpdma_stream_stats_t *stats);
+
+/**
+ * Copy 'count' bytes from DDR of board 'src' to DDR of board 'dst'. The engine
+ * of 'src' writes the DDR window of 'dst' directly when the PCIe topology allows
+ * peer to peer, otherwise the data is staged in host memory (pipelined receive
+ * and send). Returns 0 on success.
+ */
+int xpdma_copyP2P(xpdma_t *src, unsigned int srcAddr, xpdma_t *dst, unsigned int dstAddr, uint64_t count);
+
+/**
+ * Transform on copy: xpdma_recvTransform receives 'count' bytes of samples in
+ * board format from DDR at 'addr' and stores them converted in host format to
+ * 'data' (xpdma_transformSize bytes) in the same pass, xpdma_sendTransform is
+ * the inverse. Board samples of 'channels' channels are interleaved, host
+ * samples are planar (channel c starts at c * frames). 'count' must hold whole
+ * frames (and whole 3 byte pairs of 12 bit samples).
+ */
+#define XPDMA_FMT_S16       0   // 16 bit signed
+#define XPDMA_FMT_S12P      1   // 12 bit signed, two little endian samples packed in 3 bytes (board only)
+#define XPDMA_FMT_F32       2   // float, sample * scale (host only)
+
+#define XPDMA_XFORM_CHANNELS_MAX    64
+
+typedef struct {
+    uint32_t format;        // XPDMA_FMT_* of the board data
+    uint32_t hostFormat;    // XPDMA_FMT_* of the host data
+    uint32_t swap;          // board 16 bit samples are big endian
+    uint32_t channels;      // interleaved board channels to (de)interleave, 0/1 - none
+    float scale;            // host float = sample * scale, 0 - 1.0
+} xpdma_transform_t;
+
+size_t xpdma_transformSize(const xpdma_transform_t *tf, size_t count);
+int xpdma_recvTransform(xpdma_t *fpga, void *data, size_t count, unsigned int addr, const xpdma_transform_t *tf);
+int xpdma_sendTransform(xpdma_t *fpga, const void *data, size_t count, unsigned int addr, const xpdma_transform_t *tf);
+
+/**
+ * Tracing: xpdma_traceStart (or XPDMA_TRACE=<file> in the environment, read by
+ * the first xpdma_open) writes every call that moves data or changes handle
+ * settings to 'path' as an xpdma_trace_header_t followed by xpdma_trace_rec_t
+ * records in completion order; xpdma_replay (software/replay) issues them again.
+ * Calls the library makes for a traced call (streams, P2P fallback, write
+ * coalescing flushes) are part of its record. Returns 0 on success.
+ */
+#define XPDMA_TRACE_MAGIC   "XPDMATRC"
+#define XPDMA_TRACE_VERSION 1
+
+enum {
+    XPDMA_OP_OPEN,              // board: id
+    XPDMA_OP_CLOSE,
+    XPDMA_OP_SEND,              // xpdma_send/xpdma_sendEx
+    XPDMA_OP_RECV,              // xpdma_recv/xpdma_recvEx
+    XPDMA_OP_SEND_REG,          // reg: handle, arg: buffer offset
+    XPDMA_OP_RECV_REG,
+    XPDMA_OP_SENDV,             // arg: iovcnt
+    XPDMA_OP_RECVV,
+    XPDMA_OP_FLUSH,
+    XPDMA_OP_COPY_P2P,          // addr: source, arg: destination address, peer: destination handle
+    XPDMA_OP_SEND_TRANSFORM,    // count: board bytes, arg: xpdma_trace_packTransform
+    XPDMA_OP_RECV_TRANSFORM,
+    XPDMA_OP_LOAD_FILE,         // arg: file offset
+    XPDMA_OP_DUMP_FILE,
+    XPDMA_OP_SET_PARAM,         // addr: parameter, count: value
+    XPDMA_OP_SET_COALESCING,    // count: maxWrite, addr: flushSize, arg: maxAgeUs
+    XPDMA_OP_SET_REGCACHE,      // count: entries
+    XPDMA_OP_REGISTER,          // count: length, reg: handle
+    XPDMA_OP_UNREGISTER,        // reg: handle
+    XPDMA_OP_NUM
+};
+
+typedef struct {
+    char magic[8];          // XPDMA_TRACE_MAGIC
+    uint32_t version;       // XPDMA_TRACE_VERSION
+    uint32_t recordSize;    // sizeof(xpdma_trace_rec_t)
+    uint64_t startTime;     // CLOCK_REALTIME of the trace start, ns
+} xpdma_trace_header_t;
+
+typedef struct {
+    uint64_t start;         // call start, ns since the trace start (CLOCK_MONOTONIC)
+    uint64_t end;           // call end
+    uint64_t count;         // bytes
+    uint64_t addr;          // DDR address
+    uint64_t arg;           // op specific (XPDMA_OP_*)
+    uint32_t reg;           // registered buffer handle
+    uint32_t flags;         // XPDMA_FLAG_*
+    uint32_t thread;        // Linux thread id of the caller
+    int32_t result;         // 0 - success, -1 - error
+    uint16_t op;            // XPDMA_OP_*
+    int16_t board;          // board id
+    uint16_t device;        // handle number: xpdma_open calls of the process from 1
+    uint16_t peer;          // second handle (XPDMA_OP_COPY_P2P)
+} xpdma_trace_rec_t;
+
+int xpdma_traceStart(const char *path);
+int xpdma_traceStop(void);
+
+// xpdma_transform_t in a record (arg of XPDMA_OP_*_TRANSFORM)
+uint64_t xpdma_trace_packTransform(const xpdma_transform_t *tf);
+void xpdma_trace_unpackTransform(uint64_t arg, xpdma_transform_t *tf);
+
 #ifdef __cplusplus
 }
 #endif
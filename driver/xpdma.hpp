@@ -0,0 +1,172 @@
+#ifndef XPDMA_HPP
+#define XPDMA_HPP
+
+//
+// C++17 layer over libxpdma (libxpdma_cpp.a, link after libxpdma.a):
+//
+//     xpdma::Device dev(0);
+//     xpdma::DmaBuffer buf = dev.buffer(1 << 20);         // pooled, registered
+//     std::future<xpdma::DmaBuffer> f = dev.sendAsync(std::move(buf), 0, 1 << 20);
+//     compute();                                         // overlaps the transfer
+//     buf = f.get();                                     // throws xpdma::Error on failure
+//
+// Errors are reported by xpdma::Error exceptions carrying the errno value.
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#if __has_include(<version>)
+#include <version>
+#endif
+#if defined(__cpp_lib_span)
+#include <span>
+#endif
+
+#include "xpdma.h"
+
+namespace xpdma {
+
+#if defined(__cpp_lib_span)
+template <class T>
+using span = std::span<T>;
+#else
+/**
+ * Contiguous range (std::span subset) for C++17 builds
+ */
+template <class T>
+class span {
+public:
+    constexpr span() noexcept : data_(nullptr), size_(0) {}
+    constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+    template <class C, class = decltype(std::data(std::declval<C &>()))>
+    constexpr span(C &c) noexcept : data_(std::data(c)), size_(std::size(c)) {}
+    template <class U, class = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>>
+    constexpr span(const span<U> &other) noexcept : data_(other.data()), size_(other.size()) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr std::size_t size_bytes() const noexcept { return size_ * sizeof(T); }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+    constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+    constexpr span subspan(std::size_t offset, std::size_t count) const noexcept { return span(data_ + offset, count); }
+
+private:
+    T *data_;
+    std::size_t size_;
+};
+#endif
+
+// Byte views of containers and arrays for send/recv
+template <class C>
+span<const std::byte> as_bytes(const C &c) noexcept
+{
+    return {reinterpret_cast<const std::byte *>(std::data(c)), std::size(c) * sizeof(*std::data(c))};
+}
+
+template <class C>
+span<std::byte> as_writable_bytes(C &c) noexcept
+{
+    return {reinterpret_cast<std::byte *>(std::data(c)), std::size(c) * sizeof(*std::data(c))};
+}
+
+/**
+ * Failed call, code() is the errno value (EIO when the driver gave none)
+ */
+class Error : public std::runtime_error {
+public:
+    Error(const std::string &what, int code);
+    int code() const noexcept { return code_; }
+
+private:
+    int code_;
+};
+
+namespace detail {
+struct DeviceState;
+struct PoolEntry;
+}
+
+/**
+ * Move-only host buffer from the pool of a Device: NUMA local, registered for
+ * zero copy DMA with the board and given back to the pool when destroyed.
+ * size() is the requested size, the pooled allocation may be larger.
+ */
+class DmaBuffer {
+public:
+    DmaBuffer() noexcept = default;
+    DmaBuffer(DmaBuffer &&other) noexcept;
+    DmaBuffer &operator=(DmaBuffer &&other) noexcept;
+    DmaBuffer(const DmaBuffer &) = delete;
+    DmaBuffer &operator=(const DmaBuffer &) = delete;
+    ~DmaBuffer();
+
+    std::byte *data() const noexcept;
+    std::size_t size() const noexcept { return size_; }
+    span<std::byte> bytes() const noexcept { return {data(), size_}; }
+    explicit operator bool() const noexcept { return entry_ != nullptr; }
+
+    // Typed view of the buffer
+    template <class T>
+    span<T> as() const noexcept { return {reinterpret_cast<T *>(data()), size_ / sizeof(T)}; }
+
+private:
+    friend class Device;
+    DmaBuffer(std::shared_ptr<detail::DeviceState> state, detail::PoolEntry *entry, std::size_t size) noexcept;
+    void release() noexcept;
+
+    std::shared_ptr<detail::DeviceState> state_;
+    detail::PoolEntry *entry_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+/**
+ * Open board with a buffer pool and a worker thread (started on the first
+ * asynchronous call, bound to the board NUMA node) that runs asynchronous
+ * transfers in submission order. Memory given to sendAsync/recvAsync as a span
+ * must stay valid until the future is ready; DmaBuffer overloads take the
+ * buffer and hand it back through the future.
+ */
+class Device {
+public:
+    explicit Device(int id);
+    Device(Device &&other) noexcept;
+    Device &operator=(Device &&other) noexcept;
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+    ~Device();
+
+    int id() const noexcept;
+    xpdma_t *handle() const noexcept; // for the C API (parameters, statistics)
+
+    // Pooled buffer of at least 'size' bytes, reused after release (no allocation per call)
+    DmaBuffer buffer(std::size_t size);
+
+    // Blocking transfers, 'flags' XPDMA_FLAG_*
+    void send(span<const std::byte> data, std::uint32_t addr, unsigned int flags = 0);
+    void recv(span<std::byte> data, std::uint32_t addr, unsigned int flags = 0);
+    void send(const DmaBuffer &buf, std::uint32_t addr, std::size_t count, unsigned int flags = 0);
+    void recv(DmaBuffer &buf, std::uint32_t addr, std::size_t count, unsigned int flags = 0);
+
+    // Transfers run by the board worker
+    std::future<void> sendAsync(span<const std::byte> data, std::uint32_t addr, unsigned int flags = 0);
+    std::future<void> recvAsync(span<std::byte> data, std::uint32_t addr, unsigned int flags = 0);
+    std::future<DmaBuffer> sendAsync(DmaBuffer &&buf, std::uint32_t addr, std::size_t count, unsigned int flags = 0);
+    std::future<DmaBuffer> recvAsync(DmaBuffer &&buf, std::uint32_t addr, std::size_t count, unsigned int flags = 0);
+
+private:
+    // Throws Error (EINVAL) unless 'buf' holds 'count' bytes and is registered with this board
+    void checkBuffer(const DmaBuffer &buf, std::size_t count, const char *what) const;
+
+    std::shared_ptr<detail::DeviceState> state_;
+};
+
+} // namespace xpdma
+
+#endif
@@ -0,0 +1,326 @@
+//
+// C++ layer over libxpdma: device state, buffer pool and board worker
+//
+
+#include "xpdma.hpp"
+
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xpdma {
+
+namespace {
+
+constexpr std::size_t kPoolMinSize = 64 << 10; // smallest pooled allocation
+
+// Pool size class: power of two, at least kPoolMinSize
+std::size_t poolClass(std::size_t size)
+{
+    std::size_t c = kPoolMinSize;
+    while (c < size)
+        c <<= 1;
+    return c;
+}
+
+[[noreturn]] void fail(const char *what)
+{
+    throw Error(what, errno ? errno : EIO);
+}
+
+} // namespace
+
+Error::Error(const std::string &what, int code)
+    : std::runtime_error(what + ": " + std::to_string(code)), code_(code)
+{
+}
+
+namespace detail {
+
+struct PoolEntry {
+    void *data;
+    std::size_t capacity;
+    std::uint32_t handle;
+    bool registered;        // zero copy handle, else bounce copies in the driver
+};
+
+/**
+ * Shared by the Device and its buffers: buffers may outlive the Device, the
+ * board handle stays open until the last one is back.
+ */
+struct DeviceState {
+    xpdma_t *fpga = nullptr;
+    int id = 0;
+
+    std::mutex poolLock;
+    std::multimap<std::size_t, PoolEntry *> free; // by capacity
+    std::vector<PoolEntry *> all;
+
+    std::mutex queueLock;
+    std::condition_variable queueCond;
+    std::deque<std::function<void()>> queue;
+    std::thread worker;
+    bool stop = false;
+
+    ~DeviceState()
+    {
+        for (PoolEntry *entry : all) {
+            if (entry->registered)
+                xpdma_unregisterBuffer(fpga, entry->handle);
+            xpdma_freeBuffer(entry->data, entry->capacity);
+            delete entry;
+        }
+        xpdma_close(fpga);
+    }
+
+    void run()
+    {
+        xpdma_bindThread(fpga);
+
+        std::unique_lock<std::mutex> lock(queueLock);
+        for (;;) {
+            queueCond.wait(lock, [this] { return stop || !queue.empty(); });
+            if (queue.empty())
+                break; // stop after the queued transfers
+            std::function<void()> job = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+    void shutdown()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            stop = true;
+        }
+        queueCond.notify_one();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    template <class R>
+    std::future<R> submit(std::function<R()> fn)
+    {
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(fn));
+        std::future<R> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            if (!worker.joinable())
+                worker = std::thread(&DeviceState::run, this);
+            queue.emplace_back([task] { (*task)(); });
+        }
+        queueCond.notify_one();
+        return result;
+    }
+
+    void transfer(bool send, void *data, std::size_t count, std::uint32_t addr, unsigned int flags)
+    {
+        errno = 0;
+        if (send ? xpdma_sendEx(fpga, data, count, addr, flags) : xpdma_recvEx(fpga, data, count, addr, flags))
+            fail(send ? "xpdma_send" : "xpdma_recv");
+    }
+
+    void transfer(bool send, PoolEntry *entry, std::size_t count, std::uint32_t addr, unsigned int flags)
+    {
+        if (!entry->registered) {
+            transfer(send, entry->data, count, addr, flags);
+            return;
+        }
+        errno = 0;
+        if (send ? xpdma_sendReg(fpga, entry->handle, 0, count, addr, flags)
+                 : xpdma_recvReg(fpga, entry->handle, 0, count, addr, flags))
+            fail(send ? "xpdma_sendReg" : "xpdma_recvReg");
+    }
+};
+
+} // namespace detail
+
+DmaBuffer::DmaBuffer(std::shared_ptr<detail::DeviceState> state, detail::PoolEntry *entry, std::size_t size) noexcept
+    : state_(std::move(state)), entry_(entry), size_(size)
+{
+}
+
+DmaBuffer::DmaBuffer(DmaBuffer &&other) noexcept
+    : state_(std::move(other.state_)), entry_(other.entry_), size_(other.size_)
+{
+    other.entry_ = nullptr;
+    other.size_ = 0;
+}
+
+DmaBuffer &DmaBuffer::operator=(DmaBuffer &&other) noexcept
+{
+    if (this != &other) {
+        release();
+        state_ = std::move(other.state_);
+        entry_ = other.entry_;
+        size_ = other.size_;
+        other.entry_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+DmaBuffer::~DmaBuffer()
+{
+    release();
+}
+
+std::byte *DmaBuffer::data() const noexcept
+{
+    return entry_ ? static_cast<std::byte *>(entry_->data) : nullptr;
+}
+
+void DmaBuffer::release() noexcept
+{
+    if (entry_ != nullptr) {
+        std::lock_guard<std::mutex> lock(state_->poolLock);
+        state_->free.emplace(entry_->capacity, entry_);
+    }
+    entry_ = nullptr;
+    size_ = 0;
+    state_.reset();
+}
+
+Device::Device(int id) : state_(std::make_shared<detail::DeviceState>())
+{
+    state_->id = id;
+    state_->fpga = xpdma_open(id);
+    if (state_->fpga == nullptr)
+        fail("xpdma_open");
+}
+
+Device::Device(Device &&other) noexcept = default;
+
+Device &Device::operator=(Device &&other) noexcept
+{
+    if (this != &other) {
+        if (state_)
+            state_->shutdown();
+        state_ = std::move(other.state_);
+    }
+    return *this;
+}
+
+Device::~Device()
+{
+    if (state_)
+        state_->shutdown();
+}
+
+int Device::id() const noexcept
+{
+    return state_->id;
+}
+
+xpdma_t *Device::handle() const noexcept
+{
+    return state_->fpga;
+}
+
+DmaBuffer Device::buffer(std::size_t size)
+{
+    std::size_t capacity = poolClass(size);
+    detail::PoolEntry *entry;
+
+    {
+        std::lock_guard<std::mutex> lock(state_->poolLock);
+        auto it = state_->free.find(capacity);
+        if (it != state_->free.end()) {
+            entry = it->second;
+            state_->free.erase(it);
+            return DmaBuffer(state_, entry, size);
+        }
+    }
+
+    entry = new detail::PoolEntry{xpdma_allocBuffer(state_->fpga, capacity), capacity, 0, false};
+    if (entry->data == nullptr) {
+        delete entry;
+        fail("xpdma_allocBuffer");
+    }
+    entry->registered = xpdma_registerBuffer(state_->fpga, entry->data, capacity, &entry->handle) == 0;
+
+    std::lock_guard<std::mutex> lock(state_->poolLock);
+    state_->all.push_back(entry);
+    return DmaBuffer(state_, entry, size);
+}
+
+void Device::send(span<const std::byte> data, std::uint32_t addr, unsigned int flags)
+{
+    state_->transfer(true, const_cast<std::byte *>(data.data()), data.size(), addr, flags);
+}
+
+void Device::recv(span<std::byte> data, std::uint32_t addr, unsigned int flags)
+{
+    state_->transfer(false, data.data(), data.size(), addr, flags);
+}
+
+void Device::checkBuffer(const DmaBuffer &buf, std::size_t count, const char *what) const
+{
+    if (!buf || count > buf.size())
+        throw Error(std::string(what) + ": buffer too small", EINVAL);
+    if (buf.state_ != state_)
+        throw Error(std::string(what) + ": buffer of another device", EINVAL);
+}
+
+void Device::send(const DmaBuffer &buf, std::uint32_t addr, std::size_t count, unsigned int flags)
+{
+    checkBuffer(buf, count, "xpdma send");
+    state_->transfer(true, buf.entry_, count, addr, flags);
+}
+
+void Device::recv(DmaBuffer &buf, std::uint32_t addr, std::size_t count, unsigned int flags)
+{
+    checkBuffer(buf, count, "xpdma recv");
+    state_->transfer(false, buf.entry_, count, addr, flags);
+}
+
+std::future<void> Device::sendAsync(span<const std::byte> data, std::uint32_t addr, unsigned int flags)
+{
+    detail::DeviceState *state = state_.get();
+    return state->submit<void>([state, data, addr, flags] {
+        state->transfer(true, const_cast<std::byte *>(data.data()), data.size(), addr, flags);
+    });
+}
+
+std::future<void> Device::recvAsync(span<std::byte> data, std::uint32_t addr, unsigned int flags)
+{
+    detail::DeviceState *state = state_.get();
+    return state->submit<void>([state, data, addr, flags] {
+        state->transfer(false, data.data(), data.size(), addr, flags);
+    });
+}
+
+std::future<DmaBuffer> Device::sendAsync(DmaBuffer &&buf, std::uint32_t addr, std::size_t count, unsigned int flags)
+{
+    checkBuffer(buf, count, "xpdma sendAsync");
+
+    // std::function needs a copyable callable: the buffer travels in a shared_ptr
+    auto owned = std::make_shared<DmaBuffer>(std::move(buf));
+    detail::DeviceState *state = state_.get();
+    return state->submit<DmaBuffer>([state, owned, addr, count, flags] {
+        state->transfer(true, owned->entry_, count, addr, flags);
+        return std::move(*owned);
+    });
+}
+
+std::future<DmaBuffer> Device::recvAsync(DmaBuffer &&buf, std::uint32_t addr, std::size_t count, unsigned int flags)
+{
+    checkBuffer(buf, count, "xpdma recvAsync");
+
+    auto owned = std::make_shared<DmaBuffer>(std::move(buf));
+    detail::DeviceState *state = state_.get();
+    return state->submit<DmaBuffer>([state, owned, addr, count, flags] {
+        state->transfer(false, owned->entry_, count, addr, flags);
+        return std::move(*owned);
+    });
+}
+
+} // namespace xpdma
@@ -12,16 +12,43 @@
 #include <linux/dma-mapping.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/sched/signal.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/xarray.h>
+#include <linux/kref.h>
+#include <linux/scatterlist.h>
+#include <linux/mmu_notifier.h>
+#include <linux/sched/mm.h>
+#include <linux/uio.h>
+#include <linux/pci-p2pdma.h>
+#include <linux/dma-buf.h>
+#include <linux/workqueue.h>
+#include <linux/highmem.h>
+#include <linux/bvec.h>
+#include <linux/interrupt.h>
+#include <linux/eventfd.h>
+#include <linux/anon_inodes.h>
+#include <linux/poll.h>
 #include "xpdma_driver.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_DESCRIPTION("PCIe driver for Xilinx CDMA subsystem (XAPP1171), Linux");
 MODULE_AUTHOR("Strezhik Iurii");
+MODULE_IMPORT_NS(DMA_BUF);
 
 // Max CDMA buffer size
 #define MAX_BTT             0x007FFFFF   // 8 MBytes maximum for DMA Transfer */
 #define BUF_SIZE            (4<<20)      // 4 MBytes read/write buffer size
-#define TRANSFER_SIZE       (4<<20)      // 4 MBytes transfer size for scatter gather
+#define TRANSFER_SIZE       (4<<20)      // 4 MBytes transfer size for scatter gather (AXIBAR1 window)
 #define DESCRIPTOR_SIZE     64           // 64-byte aligned Transfer Descriptor
 
 #define BRAM_OFFSET         0x00000000   // Translation BRAM offset
@@ -72,10 +99,15 @@ MODULE_AUTHOR("Strezhik Iurii");
  **/
 #define CDMA_BTT_OFFSET     0x28         // Bytes to transfer Register
 
+#define PIO_BAR             2            // DDR3 window for programmed I/O (IP BAR1, host BAR2 with 64 bit BARs)
+#define PIO_STEP            512          // Programmed I/O bounce size
+
 #define AXI_PCIE_DM_ADDR    0x80000000   // AXI:BAR1 Address
 #define AXI_PCIE_SG_ADDR    0x80800000   // AXI:BAR0 Address
 #define AXI_BRAM_ADDR       0x81000000   // AXI Translation BRAM Address
+#define AXI_WINDOW_ADDR     0x90000000   // AXI:BAR2..BAR5 Address, data windows of designs with a capability register
 #define AXI_DDR3_ADDR       0x00000000   // AXI DDR3 Address
+#define DDR3_SIZE           0x40000000   // KC705 SODIMM (1 GB), AXI from AXI_PCIE_DM_ADDR up is windows and BRAM
 
 #define SG_COMPLETE_MASK    0xF0000000   // Scatter Gather Operation Complete status flag mask
 #define SG_DEC_ERR_MASK     0x40000000   // Scatter Gather Operation Decode Error flag mask
@@ -83,6 +115,16 @@ MODULE_AUTHOR("Strezhik Iurii");
 #define SG_INT_ERR_MASK     0x10000000   // Scatter Gather Operation Internal Error flag mask
 
 #define BRAM_STEP           0x8          // Translation Vector Length
+#define BRAM_VECTORS_SIZE   0x4000       // Translation vectors area (BRAM above it holds user config registers)
+#define VECTOR_BRAM_OFFSET  0x00020000   // Vector BRAM of designs with a capability register
+#define VECTOR_STAGE_SIZE   0x20000      // Largest vector BRAM (128 KB)
+#define VECTOR_STAGE_OFFSET (BUF_SIZE - VECTOR_STAGE_SIZE) // Translation vectors staged in the descriptor chain buffer
+#define VECTOR_MMIO_MAX     2            // Vectors still written to BRAM by MMIO, more are uploaded by the chain
+#define VECTOR_SLOTS        (BRAM_VECTORS_SIZE / BRAM_STEP)
+#define RING_DESCS          16384        // Persistent descriptor ring at the start of the chain buffer (1 MB)
+#define RING_RUNS           16           // Engine runs queued on the ring per board
+#define RING_NORMAL_MAX     (2 * BUF_SIZE) // Normal priority bytes in flight: the chunk in service and one queued
+#define BOUNCE_SLOTS        2            // Bounce buffers per direction, a chunk is copied while another one runs
 #define ADDR_BTT            0x00000008   // 64 bit address translation descriptor control length
 
 /**
@@ -127,12 +169,40 @@ MODULE_AUTHOR("Strezhik Iurii");
 #define AXIBAR2PCIEBAR_0L   0x20C        // AXI:BAR0 Lower Address Translation (bits [31:0])
 #define AXIBAR2PCIEBAR_1U   0x210        // AXI:BAR1 Upper Address Translation (bits [63:32])
 #define AXIBAR2PCIEBAR_1L   0x214        // AXI:BAR1 Lower Address Translation (bits [31:0])
+#define AXIBAR2PCIEBAR_2U   0x218        // AXI:BAR2 Upper Address Translation, BAR3..BAR5 follow every 8 bytes
+
+/**
+ * Capability register (read only AXI GPIO at BAR0 + CAP_OFFSET, designs with a
+ * 256 KB BAR0), older designs have a 64 KB BAR0 and the AXIBAR1 window only.
+ * |31----24|23----20|19----16|15-----------8|7--------------0|
+ * |  0xC4  |windows |  RSVD  |log2 win size |log2 vector BRAM|
+ **/
+#define CAP_OFFSET          0x00010000
+#define CAP_MAGIC           0xC4
+#define CAP_BAR_SIZE        0x00040000   // BAR0 size of designs with the capability register
+#define XLAT_WINDOWS_MAX    4            // Data windows AXIBAR2..AXIBAR5
 
 #define CDMA_RESET_LOOP	    1000000      // Reset timeout counter limit
 #define CDMA_TRANSFER_LOOP    1000000      // Scatter Gather Transfer timeout counter limit
 
-#define DMA_SIMPLE_MODE    0
-#define DMA_SG_MODE        1
+#define SG_TIMEOUT_SHIFT    5            // Run timeout grows 1 us per 32 bytes queued (32 MB/s worst case)
+
+#define HYBRID_MIN_SLEEP_NS 20000        // Shorter predicted runs are busy-polled from the start
+#define HYBRID_MIN_SAMPLE   (64<<10)     // Smallest run used to update the throughput estimate
+#define DEFAULT_BANDWIDTH   1000000000   // Initial throughput estimate, bytes/s
+
+#define VCACHE_BATCH        (BUF_SIZE >> PAGE_SHIFT) // Pages of one DDR mapping read/write back run
+#define VCACHE_DIRTY        XA_MARK_0    // Cached page modified since the last write back
+
+#define SG_SEG_MAX          (RING_DESCS / 4 - 1) // Data descriptors of one chain run, two longest runs fit the ring
+#define CHAIN_MAX_LIMIT     (1UL << 30)  // Largest XPDMA_PARAM_CHAIN_MAX
+
+#define DDR_ALLOC_SHIFT     12           // Smallest DDR3 allocation 4 KB: AXI bursts never cross it
+#define DDR_ORDERS          21           // DDR3 allocation block sizes 4 KB .. 4 GB
+
+#define COPY_WORKERS_MAX    8            // CPUs a bounce buffer copy may be split across
+#define COPY_SPLIT_MIN      (256<<10)    // Smallest share of a split bounce buffer copy
+#define COPY_PAGES          (BUF_SIZE >> PAGE_SHIFT) // User pages taken per split copy round
 
 // #define XPDMA_DEBUG 1   // debug
 
@@ -148,19 +218,205 @@ typedef struct {
     u32 status;     /* 0x1C */
 } __aligned(DESCRIPTOR_SIZE) sg_desc_t;
 
+// Chain segment: one data descriptor between DDR3 and a host bus address range
+struct xpdma_seg {
+    dma_addr_t host;    // Host bus address
+    u32 ddr;            // DDR3 address
+    u32 len;            // Length, must not cross an aligned host window (xpdma_windowSize)
+};
+
 #define HAVE_KERNEL_REG     0x01    // Kernel registration
 #define HAVE_MEM_REGION     0x02    // I/O Memory region
+#define HAVE_PIO_REGION     0x04    // DDR3 window memory region
 
 int gDrvrMajor = 241;               // Major number not dynamic
 int gKernelRegFlag = 0;
 
 
+static uint default_weight = XPDMA_WEIGHT_DEFAULT;
+module_param(default_weight, uint, 0644);
+MODULE_PARM_DESC(default_weight, "Fair share weight of a newly opened client");
+
+static ulong default_rate = 0;
+module_param(default_rate, ulong, 0644);
+MODULE_PARM_DESC(default_rate, "Bandwidth limit of a newly opened client, bytes/s (0 - unlimited)");
+
+static ulong pio_send_max = 4096;
+module_param(pio_send_max, ulong, 0644);
+MODULE_PARM_DESC(pio_send_max, "Largest send done by programmed I/O, bytes (0 - never)");
+
+static ulong pio_recv_max = 256;
+module_param(pio_recv_max, ulong, 0644);
+MODULE_PARM_DESC(pio_recv_max, "Largest receive done by programmed I/O, bytes (0 - never)");
+
+static uint poll_mode = XPDMA_POLL_CLASSIC;
+module_param(poll_mode, uint, 0644);
+MODULE_PARM_DESC(poll_mode, "Default completion polling: 0 - classic 10 us poll, 1 - hybrid sleep + busy poll");
+
+static uint mmap_readahead = 16;
+module_param(mmap_readahead, uint, 0644);
+MODULE_PARM_DESC(mmap_readahead, "DDR mapping: pages read by a random page fault");
+
+static uint mmap_readahead_max = 256;
+module_param(mmap_readahead_max, uint, 0644);
+MODULE_PARM_DESC(mmap_readahead_max, "DDR mapping: readahead window limit of sequential page faults, pages");
+
+static uint mmap_cache_pages = 16384;
+module_param(mmap_cache_pages, uint, 0644);
+MODULE_PARM_DESC(mmap_cache_pages, "DDR mapping: host pages cached per mapping, least recently used are evicted");
+
+static int board_node = NUMA_NO_NODE;
+module_param(board_node, int, 0444);
+MODULE_PARM_DESC(board_node, "NUMA node of boards the firmware reports none for (-1 - leave unknown)");
+
+static int max_read_request = 4096;
+module_param(max_read_request, int, 0444);
+MODULE_PARM_DESC(max_read_request, "PCIe Max Read Request Size set at probe, bytes (128..4096, 0 - leave firmware value)");
+
+static bool relaxed_ordering = false;
+module_param(relaxed_ordering, bool, 0444);
+MODULE_PARM_DESC(relaxed_ordering, "Enable PCIe relaxed ordering for the board (CDMA status writes may pass data writes)");
+
+static bool no_snoop = false;
+module_param(no_snoop, bool, 0444);
+MODULE_PARM_DESC(no_snoop, "Enable PCIe no-snoop for the board (only safe on cache coherent platforms that ignore it)");
+
+static uint expect_width = 0;
+module_param(expect_width, uint, 0444);
+MODULE_PARM_DESC(expect_width, "Expected PCIe link width, lanes (0 - endpoint capability)");
+
+static uint expect_speed = 0;
+module_param(expect_speed, uint, 0444);
+MODULE_PARM_DESC(expect_speed, "Expected PCIe link speed, MT/s (0 - endpoint capability)");
+
+static ulong dmabuf_max = 256 << 20;
+module_param(dmabuf_max, ulong, 0644);
+MODULE_PARM_DESC(dmabuf_max, "Largest buffer exported as a dma-buf, bytes");
+
+static uint copy_workers = 1;
+module_param(copy_workers, uint, 0644);
+MODULE_PARM_DESC(copy_workers, "Default CPUs sharing a bounce buffer copy of user memory (1 - caller only, max 8)");
+
+static ulong ddr_size = 0;
+module_param(ddr_size, ulong, 0444);
+MODULE_PARM_DESC(ddr_size, "DDR3 bytes of the boards (0 - DDR3 window size, 1 GB without a window)");
+
+static ulong ddr_alloc_base = 0;
+module_param(ddr_alloc_base, ulong, 0444);
+MODULE_PARM_DESC(ddr_alloc_base, "DDR3 allocator: bytes at the start of DDR3 left to fixed addresses");
+
+static ulong ddr_alloc_size = 0;
+module_param(ddr_alloc_size, ulong, 0444);
+MODULE_PARM_DESC(ddr_alloc_size, "DDR3 allocator: bytes managed after ddr_alloc_base (0 - to the end of DDR3)");
+
+static uint user_irqs = XPDMA_IRQ_MAX;
+module_param(user_irqs, uint, 0444);
+MODULE_PARM_DESC(user_irqs, "MSI vectors requested for user logic interrupts (0 - none, at most 8)");
+
+static ulong chain_max = BUF_SIZE;
+module_param(chain_max, ulong, 0444);
+MODULE_PARM_DESC(chain_max, "Default bytes of one zero copy chain on boards with several translation windows (longer runs delay high priority requests)");
+
 static dev_t first;         // Global variable for the first device number
 static struct cdev c_dev;     // Global variable for the character device structure
 static struct class *cl;     // Global variable for the device class
+static struct device *gDevice; // Global variable for the device node
+
+static struct workqueue_struct *gCopyWq; // Split bounce buffer copies
+
+// Open file descriptor of /dev/xpdma: bandwidth limit and fair share state
+struct xpdma_client {
+    struct list_head node;          // gClients entry
+    spinlock_t lock;
+    cdmaLimit_t limit;
+    s64 tokens;                     // Token bucket level, bytes (negative - debt)
+    ktime_t lastRefill;
+    ktime_t openTime;
+    u64 vtime[XPDMA_NUM_MAX];       // Per board virtual finish time (fair queueing)
+    cdmaClientStats_t stats;
+    struct mutex mmapLock;          // mmaps list
+    struct list_head mmaps;         // DDR mappings (xpdma_vcache) made through this file
+    struct xarray mrs;              // Registered buffers (xpdma_mr) by handle
+    struct xarray ddrs;             // Allocated DDR3 regions (xpdma_ddr_region) by handle
+};
+
+// MSI vector of user logic interrupts
+struct xpdma_irq_vector {
+    int id;
+    u32 vector;
+    atomic64_t count;
+};
+
+static LIST_HEAD(gClients);
+static DEFINE_SPINLOCK(gClientsLock);
+
+// Request waiting for the CDMA engine
+struct xpdma_waiter {
+    struct list_head list;
+    bool granted;
+    u64 tag;                        // Virtual start time, lowest is served first inside a class
+};
+
+// Per board engine scheduler: one owner at a time, waiters queued by priority class
+struct xpdma_sched {
+    spinlock_t lock;
+    wait_queue_head_t wq;
+    struct list_head queue[XPDMA_PRIO_NUM];
+    bool busy;
+    struct task_struct *owner;      // Task running the engine, NULL for none or a passed on grant
+    int ownerPrio;                  // Class of the current grant
+    u64 vtime;                      // Start tag of the request in service
+    cdmaStats_t stats;
+};
+
+/**
+ * One engine run queued on the descriptor ring. The submitter owns the struct
+ * and waits for it; runs retire in order as the CDMA completes them.
+ */
+struct xpdma_run {
+    u32 head;                       // First ring descriptor
+    u32 tail;                       // Last ring descriptor, its status completes the run
+    u32 descs;                      // Ring descriptors used
+    u32 vec;                        // First BRAM vector slot
+    u32 vecs;                       // BRAM vector slots used (with slots skipped at the wrap)
+    int direction;
+    int prio;                       // Class of the grant that queued the run
+    size_t count;                   // Bytes, for the hybrid poll prediction
+    ktime_t start;                  // Submit time
+    ktime_t end;                    // Retire time
+    ktime_t due;                    // Predicted retire time, after the runs queued ahead
+    ktime_t deadline;               // Timeout, scaled to the bytes queued up to this run
+    u64 queuedNs;                   // Time behind earlier runs of the ring (scheduler wait)
+    bool sample;                    // Ring was idle at submit, run time is the engine time
+    bool done;
+    int result;
+};
 
-//semaphores
-static struct semaphore gSemDma;
+/**
+ * Persistent circular descriptor chain of a board: descriptor i always links
+ * to i + 1, the engine runs up to TAILDESC and new runs are queued by filling
+ * the following descriptors and moving TAILDESC, also while it is busy.
+ * BRAM translation vectors are used as a ring as well, so a queued run never
+ * rewrites a vector an earlier run still has to load.
+ */
+struct xpdma_ring {
+    spinlock_t lock;
+    struct xpdma_run *runs[RING_RUNS]; // Runs in flight, oldest at 'first'
+    u32 first;
+    u32 nrRuns;
+    u32 descHead;                   // Oldest descriptor in use
+    u32 nrDescs;
+    u32 vecHead;                    // Oldest BRAM vector slot in use
+    u32 nrVecs;
+    u64 retired;                    // Runs retired or failed so far
+    u64 bytes[XPDMA_PRIO_NUM];      // Bytes of the runs in flight per class
+    ktime_t lastEnd;                // Retire time of the newest retired run
+    ktime_t due;                    // Predicted retire time of the newest run
+    u32 generation;                 // Bumped when the ring is failed and emptied
+    bool reset;                     // Engine must be reset before the next run
+    wait_queue_head_t wq;           // Bounce buffer waiters
+    struct task_struct *bounce[2][BOUNCE_SLOTS]; // Bounce buffer owners
+};
 
 struct xpdma_state {
     struct pci_dev *dev;
@@ -172,14 +428,88 @@ struct xpdma_state {
     char *readBuffer /*= NULL*/;       // Pointer to dword aligned DMA Read buffer
     char *writeBuffer /*= NULL*/;      // Pointer to dword aligned DMA Write buffer
     sg_desc_t *descChain;          // Translation Descriptors chain
-    size_t descChainLength;
+    struct xpdma_ring ring;        // Descriptor ring in descChain
+    char *bounce[2][BOUNCE_SLOTS]; // Send/receive bounce buffers, slot 0 is writeBuffer/readBuffer
+    dma_addr_t bounceHWAddr[2][BOUNCE_SLOTS];
     dma_addr_t readHWAddr;
     dma_addr_t writeHWAddr;
     dma_addr_t descChainHWAddr;
+    struct xpdma_sched sched;      // CDMA engine scheduler
+    unsigned long pioHdwr;         // DDR3 window address (Hardware address)
+    unsigned long pioLen;          // DDR3 window length, 0 if the bitstream has no window
+    u64 ddrMem;                    // DDR3 bytes at AXI_DDR3_ADDR the engine may address
+    bool wedged;                   // Engine did not stop after a failed run, it may still write host memory
+    void __iomem *pioVirt;         // DDR3 window, write-combining mapping
+    u64 pioSendMax;                // Programmed I/O thresholds
+    u64 pioRecvMax;
+    u32 pollMode;                  // XPDMA_POLL_* default of the board
+    u64 bandwidth[2];              // Measured send/receive throughput, bytes/s
+    struct xpdma_seg *segs;        // Chain segments of a run (engine owner only)
+    u32 linkWidth;                 // Negotiated PCIe link: lanes
+    u32 linkSpeed;                 // and MT/s per lane
+    struct mutex p2pLock;          // peer window mappings
+    dma_addr_t p2pAddr[XPDMA_NUM_MAX]; // DDR3 window of a peer as seen by this board, 0 - not mapped
+    s8 p2pState[XPDMA_NUM_MAX];    // 0 - not checked, 1 - peer reachable, -1 - not supported
+    u32 copyWorkers;               // CPUs sharing a bounce buffer copy (XPDMA_PARAM_COPY_WORKERS)
+    struct mutex ddrLock;          // DDR3 allocator
+    unsigned long *ddrMap[DDR_ORDERS]; // Free blocks of each order, bit n - block at n << (DDR_ALLOC_SHIFT + order)
+    unsigned long ddrBits[DDR_ORDERS];
+    unsigned long ddrNrFree[DDR_ORDERS];
+    u64 ddrBase;                   // Managed range
+    u64 ddrSize;
+    u64 ddrUsed;                   // Bytes in allocated blocks
+    u64 ddrRequested;              // Bytes asked for by the allocated regions
+    u32 ddrRegions;
+    u32 irqVectors;                // MSI vectors granted for user interrupts
+    struct xpdma_irq_vector irqVec[XPDMA_IRQ_MAX];
+    wait_queue_head_t irqWait;     // IOCTL_IRQOPEN readers
+    spinlock_t irqLock;            // irqEventfds, taken in the interrupt handler
+    struct list_head irqEventfds;  // xpdma_irq_eventfd entries
+    u32 caps;                      // Capability register, 0 - older design
+    u32 vecBase;                   // Translation vectors, offset from AXI_BRAM_ADDR (and in BAR0)
+    u32 vecSlots;                  // Translation vectors the BRAM holds
+    u32 segMax;                    // Data descriptors of one chain run
+    u64 chainMax;                  // Bytes of one zero copy chain run (XPDMA_PARAM_CHAIN_MAX)
+    u32 nrWindows;                 // Data windows (AXIBAR) a chain maps host memory through
+    u32 windowShift;               // log2 of the window size
+    u32 windowAxi[XLAT_WINDOWS_MAX]; // AXI address of each window
+    u32 windowReg[XLAT_WINDOWS_MAX]; // AXIBAR2PCIEBAR_nU of each window
+};
+
+/**
+ * DDR mapping (mmap of /dev/xpdma): host page cache of a board DDR3 range.
+ * Pages are indexed by file page offset ((id << 32) | DDR3 address) >> PAGE_SHIFT,
+ * read on page fault with readahead and written back in batched chains.
+ */
+struct xpdma_vcache {
+    struct list_head node;          // xpdma_client.mmaps entry
+    struct list_head vmas;          // xpdma_vcache_vma list, protected by mmap_lock
+    struct mm_struct *mm;
+    struct xpdma_client *client;
+    int id;
+    struct mutex lock;              // pages, lru, readahead
+    struct xarray pages;            // page offset -> struct page, VCACHE_DIRTY marked if modified
+    struct list_head lru;           // cached pages (page->lru), least recently faulted first
+    unsigned long nrPages;
+    pgoff_t raNext;                 // page after the last readahead (sequential fault detection)
+    unsigned int raPages;           // current readahead window
+    struct page **batch;            // write back batch, VCACHE_BATCH pages
+};
+
+// Split/moved parts of a DDR mapping share its cache
+struct xpdma_vcache_vma {
+    struct list_head node;
+    struct vm_area_struct *vma;
 };
 
 static struct xpdma_state xpdmas[XPDMA_NUM_MAX];
 
+// Board DDR3 bytes, board addresses of every transfer stay below
+static inline u64 xpdma_ddrSize(int id)
+{
+    return xpdmas[id].ddrMem;
+}
+
 
 // struct pci_dev *xpdmas[id].dev = NULL;        // PCI device structure
 // unsigned int xpdmas[id].statFlags = 0x00;     // Status flags used for cleanup
@@ -199,27 +529,48 @@ static struct xpdma_state xpdmas[XPDMA_NUM_MAX];
 // Prototypes
 static int xpdma_reset(int id);
 static int xpdma_isIdle(int id);
-ssize_t xpdma_write (struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
-ssize_t xpdma_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+static ssize_t xpdma_write_iter (struct kiocb *iocb, struct iov_iter *from);
+static ssize_t xpdma_read_iter (struct kiocb *iocb, struct iov_iter *to);
+static loff_t xpdma_llseek (struct file *filp, loff_t offset, int whence);
 long xpdma_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
 int xpdma_open(struct inode *inode, struct file *filp);
 int xpdma_release(struct inode *inode, struct file *filp);
+static int xpdma_mmap(struct file *filp, struct vm_area_struct *vma);
+static int xpdma_fsync(struct file *filp, loff_t start, loff_t end, int datasync);
+static int xpdma_mr_register(struct xpdma_client *client, cdmaRegister_t *reg);
+static int xpdma_mr_unregister(struct xpdma_client *client, u32 handle);
+static int xpdma_mr_ioctl(struct xpdma_client *client, int direction, const cdmaRegBuffer_t *buffer);
+static int xpdma_p2p_copy(struct xpdma_client *client, const cdmaCopy_t *copy);
+static int xpdma_dmabuf_export(cdmaDmaBuf_t *req);
+static int xpdma_mr_import(struct xpdma_client *client, cdmaDmaBuf_t *req);
+static int xpdma_ddr_alloc(struct xpdma_client *client, cdmaDdrAlloc_t *req);
+static int xpdma_ddr_free(struct xpdma_client *client, u32 handle);
+static void xpdma_ddr_getStats(int id, cdmaDdrStats_t *stats);
+static int xpdma_irq_open(cdmaIrqOpen_t *req);
+static int xpdma_irq_eventfd(struct xpdma_client *client, const cdmaIrqEventfd_t *req);
+static void xpdma_irq_release(struct xpdma_client *client);
+static void xpdma_irq_getStats(int id, cdmaIrqStats_t *stats);
 static inline u32 xpdma_readReg (int id, u32 reg);
 static inline void xpdma_writeReg (int id, u32 reg, u32 val);
-ssize_t xpdma_send (int id, void *data, size_t count, u32 addr);
-ssize_t xpdma_recv (int id, void *data, size_t count, u32 addr);
+ssize_t xpdma_send (struct xpdma_client *client, int id, void *data, size_t count, u32 addr, u32 flags);
+ssize_t xpdma_recv (struct xpdma_client *client, int id, void *data, size_t count, u32 addr, u32 flags);
 void xpdma_showInfo (int id);
 void show_descriptors(int id);
+static int xpdma_ring_drain(int id);
 static inline void xpdma_debug(int id, const char *info);
 
 // Aliasing write, read, ioctl, etc...
 struct file_operations xpdma_intf = {
-        read           : xpdma_read,
-        write          : xpdma_write,
+        read_iter      : xpdma_read_iter,
+        write_iter     : xpdma_write_iter,
+        splice_read    : generic_file_splice_read,
+        splice_write   : iter_file_splice_write,
         unlocked_ioctl : xpdma_ioctl,
-        //llseek         : xpdma_lseek,
+        llseek         : xpdma_llseek,
         open           : xpdma_open,
         release        : xpdma_release,
+        mmap           : xpdma_mmap,
+        fsync          : xpdma_fsync,
 };
 
 static inline void xpdma_debug(int id, const char *info)
@@ -232,7 +583,418 @@ static inline void xpdma_debug(int id, const char *info)
 #endif
 }
 
-static int simple_operation(int id, int direction, size_t count, u32 addr)
+// NUMA node of the board, host memory used for its transfers is allocated there
+static inline int xpdma_node(int id)
+{
+    return dev_to_node(&xpdmas[id].dev->dev);
+}
+
+static inline bool xpdma_isValidId(int id)
+{
+    return (id >= 0) && (id < XPDMA_NUM_MAX) && xpdmas[id].used;
+}
+
+static inline int xpdma_flagsToPrio(u32 flags)
+{
+    return (flags & XPDMA_FLAG_PRIO_HIGH) ? XPDMA_PRIO_HIGH : XPDMA_PRIO_NORMAL;
+}
+
+static void xpdma_sched_init(int id)
+{
+    struct xpdma_sched *sched = &xpdmas[id].sched;
+    int prio;
+
+    spin_lock_init(&sched->lock);
+    init_waitqueue_head(&sched->wq);
+    for (prio = 0; prio < XPDMA_PRIO_NUM; ++prio)
+        INIT_LIST_HEAD(&sched->queue[prio]);
+    sched->busy = false;
+    sched->owner = NULL;
+    sched->vtime = 0;
+    memset(&sched->stats, 0, sizeof(sched->stats));
+    sched->stats.id = id;
+}
+
+/**
+ * Hand the engine to the highest non-empty class (sched->lock held).
+ * Inside a class the waiter with the lowest virtual start tag wins (start-time
+ * fair queueing), so clients share the engine in proportion to their weights.
+ */
+static bool xpdma_sched_grantNext(struct xpdma_sched *sched)
+{
+    struct xpdma_waiter *next;
+    struct xpdma_waiter *waiter;
+    int prio;
+
+    for (prio = XPDMA_PRIO_NUM - 1; prio >= 0; --prio) {
+        if (list_empty(&sched->queue[prio]))
+            continue;
+        next = list_first_entry(&sched->queue[prio], struct xpdma_waiter, list);
+        list_for_each_entry(waiter, &sched->queue[prio], list)
+            if (waiter->tag < next->tag)
+                next = waiter;
+        list_del_init(&next->list);
+        sched->vtime = next->tag;
+        WRITE_ONCE(next->granted, true);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Take the board CDMA engine for one engine run of 'bytes' bytes.
+ * dma_block() calls it once per chunk, so a high priority request queued behind
+ * a large transfer gets the engine at the next chunk boundary; its run queues
+ * behind at most RING_NORMAL_MAX bytes of normal priority runs (xpdma_ring_space).
+ * client may be NULL for driver internal requests (not accounted in fair share).
+ */
+static int xpdma_sched_acquire(int id, int prio, struct xpdma_client *client, size_t bytes)
+{
+    struct xpdma_sched *sched = &xpdmas[id].sched;
+    struct xpdma_waiter waiter;
+    ktime_t start = ktime_get();
+    u64 waitNs;
+
+    INIT_LIST_HEAD(&waiter.list);
+    waiter.granted = false;
+
+    spin_lock(&sched->lock);
+    waiter.tag = sched->vtime;
+    if (client) {
+        if (client->vtime[id] > waiter.tag)
+            waiter.tag = client->vtime[id];
+        client->vtime[id] = waiter.tag + div_u64((u64)bytes * XPDMA_WEIGHT_DEFAULT, client->limit.weight);
+    }
+    if (!sched->busy) {
+        // queues are always empty while the engine is free
+        sched->busy = true;
+        sched->vtime = waiter.tag;
+        waiter.granted = true;
+    } else {
+        list_add_tail(&waiter.list, &sched->queue[prio]);
+    }
+    spin_unlock(&sched->lock);
+
+    if (!waiter.granted && wait_event_killable(sched->wq, READ_ONCE(waiter.granted))) {
+        spin_lock(&sched->lock);
+        if (waiter.granted) {
+            // engine was granted while we were being killed: pass it on
+            if (!xpdma_sched_grantNext(sched))
+                sched->busy = false;
+        } else {
+            list_del(&waiter.list);
+        }
+        spin_unlock(&sched->lock);
+        wake_up_all(&sched->wq);
+        return -EINTR;
+    }
+
+    waitNs = ktime_to_ns(ktime_sub(ktime_get(), start));
+    spin_lock(&sched->lock);
+    sched->owner = current;
+    sched->ownerPrio = prio;
+    sched->stats.requests[prio]++;
+    sched->stats.waitNs[prio] += waitNs;
+    if (waitNs > sched->stats.maxWaitNs[prio])
+        sched->stats.maxWaitNs[prio] = waitNs;
+    spin_unlock(&sched->lock);
+
+    return (SUCCESS);
+}
+
+/**
+ * Largest engine run for a request of class 'prio': normal requests fall back
+ * to BUF_SIZE runs while high priority requests wait, so XPDMA_PARAM_CHAIN_MAX
+ * never delays them by more than a chunk.
+ */
+static u64 xpdma_sched_runMax(int id, int prio)
+{
+    struct xpdma_sched *sched = &xpdmas[id].sched;
+    bool urgent;
+
+    if ((XPDMA_PRIO_NORMAL != prio) || (xpdmas[id].chainMax <= BUF_SIZE))
+        return xpdmas[id].chainMax;
+
+    spin_lock(&sched->lock);
+    urgent = !list_empty(&sched->queue[XPDMA_PRIO_HIGH]);
+    spin_unlock(&sched->lock);
+
+    return urgent ? BUF_SIZE : xpdmas[id].chainMax;
+}
+
+// Ring wait of a retired run in the scheduler statistics of its class
+static void xpdma_sched_accountRing(int id, const struct xpdma_run *run)
+{
+    struct xpdma_sched *sched = &xpdmas[id].sched;
+
+    if (!run->queuedNs)
+        return;
+
+    spin_lock(&sched->lock);
+    sched->stats.waitNs[run->prio] += run->queuedNs;
+    if (run->queuedNs > sched->stats.maxWaitNs[run->prio])
+        sched->stats.maxWaitNs[run->prio] = run->queuedNs;
+    spin_unlock(&sched->lock);
+}
+
+static void xpdma_sched_release(int id, int prio, size_t bytes)
+{
+    struct xpdma_sched *sched = &xpdmas[id].sched;
+
+    spin_lock(&sched->lock);
+    sched->owner = NULL;
+    sched->stats.bytes[prio] += bytes;
+    if (!xpdma_sched_grantNext(sched))
+        sched->busy = false;
+    spin_unlock(&sched->lock);
+    wake_up_all(&sched->wq);
+}
+
+/**
+ * Token bucket rate limit of a client: take 'bytes' tokens, sleep while in debt.
+ */
+static int xpdma_client_throttle(struct xpdma_client *client, size_t bytes)
+{
+    ktime_t now;
+    ktime_t delay;
+    u64 refill;
+    u64 burst;
+    s64 delayNs = 0;
+
+    if (!client)
+        return (SUCCESS);
+
+    spin_lock(&client->lock);
+    if (client->limit.rate) {
+        now = ktime_get();
+        burst = client->limit.burst ? client->limit.burst : BUF_SIZE;
+        refill = mul_u64_u64_div_u64(ktime_to_ns(ktime_sub(now, client->lastRefill)), client->limit.rate, NSEC_PER_SEC);
+        refill = min_t(u64, refill, S64_MAX / 2);
+        client->tokens = min_t(s64, client->tokens + (s64)refill, (s64)burst);
+        client->lastRefill = now;
+        client->tokens -= bytes;
+        if (client->tokens < 0)
+            delayNs = mul_u64_u64_div_u64(-client->tokens, NSEC_PER_SEC, client->limit.rate);
+    }
+    spin_unlock(&client->lock);
+
+    if (delayNs <= 0)
+        return (SUCCESS);
+
+    delay = ns_to_ktime(delayNs);
+    set_current_state(TASK_KILLABLE);
+    schedule_hrtimeout(&delay, HRTIMER_MODE_REL);
+    if (fatal_signal_pending(current))
+        return -EINTR;
+
+    spin_lock(&client->lock);
+    client->stats.throttleNs += delayNs;
+    spin_unlock(&client->lock);
+    return (SUCCESS);
+}
+
+static void xpdma_client_account(struct xpdma_client *client, int direction, size_t bytes)
+{
+    if (!client)
+        return;
+
+    spin_lock(&client->lock);
+    client->stats.requests++;
+    if (PCI_DMA_TODEVICE == direction)
+        client->stats.bytesSent += bytes;
+    else
+        client->stats.bytesRecv += bytes;
+    spin_unlock(&client->lock);
+}
+
+/**
+ * Set the limit of a client. Only CAP_SYS_ADMIN may loosen it (higher or no
+ * rate, deeper burst) or raise the weight above XPDMA_WEIGHT_DEFAULT and the
+ * current weight, anyone may tighten it.
+ */
+static int xpdma_client_setLimit(struct xpdma_client *client, const cdmaLimit_t *limit)
+{
+    bool loosen;
+
+    if ((limit->weight == 0) || (limit->weight > XPDMA_WEIGHT_MAX))
+        return (CRIT_ERR);
+
+    spin_lock(&client->lock);
+    loosen = (client->limit.rate && (!limit->rate || (limit->rate > client->limit.rate))) ||
+             ((limit->burst ? limit->burst : BUF_SIZE) > (client->limit.burst ? client->limit.burst : BUF_SIZE)) ||
+             ((limit->weight > XPDMA_WEIGHT_DEFAULT) && (limit->weight > client->limit.weight));
+    spin_unlock(&client->lock);
+
+    if (loosen && !capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    spin_lock(&client->lock);
+    client->limit = *limit;
+    client->tokens = limit->burst ? limit->burst : BUF_SIZE;
+    client->lastRefill = ktime_get();
+    spin_unlock(&client->lock);
+    return (SUCCESS);
+}
+
+/**
+ * Programmed I/O through the DDR3 BAR window: no descriptor chain and no engine
+ * polling, just write-combined stores (send) or uncached loads (receive).
+ * Loads are at most 8 bytes per PCIe read, so the receive threshold is lower.
+ * The board is taken through the scheduler like a DMA request and the ring is
+ * drained first, so PIO stays ordered with the runs queued before it and shows
+ * in the scheduler statistics.
+ */
+static int pio_operation(struct xpdma_client *client, int id, int direction, void *data, size_t count, u32 addr, u32 flags)
+{
+    u8 buf[PIO_STEP] __aligned(8);
+    char *curData = data;
+    void __iomem *curIo = xpdmas[id].pioVirt + addr;
+    int prio = xpdma_flagsToPrio(flags);
+    int result = SUCCESS;
+    size_t btt;
+    size_t unsended = count;
+
+    if ((u64)addr + count > xpdmas[id].pioLen)
+        return (CRIT_ERR);
+    if (!count)
+        return (SUCCESS);
+
+    if (xpdma_client_throttle(client, count) || xpdma_sched_acquire(id, prio, client, count))
+        return (CRIT_ERR);
+
+    if (xpdma_ring_drain(id)) {
+        xpdma_sched_release(id, prio, count);
+        return (CRIT_ERR);
+    }
+
+    while (unsended) {
+        btt = (unsended < PIO_STEP) ? unsended : PIO_STEP;
+
+        if (PCI_DMA_TODEVICE == direction) {
+            if (copy_from_user(buf, curData, btt)) {
+                result = CRIT_ERR;
+                break;
+            }
+            memcpy_toio(curIo, buf, btt);
+        } else {
+            memcpy_fromio(buf, curIo, btt);
+            if (copy_to_user(curData, buf, btt)) {
+                result = CRIT_ERR;
+                break;
+            }
+        }
+
+        curData += btt;
+        curIo += btt;
+        unsended -= btt;
+    }
+
+    if ((PCI_DMA_TODEVICE == direction) && (unsended < count)) {
+        // drain write-combining buffers; the read can't pass posted writes, so data is in DDR
+        // before any following CDMA run touches it. Aligned dword of the last written byte.
+        wmb();
+        (void)readl(xpdmas[id].pioVirt + ALIGN_DOWN(addr + (count - unsended) - 1, 4));
+    }
+
+    xpdma_sched_release(id, prio, count);
+    if (SUCCESS != result)
+        return (result);
+
+    xpdma_client_account(client, direction, count);
+    return (SUCCESS);
+}
+
+static bool xpdma_usePio(int id, int direction, size_t count, u32 addr, u32 flags)
+{
+    if ((NULL == xpdmas[id].pioVirt) || (flags & (XPDMA_FLAG_FORCE_DMA | XPDMA_FLAG_SIMPLE)))
+        return false;
+    if ((u64)addr + count > xpdmas[id].pioLen)
+        return false;
+    if (flags & XPDMA_FLAG_FORCE_PIO)
+        return true;
+    return count <= ((PCI_DMA_TODEVICE == direction) ? xpdmas[id].pioSendMax : xpdmas[id].pioRecvMax);
+}
+
+static int xpdma_setParam(int id, u32 param, u64 value)
+{
+    switch (param) {
+        case XPDMA_PARAM_PIO_SEND_MAX:
+            xpdmas[id].pioSendMax = value;
+            return (SUCCESS);
+        case XPDMA_PARAM_PIO_RECV_MAX:
+            xpdmas[id].pioRecvMax = value;
+            return (SUCCESS);
+        case XPDMA_PARAM_POLL_MODE:
+            if (value > XPDMA_POLL_HYBRID)
+                return (CRIT_ERR);
+            xpdmas[id].pollMode = value;
+            return (SUCCESS);
+        case XPDMA_PARAM_COPY_WORKERS:
+            if ((value < 1) || (value > COPY_WORKERS_MAX))
+                return (CRIT_ERR);
+            xpdmas[id].copyWorkers = value;
+            return (SUCCESS);
+        case XPDMA_PARAM_CHAIN_MAX:
+            if ((value < PAGE_SIZE) || (value > CHAIN_MAX_LIMIT))
+                return (CRIT_ERR);
+            xpdmas[id].chainMax = value;
+            return (SUCCESS);
+        default:
+            return (CRIT_ERR);
+    }
+}
+
+static int xpdma_getParam(int id, u32 param, u64 *value)
+{
+    switch (param) {
+        case XPDMA_PARAM_PIO_SEND_MAX:
+            *value = xpdmas[id].pioSendMax;
+            return (SUCCESS);
+        case XPDMA_PARAM_PIO_RECV_MAX:
+            *value = xpdmas[id].pioRecvMax;
+            return (SUCCESS);
+        case XPDMA_PARAM_PIO_WINDOW:
+            *value = xpdmas[id].pioLen;
+            return (SUCCESS);
+        case XPDMA_PARAM_POLL_MODE:
+            *value = xpdmas[id].pollMode;
+            return (SUCCESS);
+        case XPDMA_PARAM_SEND_BANDWIDTH:
+            *value = xpdmas[id].bandwidth[0];
+            return (SUCCESS);
+        case XPDMA_PARAM_RECV_BANDWIDTH:
+            *value = xpdmas[id].bandwidth[1];
+            return (SUCCESS);
+        case XPDMA_PARAM_NUMA_NODE:
+            *value = (u64)(s64)dev_to_node(&xpdmas[id].dev->dev);
+            return (SUCCESS);
+        case XPDMA_PARAM_LINK_WIDTH:
+            *value = xpdmas[id].linkWidth;
+            return (SUCCESS);
+        case XPDMA_PARAM_LINK_SPEED:
+            *value = xpdmas[id].linkSpeed;
+            return (SUCCESS);
+        case XPDMA_PARAM_COPY_WORKERS:
+            *value = xpdmas[id].copyWorkers;
+            return (SUCCESS);
+        case XPDMA_PARAM_CHAIN_MAX:
+            *value = xpdmas[id].chainMax;
+            return (SUCCESS);
+        case XPDMA_PARAM_CHAIN_SEGS:
+            *value = xpdmas[id].segMax;
+            return (SUCCESS);
+        case XPDMA_PARAM_XLAT_WINDOWS:
+            *value = xpdmas[id].nrWindows;
+            return (SUCCESS);
+        case XPDMA_PARAM_DDR_SIZE:
+            *value = xpdma_ddrSize(id);
+            return (SUCCESS);
+        default:
+            return (CRIT_ERR);
+    }
+}
+
+static int simple_operation(int id, int direction, dma_addr_t host, size_t count, u32 addr)
 {
     dma_addr_t pntr = 0;
     dma_addr_t src_pntr = 0;
@@ -242,13 +1004,13 @@ static int simple_operation(int id, int direction, size_t count, u32 addr)
 
     if (PCI_DMA_FROMDEVICE == direction)
     {
-        pntr = xpdmas[id].readHWAddr;
+        pntr = host;
         src_pntr = (dma_addr_t)AXI_DDR3_ADDR;
         dst_pntr = (dma_addr_t)AXI_PCIE_DM_ADDR;
     }
     else if (PCI_DMA_TODEVICE == direction)
     {
-        pntr = xpdmas[id].writeHWAddr;
+        pntr = host;
         src_pntr = (dma_addr_t)AXI_PCIE_DM_ADDR;
         dst_pntr = (dma_addr_t)AXI_DDR3_ADDR;
     }
@@ -333,31 +1095,59 @@ static int simple_operation(int id, int direction, size_t count, u32 addr)
 
 long xpdma_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    u32 regx = 0;
+    void __user *argp = (void __user *)arg;
+    struct xpdma_client *client = filp->private_data;
     int result = CRIT_ERR;
     int id;
-    
-    down(&gSemDma);
-  
-    stac();
+    cdmaReg_t reg;
+    cdmaBuffer_t buffer;
+    cdmaStats_t stats;
+    cdmaLimit_t limit;
+    cdmaClientStats_t clientStats;
+    cdmaParam_t param;
+    cdmaRegister_t registration;
+    cdmaRegBuffer_t regBuffer;
+    cdmaCopy_t copy;
+    cdmaDmaBuf_t dmabuf;
+    cdmaDdrAlloc_t ddrAlloc;
+    cdmaDdrStats_t ddrStats;
+    cdmaIrqOpen_t irqOpen;
+    cdmaIrqEventfd_t irqEventfd;
+    cdmaIrqStats_t irqStats;
+
 //    printk(KERN_INFO"%s: Ioctl command: %d \n", DEVICE_NAME, cmd);
     switch (cmd) {
         case IOCTL_RESET:
-            result = xpdma_reset((*(int *)arg));
+            if (get_user(id, (int __user *)argp) || !xpdma_isValidId(id))
+                break;
+            if (xpdma_sched_acquire(id, XPDMA_PRIO_HIGH, NULL, 0))
+                break;
+            xpdma_ring_drain(id);
+            result = xpdma_reset(id);
+            xpdma_sched_release(id, XPDMA_PRIO_HIGH, 0);
             break;
         case IOCTL_RDCDMAREG: // Read CDMA config registers
-//             printk(KERN_INFO"%s: FPGA %d\n", DEVICE_NAME, (*(cdmaReg_t *)arg).id);
-//             printk(KERN_INFO"%s: Read Register 0x%X\n", DEVICE_NAME, (*(cdmaReg_t *)arg).reg);
-            regx = xpdma_readReg((*(cdmaReg_t *)arg).id, (*(cdmaReg_t *)arg).reg);
-            (*(cdmaReg_t *)arg).value = regx;
-//             printk(KERN_INFO"%s: Readed value 0x%X\n", DEVICE_NAME, regx);
+            if (copy_from_user(&reg, argp, sizeof(reg)) || !xpdma_isValidId(reg.id))
+                break;
+//             printk(KERN_INFO"%s: Read Register 0x%X\n", DEVICE_NAME, reg.reg);
+            if (xpdma_sched_acquire(reg.id, XPDMA_PRIO_HIGH, NULL, 0))
+                break;
+            xpdma_ring_drain(reg.id);
+            reg.value = xpdma_readReg(reg.id, reg.reg);
+            xpdma_sched_release(reg.id, XPDMA_PRIO_HIGH, 0);
+            if (copy_to_user(argp, &reg, sizeof(reg)))
+                break;
             result = SUCCESS;
             break;
         case IOCTL_WRCDMAREG: // Write CDMA config registers
-//             printk(KERN_INFO"%s: FPGA %d\n", DEVICE_NAME, (*(cdmaReg_t *)arg).id);
-//             printk(KERN_INFO"%s: Write Register 0x%X\n", DEVICE_NAME, (*(cdmaReg_t *)arg).reg);
-//             printk(KERN_INFO"%s: Write Value 0x%X\n", DEVICE_NAME, (*(cdmaReg_t *)arg).value);
-            xpdma_writeReg((*(cdmaReg_t *)arg).id, (*(cdmaReg_t *)arg).reg, (*(cdmaReg_t *)arg).value);
+            if (copy_from_user(&reg, argp, sizeof(reg)) || !xpdma_isValidId(reg.id))
+                break;
+//             printk(KERN_INFO"%s: Write Register 0x%X, value 0x%X\n", DEVICE_NAME, reg.reg, reg.value);
+            if (xpdma_sched_acquire(reg.id, XPDMA_PRIO_HIGH, NULL, 0))
+                break;
+            xpdma_ring_drain(reg.id);
+            xpdma_writeReg(reg.id, reg.reg, reg.value);
+            xpdma_sched_release(reg.id, XPDMA_PRIO_HIGH, 0);
             result = SUCCESS;
             break;
         case IOCTL_RDCFGREG:
@@ -370,39 +1160,174 @@ long xpdma_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
             break;
         case IOCTL_SEND:
             // Send data from Host system to AXI CDMA
-            id = (*(cdmaBuffer_t *)arg).id;
-            xpdma_debug(id, "IOCTL_SEND 0"); // this is OK
-            // printk(KERN_INFO"%s: FPGA %d\n", DEVICE_NAME, (*(cdmaBuffer_t *)arg).id);
-            printk(KERN_INFO"%s: Send Data size 0x%X\n", DEVICE_NAME, (*(cdmaBuffer_t *)arg).count);
-            printk(KERN_INFO"%s: Send Data address 0x%X\n", DEVICE_NAME, (*(cdmaBuffer_t *)arg).addr);
-            result = xpdma_send ((*(cdmaBuffer_t *)arg).id, (*(cdmaBuffer_t *)arg).data, (*(cdmaBuffer_t *)arg).count, (*(cdmaBuffer_t *)arg).addr);
-            // xpdma_showInfo (id); // this is OK
-            xpdma_debug(id, "IOCTL_SEND"); // this is OK
-            // xpdma_debug((*(cdmaBuffer_t *)arg).id, "IOCTL_SEND"); // this will report "#PF: supervisor read access in kernel mode"
-            printk(KERN_INFO"%s: Sended\n", DEVICE_NAME);
+            if (copy_from_user(&buffer, argp, sizeof(buffer)) || !xpdma_isValidId(buffer.id) ||
+                ((u64)buffer.addr + buffer.count > xpdma_ddrSize(buffer.id)))
+                break;
+            xpdma_debug(buffer.id, "IOCTL_SEND 0");
+#ifdef XPDMA_DEBUG
+            printk(KERN_INFO"%s: Send Data size 0x%X, address 0x%X, flags 0x%X\n", DEVICE_NAME, buffer.count, buffer.addr, buffer.flags);
+#endif
+            result = xpdma_send(client, buffer.id, buffer.data, buffer.count, buffer.addr, buffer.flags);
+            xpdma_debug(buffer.id, "IOCTL_SEND");
             break;
         case IOCTL_RECV:
             // Receive data from AXI CDMA to Host system
-            id = (*(cdmaBuffer_t *)arg).id;
-            xpdma_debug(id, "IOCTL_REV 0"); // this is OK
-            // printk(KERN_INFO"%s: FPGA %d\n", DEVICE_NAME, (*(cdmaBuffer_t *)arg).id);
-            printk(KERN_INFO"%s: Receive Data size 0x%X\n", DEVICE_NAME, (*(cdmaBuffer_t *)arg).count);
-            printk(KERN_INFO"%s: Receive Data address 0x%X\n", DEVICE_NAME, (*(cdmaBuffer_t *)arg).addr);
-            result = xpdma_recv ((*(cdmaBuffer_t *)arg).id, (*(cdmaBuffer_t *)arg).data, (*(cdmaBuffer_t *)arg).count, (*(cdmaBuffer_t *)arg).addr);
-            // xpdma_debug((*(cdmaBuffer_t *)arg).id, "IOCTL_REV");  // this will report "#PF: supervisor read access in kernel mode"
-            xpdma_debug(id, "IOCTL_REV"); // this is OK
-            printk(KERN_INFO"%s: Received\n", DEVICE_NAME);
+            if (copy_from_user(&buffer, argp, sizeof(buffer)) || !xpdma_isValidId(buffer.id) ||
+                ((u64)buffer.addr + buffer.count > xpdma_ddrSize(buffer.id)))
+                break;
+            xpdma_debug(buffer.id, "IOCTL_REV 0");
+#ifdef XPDMA_DEBUG
+            printk(KERN_INFO"%s: Receive Data size 0x%X, address 0x%X, flags 0x%X\n", DEVICE_NAME, buffer.count, buffer.addr, buffer.flags);
+#endif
+            result = xpdma_recv(client, buffer.id, buffer.data, buffer.count, buffer.addr, buffer.flags);
+            xpdma_debug(buffer.id, "IOCTL_REV");
             break;
         case IOCTL_INFO:
-            xpdma_showInfo ((*(int *)arg));
+            if (get_user(id, (int __user *)argp) || !xpdma_isValidId(id))
+                break;
+            if (xpdma_sched_acquire(id, XPDMA_PRIO_HIGH, NULL, 0))
+                break;
+            xpdma_ring_drain(id);
+            xpdma_showInfo(id);
+            xpdma_sched_release(id, XPDMA_PRIO_HIGH, 0);
+            result = SUCCESS;
+            break;
+        case IOCTL_STATS:
+            if (get_user(id, (int __user *)argp) || !xpdma_isValidId(id))
+                break;
+            spin_lock(&xpdmas[id].sched.lock);
+            stats = xpdmas[id].sched.stats;
+            spin_unlock(&xpdmas[id].sched.lock);
+            if (copy_to_user(argp, &stats, sizeof(stats)))
+                break;
+            result = SUCCESS;
+            break;
+        case IOCTL_SETLIMIT:
+            if (copy_from_user(&limit, argp, sizeof(limit)))
+                break;
+            result = xpdma_client_setLimit(client, &limit);
+            break;
+        case IOCTL_SETPARAM:
+            // tunables are board wide, they apply to every client
+            if (!capable(CAP_SYS_ADMIN)) {
+                result = -EPERM;
+                break;
+            }
+            if (copy_from_user(&param, argp, sizeof(param)) || !xpdma_isValidId(param.id))
+                break;
+            result = xpdma_setParam(param.id, param.param, param.value);
+            break;
+        case IOCTL_GETPARAM:
+            if (copy_from_user(&param, argp, sizeof(param)) || !xpdma_isValidId(param.id))
+                break;
+            result = xpdma_getParam(param.id, param.param, &param.value);
+            if ((SUCCESS == result) && copy_to_user(argp, &param, sizeof(param)))
+                result = CRIT_ERR;
+            break;
+        case IOCTL_REGISTER:
+            if (copy_from_user(&registration, argp, sizeof(registration)) || !xpdma_isValidId(registration.id))
+                break;
+            result = xpdma_mr_register(client, &registration);
+            if ((SUCCESS == result) && copy_to_user(argp, &registration, sizeof(registration))) {
+                xpdma_mr_unregister(client, registration.handle);
+                result = CRIT_ERR;
+            }
+            break;
+        case IOCTL_UNREGISTER:
+            if (copy_from_user(&registration, argp, sizeof(registration)))
+                break;
+            result = xpdma_mr_unregister(client, registration.handle);
+            break;
+        case IOCTL_SENDREG:
+            if (copy_from_user(&regBuffer, argp, sizeof(regBuffer)))
+                break;
+            result = xpdma_mr_ioctl(client, PCI_DMA_TODEVICE, &regBuffer);
+            break;
+        case IOCTL_RECVREG:
+            if (copy_from_user(&regBuffer, argp, sizeof(regBuffer)))
+                break;
+            result = xpdma_mr_ioctl(client, PCI_DMA_FROMDEVICE, &regBuffer);
+            break;
+        case IOCTL_COPYP2P:
+            if (copy_from_user(&copy, argp, sizeof(copy)))
+                break;
+            result = xpdma_p2p_copy(client, &copy);
+            break;
+        case IOCTL_EXPORTBUF:
+            if (copy_from_user(&dmabuf, argp, sizeof(dmabuf)) || !xpdma_isValidId(dmabuf.id))
+                break;
+            result = xpdma_dmabuf_export(&dmabuf);
+            // the descriptor is installed already, it is closed with the process
+            if ((SUCCESS == result) && copy_to_user(argp, &dmabuf, sizeof(dmabuf)))
+                result = CRIT_ERR;
+            break;
+        case IOCTL_IMPORTBUF:
+            if (copy_from_user(&dmabuf, argp, sizeof(dmabuf)) || !xpdma_isValidId(dmabuf.id))
+                break;
+            result = xpdma_mr_import(client, &dmabuf);
+            if ((SUCCESS == result) && copy_to_user(argp, &dmabuf, sizeof(dmabuf))) {
+                xpdma_mr_unregister(client, dmabuf.handle);
+                result = CRIT_ERR;
+            }
+            break;
+        case IOCTL_DDRALLOC:
+            if (copy_from_user(&ddrAlloc, argp, sizeof(ddrAlloc)) || !xpdma_isValidId(ddrAlloc.id))
+                break;
+            result = xpdma_ddr_alloc(client, &ddrAlloc);
+            if ((SUCCESS == result) && copy_to_user(argp, &ddrAlloc, sizeof(ddrAlloc))) {
+                xpdma_ddr_free(client, ddrAlloc.handle);
+                result = CRIT_ERR;
+            }
+            break;
+        case IOCTL_DDRFREE:
+            if (copy_from_user(&ddrAlloc, argp, sizeof(ddrAlloc)))
+                break;
+            result = xpdma_ddr_free(client, ddrAlloc.handle);
+            break;
+        case IOCTL_DDRSTATS:
+            if (get_user(id, (int __user *)argp) || !xpdma_isValidId(id))
+                break;
+            xpdma_ddr_getStats(id, &ddrStats);
+            if (copy_to_user(argp, &ddrStats, sizeof(ddrStats)))
+                break;
+            result = SUCCESS;
+            break;
+        case IOCTL_IRQOPEN:
+            if (copy_from_user(&irqOpen, argp, sizeof(irqOpen)) || !xpdma_isValidId(irqOpen.id))
+                break;
+            result = xpdma_irq_open(&irqOpen);
+            if (result < 0)
+                break;
+            // the descriptor is installed: the caller owns it even if the copy fails
+            irqOpen.fd = result;
+            result = copy_to_user(argp, &irqOpen, sizeof(irqOpen)) ? CRIT_ERR : SUCCESS;
+            break;
+        case IOCTL_IRQEVENTFD:
+            if (copy_from_user(&irqEventfd, argp, sizeof(irqEventfd)) || !xpdma_isValidId(irqEventfd.id))
+                break;
+            result = xpdma_irq_eventfd(client, &irqEventfd);
+            break;
+        case IOCTL_IRQSTATS:
+            if (get_user(id, (int __user *)argp) || !xpdma_isValidId(id))
+                break;
+            xpdma_irq_getStats(id, &irqStats);
+            if (copy_to_user(argp, &irqStats, sizeof(irqStats)))
+                break;
+            result = SUCCESS;
+            break;
+        case IOCTL_CLIENTSTATS:
+            spin_lock(&client->lock);
+            clientStats = client->stats;
+            clientStats.limit = client->limit;
+            clientStats.lifeNs = ktime_to_ns(ktime_sub(ktime_get(), client->openTime));
+            spin_unlock(&client->lock);
+            if (copy_to_user(argp, &clientStats, sizeof(clientStats)))
+                break;
             result = SUCCESS;
             break;
         default:
             break;
     }
-    clac();
-    
-    up(&gSemDma);
 
     return result;
 }
@@ -428,7 +1353,8 @@ void xpdma_showInfo (int id)
     printk(KERN_INFO "%s: xpdmas[id].writeBuffer address: 0x%016lX\n", DEVICE_NAME, (size_t)xpdmas[id].writeBuffer);
     printk(KERN_INFO "%s: xpdmas[id].writeBuffer:         %s\n", DEVICE_NAME, xpdmas[id].writeBuffer);
     printk(KERN_INFO "%s: xpdmas[id].descChain:           0x%016lX\n", DEVICE_NAME, (size_t)xpdmas[id].descChain);
-    printk(KERN_INFO "%s: xpdmas[id].descChainLength:     0x%016lX\n", DEVICE_NAME, (size_t)xpdmas[id].descChainLength);
+    printk(KERN_INFO "%s: xpdmas[id].ring:                %u runs, %u descriptors, %u vectors\n", DEVICE_NAME,
+           xpdmas[id].ring.nrRuns, xpdmas[id].ring.nrDescs, xpdmas[id].ring.nrVecs);
 
     printk(KERN_INFO "%s: REGISTERS:\n", DEVICE_NAME);
 
@@ -446,77 +1372,165 @@ void xpdma_showInfo (int id)
         printk(KERN_INFO "%s: 0x%08X: 0x%08X\n", DEVICE_NAME, CDMA_OFFSET + c, xpdma_readReg(id, CDMA_OFFSET + c));
 }
 
-ssize_t create_desc_chain(int id, int direction, u32 size, u32 addr)
+static inline u64 xpdma_windowSize(int id)
 {
-    // length of desctriptors chain
-    u32 count = 0;
-    u32 sgAddr = AXI_PCIE_SG_ADDR; // current descriptor address in chain
-    u32 bramAddr = AXI_BRAM_ADDR ; // Translation BRAM Address
-    u32 btt = 0;                   // current descriptor BTT
-    u32 unmappedSize = size;       // unmapped data size
-    u32 srcAddr = 0;               // source address (SG_DM of DDR3)
-    u32 destAddr = 0;              // destination address (SG_DM of DDR3)
-
-    xpdmas[id].descChainLength = (size + (u32)(TRANSFER_SIZE) - 1) / (u32)(TRANSFER_SIZE);
-//    printk(KERN_INFO"%s: xpdmas[id].descChainLength = %lu\n", DEVICE_NAME, xpdmas[id].descChainLength);
+    return (u64)1 << xpdmas[id].windowShift;
+}
 
-    // TODO: future: add PCI_DMA_NONE as indicator of MEM 2 MEM transitions
-    if (direction == PCI_DMA_FROMDEVICE) {
-        srcAddr  = AXI_DDR3_ADDR + addr;
-        destAddr = AXI_PCIE_DM_ADDR;
-        // printk(KERN_INFO"%s: create_desc_chain: PCI_DMA_FROMDEVICE, src: 0x%08X -> dst: 0x%08X\n", DEVICE_NAME, srcAddr, destAddr);
-    } else if (direction == PCI_DMA_TODEVICE) {
-        srcAddr  = AXI_PCIE_DM_ADDR;
-        destAddr = AXI_DDR3_ADDR + addr;
-        // printk(KERN_INFO"%s: create_desc_chain: PCI_DMA_TODEVICE, src: 0x%08X -> dst: 0x%08X\n", DEVICE_NAME, srcAddr, destAddr);
-    } else {
-        printk(KERN_INFO"%s: Descriptors Chain create error: unknown direction\n", DEVICE_NAME);
-        return (CRIT_ERR);
-    }
+/**
+ * Host windows mapped by the data windows while a chain is built. A chain
+ * starts with none (an earlier run left the windows anywhere); a missing
+ * window replaces the oldest one, so buffers spread over up to nrWindows host
+ * windows need one translation per window instead of one per switch.
+ */
+struct xpdma_windows {
+    dma_addr_t base[XLAT_WINDOWS_MAX];
+    u32 next;                       // replaced next
+};
 
-    // fill descriptor chain
-//    printk(KERN_INFO"%s: fill descriptor chain\n", DEVICE_NAME);
-    for (count = 0; count < xpdmas[id].descChainLength; ++count) {
-        sg_desc_t *addrDesc = xpdmas[id].descChain + 2 * count; // address translation descriptor
-        sg_desc_t *dataDesc = addrDesc + 1;                // target data transfer descriptor
-        btt = (unmappedSize > TRANSFER_SIZE) ? TRANSFER_SIZE : unmappedSize;
+static void xpdma_windows_init(struct xpdma_windows *windows)
+{
+    u32 w;
 
-        // fill address translation descriptor
-//        printk(KERN_INFO"%s: fill address translation descriptor\n", DEVICE_NAME);
-        addrDesc->nextDesc  = sgAddr + DESCRIPTOR_SIZE;
-        addrDesc->srcAddr   = bramAddr;
-        addrDesc->destAddr  = AXI_BRAM_ADDR + PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_1U;
-        addrDesc->control   = ADDR_BTT;
-        addrDesc->status    = 0x00000000;
-        sgAddr += DESCRIPTOR_SIZE;
+    for (w = 0; w < XLAT_WINDOWS_MAX; ++w)
+        windows->base[w] = 1; // none, windows are aligned
+    windows->next = 0;
+}
 
-        // fill target data transfer descriptor
-//        printk(KERN_INFO"%s: fill address data transfer descriptor\n", DEVICE_NAME);
-        dataDesc->nextDesc  = sgAddr + DESCRIPTOR_SIZE;
-        dataDesc->srcAddr   = srcAddr;
-        dataDesc->destAddr  = destAddr;
-        dataDesc->control   = btt;
-        dataDesc->status    = 0x00000000;
-        sgAddr += DESCRIPTOR_SIZE;
+// Window mapping host window 'base', false when it must be translated first
+static bool xpdma_windows_find(int id, struct xpdma_windows *windows, dma_addr_t base, u32 *window)
+{
+    u32 w;
 
-//        printk(KERN_INFO"%s: update counters\n", DEVICE_NAME);
-        bramAddr += BRAM_STEP;
-        unmappedSize -= btt;
-        srcAddr += btt;
-        destAddr += btt;
+    for (w = 0; w < xpdmas[id].nrWindows; ++w) {
+        if (windows->base[w] == base) {
+            *window = w;
+            return true;
+        }
     }
 
-    xpdmas[id].descChain[2 * xpdmas[id].descChainLength - 1].nextDesc = AXI_PCIE_SG_ADDR; // tail descriptor pointed to chain head
-
-    return (SUCCESS);
+    *window = windows->next;
+    windows->base[*window] = base;
+    windows->next = (windows->next + 1) % xpdmas[id].nrWindows;
+    return false;
 }
 
-void show_descriptors(int id)
+/**
+ * Check the segments of one engine run and count the BRAM translation vectors
+ * it needs: every segment is a data descriptor, its host side is reached
+ * through a data window (AXIBAR1, or AXIBAR2..5 per the capability register);
+ * an address translation descriptor (vector from BRAM to AXIBAR2PCIEBAR_n) is
+ * put in front of a segment whose host window none of the windows maps.
+ */
+static int sg_chainSize(int id, int direction, const struct xpdma_seg *segs, int nsegs, u32 *vecs)
 {
-    int c = 0;
-    sg_desc_t *descriptor = xpdmas[id].descChain;
+    struct xpdma_windows windows;
+    u64 size = xpdma_windowSize(id);
+    dma_addr_t base;
+    u32 window;
+    int c;
 
-    if (!xpdmas[id].used) {
+    // TODO: future: add PCI_DMA_NONE as indicator of MEM 2 MEM transitions
+    if ((direction != PCI_DMA_FROMDEVICE) && (direction != PCI_DMA_TODEVICE)) {
+        printk(KERN_INFO"%s: Descriptors Chain create error: unknown direction\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+
+    if ((nsegs <= 0) || (nsegs > xpdmas[id].segMax)) {
+        printk(KERN_INFO"%s: Descriptors Chain create error: %d segments\n", DEVICE_NAME, nsegs);
+        return (CRIT_ERR);
+    }
+
+    xpdma_windows_init(&windows);
+    *vecs = 0;
+    for (c = 0; c < nsegs; ++c) {
+        base = segs[c].host & ~((dma_addr_t)size - 1);
+        if ((segs[c].len == 0) || (segs[c].host - base + segs[c].len > size)) {
+            printk(KERN_INFO"%s: Descriptors Chain create error: segment crosses a translation window\n", DEVICE_NAME);
+            return (CRIT_ERR);
+        }
+        if (!xpdma_windows_find(id, &windows, base, &window))
+            (*vecs)++;
+    }
+
+    return (SUCCESS);
+}
+
+/**
+ * Fill the ring descriptors of a run (slots reserved by sg_submit, the engine
+ * does not reach them before TAILDESC moves).
+ *
+ * Vectors are staged in the tail of the chain buffer. Short tables are written to
+ * BRAM by MMIO, longer ones are copied by a leading descriptor so chain start
+ * does not pay one uncached PCIe write per vector word; the CDMA runs
+ * descriptors in order, as the translation descriptors already rely on.
+ */
+ssize_t create_desc_chain(int id, int direction, const struct xpdma_seg *segs, int nsegs, const struct xpdma_run *run, u32 vecs)
+{
+    sg_desc_t *ring = xpdmas[id].descChain;
+    u32 *vectors = (u32 *)((char *)xpdmas[id].descChain + VECTOR_STAGE_OFFSET);
+    u32 vecBase = xpdmas[id].vecBase;
+    u32 slot = run->head;                    // current descriptor
+    u32 vec = run->vec;                      // current Translation BRAM vector
+    struct xpdma_windows windows;
+    dma_addr_t base;
+    sg_desc_t *desc;
+    u32 hostAddr;
+    u32 window;
+    int c;
+
+    if (vecs > VECTOR_MMIO_MAX) {
+        desc = ring + slot;
+        desc->srcAddr   = AXI_PCIE_SG_ADDR + VECTOR_STAGE_OFFSET + vec * BRAM_STEP;
+        desc->destAddr  = AXI_BRAM_ADDR + vecBase + vec * BRAM_STEP;
+        desc->control   = vecs * BRAM_STEP;
+        desc->status    = 0x00000000;
+        slot = (slot + 1) % RING_DESCS;
+    }
+
+    xpdma_windows_init(&windows);
+    for (c = 0; c < nsegs; ++c) {
+        base = segs[c].host & ~((dma_addr_t)xpdma_windowSize(id) - 1);
+
+        if (!xpdma_windows_find(id, &windows, base, &window)) {
+            // Translation vector, BRAM layout
+            vectors[vec * 2 + 0] = (base >> 32) & 0xFFFFFFFF; // Upper 32 bit
+            vectors[vec * 2 + 1] = (base >> 0 ) & 0xFFFFFFFF; // Lower 32 bit
+            if (vecs <= VECTOR_MMIO_MAX) {
+                xpdma_writeReg (id, (vecBase + vec * BRAM_STEP + 4), vectors[vec * 2 + 1]); // Lower 32 bit
+                xpdma_writeReg (id, (vecBase + vec * BRAM_STEP + 0), vectors[vec * 2 + 0]); // Upper 32 bit
+            }
+
+            // fill address translation descriptor
+            desc = ring + slot;
+            desc->srcAddr   = AXI_BRAM_ADDR + vecBase + vec * BRAM_STEP;
+            desc->destAddr  = AXI_BRAM_ADDR + PCIE_CTL_OFFSET + xpdmas[id].windowReg[window];
+            desc->control   = ADDR_BTT;
+            desc->status    = 0x00000000;
+            slot = (slot + 1) % RING_DESCS;
+
+            vec++;
+        }
+
+        // fill target data transfer descriptor
+        hostAddr = xpdmas[id].windowAxi[window] + (u32)(segs[c].host - base);
+        desc = ring + slot;
+        desc->srcAddr   = (direction == PCI_DMA_FROMDEVICE) ? (AXI_DDR3_ADDR + segs[c].ddr) : hostAddr;
+        desc->destAddr  = (direction == PCI_DMA_FROMDEVICE) ? hostAddr : (AXI_DDR3_ADDR + segs[c].ddr);
+        desc->control   = segs[c].len;
+        desc->status    = 0x00000000;
+        slot = (slot + 1) % RING_DESCS;
+    }
+
+    return (SUCCESS);
+}
+
+void show_descriptors(int id)
+{
+    int c = 0;
+    sg_desc_t *descriptor = xpdmas[id].descChain;
+
+    if (!xpdmas[id].used) {
         printk(KERN_WARNING"%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
         return;
     }
@@ -549,302 +1563,2540 @@ void show_descriptors(int id)
     }
 }
 
-int xpdma_open(struct inode *inode, struct file *filp)
+int xpdma_open(struct inode *inode, struct file *filp)
+{
+    struct xpdma_client *client;
+
+    client = kzalloc(sizeof(*client), GFP_KERNEL);
+    if (NULL == client)
+        return -ENOMEM;
+
+    spin_lock_init(&client->lock);
+    client->limit.weight = clamp_t(uint, default_weight, 1, XPDMA_WEIGHT_MAX);
+    client->limit.rate = default_rate;
+    client->limit.burst = 0;
+    client->tokens = BUF_SIZE;
+    client->lastRefill = ktime_get();
+    client->openTime = client->lastRefill;
+    client->stats.pid = task_tgid_nr(current);
+    mutex_init(&client->mmapLock);
+    INIT_LIST_HEAD(&client->mmaps);
+    xa_init_flags(&client->mrs, XA_FLAGS_ALLOC1);
+    xa_init_flags(&client->ddrs, XA_FLAGS_ALLOC1);
+
+    spin_lock(&gClientsLock);
+    list_add_tail(&client->node, &gClients);
+    spin_unlock(&gClientsLock);
+
+    filp->private_data = client;
+    printk(KERN_INFO"%s: Open: module opened by pid %d\n", DEVICE_NAME, client->stats.pid);
+    return (SUCCESS);
+}
+
+static int xpdma_reset(int id)
+{
+    int loop = CDMA_RESET_LOOP;
+    u32 tmp;
+
+    if (!xpdmas[id].used) {
+        printk(KERN_WARNING"%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
+        return (CRIT_ERR);
+    }
+
+    printk(KERN_INFO"%s: RESET CDMA\n", DEVICE_NAME);
+    //down(&gSemDma);
+    xpdma_writeReg(id, (CDMA_OFFSET + CDMA_CONTROL_OFFSET),
+                   xpdma_readReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET) | CDMA_CR_RESET_MASK);
+
+    tmp = xpdma_readReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_RESET_MASK;
+
+    /* Wait for the hardware to finish reset */
+    while (loop && tmp) {
+        tmp = xpdma_readReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_RESET_MASK;
+        loop--;
+    }
+
+    if (!loop) {
+        printk(KERN_INFO"%s: reset timeout, CONTROL_REG: 0x%08X, STATUS_REG 0x%08X\n",
+                DEVICE_NAME,
+                xpdma_readReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET),
+                xpdma_readReg(id, CDMA_OFFSET + CDMA_STATUS_OFFSET));
+        return (CRIT_ERR);
+    }
+
+    // For Axi CDMA, always do sg transfers if sg mode is built in
+    xpdma_writeReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET, tmp | CDMA_CR_SG_EN);
+    WRITE_ONCE(xpdmas[id].wedged, false);
+
+    //up(&gSemDma);
+
+    printk(KERN_INFO"%s: SUCCESSFULLY RESET CDMA!\n", DEVICE_NAME);
+
+    return (SUCCESS);
+}
+
+static int xpdma_isIdle(int id)
+{
+    if (!xpdmas[id].used) {
+        printk(KERN_WARNING"%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
+        return 0;
+    }
+    return xpdma_readReg(id, CDMA_OFFSET + CDMA_STATUS_OFFSET) &
+           CDMA_CR_IDLE_MASK;
+}
+
+static void xpdma_ring_init(int id)
+{
+    struct xpdma_ring *ring = &xpdmas[id].ring;
+    u32 c;
+
+    spin_lock_init(&ring->lock);
+    init_waitqueue_head(&ring->wq);
+    ring->first = 0;
+    ring->nrRuns = 0;
+    ring->descHead = 0;
+    ring->nrDescs = 0;
+    ring->vecHead = 0;
+    ring->nrVecs = 0;
+    ring->retired = 0;
+    memset(ring->bytes, 0, sizeof(ring->bytes));
+    ring->lastEnd = 0;
+    ring->due = 0;
+    ring->generation = 0;
+    ring->reset = false;
+    memset(ring->bounce, 0, sizeof(ring->bounce));
+
+    for (c = 0; c < RING_DESCS; ++c) {
+        xpdmas[id].descChain[c].nextDesc = AXI_PCIE_SG_ADDR + ((c + 1) % RING_DESCS) * DESCRIPTOR_SIZE;
+        xpdmas[id].descChain[c].status = 0x00000000;
+    }
+}
+
+/**
+ * Stop the engine with a CDMA soft reset, it finishes the AXI transfers in
+ * progress and then stays idle until xpdma_reset enables it again. An engine
+ * that doesn't come out of reset is marked wedged: the pages of its runs stay
+ * pinned (xpdma_mr_release) since it may still write them.
+ */
+static void xpdma_engine_stop(int id)
+{
+    int loop = CDMA_RESET_LOOP;
+
+    xpdma_writeReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET, CDMA_CR_RESET_MASK);
+    while (loop && (xpdma_readReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_RESET_MASK))
+        loop--;
+
+    if (!loop) {
+        printk(KERN_ERR"%s: FPGA %d engine doesn't stop, STATUS_REG 0x%08X\n", DEVICE_NAME, id,
+               xpdma_readReg(id, CDMA_OFFSET + CDMA_STATUS_OFFSET));
+        WRITE_ONCE(xpdmas[id].wedged, true);
+    }
+}
+
+/**
+ * Fail every run in flight and empty the ring (ring->lock held). The engine is
+ * stopped first, so the callers may reuse or unpin the buffers of the failed
+ * runs, and reset before the next run.
+ */
+static void xpdma_ring_failLocked(int id, const char *error)
+{
+    struct xpdma_ring *ring = &xpdmas[id].ring;
+    struct xpdma_run *run;
+
+    if (ring->nrRuns) {
+        printk(KERN_INFO "%s: Scatter Gather Operation: %s\n", DEVICE_NAME, error);
+        show_descriptors(id);
+        xpdma_engine_stop(id);
+    }
+
+    while (ring->nrRuns) {
+        run = ring->runs[ring->first];
+        run->result = CRIT_ERR;
+        run->end = ktime_get();
+        smp_store_release(&run->done, true);
+        ring->first = (ring->first + 1) % RING_RUNS;
+        ring->nrRuns--;
+        ring->retired++;
+    }
+
+    ring->descHead = 0;
+    ring->nrDescs = 0;
+    ring->vecHead = 0;
+    ring->nrVecs = 0;
+    memset(ring->bytes, 0, sizeof(ring->bytes));
+    ring->generation++;
+    ring->reset = true;
+}
+
+static void xpdma_ring_fail(int id, const char *error)
+{
+    spin_lock(&xpdmas[id].ring.lock);
+    xpdma_ring_failLocked(id, error);
+    spin_unlock(&xpdmas[id].ring.lock);
+}
+
+// Retire completed runs in order, free their descriptors and vectors (ring->lock held)
+static void xpdma_ring_reap(int id)
+{
+    struct xpdma_ring *ring = &xpdmas[id].ring;
+    struct xpdma_run *run;
+    u32 status;
+
+    while (ring->nrRuns) {
+        run = ring->runs[ring->first];
+        status = READ_ONCE(xpdmas[id].descChain[run->tail].status);
+        if (!(status & SG_COMPLETE_MASK))
+            return;
+
+        if (status & SG_DEC_ERR_MASK) {
+            xpdma_ring_failLocked(id, "Decode Error");
+            return;
+        }
+        if (status & SG_SLAVE_ERR_MASK) {
+            xpdma_ring_failLocked(id, "Slave Error");
+            return;
+        }
+        if (status & SG_INT_ERR_MASK) {
+            xpdma_ring_failLocked(id, "Internal Error");
+            return;
+        }
+
+        ring->descHead = (ring->descHead + run->descs) % RING_DESCS;
+        ring->nrDescs -= run->descs;
+        ring->vecHead = (ring->vecHead + run->vecs) % xpdmas[id].vecSlots;
+        ring->nrVecs -= run->vecs;
+        ring->first = (ring->first + 1) % RING_RUNS;
+        ring->nrRuns--;
+        ring->retired++;
+        ring->bytes[run->prio] -= run->count;
+
+        run->result = SUCCESS;
+        run->end = ktime_get();
+        // the engine took the run when the previous one retired
+        run->queuedNs = ktime_after(ring->lastEnd, run->start) ? ktime_to_ns(ktime_sub(ring->lastEnd, run->start)) : 0;
+        ring->lastEnd = run->end;
+        smp_store_release(&run->done, true);
+    }
+}
+
+// Non-blocking completion check of a run
+static bool xpdma_ring_poll(int id, struct xpdma_run *run)
+{
+    if (smp_load_acquire(&run->done))
+        return true;
+
+    // status of our tail is only a hint, retiring is done in order under the lock
+    if (!(READ_ONCE(xpdmas[id].descChain[run->tail].status) & SG_COMPLETE_MASK))
+        return false;
+
+    spin_lock(&xpdmas[id].ring.lock);
+    xpdma_ring_reap(id);
+    spin_unlock(&xpdmas[id].ring.lock);
+
+    return smp_load_acquire(&run->done);
+}
+
+// Wait until the oldest run in flight retires (engine held)
+static int xpdma_ring_waitOldest(int id)
+{
+    struct xpdma_ring *ring = &xpdmas[id].ring;
+    ktime_t deadline = 0;
+    u64 target;
+    bool done;
+
+    spin_lock(&ring->lock);
+    xpdma_ring_reap(id);
+    target = ring->retired + 1;
+    done = !ring->nrRuns;
+    if (!done)
+        deadline = ring->runs[ring->first]->deadline;
+    spin_unlock(&ring->lock);
+
+    while (!done) {
+        if (!ktime_before(ktime_get(), deadline)) {
+            xpdma_ring_fail(id, "Timeout Error");
+            return (CRIT_ERR);
+        }
+        udelay(10);
+        cond_resched();
+        spin_lock(&ring->lock);
+        xpdma_ring_reap(id);
+        done = ring->retired >= target;
+        spin_unlock(&ring->lock);
+    }
+
+    return (SUCCESS);
+}
+
+// Wait for every run in flight and reset the engine if a run failed (engine held)
+static int xpdma_ring_drain(int id)
+{
+    struct xpdma_ring *ring = &xpdmas[id].ring;
+    bool reset;
+
+    while (READ_ONCE(ring->nrRuns))
+        if (xpdma_ring_waitOldest(id))
+            break;
+
+    spin_lock(&ring->lock);
+    reset = ring->reset;
+    ring->reset = false;
+    spin_unlock(&ring->lock);
+
+    return reset ? xpdma_reset(id) : (SUCCESS);
+}
+
+/**
+ * Ring room for a run (ring->lock held): the descriptors follow the ring tail,
+ * the vectors must be contiguous for the upload descriptor, slots up to the
+ * end of BRAM are skipped when they don't fit. Normal priority runs also wait
+ * while RING_NORMAL_MAX bytes of them are in flight, so a high priority run
+ * never queues behind more than that. Returns the first vector slot.
+ */
+static int xpdma_ring_space(int id, const struct xpdma_run *run, u32 descs, u32 vecs, u32 *skip)
+{
+    struct xpdma_ring *ring = &xpdmas[id].ring;
+    u32 slots = xpdmas[id].vecSlots;
+    u64 normal = ring->bytes[XPDMA_PRIO_NORMAL];
+    u32 vecTail;
+
+    if ((ring->nrRuns == RING_RUNS) || (ring->nrDescs + descs > RING_DESCS) || (ring->nrVecs + vecs > slots))
+        return -1;
+
+    if ((XPDMA_PRIO_NORMAL == run->prio) && normal && (normal + run->count > RING_NORMAL_MAX))
+        return -1;
+
+    if (!ring->nrVecs)
+        ring->vecHead = 0;
+    vecTail = (ring->vecHead + ring->nrVecs) % slots;
+
+    *skip = 0;
+    if ((vecTail < ring->vecHead) || (vecTail + vecs <= slots))
+        return (vecTail + vecs <= ((vecTail < ring->vecHead) ? ring->vecHead : slots)) ? (int)vecTail : -1;
+
+    // wrap: restart at slot 0
+    if (vecs > ring->vecHead)
+        return -1;
+    *skip = slots - vecTail;
+    return 0;
+}
+
+/**
+ * Queue a descriptor chain over 'segs' on the board ring and start it (engine
+ * must be held). Returns once the engine owns the run, wait with sg_wait.
+ */
+static int sg_submit(int id, int direction, const struct xpdma_seg *segs, int nsegs, struct xpdma_run *run)
+{
+    struct xpdma_ring *ring = &xpdmas[id].ring;
+    int dir = (PCI_DMA_TODEVICE == direction) ? 0 : 1;
+    size_t pntr = 0;
+    u64 ahead;
+    bool queued;
+    bool idle = false;
+    u32 generation = 0;
+    u32 descs;
+    u32 vecs;
+    u32 skip;
+    int vec = -1;
+    int loop;
+    int c;
+
+    // longest run: upload + translation and data descriptor per segment
+    BUILD_BUG_ON(RING_DESCS * DESCRIPTOR_SIZE > VECTOR_STAGE_OFFSET);
+    BUILD_BUG_ON(2 * (1 + 2 * SG_SEG_MAX) > RING_DESCS);
+    BUILD_BUG_ON(VECTOR_SLOTS * BRAM_STEP > VECTOR_STAGE_SIZE);
+
+    if (sg_chainSize(id, direction, segs, nsegs, &vecs))
+        return (CRIT_ERR);
+    descs = nsegs + vecs + ((vecs > VECTOR_MMIO_MAX) ? 1 : 0);
+
+    run->direction = direction;
+    run->prio = xpdmas[id].sched.ownerPrio;
+    run->count = 0;
+    for (c = 0; c < nsegs; ++c)
+        run->count += segs[c].len;
+    run->queuedNs = 0;
+    run->done = false;
+    run->result = CRIT_ERR;
+
+    // previous run failed: recover the engine before anything is queued
+    if (READ_ONCE(ring->reset) && xpdma_ring_drain(id))
+        return (CRIT_ERR);
+
+    // room in the ring, the oldest runs retire while we wait
+    while (vec < 0) {
+        spin_lock(&ring->lock);
+        xpdma_ring_reap(id);
+        vec = xpdma_ring_space(id, run, descs, vecs, &skip);
+        if (vec >= 0) {
+            run->head = (ring->descHead + ring->nrDescs) % RING_DESCS;
+            run->tail = (run->head + descs - 1) % RING_DESCS;
+            run->descs = descs;
+            run->vec = vec;
+            run->vecs = vecs + skip;
+            generation = ring->generation;
+        }
+        spin_unlock(&ring->lock);
+        if ((vec < 0) && xpdma_ring_waitOldest(id))
+            return (CRIT_ERR);
+    }
+
+    // Create Descriptors chain and write appropriate Translation Vectors
+    if (create_desc_chain(id, direction, segs, nsegs, run, vecs))
+        return (CRIT_ERR);
+
+    // publish the run, unless the ring was failed while we filled it
+    spin_lock(&ring->lock);
+    queued = generation == ring->generation;
+    if (queued) {
+        idle = !ring->nrRuns;
+        ring->runs[(ring->first + ring->nrRuns) % RING_RUNS] = run;
+        ring->nrRuns++;
+        ring->nrDescs += run->descs;
+        ring->nrVecs += run->vecs;
+        ahead = ring->bytes[XPDMA_PRIO_NORMAL] + ring->bytes[XPDMA_PRIO_HIGH];
+        ring->bytes[run->prio] += run->count;
+        run->start = ktime_get();
+        run->sample = idle;
+        // the engine starts this run when the runs ahead retire
+        run->due = ktime_add_ns(ktime_after(ring->due, run->start) ? ring->due : run->start,
+                                div64_u64((u64)run->count * NSEC_PER_SEC, xpdmas[id].bandwidth[dir]));
+        ring->due = run->due;
+        run->deadline = ktime_add_us(run->start, (u64)CDMA_TRANSFER_LOOP * 10 +
+                                     ((ahead + run->count) >> SG_TIMEOUT_SHIFT));
+    }
+    spin_unlock(&ring->lock);
+    if (!queued)
+        return (CRIT_ERR);
+
+    if (idle) {
+        // nothing in flight: the engine passed the last tail, (re)start from our head
+        for (loop = CDMA_RESET_LOOP; loop && !xpdma_isIdle(id); --loop)
+            cpu_relax();
+
+        // Set DMA to Scatter Gather Mode
+        xpdma_writeReg (id, CDMA_OFFSET + CDMA_CONTROL_OFFSET, CDMA_CR_SG_EN);
+
+        // Update PCIe Translation vector of the chain buffer
+        pntr =  (size_t) (xpdmas[id].descChainHWAddr);
+        xpdma_writeReg (id, (PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_0L), (pntr >> 0)  & 0xFFFFFFFF); // Lower 32 bit
+        xpdma_writeReg (id, (PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_0U), (pntr >> 32) & 0xFFFFFFFF); // Upper 32 bit
+
+        // Write a valid pointer to DMA CURDESC_PNTR
+        xpdma_writeReg (id, (CDMA_OFFSET + CDMA_CDESC_OFFSET), AXI_PCIE_SG_ADDR + run->head * DESCRIPTOR_SIZE);
+    }
+
+    // Write a valid pointer to DMA TAILDESC_PNTR, a busy engine continues into the new run
+    xpdma_writeReg (id, (CDMA_OFFSET + CDMA_TDESC_OFFSET), AXI_PCIE_SG_ADDR + run->tail * DESCRIPTOR_SIZE);
+
+    // the engine may have stopped at the old tail just before it moved: restart at our head
+    if (!idle && xpdma_isIdle(id) && !(READ_ONCE(xpdmas[id].descChain[run->head].status) & SG_COMPLETE_MASK)) {
+        xpdma_writeReg (id, (CDMA_OFFSET + CDMA_CDESC_OFFSET), AXI_PCIE_SG_ADDR + run->head * DESCRIPTOR_SIZE);
+        xpdma_writeReg (id, (CDMA_OFFSET + CDMA_TDESC_OFFSET), AXI_PCIE_SG_ADDR + run->tail * DESCRIPTOR_SIZE);
+    }
+
+    return (SUCCESS);
+}
+
+// Mark a run that did not go through the ring (simple mode) as finished
+static void sg_complete(struct xpdma_run *run, int direction, int result)
+{
+    run->direction = direction;
+    run->prio = XPDMA_PRIO_NORMAL;
+    run->count = 0;
+    run->queuedNs = 0;
+    run->sample = false;
+    run->result = result;
+    run->done = true;
+}
+
+/**
+ * Wait for a queued run, until its deadline (10 s plus 1 us per 32 bytes queued
+ * up to and including it).
+ * Classic mode polls every 10 us. Hybrid mode sleeps on an hrtimer for most of
+ * the time to the predicted retire time (measured board throughput over the
+ * runs queued ahead and this one) and busy-polls the descriptor status only
+ * for the tail (NVMe style hybrid polling).
+ */
+static int sg_wait(int id, struct xpdma_run *run, u32 flags)
+{
+    int dir = (PCI_DMA_TODEVICE == run->direction) ? 0 : 1;
+    bool hybrid = xpdmas[id].pollMode == XPDMA_POLL_HYBRID;
+    ktime_t sleep;
+    s64 predictNs;
+    u64 runNs;
+
+    if (flags & XPDMA_FLAG_POLL_HYBRID)
+        hybrid = true;
+    else if (flags & XPDMA_FLAG_POLL_CLASSIC)
+        hybrid = false;
+
+    if (xpdma_ring_poll(id, run)) {
+        // finished already
+    } else if (hybrid) {
+        predictNs = ktime_to_ns(ktime_sub(run->due, ktime_get()));
+        if (predictNs >= HYBRID_MIN_SLEEP_NS) {
+            sleep = ns_to_ktime(predictNs - predictNs / 4);
+            set_current_state(TASK_UNINTERRUPTIBLE);
+            schedule_hrtimeout_range(&sleep, predictNs / 16, HRTIMER_MODE_REL);
+        }
+        while (!xpdma_ring_poll(id, run) && ktime_before(ktime_get(), run->deadline)) {
+            cpu_relax();
+            cond_resched();
+        }
+    } else {
+        while (!xpdma_ring_poll(id, run) && ktime_before(ktime_get(), run->deadline)) {
+            udelay(10);// TODO: can it be less?
+            cond_resched();
+        }
+    }
+
+    if (!smp_load_acquire(&run->done))
+        xpdma_ring_fail(id, "Timeout Error");
+
+    if (SUCCESS != run->result)
+        return (CRIT_ERR);
+
+    xpdma_sched_accountRing(id, run);
+
+    // update throughput estimate (small runs are dominated by start latency)
+    runNs = ktime_to_ns(ktime_sub(run->end, run->start)) - run->queuedNs;
+    if (run->sample && (run->count >= HYBRID_MIN_SAMPLE) && runNs)
+        xpdmas[id].bandwidth[dir] = (xpdmas[id].bandwidth[dir] * 7 + div64_u64((u64)run->count * NSEC_PER_SEC, runNs)) / 8;
+
+    return (SUCCESS);
+}
+
+/**
+ * Run a descriptor chain over 'segs' and wait for it (engine must be held)
+ */
+static int sg_run(int id, int direction, const struct xpdma_seg *segs, int nsegs, u32 flags)
+{
+    struct xpdma_run run;
+
+    if (sg_submit(id, direction, segs, nsegs, &run))
+        return (CRIT_ERR);
+
+    return sg_wait(id, &run, flags);
+}
+
+static bool xpdma_bounce_tryGet(int id, int dir, int *slot)
+{
+    struct xpdma_ring *ring = &xpdmas[id].ring;
+    int c;
+
+    spin_lock(&ring->lock);
+    for (c = 0; c < BOUNCE_SLOTS; ++c) {
+        if (NULL == ring->bounce[dir][c]) {
+            ring->bounce[dir][c] = current;
+            *slot = c;
+            break;
+        }
+    }
+    spin_unlock(&ring->lock);
+
+    return c < BOUNCE_SLOTS;
+}
+
+/**
+ * Take a bounce buffer of a direction (0 - send, 1 - receive). Taken before the
+ * engine and given back once the run finished and the data was copied out, so
+ * the next chunk can be copied while the previous one runs.
+ */
+static int xpdma_bounce_get(int id, int dir)
+{
+    int slot = -1;
+
+    if (wait_event_killable(xpdmas[id].ring.wq, xpdma_bounce_tryGet(id, dir, &slot)))
+        return -EINTR;
+    return slot;
+}
+
+static void xpdma_bounce_put(int id, int dir, int slot)
+{
+    spin_lock(&xpdmas[id].ring.lock);
+    xpdmas[id].ring.bounce[dir][slot] = NULL;
+    spin_unlock(&xpdmas[id].ring.lock);
+    wake_up(&xpdmas[id].ring.wq);
+}
+
+// Share of a split bounce buffer copy: pages bv[0..nr) and their place in the bounce buffer
+struct xpdma_copy_part {
+    struct work_struct work;
+    const struct bio_vec *bv;
+    unsigned int nr;
+    char *buf;
+    bool toDevice;
+};
+
+static void xpdma_copy_part_run(struct xpdma_copy_part *part)
+{
+    char *buf = part->buf;
+    unsigned int c;
+    char *va;
+
+    for (c = 0; c < part->nr; ++c) {
+        va = kmap_atomic(part->bv[c].bv_page);
+        if (part->toDevice)
+            memcpy(buf, va + part->bv[c].bv_offset, part->bv[c].bv_len);
+        else
+            memcpy(va + part->bv[c].bv_offset, buf, part->bv[c].bv_len);
+        kunmap_atomic(va);
+        buf += part->bv[c].bv_len;
+    }
+}
+
+static void xpdma_copy_work(struct work_struct *work)
+{
+    xpdma_copy_part_run(container_of(work, struct xpdma_copy_part, work));
+}
+
+/**
+ * Copy 'count' bytes between pages 'bv' and a bounce buffer in shares of similar
+ * size: the caller copies the first one, the others run at the same time on
+ * unbound workqueue workers near the board NUMA node.
+ */
+static void xpdma_copy_pages(int id, const struct bio_vec *bv, unsigned int nr, size_t count, char *buf,
+                             bool toDevice, unsigned int workers)
+{
+    struct xpdma_copy_part parts[COPY_WORKERS_MAX];
+    size_t share;
+    size_t bytes;
+    unsigned int first = 0;
+    unsigned int nrParts;
+    unsigned int n;
+
+    workers = clamp_t(size_t, count / COPY_SPLIT_MIN, 1, workers);
+    share = DIV_ROUND_UP(count, workers);
+
+    for (nrParts = 0; (nrParts < workers) && (first < nr); ++nrParts) {
+        bytes = 0;
+        for (n = first; (n < nr) && ((bytes < share) || (nrParts == workers - 1)); ++n)
+            bytes += bv[n].bv_len;
+
+        parts[nrParts].bv = bv + first;
+        parts[nrParts].nr = n - first;
+        parts[nrParts].buf = buf;
+        parts[nrParts].toDevice = toDevice;
+        if (nrParts > 0) {
+            INIT_WORK_ONSTACK(&parts[nrParts].work, xpdma_copy_work);
+            queue_work_node(xpdma_node(id), gCopyWq, &parts[nrParts].work);
+        }
+        buf += bytes;
+        first = n;
+    }
+
+    xpdma_copy_part_run(&parts[0]);
+
+    for (n = 1; n < nrParts; ++n) {
+        flush_work(&parts[n].work);
+        destroy_work_on_stack(&parts[n].work);
+    }
+}
+
+/**
+ * Copy a chunk between the data of 'iter' and a bounce buffer. The copy of user
+ * memory (iovec iterators) can be split across XPDMA_PARAM_COPY_WORKERS CPUs:
+ * workers have no user address space, so the user pages of the chunk are taken
+ * in rounds of COPY_PAGES and copied through kernel mappings. Other iterators
+ * and chunks too small to split are copied by the caller.
+ */
+static int xpdma_bounce_copy(int id, int direction, char *buf, size_t count, struct iov_iter *iter)
+{
+    bool toDevice = (PCI_DMA_TODEVICE == direction);
+    unsigned int workers = xpdmas[id].copyWorkers;
+    struct page **pages;
+    struct bio_vec *bv;
+    size_t done = 0;
+    size_t got;
+    size_t start;
+    size_t len;
+    ssize_t n;
+    unsigned int nr;
+    unsigned int c;
+    int result = SUCCESS;
+
+    pages = NULL;
+    if ((workers > 1) && (count >= 2 * COPY_SPLIT_MIN) && (NULL != gCopyWq) && iter_is_iovec(iter))
+        pages = kvmalloc_array(COPY_PAGES, sizeof(*pages) + sizeof(*bv), GFP_KERNEL);
+
+    if (NULL == pages) {
+        if (toDevice)
+            return (copy_from_iter(buf, count, iter) == count) ? SUCCESS : CRIT_ERR;
+        return (copy_to_iter(buf, count, iter) == count) ? SUCCESS : CRIT_ERR;
+    }
+    bv = (struct bio_vec *)(pages + COPY_PAGES);
+
+    while (done < count) {
+        nr = 0;
+        got = 0;
+        // one iovec segment at most per call
+        while ((done + got < count) && (nr < COPY_PAGES)) {
+            n = iov_iter_get_pages(iter, pages + nr, count - done - got, COPY_PAGES - nr, &start);
+            if (n <= 0)
+                break;
+            iov_iter_advance(iter, n);
+            got += n;
+            for (len = n; len; ++nr) {
+                bv[nr].bv_page = pages[nr];
+                bv[nr].bv_offset = start;
+                bv[nr].bv_len = min_t(size_t, len, PAGE_SIZE - start);
+                len -= bv[nr].bv_len;
+                start = 0;
+            }
+        }
+
+        if (0 == got) {
+            result = CRIT_ERR;
+            break;
+        }
+
+        xpdma_copy_pages(id, bv, nr, got, buf + done, toDevice, workers);
+
+        for (c = 0; c < nr; ++c) {
+            if (!toDevice) {
+                flush_dcache_page(pages[c]);
+                set_page_dirty_lock(pages[c]);
+            }
+            put_page(pages[c]);
+        }
+        done += got;
+    }
+
+    kvfree(pages);
+    return result;
+}
+
+// dma_block chunk in flight
+struct xpdma_chunk {
+    struct xpdma_run run;
+    int slot;                       // Bounce buffer, -1 if the chunk is free
+    size_t count;
+};
+
+// Wait for a chunk of dma_block, copy it out (receive) and free its bounce buffer
+static int dma_chunk_finish(struct xpdma_client *client, int id, int direction, struct iov_iter *iter,
+                            struct xpdma_chunk *chunk, u32 flags)
+{
+    int dir = (PCI_DMA_TODEVICE == direction) ? 0 : 1;
+    int result = sg_wait(id, &chunk->run, flags);
+
+    // chunks finish in order, so the iterator is at the chunk data
+    if ((SUCCESS == result) && (PCI_DMA_FROMDEVICE == direction))
+        if (xpdma_bounce_copy(id, direction, xpdmas[id].bounce[dir][chunk->slot], chunk->count, iter)) {
+            printk("%s: dma_block: Failed copy to user.\n", DEVICE_NAME);
+            result = CRIT_ERR;
+        }
+
+    xpdma_bounce_put(id, dir, chunk->slot);
+    chunk->slot = -1;
+    if (SUCCESS == result)
+        xpdma_client_account(client, direction, chunk->count);
+    return result;
+}
+
+/**
+ * Bounce buffer transfer of the data of 'iter' (user buffers of the ioctls,
+ * any iterator of read_iter/write_iter/splice) from or to DDR at 'addr'.
+ * XPDMA_FLAG_SIMPLE runs chunks in simple (register programmed) CDMA mode.
+ */
+static int dma_block(struct xpdma_client *client, int id, int direction, struct iov_iter *iter, u32 addr, u32 flags)
+{
+    int dir = (PCI_DMA_TODEVICE == direction) ? 0 : 1;
+    struct xpdma_chunk chunks[BOUNCE_SLOTS];
+    struct xpdma_chunk *chunk;
+    struct xpdma_seg seg;
+    size_t unsended = iov_iter_count(iter);
+    u32 curAddr = addr;
+    u32 btt = BUF_SIZE;
+    int prio = xpdma_flagsToPrio(flags);
+    int result = SUCCESS;
+    int cur = 0;
+    int c;
+
+    if ( (addr % 4) != 0 )  {
+        printk(KERN_WARNING"%s: DMA: Address %08X not dword aligned.\n", DEVICE_NAME, addr);
+        return (CRIT_ERR);
+    }
+
+    for (c = 0; c < BOUNCE_SLOTS; ++c)
+        chunks[c].slot = -1;
+
+    // divide block, every chunk is a separate engine run; while one chunk runs
+    // the next one is copied to another bounce buffer and queued behind it
+    while (unsended) {
+        chunk = &chunks[cur];
+        if ((chunk->slot >= 0) && dma_chunk_finish(client, id, direction, iter, chunk, flags)) {
+            result = CRIT_ERR;
+            break;
+        }
+
+        btt = (unsended < BUF_SIZE) ? unsended : BUF_SIZE;
+//        printk(KERN_INFO"%s: SG Block: BTT=%u\tunsended=%lu \n", DEVICE_NAME, btt, unsended);
+
+        if (xpdma_client_throttle(client, btt)) {
+            result = CRIT_ERR;
+            break;
+        }
+
+        chunk->slot = xpdma_bounce_get(id, dir);
+        if (chunk->slot < 0) {
+            result = CRIT_ERR;
+            break;
+        }
+        chunk->count = btt;
+
+        if (PCI_DMA_TODEVICE == direction)
+            if (xpdma_bounce_copy(id, direction, xpdmas[id].bounce[dir][chunk->slot], btt, iter)) {
+                printk(KERN_WARNING"%s: dma_block: Failed copy from user.\n", DEVICE_NAME);
+                result = CRIT_ERR;
+            }
+
+        if ((SUCCESS == result) && xpdma_sched_acquire(id, prio, client, btt))
+            result = CRIT_ERR;
+        else if (SUCCESS == result) {
+            if (!(flags & XPDMA_FLAG_SIMPLE)) {
+                seg.host = xpdmas[id].bounceHWAddr[dir][chunk->slot];
+                seg.ddr = curAddr;
+                seg.len = btt;
+                result = sg_submit(id, direction, &seg, 1, &chunk->run);
+            } else {
+                // simple mode has no chain: the ring must be empty
+                result = xpdma_ring_drain(id);
+                if (SUCCESS == result)
+                    result = simple_operation(id, direction, xpdmas[id].bounceHWAddr[dir][chunk->slot], btt, curAddr);
+                sg_complete(&chunk->run, direction, result);
+            }
+            xpdma_sched_release(id, prio, btt);
+        }
+
+        if (SUCCESS != result) {
+            xpdma_bounce_put(id, dir, chunk->slot);
+            chunk->slot = -1;
+            break;
+        }
+
+        curAddr += BUF_SIZE;
+        unsended -= btt;
+        cur = (cur + 1) % BOUNCE_SLOTS;
+    }
+
+    // chunks still in flight, oldest first
+    for (c = 0; c < BOUNCE_SLOTS; ++c, cur = (cur + 1) % BOUNCE_SLOTS)
+        if ((chunks[cur].slot >= 0) && dma_chunk_finish(client, id, direction, iter, &chunks[cur], flags))
+            result = CRIT_ERR;
+
+    return result;
+}
+
+/**
+ * Pinned user buffer (zero copy): pages are pinned and mapped for the board once,
+ * chain segments point straight at them instead of the bounce buffers.
+ * Registered buffers (IOCTL_REGISTER) are watched by an MMU interval notifier:
+ * once the user mapping goes away the pages no longer back the buffer and the
+ * handle only returns -ESTALE.
+ * Imported dma-bufs (IOCTL_IMPORTBUF) are registered buffers too: the exporter
+ * maps its attachment for the board and owns cache maintenance.
+ */
+struct xpdma_mr {
+    struct kref ref;
+    struct mmu_interval_notifier notifier;
+    bool notify;                    // notifier inserted
+    bool stale;                     // user mapping changed under the registration
+    bool write;                     // pinned writable (device may write the pages)
+    bool longterm;                  // FOLL_LONGTERM pin charged to pinned_vm (registrations)
+    enum dma_data_direction dir;
+    int id;                         // Board the pages are mapped for
+    u64 length;
+    struct page **pages;
+    unsigned long nrPages;
+    struct sg_table sgt;
+    struct mm_struct *mm;           // pinned_vm accounting
+    struct dma_buf *dmabuf;         // Imported dma-buf, NULL for pinned user pages
+    struct dma_buf_attachment *attach;
+    struct sg_table *mapped;        // Attachment mapping, copied to sgt
+};
+
+static bool xpdma_mr_invalidate(struct mmu_interval_notifier *mni, const struct mmu_notifier_range *range, unsigned long cur_seq)
+{
+    struct xpdma_mr *mr = container_of(mni, struct xpdma_mr, notifier);
+
+    // pinned pages don't move: protection changes (mprotect, fork COW) keep them valid
+    if ((range->event == MMU_NOTIFY_PROTECTION_VMA) || (range->event == MMU_NOTIFY_PROTECTION_PAGE) ||
+        (range->event == MMU_NOTIFY_SOFT_DIRTY))
+        return true;
+
+    WRITE_ONCE(mr->stale, true);
+    return true;
+}
+
+static const struct mmu_interval_notifier_ops xpdma_mr_ops = {
+    .invalidate = xpdma_mr_invalidate,
+};
+
+static void xpdma_mr_release(struct kref *ref)
+{
+    struct xpdma_mr *mr = container_of(ref, struct xpdma_mr, ref);
+
+    if (READ_ONCE(xpdmas[mr->id].wedged)) {
+        // the engine may still write the pages: leak them rather than free them under it
+        printk(KERN_ERR"%s: FPGA %d engine wedged, buffer of %llu bytes stays mapped\n", DEVICE_NAME, mr->id, mr->length);
+        return;
+    }
+
+    if (mr->dmabuf) {
+        if (mr->mapped)
+            dma_buf_unmap_attachment(mr->attach, mr->mapped, mr->dir);
+        if (mr->attach)
+            dma_buf_detach(mr->dmabuf, mr->attach);
+        dma_buf_put(mr->dmabuf);
+        kfree(mr);
+        return;
+    }
+
+    if (mr->notify)
+        mmu_interval_notifier_remove(&mr->notifier);
+    if (mr->sgt.sgl) {
+        dma_unmap_sgtable(&xpdmas[mr->id].dev->dev, &mr->sgt, mr->dir, 0);
+        sg_free_table(&mr->sgt);
+    }
+    unpin_user_pages_dirty_lock(mr->pages, mr->nrPages, mr->write);
+    if (mr->longterm)
+        atomic64_sub(mr->nrPages, &mr->mm->pinned_vm);
+    mmdrop(mr->mm);
+    kvfree(mr->pages);
+    kfree(mr);
+}
+
+static inline void xpdma_mr_put(struct xpdma_mr *mr)
+{
+    kref_put(&mr->ref, xpdma_mr_release);
+}
+
+/**
+ * Pin [data, data + length) of the calling process and map it for board 'id',
+ * 'write' if the device may write it. Registrations ('notify') pin long term
+ * and count against RLIMIT_MEMLOCK (pinned_vm) like RDMA memory regions,
+ * one-shot transfers pin only for the call.
+ */
+static struct xpdma_mr *xpdma_mr_create(int id, u64 data, u64 length, bool notify, bool write)
+{
+    struct xpdma_mr *mr;
+    u64 start = data & PAGE_MASK;
+    unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+    long pinned;
+    int result = -ENOMEM;
+
+    if ((length == 0) || (data + length < data) || !access_ok((void __user *)data, length))
+        return ERR_PTR(-EFAULT);
+
+    mr = kzalloc_node(sizeof(*mr), GFP_KERNEL, xpdma_node(id));
+    if (NULL == mr)
+        return ERR_PTR(-ENOMEM);
+
+    kref_init(&mr->ref);
+    mr->write = write;
+    mr->longterm = notify;
+    mr->dir = write ? DMA_BIDIRECTIONAL : DMA_TO_DEVICE;
+    mr->id = id;
+    mr->length = length;
+    mr->nrPages = (PAGE_ALIGN(data + length) - start) >> PAGE_SHIFT;
+    mr->mm = current->mm;
+    mmgrab(mr->mm);
+
+    if (mr->longterm && (atomic64_add_return(mr->nrPages, &mr->mm->pinned_vm) > limit) && !capable(CAP_IPC_LOCK)) {
+        atomic64_sub(mr->nrPages, &mr->mm->pinned_vm);
+        mmdrop(mr->mm);
+        kfree(mr);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    mr->pages = kvmalloc_array(mr->nrPages, sizeof(*mr->pages), GFP_KERNEL);
+    if (NULL == mr->pages) {
+        if (mr->longterm)
+            atomic64_sub(mr->nrPages, &mr->mm->pinned_vm);
+        mr->nrPages = 0;
+        goto fail;
+    }
+
+    pinned = pin_user_pages_fast(start, mr->nrPages, (write ? FOLL_WRITE : 0) | (mr->longterm ? FOLL_LONGTERM : 0), mr->pages);
+    if ((pinned < 0) || ((unsigned long)pinned != mr->nrPages)) {
+        // unpin what was pinned, the rest of pinned_vm goes back too
+        if (mr->longterm)
+            atomic64_sub(mr->nrPages - max(pinned, 0L), &mr->mm->pinned_vm);
+        mr->nrPages = max(pinned, 0L);
+        result = (pinned < 0) ? pinned : -EFAULT;
+        goto fail;
+    }
+
+    result = sg_alloc_table_from_pages(&mr->sgt, mr->pages, mr->nrPages, offset_in_page(data), length, GFP_KERNEL);
+    if (result)
+        goto fail;
+
+    result = dma_map_sgtable(&xpdmas[id].dev->dev, &mr->sgt, mr->dir, 0);
+    if (result) {
+        sg_free_table(&mr->sgt);
+        mr->sgt.sgl = NULL;
+        goto fail;
+    }
+
+    if (notify) {
+        result = mmu_interval_notifier_insert(&mr->notifier, current->mm, start, mr->nrPages << PAGE_SHIFT, &xpdma_mr_ops);
+        if (result)
+            goto fail;
+        mr->notify = true;
+    }
+
+    return mr;
+
+fail:
+    xpdma_mr_put(mr);
+    return ERR_PTR(result);
+}
+
+/**
+ * Transfer [offset, offset + count) of a pinned buffer, every run takes at most
+ * xpdma_sched_runMax bytes (BUF_SIZE by default, the same preemption points as
+ * dma_block) and segMax segments.
+ */
+static int xpdma_mr_transfer(struct xpdma_client *client, int direction, struct xpdma_mr *mr, u64 offset, size_t count, u32 addr, u32 flags)
+{
+    int id = mr->id;
+    struct device *dev = &xpdmas[id].dev->dev;
+    struct xpdma_seg *segs = xpdmas[id].segs;
+    struct scatterlist *sg = mr->sgt.sgl;
+    struct xpdma_run runs[2];       // one run is queued while the other one runs
+    size_t bytes[2] = { 0, 0 };     // bytes of a run in flight, 0 - none
+    int prio = xpdma_flagsToPrio(flags);
+    u64 sgOffset = offset;          // position inside the current sg entry
+    size_t btt;
+    size_t left;
+    dma_addr_t host;
+    u32 len;
+    int nsegs;
+    int result = SUCCESS;
+    int cur = 0;
+    int c;
+
+    if ((offset > mr->length) || (count > mr->length - offset) || ((addr % 4) != 0) ||
+        ((u64)addr + count > xpdma_ddrSize(id)))
+        return (CRIT_ERR);
+
+    if ((PCI_DMA_FROMDEVICE == direction) && !mr->write)
+        return (CRIT_ERR);
+
+    if (READ_ONCE(mr->stale))
+        return -ESTALE;
+
+    if (!count)
+        return (SUCCESS);
+
+    while (sgOffset >= sg_dma_len(sg)) {
+        sgOffset -= sg_dma_len(sg);
+        sg = sg_next(sg);
+    }
+
+    if ((PCI_DMA_TODEVICE == direction) && !mr->dmabuf)
+        dma_sync_sgtable_for_device(dev, &mr->sgt, mr->dir);
+
+    while (count) {
+        if (bytes[cur]) {
+            result = sg_wait(id, &runs[cur], flags);
+            if (SUCCESS != result)
+                break;
+            xpdma_client_account(client, direction, bytes[cur]);
+            bytes[cur] = 0;
+        }
+
+        btt = min_t(u64, count, xpdma_sched_runMax(id, prio));
+
+        if (xpdma_client_throttle(client, btt) || xpdma_sched_acquire(id, prio, client, btt)) {
+            result = CRIT_ERR;
+            break;
+        }
+
+        // segments must not cross a translation window
+        left = btt;
+        for (nsegs = 0; left && (nsegs < xpdmas[id].segMax); ++nsegs) {
+            host = sg_dma_address(sg) + sgOffset;
+            len = min_t(u64, sg_dma_len(sg) - sgOffset, left);
+            len = min_t(u64, len, xpdma_windowSize(id) - (host & (xpdma_windowSize(id) - 1)));
+            segs[nsegs].host = host;
+            segs[nsegs].ddr = addr;
+            segs[nsegs].len = len;
+            addr += len;
+            left -= len;
+            sgOffset += len;
+            if (sgOffset == sg_dma_len(sg)) {
+                sg = sg_next(sg);
+                sgOffset = 0;
+            }
+        }
+        btt -= left;
+
+        result = sg_submit(id, direction, segs, nsegs, &runs[cur]);
+        xpdma_sched_release(id, prio, btt);
+        if (SUCCESS != result)
+            break;
+        bytes[cur] = btt;
+
+        count -= btt;
+        cur ^= 1;
+    }
+
+    // runs still in flight, oldest first
+    for (c = 0; c < 2; ++c, cur ^= 1) {
+        if (!bytes[cur])
+            continue;
+        if (SUCCESS == sg_wait(id, &runs[cur], flags))
+            xpdma_client_account(client, direction, bytes[cur]);
+        else
+            result = CRIT_ERR;
+    }
+    if (SUCCESS != result)
+        return result;
+
+    if ((PCI_DMA_FROMDEVICE == direction) && !mr->dmabuf)
+        dma_sync_sgtable_for_cpu(dev, &mr->sgt, mr->dir);
+
+    return (SUCCESS);
+}
+
+// XPDMA_FLAG_ZERO_COPY without registration: pin and map for this call only
+static int xpdma_mr_oneshot(struct xpdma_client *client, int id, int direction, void *data, size_t count, u32 addr, u32 flags)
+{
+    struct xpdma_mr *mr;
+    int result;
+
+    if (!count)
+        return (SUCCESS);
+
+    mr = xpdma_mr_create(id, (u64)(uintptr_t)data, count, false, PCI_DMA_FROMDEVICE == direction);
+    if (IS_ERR(mr))
+        return PTR_ERR(mr);
+
+    result = xpdma_mr_transfer(client, direction, mr, 0, count, addr, flags);
+    xpdma_mr_put(mr);
+    return result;
+}
+
+static int xpdma_mr_register(struct xpdma_client *client, cdmaRegister_t *reg)
+{
+    struct xpdma_mr *mr;
+    int result;
+
+    if (reg->access & ~(XPDMA_ACCESS_SEND | XPDMA_ACCESS_RECV))
+        return -EINVAL;
+
+    // send only registrations pin read-only, const data and PROT_READ mappings work
+    mr = xpdma_mr_create(reg->id, reg->data, reg->length, true, !reg->access || (reg->access & XPDMA_ACCESS_RECV));
+    if (IS_ERR(mr))
+        return PTR_ERR(mr);
+
+    result = xa_alloc(&client->mrs, &reg->handle, mr, xa_limit_32b, GFP_KERNEL);
+    if (result)
+        xpdma_mr_put(mr);
+    return result;
+}
+
+// Attach a dma-buf of another driver (or exported by this one) to the board
+static int xpdma_mr_import(struct xpdma_client *client, cdmaDmaBuf_t *req)
+{
+    struct xpdma_mr *mr;
+    struct sg_table *sgt;
+    int result;
+
+    mr = kzalloc_node(sizeof(*mr), GFP_KERNEL, xpdma_node(req->id));
+    if (NULL == mr)
+        return -ENOMEM;
+
+    kref_init(&mr->ref);
+    mr->write = true;
+    mr->dir = DMA_BIDIRECTIONAL;
+    mr->id = req->id;
+
+    mr->dmabuf = dma_buf_get(req->fd);
+    if (IS_ERR(mr->dmabuf)) {
+        result = PTR_ERR(mr->dmabuf);
+        kfree(mr);
+        return result;
+    }
+    mr->length = mr->dmabuf->size;
+
+    mr->attach = dma_buf_attach(mr->dmabuf, &xpdmas[req->id].dev->dev);
+    if (IS_ERR(mr->attach)) {
+        result = PTR_ERR(mr->attach);
+        mr->attach = NULL;
+        goto fail;
+    }
+
+    sgt = dma_buf_map_attachment(mr->attach, mr->dir);
+    if (IS_ERR(sgt)) {
+        result = PTR_ERR(sgt);
+        goto fail;
+    }
+    mr->mapped = sgt;
+    mr->sgt = *sgt;
+
+    result = xa_alloc(&client->mrs, &req->handle, mr, xa_limit_32b, GFP_KERNEL);
+    if (result)
+        goto fail;
+    req->length = mr->length;
+    return (SUCCESS);
+
+fail:
+    xpdma_mr_put(mr);
+    return result;
+}
+
+static int xpdma_mr_unregister(struct xpdma_client *client, u32 handle)
+{
+    struct xpdma_mr *mr = xa_erase(&client->mrs, handle);
+
+    if (NULL == mr)
+        return (CRIT_ERR);
+
+    // a transfer still running on it holds its own reference
+    xpdma_mr_put(mr);
+    return (SUCCESS);
+}
+
+static struct xpdma_mr *xpdma_mr_get(struct xpdma_client *client, u32 handle)
+{
+    struct xpdma_mr *mr;
+
+    xa_lock(&client->mrs);
+    mr = xa_load(&client->mrs, handle);
+    if (mr)
+        kref_get(&mr->ref);
+    xa_unlock(&client->mrs);
+    return mr;
+}
+
+static int xpdma_mr_ioctl(struct xpdma_client *client, int direction, const cdmaRegBuffer_t *buffer)
+{
+    struct xpdma_mr *mr = xpdma_mr_get(client, buffer->handle);
+    int result;
+
+    if (NULL == mr)
+        return (CRIT_ERR);
+
+    result = xpdma_mr_transfer(client, direction, mr, buffer->offset, buffer->count, buffer->addr, buffer->flags);
+    xpdma_mr_put(mr);
+    return result;
+}
+
+/**
+ * dma-buf exporter: host pages on the board NUMA node shared with other drivers
+ * (NICs, capture cards) and mmap, each attachment gets its own mapping. The
+ * board itself uses a buffer by importing the descriptor like any other dma-buf.
+ */
+struct xpdma_dmabuf {
+    struct page **pages;
+    unsigned long nrPages;
+};
+
+static struct sg_table *xpdma_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir)
+{
+    struct xpdma_dmabuf *buf = attach->dmabuf->priv;
+    struct sg_table *sgt;
+    int result;
+
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (NULL == sgt)
+        return ERR_PTR(-ENOMEM);
+
+    result = sg_alloc_table_from_pages(sgt, buf->pages, buf->nrPages, 0, buf->nrPages << PAGE_SHIFT, GFP_KERNEL);
+    if (result) {
+        kfree(sgt);
+        return ERR_PTR(result);
+    }
+
+    result = dma_map_sgtable(attach->dev, sgt, dir, 0);
+    if (result) {
+        sg_free_table(sgt);
+        kfree(sgt);
+        return ERR_PTR(result);
+    }
+
+    return sgt;
+}
+
+static void xpdma_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt, enum dma_data_direction dir)
+{
+    dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static void xpdma_dmabuf_free(struct xpdma_dmabuf *buf)
+{
+    unsigned long c;
+
+    for (c = 0; c < buf->nrPages; ++c)
+        __free_page(buf->pages[c]);
+    kvfree(buf->pages);
+    kfree(buf);
+}
+
+static void xpdma_dmabuf_release(struct dma_buf *dmabuf)
+{
+    xpdma_dmabuf_free(dmabuf->priv);
+}
+
+static int xpdma_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct xpdma_dmabuf *buf = dmabuf->priv;
+    unsigned long addr = vma->vm_start;
+    unsigned long c;
+    int result;
+
+    // the whole mapping must be backed by the buffer
+    if ((vma->vm_pgoff > buf->nrPages) || (vma_pages(vma) > buf->nrPages - vma->vm_pgoff))
+        return -EINVAL;
+
+    for (c = vma->vm_pgoff; addr < vma->vm_end; ++c, addr += PAGE_SIZE) {
+        result = vm_insert_page(vma, addr, buf->pages[c]);
+        if (result)
+            return result;
+    }
+
+    return (SUCCESS);
+}
+
+static const struct dma_buf_ops xpdma_dmabuf_ops = {
+    .map_dma_buf    = xpdma_dmabuf_map,
+    .unmap_dma_buf  = xpdma_dmabuf_unmap,
+    .release        = xpdma_dmabuf_release,
+    .mmap           = xpdma_dmabuf_mmap,
+};
+
+static int xpdma_dmabuf_export(cdmaDmaBuf_t *req)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(info);
+    struct xpdma_dmabuf *buf;
+    struct dma_buf *dmabuf;
+    unsigned long c;
+    int fd;
+
+    if ((req->length == 0) || (req->length > dmabuf_max))
+        return -EINVAL;
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (NULL == buf)
+        return -ENOMEM;
+
+    buf->pages = kvmalloc_array(PAGE_ALIGN(req->length) >> PAGE_SHIFT, sizeof(*buf->pages), GFP_KERNEL);
+    if (NULL == buf->pages) {
+        kfree(buf);
+        return -ENOMEM;
+    }
+
+    for (c = 0; c < PAGE_ALIGN(req->length) >> PAGE_SHIFT; ++c) {
+        buf->pages[c] = alloc_pages_node(xpdma_node(req->id), GFP_KERNEL | __GFP_ZERO, 0);
+        if (NULL == buf->pages[c])
+            break;
+        buf->nrPages++;
+    }
+
+    if (buf->nrPages != PAGE_ALIGN(req->length) >> PAGE_SHIFT) {
+        xpdma_dmabuf_free(buf);
+        return -ENOMEM;
+    }
+
+    info.ops = &xpdma_dmabuf_ops;
+    info.size = buf->nrPages << PAGE_SHIFT;
+    info.flags = O_RDWR;
+    info.priv = buf;
+
+    dmabuf = dma_buf_export(&info);
+    if (IS_ERR(dmabuf)) {
+        xpdma_dmabuf_free(buf);
+        return PTR_ERR(dmabuf);
+    }
+
+    fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+    if (fd < 0) {
+        // frees the pages through xpdma_dmabuf_release
+        dma_buf_put(dmabuf);
+        return fd;
+    }
+
+    req->fd = fd;
+    req->length = info.size;
+    return (SUCCESS);
+}
+
+/**
+ * DDR3 allocator: binary buddy over [ddrBase, ddrBase + ddrSize) so clients
+ * sharing a board get disjoint regions instead of planning fixed addresses.
+ * Blocks are 4 KB .. 4 GB, aligned to their size in DDR3 address space; a free
+ * block is a bit in the map of its order, found with find_first_bit and
+ * merged with its buddy when both are free. Regions belong to the file that
+ * allocated them and go back when it is closed.
+ */
+struct xpdma_ddr_region {
+    int id;
+    u64 addr;
+    u64 length;             // requested
+    unsigned int order;
+};
+
+static inline u64 xpdma_ddr_blockSize(unsigned int order)
+{
+    return (u64)1 << (DDR_ALLOC_SHIFT + order);
+}
+
+static void xpdma_ddr_setFree(int id, u64 addr, unsigned int order)
+{
+    set_bit(addr >> (DDR_ALLOC_SHIFT + order), xpdmas[id].ddrMap[order]);
+    xpdmas[id].ddrNrFree[order]++;
+}
+
+static void xpdma_ddr_exit(int id)
+{
+    unsigned int order;
+
+    for (order = 0; order < DDR_ORDERS; ++order) {
+        kvfree(xpdmas[id].ddrMap[order]);
+        xpdmas[id].ddrMap[order] = NULL;
+        xpdmas[id].ddrNrFree[order] = 0;
+    }
+    xpdmas[id].ddrSize = 0;
+}
+
+/**
+ * Managed range from ddr_alloc_base/ddr_alloc_size inside the DDR3 of the board
+ * (xpdma_ddrSize, never the PCIe windows and BRAM above it), seeded with the
+ * largest aligned blocks that fit
+ */
+static void xpdma_ddr_init(int id)
+{
+    u64 end = xpdma_ddrSize(id);
+    u64 base = ALIGN((u64)ddr_alloc_base, xpdma_ddr_blockSize(0));
+    u64 addr;
+    unsigned int order;
+
+    if (ddr_alloc_size && (base + ddr_alloc_size < end))
+        end = base + ddr_alloc_size;
+    end &= ~(xpdma_ddr_blockSize(0) - 1);
+    if (base >= end) {
+        printk(KERN_WARNING"%s: DDR allocator: empty range, board %d\n", DEVICE_NAME, id);
+        return;
+    }
+
+    for (order = 0; order < DDR_ORDERS; ++order) {
+        xpdmas[id].ddrBits[order] = (unsigned long)DIV_ROUND_UP_ULL(end, xpdma_ddr_blockSize(order));
+        xpdmas[id].ddrMap[order] = kvzalloc(BITS_TO_LONGS(xpdmas[id].ddrBits[order]) * sizeof(unsigned long), GFP_KERNEL);
+        if (NULL == xpdmas[id].ddrMap[order]) {
+            printk(KERN_WARNING"%s: DDR allocator: no memory for the block maps, board %d\n", DEVICE_NAME, id);
+            xpdma_ddr_exit(id);
+            return;
+        }
+    }
+
+    for (addr = base; addr < end; addr += xpdma_ddr_blockSize(order)) {
+        order = DDR_ORDERS - 1;
+        while ((addr & (xpdma_ddr_blockSize(order) - 1)) || (addr + xpdma_ddr_blockSize(order) > end))
+            order--;
+        xpdma_ddr_setFree(id, addr, order);
+    }
+
+    xpdmas[id].ddrBase = base;
+    xpdmas[id].ddrSize = end - base;
+    printk(KERN_INFO"%s: DDR allocator: 0x%llX bytes from 0x%llX, board %d\n", DEVICE_NAME, end - base, base, id);
+}
+
+/**
+ * Block back to the allocator, merged with its free buddies
+ */
+static void xpdma_ddr_put(struct xpdma_ddr_region *region)
+{
+    struct xpdma_state *st = &xpdmas[region->id];
+    unsigned int order = region->order;
+    u64 addr = region->addr;
+    unsigned long buddy;
+
+    mutex_lock(&st->ddrLock);
+    st->ddrUsed -= xpdma_ddr_blockSize(order);
+    st->ddrRequested -= region->length;
+    st->ddrRegions--;
+
+    while (order < DDR_ORDERS - 1) {
+        buddy = (addr ^ xpdma_ddr_blockSize(order)) >> (DDR_ALLOC_SHIFT + order);
+        if ((buddy >= st->ddrBits[order]) || !test_bit(buddy, st->ddrMap[order]))
+            break;
+        clear_bit(buddy, st->ddrMap[order]);
+        st->ddrNrFree[order]--;
+        addr &= ~xpdma_ddr_blockSize(order);
+        order++;
+    }
+    xpdma_ddr_setFree(region->id, addr, order);
+    mutex_unlock(&st->ddrLock);
+
+    kfree(region);
+}
+
+static int xpdma_ddr_alloc(struct xpdma_client *client, cdmaDdrAlloc_t *req)
+{
+    struct xpdma_state *st = &xpdmas[req->id];
+    struct xpdma_ddr_region *region;
+    unsigned int order = 0;
+    unsigned int j;
+    unsigned long n;
+    u64 addr;
+    u64 need;
+    int result;
+
+    if ((0 == req->length) || (req->align & (req->align - 1)))
+        return -EINVAL;
+
+    // blocks are aligned to their size: alignment is a block size too
+    need = max_t(u64, req->length, req->align);
+    while ((order < DDR_ORDERS) && (xpdma_ddr_blockSize(order) < need))
+        order++;
+    if (order == DDR_ORDERS)
+        return -ENOMEM;
+
+    region = kzalloc(sizeof(*region), GFP_KERNEL);
+    if (NULL == region)
+        return -ENOMEM;
+
+    mutex_lock(&st->ddrLock);
+    for (j = order; (j < DDR_ORDERS) && !st->ddrNrFree[j]; ++j)
+        ;
+    if ((0 == st->ddrSize) || (j == DDR_ORDERS)) {
+        mutex_unlock(&st->ddrLock);
+        kfree(region);
+        return -ENOMEM;
+    }
+
+    n = find_first_bit(st->ddrMap[j], st->ddrBits[j]);
+    clear_bit(n, st->ddrMap[j]);
+    st->ddrNrFree[j]--;
+    addr = (u64)n << (DDR_ALLOC_SHIFT + j);
+
+    // split down to the order asked for, upper halves stay free
+    while (j > order) {
+        j--;
+        xpdma_ddr_setFree(req->id, addr + xpdma_ddr_blockSize(j), j);
+    }
+
+    st->ddrUsed += xpdma_ddr_blockSize(order);
+    st->ddrRequested += req->length;
+    st->ddrRegions++;
+    mutex_unlock(&st->ddrLock);
+
+    region->id = req->id;
+    region->addr = addr;
+    region->length = req->length;
+    region->order = order;
+
+    result = xa_alloc(&client->ddrs, &req->handle, region, xa_limit_32b, GFP_KERNEL);
+    if (result) {
+        xpdma_ddr_put(region);
+        return result;
+    }
+
+    spin_lock(&client->lock);
+    client->stats.ddrBytes += xpdma_ddr_blockSize(order);
+    spin_unlock(&client->lock);
+
+    req->addr = addr;
+    return (SUCCESS);
+}
+
+static int xpdma_ddr_free(struct xpdma_client *client, u32 handle)
+{
+    struct xpdma_ddr_region *region = xa_erase(&client->ddrs, handle);
+
+    if (NULL == region)
+        return -EINVAL;
+
+    spin_lock(&client->lock);
+    client->stats.ddrBytes -= xpdma_ddr_blockSize(region->order);
+    spin_unlock(&client->lock);
+
+    xpdma_ddr_put(region);
+    return (SUCCESS);
+}
+
+/**
+ * Usage and fragmentation: free bytes against the largest free block
+ */
+static void xpdma_ddr_getStats(int id, cdmaDdrStats_t *stats)
+{
+    struct xpdma_state *st = &xpdmas[id];
+    unsigned int order;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->id = id;
+
+    mutex_lock(&st->ddrLock);
+    stats->base = st->ddrBase;
+    stats->size = st->ddrSize;
+    stats->used = st->ddrUsed;
+    stats->requested = st->ddrRequested;
+    stats->free = st->ddrSize - st->ddrUsed;
+    stats->regions = st->ddrRegions;
+    for (order = 0; order < DDR_ORDERS; ++order) {
+        stats->freeBlocks += st->ddrNrFree[order];
+        if (st->ddrNrFree[order])
+            stats->largestFree = xpdma_ddr_blockSize(order);
+    }
+    mutex_unlock(&st->ddrLock);
+}
+
+/**
+ * User logic interrupts: the design raises MSI vectors (INTX_MSI_Request of the
+ * AXI PCIe bridge), the handler counts them and wakes waiters. A process waits
+ * with poll()/read() on a file descriptor from IOCTL_IRQOPEN (read() of
+ * /dev/xpdma is DDR3 I/O, so events get their own file) or has an eventfd
+ * signalled, e.g. to join an existing epoll loop.
+ */
+struct xpdma_irq_file {
+    int id;
+    u32 mask;
+    spinlock_t lock;                // seen
+    u64 seen[XPDMA_IRQ_MAX];        // counts returned by the previous read
+};
+
+struct xpdma_irq_eventfd {
+    struct list_head node;          // irqEventfds entry
+    struct xpdma_client *client;
+    u32 vector;
+    struct eventfd_ctx *ctx;
+};
+
+static irqreturn_t xpdma_irq_handler(int irq, void *data)
+{
+    struct xpdma_irq_vector *vec = data;
+    struct xpdma_state *st = &xpdmas[vec->id];
+    struct xpdma_irq_eventfd *entry;
+
+    atomic64_inc(&vec->count);
+
+    spin_lock(&st->irqLock);
+    list_for_each_entry(entry, &st->irqEventfds, node) {
+        if (entry->vector == vec->vector)
+            eventfd_signal(entry->ctx, 1);
+    }
+    spin_unlock(&st->irqLock);
+
+    wake_up_interruptible_all(&st->irqWait);
+    return IRQ_HANDLED;
+}
+
+/**
+ * MSI vectors for the user interrupt lines, the host may grant fewer than
+ * requested (lines then share vectors). No vectors is not an error: the board
+ * works without user interrupts.
+ */
+static void xpdma_irq_init(int id)
+{
+    struct pci_dev *dev = xpdmas[id].dev;
+    int vectors;
+    int v;
+
+    xpdmas[id].irqVectors = 0;
+    if (0 == user_irqs)
+        return;
+
+    vectors = pci_alloc_irq_vectors(dev, 1, min_t(uint, user_irqs, XPDMA_IRQ_MAX), PCI_IRQ_MSI);
+    if (vectors < 0) {
+        printk(KERN_WARNING"%s: irq: no MSI vectors (%d), user interrupts disabled, board %d\n", DEVICE_NAME, vectors, id);
+        return;
+    }
+
+    for (v = 0; v < vectors; ++v) {
+        if (request_irq(pci_irq_vector(dev, v), xpdma_irq_handler, 0, DEVICE_NAME, &xpdmas[id].irqVec[v])) {
+            printk(KERN_WARNING"%s: irq: vector %d not requested, board %d\n", DEVICE_NAME, v, id);
+            break;
+        }
+    }
+    if (v < vectors) {
+        while (v--)
+            free_irq(pci_irq_vector(dev, v), &xpdmas[id].irqVec[v]);
+        pci_free_irq_vectors(dev);
+        return;
+    }
+
+    xpdmas[id].irqVectors = vectors;
+    printk(KERN_INFO"%s: irq: %d MSI vectors for user interrupts, board %d\n", DEVICE_NAME, vectors, id);
+}
+
+static void xpdma_irq_exit(int id)
+{
+    u32 v;
+
+    for (v = 0; v < xpdmas[id].irqVectors; ++v)
+        free_irq(pci_irq_vector(xpdmas[id].dev, v), &xpdmas[id].irqVec[v]);
+    if (xpdmas[id].irqVectors)
+        pci_free_irq_vectors(xpdmas[id].dev);
+    xpdmas[id].irqVectors = 0;
+}
+
+// Vectors of the file that fired since its previous read
+static u32 xpdma_irq_pending(struct xpdma_irq_file *file)
+{
+    u32 fired = 0;
+    u32 v;
+
+    spin_lock(&file->lock);
+    for (v = 0; v < xpdmas[file->id].irqVectors; ++v) {
+        if ((file->mask & BIT(v)) && (atomic64_read(&xpdmas[file->id].irqVec[v].count) != file->seen[v]))
+            fired |= BIT(v);
+    }
+    spin_unlock(&file->lock);
+
+    return fired;
+}
+
+static ssize_t xpdma_irq_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct xpdma_irq_file *file = filp->private_data;
+    cdmaIrqEvents_t events;
+    int result;
+    u32 v;
+
+    if (count < sizeof(events))
+        return -EINVAL;
+
+    if (!xpdma_irq_pending(file)) {
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        result = wait_event_interruptible(xpdmas[file->id].irqWait, xpdma_irq_pending(file));
+        if (result)
+            return result;
+    }
+
+    memset(&events, 0, sizeof(events));
+    spin_lock(&file->lock);
+    for (v = 0; v < xpdmas[file->id].irqVectors; ++v) {
+        events.count[v] = atomic64_read(&xpdmas[file->id].irqVec[v].count);
+        if ((file->mask & BIT(v)) && (events.count[v] != file->seen[v]))
+            events.fired |= BIT(v);
+        file->seen[v] = events.count[v];
+    }
+    spin_unlock(&file->lock);
+
+    if (copy_to_user(buf, &events, sizeof(events)))
+        return -EFAULT;
+    return sizeof(events);
+}
+
+static __poll_t xpdma_irq_poll(struct file *filp, poll_table *wait)
+{
+    struct xpdma_irq_file *file = filp->private_data;
+
+    poll_wait(filp, &xpdmas[file->id].irqWait, wait);
+    return xpdma_irq_pending(file) ? (EPOLLIN | EPOLLRDNORM) : 0;
+}
+
+static int xpdma_irq_fileRelease(struct inode *inode, struct file *filp)
+{
+    kfree(filp->private_data);
+    return 0;
+}
+
+static const struct file_operations xpdma_irq_fops = {
+    .owner   = THIS_MODULE,
+    .read    = xpdma_irq_read,
+    .poll    = xpdma_irq_poll,
+    .release = xpdma_irq_fileRelease,
+    .llseek  = noop_llseek,
+};
+
+/**
+ * Events of 'mask' vectors after the call (earlier interrupts are not reported)
+ */
+static int xpdma_irq_open(cdmaIrqOpen_t *req)
+{
+    struct xpdma_irq_file *file;
+    u32 v;
+    int fd;
+
+    if ((0 == xpdmas[req->id].irqVectors) || (0 == (req->mask & (BIT(xpdmas[req->id].irqVectors) - 1))))
+        return -ENODEV;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (NULL == file)
+        return -ENOMEM;
+    file->id = req->id;
+    file->mask = req->mask;
+    spin_lock_init(&file->lock);
+    for (v = 0; v < xpdmas[req->id].irqVectors; ++v)
+        file->seen[v] = atomic64_read(&xpdmas[req->id].irqVec[v].count);
+
+    fd = anon_inode_getfd("xpdma-irq", &xpdma_irq_fops, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        kfree(file);
+    return fd;
+}
+
+static int xpdma_irq_eventfd(struct xpdma_client *client, const cdmaIrqEventfd_t *req)
+{
+    struct xpdma_state *st = &xpdmas[req->id];
+    struct xpdma_irq_eventfd *entry;
+    struct xpdma_irq_eventfd *next;
+    struct eventfd_ctx *ctx;
+    unsigned long flags;
+    LIST_HEAD(removed);
+
+    if (req->vector >= st->irqVectors)
+        return -EINVAL;
+
+    if (req->fd < 0) {
+        spin_lock_irqsave(&st->irqLock, flags);
+        list_for_each_entry_safe(entry, next, &st->irqEventfds, node) {
+            if ((entry->client == client) && (entry->vector == req->vector))
+                list_move(&entry->node, &removed);
+        }
+        spin_unlock_irqrestore(&st->irqLock, flags);
+
+        list_for_each_entry_safe(entry, next, &removed, node) {
+            eventfd_ctx_put(entry->ctx);
+            kfree(entry);
+        }
+        return (SUCCESS);
+    }
+
+    ctx = eventfd_ctx_fdget(req->fd);
+    if (IS_ERR(ctx))
+        return PTR_ERR(ctx);
+
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    if (NULL == entry) {
+        eventfd_ctx_put(ctx);
+        return -ENOMEM;
+    }
+    entry->client = client;
+    entry->vector = req->vector;
+    entry->ctx = ctx;
+
+    spin_lock_irqsave(&st->irqLock, flags);
+    list_add_tail(&entry->node, &st->irqEventfds);
+    spin_unlock_irqrestore(&st->irqLock, flags);
+
+    return (SUCCESS);
+}
+
+// eventfds registered through a closing file
+static void xpdma_irq_release(struct xpdma_client *client)
+{
+    struct xpdma_irq_eventfd *entry;
+    struct xpdma_irq_eventfd *next;
+    unsigned long flags;
+    LIST_HEAD(removed);
+    int id;
+
+    for (id = 0; id < XPDMA_NUM_MAX; ++id) {
+        spin_lock_irqsave(&xpdmas[id].irqLock, flags);
+        list_for_each_entry_safe(entry, next, &xpdmas[id].irqEventfds, node) {
+            if (entry->client == client)
+                list_move(&entry->node, &removed);
+        }
+        spin_unlock_irqrestore(&xpdmas[id].irqLock, flags);
+    }
+
+    list_for_each_entry_safe(entry, next, &removed, node) {
+        eventfd_ctx_put(entry->ctx);
+        kfree(entry);
+    }
+}
+
+static void xpdma_irq_getStats(int id, cdmaIrqStats_t *stats)
+{
+    u32 v;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->id = id;
+    stats->vectors = xpdmas[id].irqVectors;
+    for (v = 0; v < stats->vectors; ++v)
+        stats->count[v] = atomic64_read(&xpdmas[id].irqVec[v].count);
+}
+
+/**
+ * Peer to peer: the engine of the source board reads its DDR3 and writes the
+ * DDR3 window (BAR2) of the destination board through the AXIBAR1 translation,
+ * the data never reaches host memory. The window is mapped for the source board
+ * once (dma_map_resource, so an IOMMU sees it) when the PCI topology allows the
+ * two boards to talk (pci_p2pdma_distance_many).
+ * Returns the peer window bus address, 0 if peer to peer is not possible.
+ */
+static dma_addr_t xpdma_p2p_window(int src, int dst)
+{
+    struct device *client = &xpdmas[src].dev->dev;
+    dma_addr_t addr;
+
+    if (!xpdmas[dst].pioLen)
+        return 0;
+
+    mutex_lock(&xpdmas[src].p2pLock);
+    if (!xpdmas[src].p2pState[dst]) {
+        xpdmas[src].p2pState[dst] = -1;
+        if (pci_p2pdma_distance_many(xpdmas[dst].dev, &client, 1, true) < 0) {
+            printk(KERN_INFO"%s: P2P: board %d can't reach board %d, staged copies\n", DEVICE_NAME, src, dst);
+        } else {
+            addr = dma_map_resource(client, xpdmas[dst].pioHdwr, xpdmas[dst].pioLen, DMA_BIDIRECTIONAL, 0);
+            if (dma_mapping_error(client, addr)) {
+                printk(KERN_WARNING"%s: P2P: board %d window not mapped for board %d\n", DEVICE_NAME, dst, src);
+            } else {
+                xpdmas[src].p2pAddr[dst] = addr;
+                xpdmas[src].p2pState[dst] = 1;
+                printk(KERN_INFO"%s: P2P: board %d -> board %d through 0x%llX\n", DEVICE_NAME, src, dst, (u64)addr);
+            }
+        }
+    }
+    addr = xpdmas[src].p2pAddr[dst];
+    mutex_unlock(&xpdmas[src].p2pLock);
+
+    return addr;
+}
+
+/**
+ * Copy between the DDR3 of two boards, runs of at most BUF_SIZE bytes (same
+ * preemption points as dma_block) with one queued while the other one runs.
+ * -EOPNOTSUPP when peer to peer is not possible: the caller stages the copy.
+ */
+static int xpdma_p2p_copy(struct xpdma_client *client, const cdmaCopy_t *copy)
+{
+    int id = copy->srcId;
+    struct xpdma_seg *segs;
+    struct xpdma_run runs[2];       // one run is queued while the other one runs
+    size_t bytes[2] = { 0, 0 };     // bytes of a run in flight, 0 - none
+    int prio = xpdma_flagsToPrio(copy->flags);
+    u64 count = copy->count;
+    u32 addr = copy->srcAddr;
+    u64 srcSize;
+    u64 dstSize;
+    dma_addr_t host;
+    size_t btt;
+    size_t left;
+    u32 len;
+    int nsegs;
+    int result = SUCCESS;
+    int cur = 0;
+    int c;
+
+    if (!xpdma_isValidId(copy->srcId) || !xpdma_isValidId(copy->dstId) || (copy->srcId == copy->dstId))
+        return (CRIT_ERR);
+
+    // the destination is written through its BAR window, ddr_size may exceed it
+    srcSize = xpdma_ddrSize(copy->srcId);
+    dstSize = min_t(u64, xpdma_ddrSize(copy->dstId), xpdmas[copy->dstId].pioLen);
+    if ((copy->srcAddr % 4) || (copy->dstAddr % 4) || !count ||
+        (count > srcSize) || (copy->srcAddr > srcSize - count) ||
+        (count > dstSize) || (copy->dstAddr > dstSize - count))
+        return (CRIT_ERR);
+
+    host = xpdma_p2p_window(copy->srcId, copy->dstId);
+    if (!host)
+        return -EOPNOTSUPP;
+    host += copy->dstAddr;
+
+    while (count) {
+        if (bytes[cur]) {
+            result = sg_wait(id, &runs[cur], copy->flags);
+            if (SUCCESS != result)
+                break;
+            xpdma_client_account(client, PCI_DMA_FROMDEVICE, bytes[cur]);
+            bytes[cur] = 0;
+        }
+
+        btt = (count < BUF_SIZE) ? count : BUF_SIZE;
+
+        if (xpdma_client_throttle(client, btt) || xpdma_sched_acquire(id, prio, client, btt)) {
+            result = CRIT_ERR;
+            break;
+        }
+
+        // segments must not cross a translation window
+        segs = xpdmas[id].segs;
+        left = btt;
+        for (nsegs = 0; left && (nsegs < xpdmas[id].segMax); ++nsegs) {
+            len = min_t(u64, left, xpdma_windowSize(id) - (host & (xpdma_windowSize(id) - 1)));
+            segs[nsegs].host = host;
+            segs[nsegs].ddr = addr;
+            segs[nsegs].len = len;
+            host += len;
+            addr += len;
+            left -= len;
+        }
+        btt -= left;
+
+        // the peer window is the "host" side of a receive
+        result = sg_submit(id, PCI_DMA_FROMDEVICE, segs, nsegs, &runs[cur]);
+        xpdma_sched_release(id, prio, btt);
+        if (SUCCESS != result)
+            break;
+        bytes[cur] = btt;
+
+        count -= btt;
+        cur ^= 1;
+    }
+
+    // runs still in flight, oldest first
+    for (c = 0; c < 2; ++c, cur ^= 1) {
+        if (!bytes[cur])
+            continue;
+        if (SUCCESS == sg_wait(id, &runs[cur], copy->flags))
+            xpdma_client_account(client, PCI_DMA_FROMDEVICE, bytes[cur]);
+        else
+            result = CRIT_ERR;
+    }
+
+    return result;
+}
+
+ssize_t xpdma_send (struct xpdma_client *client, int id, void *data, size_t count, u32 addr, u32 flags)
+{
+    struct iovec iov;
+    struct iov_iter iter;
+
+    if (!xpdmas[id].used) {
+        printk(KERN_WARNING"%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
+        return (CRIT_ERR);
+    }
+
+    if (xpdma_usePio(id, PCI_DMA_TODEVICE, count, addr, flags))
+        return pio_operation(client, id, PCI_DMA_TODEVICE, data, count, addr, flags);
+
+    if (flags & XPDMA_FLAG_ZERO_COPY)
+        return xpdma_mr_oneshot(client, id, PCI_DMA_TODEVICE, data, count, addr, flags);
+
+    if (import_single_range(WRITE, (void __user *)data, count, &iov, &iter))
+        return (CRIT_ERR);
+    return dma_block(client, id, PCI_DMA_TODEVICE, &iter, addr, flags);
+}
+
+ssize_t xpdma_recv (struct xpdma_client *client, int id, void *data, size_t count, u32 addr, u32 flags)
+{
+    struct iovec iov;
+    struct iov_iter iter;
+
+    if (!xpdmas[id].used) {
+        printk(KERN_WARNING"%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
+        return (CRIT_ERR);
+    }
+
+    if (xpdma_usePio(id, PCI_DMA_FROMDEVICE, count, addr, flags))
+        return pio_operation(client, id, PCI_DMA_FROMDEVICE, data, count, addr, flags);
+
+    if (flags & XPDMA_FLAG_ZERO_COPY)
+        return xpdma_mr_oneshot(client, id, PCI_DMA_FROMDEVICE, data, count, addr, flags);
+
+    if (import_single_range(READ, (void __user *)data, count, &iov, &iter))
+        return (CRIT_ERR);
+    return dma_block(client, id, PCI_DMA_FROMDEVICE, &iter, addr, flags);
+}
+
+static inline u32 xpdma_vcache_ddr(pgoff_t index)
 {
-    printk(KERN_INFO"%s: Open: module opened\n", DEVICE_NAME);
-    return (SUCCESS);
+    return (u32)((u64)index << PAGE_SHIFT);
 }
 
-static int xpdma_reset(int id)
+/**
+ * Faults of a task running a CDMA engine (send/receive from or to a DDR mapping)
+ * could wait for the engine they hold, or for a cache locked by a task waiting
+ * for it: refuse them.
+ */
+static bool xpdma_ownsEngine(void)
 {
-    int loop = CDMA_RESET_LOOP;
-    u32 tmp;
+    int id;
+    int dir;
+    int slot;
 
-    if (!xpdmas[id].used) {
-        printk(KERN_WARNING"%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
-        return (CRIT_ERR);
+    for (id = 0; id < XPDMA_NUM_MAX; ++id) {
+        if (READ_ONCE(xpdmas[id].sched.owner) == current)
+            return true;
+        // bounce buffers are taken before the engine, a fault could wait for our own buffer
+        for (dir = 0; dir < 2; ++dir)
+            for (slot = 0; slot < BOUNCE_SLOTS; ++slot)
+                if (READ_ONCE(xpdmas[id].ring.bounce[dir][slot]) == current)
+                    return true;
     }
+    return false;
+}
 
-    printk(KERN_INFO"%s: RESET CDMA\n", DEVICE_NAME);
-    //down(&gSemDma);
-    xpdma_writeReg(id, (CDMA_OFFSET + CDMA_CONTROL_OFFSET),
-                   xpdma_readReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET) | CDMA_CR_RESET_MASK);
+// Remove user mappings of a cached page, the next access faults again (cache->lock, mmap_lock held)
+static void xpdma_vcache_unmapPage(struct xpdma_vcache *cache, pgoff_t index)
+{
+    struct xpdma_vcache_vma *entry;
+    struct vm_area_struct *vma;
 
-    tmp = xpdma_readReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_RESET_MASK;
+    list_for_each_entry(entry, &cache->vmas, node) {
+        vma = entry->vma;
+        if ((index >= vma->vm_pgoff) && (index < vma->vm_pgoff + vma_pages(vma)))
+            zap_vma_ptes(vma, vma->vm_start + ((index - vma->vm_pgoff) << PAGE_SHIFT), PAGE_SIZE);
+    }
+}
 
-    /* Wait for the hardware to finish reset */
-    while (loop && tmp) {
-        tmp = xpdma_readReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_RESET_MASK;
-        loop--;
+/**
+ * Write 'n' pages of cache->batch to DDR3 in one chain run, DDR3 adjacent pages
+ * share a descriptor. On error the pages are marked dirty again.
+ */
+static int xpdma_vcache_writeBatch(struct xpdma_vcache *cache, unsigned int n)
+{
+    int id = cache->id;
+    struct xpdma_seg *segs = xpdmas[id].segs;
+    size_t bytes = (size_t)n << PAGE_SHIFT;
+    int nsegs = 0;
+    int result = CRIT_ERR;
+    int slot;
+    unsigned int c;
+    u32 ddr;
+
+    if (!n)
+        return (SUCCESS);
+
+    slot = xpdma_bounce_get(id, 0);
+    if ((slot >= 0) && !xpdma_client_throttle(cache->client, bytes) &&
+        !xpdma_sched_acquire(id, XPDMA_PRIO_NORMAL, cache->client, bytes)) {
+        for (c = 0; c < n; ++c) {
+            ddr = xpdma_vcache_ddr(cache->batch[c]->index);
+            memcpy(xpdmas[id].bounce[0][slot] + ((size_t)c << PAGE_SHIFT), page_address(cache->batch[c]), PAGE_SIZE);
+            if (nsegs && (segs[nsegs - 1].ddr + segs[nsegs - 1].len == ddr)) {
+                segs[nsegs - 1].len += PAGE_SIZE;
+                continue;
+            }
+            segs[nsegs].host = xpdmas[id].bounceHWAddr[0][slot] + ((size_t)c << PAGE_SHIFT);
+            segs[nsegs].ddr = ddr;
+            segs[nsegs].len = PAGE_SIZE;
+            nsegs++;
+        }
+        result = sg_run(id, PCI_DMA_TODEVICE, segs, nsegs, 0);
+        xpdma_sched_release(id, XPDMA_PRIO_NORMAL, bytes);
     }
+    if (slot >= 0)
+        xpdma_bounce_put(id, 0, slot);
 
-    if (!loop) {
-        printk(KERN_INFO"%s: reset timeout, CONTROL_REG: 0x%08X, STATUS_REG 0x%08X\n",
-                DEVICE_NAME,
-                xpdma_readReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET),
-                xpdma_readReg(id, CDMA_OFFSET + CDMA_STATUS_OFFSET));
-        return (CRIT_ERR);
+    if (SUCCESS != result) {
+        for (c = 0; c < n; ++c)
+            xa_set_mark(&cache->pages, cache->batch[c]->index, VCACHE_DIRTY);
+        return result;
     }
 
-    // For Axi CDMA, always do sg transfers if sg mode is built in
-    xpdma_writeReg(id, CDMA_OFFSET + CDMA_CONTROL_OFFSET, tmp | CDMA_CR_SG_EN);
+    xpdma_client_account(cache->client, PCI_DMA_TODEVICE, bytes);
+    return (SUCCESS);
+}
 
-    //up(&gSemDma);
+/**
+ * Write back dirty pages in [first, last] (cache->lock held). With 'unmap' the
+ * pages are unmapped first, so a write racing with the copy faults and dirties
+ * the page again (mmap_lock held); the last close passes false, nothing is mapped.
+ */
+static int xpdma_vcache_sync(struct xpdma_vcache *cache, pgoff_t first, pgoff_t last, bool unmap)
+{
+    unsigned long index = first;
+    unsigned int n = 0;
+    struct page *page;
+    int result = SUCCESS;
+
+    for (page = xa_find(&cache->pages, &index, last, VCACHE_DIRTY); page;
+         page = xa_find_after(&cache->pages, &index, last, VCACHE_DIRTY)) {
+        if (unmap)
+            xpdma_vcache_unmapPage(cache, index);
+        xa_clear_mark(&cache->pages, index, VCACHE_DIRTY);
+        cache->batch[n++] = page;
+        if (n == VCACHE_BATCH) {
+            if (xpdma_vcache_writeBatch(cache, n))
+                result = CRIT_ERR;
+            n = 0;
+        }
+    }
 
-    printk(KERN_INFO"%s: SUCCESSFULLY RESET CDMA!\n", DEVICE_NAME);
+    if (xpdma_vcache_writeBatch(cache, n))
+        result = CRIT_ERR;
+    return result;
+}
 
-    return (SUCCESS);
+static void xpdma_vcache_dropPage(struct xpdma_vcache *cache, struct page *page)
+{
+    xa_erase(&cache->pages, page->index);
+    __free_page(page);
+    cache->nrPages--;
+
+    spin_lock(&cache->client->lock);
+    cache->client->stats.mmapEvictions++;
+    spin_unlock(&cache->client->lock);
 }
 
-static int xpdma_isIdle(int id)
+// Free unmapped batch pages once written back, keep them cached on error
+static int xpdma_vcache_dropBatch(struct xpdma_vcache *cache, unsigned int n)
 {
-    if (!xpdmas[id].used) {
-        printk(KERN_WARNING"%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
-        return 0;
+    int result = xpdma_vcache_writeBatch(cache, n);
+    unsigned int c;
+
+    for (c = 0; c < n; ++c) {
+        if (SUCCESS == result)
+            xpdma_vcache_dropPage(cache, cache->batch[c]);
+        else
+            list_add_tail(&cache->batch[c]->lru, &cache->lru);
     }
-    return xpdma_readReg(id, CDMA_OFFSET + CDMA_STATUS_OFFSET) &
-           CDMA_CR_IDLE_MASK;
+    return result;
 }
 
-static int sg_operation(int id, int direction, size_t count, u32 addr)
+// Make room for 'need' pages: evict least recently faulted ones, dirty ones are written back
+static void xpdma_vcache_evict(struct xpdma_vcache *cache, unsigned int need)
 {
-    u32 status = 0;
-    size_t pntr = 0;
-    size_t delayTime = 0;
-    u32 countBuf = count;
-    size_t bramOffset = 0;
+    unsigned long limit = max_t(unsigned long, mmap_cache_pages, VCACHE_BATCH);
+    unsigned int n = 0;
+    struct page *page;
+
+    while ((cache->nrPages - n + need > limit) && !list_empty(&cache->lru)) {
+        page = list_first_entry(&cache->lru, struct page, lru);
+        list_del(&page->lru);
+        xpdma_vcache_unmapPage(cache, page->index);
+
+        if (!xa_get_mark(&cache->pages, page->index, VCACHE_DIRTY)) {
+            xpdma_vcache_dropPage(cache, page);
+            continue;
+        }
 
-    if (!xpdma_isIdle(id)){
-        printk(KERN_INFO"%s: CDMA is not idle\n", DEVICE_NAME);
-        xpdma_showInfo(id);
-        return (CRIT_ERR);
+        xa_clear_mark(&cache->pages, page->index, VCACHE_DIRTY);
+        cache->batch[n++] = page;
+        if (n == VCACHE_BATCH) {
+            if (xpdma_vcache_dropBatch(cache, n))
+                return;
+            n = 0;
+        }
     }
 
-    // 1. Set DMA to Scatter Gather Mode
-//    printk(KERN_INFO"%s: 1. Set DMA to Scatter Gather Mode\n", DEVICE_NAME);
-    xpdma_writeReg (id, CDMA_OFFSET + CDMA_CONTROL_OFFSET, CDMA_CR_SG_EN);
+    if (xpdma_vcache_dropBatch(cache, n))
+        printk(KERN_WARNING"%s: DDR mapping: write back of evicted pages failed\n", DEVICE_NAME);
+}
 
-    // 2. Create Descriptors chain
-//    printk(KERN_INFO"%s: 2. Create Descriptors chain\n", DEVICE_NAME);
-    create_desc_chain(id, direction, count, addr);
+/**
+ * Read the page at 'index' and the following ones (readahead) in one chain run
+ * (cache->lock held). The window doubles on sequential faults up to
+ * mmap_readahead_max and falls back to mmap_readahead on a random one.
+ */
+static struct page *xpdma_vcache_fill(struct xpdma_vcache *cache, struct vm_area_struct *vma, pgoff_t index)
+{
+    int id = cache->id;
+    pgoff_t end = vma->vm_pgoff + vma_pages(vma);
+    unsigned int raMax = clamp_t(uint, mmap_readahead_max, 1, VCACHE_BATCH);
+    unsigned int n;
+    unsigned int c;
+    struct xpdma_seg seg;
+    struct page *page;
+    int result = CRIT_ERR;
+    int slot;
 
-    // 3. Update PCIe Translation vector
-    pntr =  (size_t) (xpdmas[id].descChainHWAddr);
-//    printk(KERN_INFO"%s: 3. Update PCIe Translation vector\n", DEVICE_NAME);
-//    printk(KERN_INFO"%s: xpdmas[id].descChain 0x%016lX\n", DEVICE_NAME, pntr);
-    xpdma_writeReg (id, (PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_0L), (pntr >> 0)  & 0xFFFFFFFF); // Lower 32 bit
-    xpdma_writeReg (id, (PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_0U), (pntr >> 32) & 0xFFFFFFFF); // Upper 32 bit
+    if (index == cache->raNext)
+        cache->raPages = min(cache->raPages * 2, raMax);
+    else
+        cache->raPages = clamp_t(uint, mmap_readahead, 1, raMax);
 
-    // 4. Write appropriate Translation Vectors
-//    printk(KERN_INFO"%s: 4. Write Translation Vectors to BRAM\n", DEVICE_NAME);
-    if (PCI_DMA_FROMDEVICE == direction) {
-        pntr = (size_t)(xpdmas[id].readHWAddr);
-    } else if (PCI_DMA_TODEVICE == direction) {
-        pntr = (size_t)(xpdmas[id].writeHWAddr);
-    } else {
-        printk(KERN_INFO"%s: Write Translation Vectors to BRAM error: unknown direction\n", DEVICE_NAME);
-        return (CRIT_ERR);
-    }
+    n = min_t(pgoff_t, cache->raPages, end - index);
+    for (c = 1; c < n; ++c)
+        if (xa_load(&cache->pages, index + c))
+            break;
+    n = c;
 
-    countBuf = xpdmas[id].descChainLength;
-    while (countBuf) {
-//        printk(KERN_INFO"%s: pntr 0x%016lX\n", DEVICE_NAME, pntr);
-//        printk(KERN_INFO"%s: bramOffset 0x%016lX\n", DEVICE_NAME, bramOffset);
-//        printk(KERN_INFO"%s: countBuf 0x%08X\n", DEVICE_NAME, countBuf);
-        xpdma_writeReg (id, (BRAM_OFFSET + bramOffset + 4), (pntr >> 0 ) & 0xFFFFFFFF); // Lower 32 bit
-        xpdma_writeReg (id, (BRAM_OFFSET + bramOffset + 0), (pntr >> 32) & 0xFFFFFFFF); // Upper 32 bit
+    xpdma_vcache_evict(cache, n);
 
-        pntr += TRANSFER_SIZE;
-        bramOffset += BRAM_STEP;
-        countBuf--;
+    for (c = 0; c < n; ++c) {
+        cache->batch[c] = alloc_pages_node(xpdma_node(id), GFP_KERNEL, 0);
+        if (NULL == cache->batch[c])
+            break;
+        cache->batch[c]->index = index + c;
+    }
+    n = c;
+    if (!n)
+        return NULL;
+
+    seg.ddr = xpdma_vcache_ddr(index);
+    seg.len = n << PAGE_SHIFT;
+
+    slot = xpdma_bounce_get(id, 1);
+    if ((slot >= 0) && !xpdma_client_throttle(cache->client, seg.len) &&
+        !xpdma_sched_acquire(id, XPDMA_PRIO_NORMAL, cache->client, seg.len)) {
+        seg.host = xpdmas[id].bounceHWAddr[1][slot];
+        result = sg_run(id, PCI_DMA_FROMDEVICE, &seg, 1, 0);
+        xpdma_sched_release(id, XPDMA_PRIO_NORMAL, seg.len);
+        if (SUCCESS == result)
+            for (c = 0; c < n; ++c)
+                memcpy(page_address(cache->batch[c]), xpdmas[id].bounce[1][slot] + ((size_t)c << PAGE_SHIFT), PAGE_SIZE);
+    }
+    if (slot >= 0)
+        xpdma_bounce_put(id, 1, slot);
+
+    for (c = 0; c < n; ++c) {
+        page = cache->batch[c];
+        if ((SUCCESS != result) || xa_is_err(xa_store(&cache->pages, page->index, page, GFP_KERNEL))) {
+            __free_page(page);
+            continue;
+        }
+        list_add_tail(&page->lru, &cache->lru);
+        cache->nrPages++;
     }
 
-    // 5. Write a valid pointer to DMA CURDESC_PNTR
-//    printk(KERN_INFO"%s: 5. Write a valid pointer to DMA CURDESC_PNTR\n", DEVICE_NAME);
-    xpdma_writeReg (id, (CDMA_OFFSET + CDMA_CDESC_OFFSET), (AXI_PCIE_SG_ADDR));
+    if (SUCCESS != result)
+        return NULL;
 
-    // 6. Write a valid pointer to DMA TAILDESC_PNTR
-//    printk(KERN_INFO"%s: 6. Write a valid pointer to DMA TAILDESC_PNTR\n", DEVICE_NAME);
-    xpdma_writeReg (id, (CDMA_OFFSET + CDMA_TDESC_OFFSET), (AXI_PCIE_SG_ADDR) + ((2 * xpdmas[id].descChainLength - 1) * (DESCRIPTOR_SIZE)));
+    xpdma_client_account(cache->client, PCI_DMA_FROMDEVICE, seg.len);
+    cache->raNext = index + n;
+    return xa_load(&cache->pages, index);
+}
 
-    // wait for Scatter Gather operation...
-//    printk(KERN_INFO"%s: Scatter Gather must be started!\n", DEVICE_NAME);
+static vm_fault_t xpdma_vm_fault(struct vm_fault *vmf)
+{
+    struct xpdma_vcache *cache = vmf->vma->vm_private_data;
+    struct page *page;
+    vm_fault_t ret = VM_FAULT_SIGBUS;
 
-    delayTime = CDMA_TRANSFER_LOOP;
-    while (delayTime) {
-        delayTime--;
-        udelay(10);// TODO: can it be less?
+    if (xpdma_ownsEngine()) {
+        printk_ratelimited(KERN_WARNING"%s: DDR mapping: fault while running CDMA (buffer in a DDR mapping?)\n", DEVICE_NAME);
+        return VM_FAULT_SIGBUS;
+    }
 
-        status = (xpdmas[id].descChain + 2 * xpdmas[id].descChainLength - 1)->status;
+    mutex_lock(&cache->lock);
+    page = xa_load(&cache->pages, vmf->pgoff);
+    if (NULL == page)
+        page = xpdma_vcache_fill(cache, vmf->vma, vmf->pgoff);
+    if (page) {
+        list_move_tail(&page->lru, &cache->lru);
+        // read only while clean (write notify), the first store comes to pfn_mkwrite
+        ret = vmf_insert_pfn(vmf->vma, vmf->address, page_to_pfn(page));
+    }
+    mutex_unlock(&cache->lock);
 
-//        printk(KERN_INFO
-//        "%s: Scatter Gather Operation: loop counter %08X\n", DEVICE_NAME, CDMA_TRANSFER_LOOP - delayTime);
+    spin_lock(&cache->client->lock);
+    cache->client->stats.mmapFaults++;
+    spin_unlock(&cache->client->lock);
+    return ret;
+}
 
-//        printk(KERN_INFO
-//        "%s: Scatter Gather Operation: status 0x%08X\n", DEVICE_NAME, status);
+static vm_fault_t xpdma_vm_pfn_mkwrite(struct vm_fault *vmf)
+{
+    struct xpdma_vcache *cache = vmf->vma->vm_private_data;
+    vm_fault_t ret = VM_FAULT_SIGBUS;
 
-        if (status & SG_DEC_ERR_MASK) {
-            printk(KERN_INFO
-            "%s: Scatter Gather Operation: Decode Error\n", DEVICE_NAME);
-            show_descriptors(id);
-            return (CRIT_ERR);
-        }
+    if (xpdma_ownsEngine())
+        return VM_FAULT_SIGBUS;
 
-        if (status & SG_SLAVE_ERR_MASK) {
-            printk(KERN_INFO
-            "%s: Scatter Gather Operation: Slave Error\n", DEVICE_NAME);
-            show_descriptors(id);
-            return (CRIT_ERR);
-        }
+    mutex_lock(&cache->lock);
+    // unmapped before eviction, so a mapped page is always cached
+    if (xa_load(&cache->pages, vmf->pgoff)) {
+        xa_set_mark(&cache->pages, vmf->pgoff, VCACHE_DIRTY);
+        ret = 0;
+    }
+    mutex_unlock(&cache->lock);
+    return ret;
+}
 
-        if (status & SG_INT_ERR_MASK) {
-            printk(KERN_INFO
-            "%s: Scatter Gather Operation: Internal Error\n", DEVICE_NAME);
-            show_descriptors(id);
-            return (CRIT_ERR);
-        }
+static void xpdma_vm_open(struct vm_area_struct *vma)
+{
+    struct xpdma_vcache *cache = vma->vm_private_data;
+    struct xpdma_vcache_vma *entry;
 
-        if (status & SG_COMPLETE_MASK) {
-//            printk(KERN_INFO
-//            "%s: Scatter Gather Operation: Completed successfully\n", DEVICE_NAME);
-            return (SUCCESS);
+    entry = kmalloc(sizeof(*entry), GFP_KERNEL | __GFP_NOFAIL);
+    entry->vma = vma;
+    list_add_tail(&entry->node, &cache->vmas);
+}
+
+// Last part of a mapping closed (munmap, exit): write back and free the cache
+static void xpdma_vm_close(struct vm_area_struct *vma)
+{
+    struct xpdma_vcache *cache = vma->vm_private_data;
+    struct xpdma_vcache_vma *entry;
+    struct page *page;
+    unsigned long index;
+
+    list_for_each_entry(entry, &cache->vmas, node) {
+        if (entry->vma == vma) {
+            list_del(&entry->node);
+            kfree(entry);
+            break;
         }
     }
-//    printk(KERN_INFO
-//    "%s: xpdmas[id].readBuffer: %s\n", DEVICE_NAME, xpdmas[id].readBuffer);
-//    printk(KERN_INFO
-//    "%s: xpdmas[id].writeBuffer: %s\n", DEVICE_NAME, xpdmas[id].writeBuffer);
+    if (!list_empty(&cache->vmas))
+        return;
 
-    printk(KERN_INFO"%s: Scatter Gather Operation error: Timeout Error\n", DEVICE_NAME);
-    show_descriptors(id);
-    return (CRIT_ERR);
+    mutex_lock(&cache->client->mmapLock);
+    list_del(&cache->node);
+    mutex_unlock(&cache->client->mmapLock);
+
+    mutex_lock(&cache->lock);
+    if (xpdma_vcache_sync(cache, 0, ULONG_MAX, false))
+        printk(KERN_WARNING"%s: DDR mapping: write back on unmap failed, data lost\n", DEVICE_NAME);
+    xa_for_each(&cache->pages, index, page)
+        __free_page(page);
+    xa_destroy(&cache->pages);
+    mutex_unlock(&cache->lock);
+
+    mutex_destroy(&cache->lock);
+    kfree(cache->batch);
+    kfree(cache);
 }
 
-static int dma_block(int id, int mode, int direction, void *data, size_t count, u32 addr)
-{
-    size_t unsended = count;
-    char *curData = data;
-    u32 curAddr = addr;
-    u32 btt = BUF_SIZE;
+static const struct vm_operations_struct xpdma_vm_ops = {
+    .open        = xpdma_vm_open,
+    .close       = xpdma_vm_close,
+    .fault       = xpdma_vm_fault,
+    .pfn_mkwrite = xpdma_vm_pfn_mkwrite,
+};
 
-    if ( (addr % 4) != 0 )  {
-        printk(KERN_WARNING"%s: DMA: Address %08X not dword aligned.\n", DEVICE_NAME, addr);
-        return (CRIT_ERR);
-    }
+/**
+ * Map board DDR3: offset is XPDMA_MMAP_OFFSET(id, address), shared mappings only.
+ * Nothing is read until the pages are touched.
+ */
+static int xpdma_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct xpdma_client *client = filp->private_data;
+    u64 offset = (u64)vma->vm_pgoff << PAGE_SHIFT;
+    u64 len = vma->vm_end - vma->vm_start;
+    int id = offset >> 32;
+    struct xpdma_vcache *cache;
 
-    // divide block
-    while (unsended) {
-        btt = (unsended < BUF_SIZE) ? unsended : BUF_SIZE;
-//        printk(KERN_INFO"%s: SG Block: BTT=%u\tunsended=%lu \n", DEVICE_NAME, btt, unsended);
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
 
-        // TODO: remove this multiple checks
-        if (PCI_DMA_TODEVICE == direction)
-            if ( copy_from_user(xpdmas[id].writeBuffer, curData, btt) )  {
-                printk(KERN_WARNING"%s: dma_block: Failed copy from user.\n", DEVICE_NAME);
-                return (CRIT_ERR);
-            }
+    if (!xpdma_isValidId(id))
+        return -ENODEV;
 
-        if (mode == DMA_SG_MODE)
-        {
-            sg_operation(id, direction, btt, curAddr);
-        }
-        else if (mode == DMA_SIMPLE_MODE)
-        {
-            simple_operation(id, direction, btt, curAddr);
-        }
-        else
-        {
-            printk(KERN_WARNING "%s: Unsupport DMA mode: %d.\n", DEVICE_NAME, mode);
-            return (CRIT_ERR);
-        }
+    if ((offset & 0xFFFFFFFF) + len > xpdma_ddrSize(id))
+        return -EINVAL;
 
-        // TODO: remove this multiple checks
-        if (PCI_DMA_FROMDEVICE == direction)
-            if ( copy_to_user(curData, xpdmas[id].readBuffer, btt) )  {
-                printk("%s: dma_block: Failed copy to user.\n", DEVICE_NAME);
-                return (CRIT_ERR);
-            }
+    cache = kzalloc_node(sizeof(*cache), GFP_KERNEL, xpdma_node(id));
+    if (NULL == cache)
+        return -ENOMEM;
 
-        curData += BUF_SIZE;
-        curAddr += BUF_SIZE;
-        unsended -= btt;
+    cache->batch = kmalloc_array_node(VCACHE_BATCH, sizeof(*cache->batch), GFP_KERNEL, xpdma_node(id));
+    if (NULL == cache->batch) {
+        kfree(cache);
+        return -ENOMEM;
     }
 
+    INIT_LIST_HEAD(&cache->vmas);
+    INIT_LIST_HEAD(&cache->lru);
+    mutex_init(&cache->lock);
+    xa_init(&cache->pages);
+    cache->mm = vma->vm_mm;
+    cache->client = client;
+    cache->id = id;
+    cache->raNext = ULONG_MAX;
+
+    vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_DONTCOPY;
+    vma->vm_ops = &xpdma_vm_ops;
+    vma->vm_private_data = cache;
+    xpdma_vm_open(vma);
+
+    mutex_lock(&client->mmapLock);
+    list_add_tail(&cache->node, &client->mmaps);
+    mutex_unlock(&client->mmapLock);
     return (SUCCESS);
 }
 
-ssize_t xpdma_send (int id, void *data, size_t count, u32 addr)
+// msync(MS_SYNC) of a DDR mapping: write back its dirty pages in [start, end]
+static int xpdma_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
 {
-    if (!xpdmas[id].used) {
-        printk(KERN_WARNING"%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
-        return (CRIT_ERR);
+    struct xpdma_client *client = filp->private_data;
+    struct mm_struct *mm = current->mm;
+    struct xpdma_vcache *cache;
+    int result = SUCCESS;
+
+    if (NULL == mm)
+        return (SUCCESS);
+
+    mmap_read_lock(mm);
+    mutex_lock(&client->mmapLock);
+    list_for_each_entry(cache, &client->mmaps, node) {
+        if (cache->mm != mm)
+            continue;
+        mutex_lock(&cache->lock);
+        if (xpdma_vcache_sync(cache, start >> PAGE_SHIFT, end >> PAGE_SHIFT, true))
+            result = -EIO;
+        mutex_unlock(&cache->lock);
     }
-
-    //down(&gSemDma);
-    dma_block(id, DMA_SG_MODE, PCI_DMA_TODEVICE, (void *)data, count, addr);
-    //up(&gSemDma);
-
-    return (SUCCESS);
+    mutex_unlock(&client->mmapLock);
+    mmap_read_unlock(mm);
+    return result;
 }
 
-ssize_t xpdma_recv (int id, void *data, size_t count, u32 addr)
+/**
+ * Positional I/O on the device node: the file position is
+ * XPDMA_FILE_OFFSET(id, DDR address), so pread/pwrite/preadv/pwritev, dd, fio
+ * and splice address board DDR like a file. Transfers stop at the end of the
+ * board DDR (read returns 0 there, write -ENOSPC) and never cross boards.
+ */
+static ssize_t xpdma_rw_iter(struct kiocb *iocb, struct iov_iter *iter, int direction)
 {
-    if (!xpdmas[id].used) {
-        printk(KERN_WARNING"%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
-        return (CRIT_ERR);
-    }
+    struct xpdma_client *client = iocb->ki_filp->private_data;
+    int id = (int)(iocb->ki_pos >> 32);
+    u64 addr = iocb->ki_pos & 0xFFFFFFFF;
+    size_t count = iov_iter_count(iter);
+    u64 size;
 
-    //down(&gSemDma);
-    dma_block(id, DMA_SG_MODE, PCI_DMA_FROMDEVICE, (void *)data, count, addr);
-    //up(&gSemDma);
+    if ((iocb->ki_pos < 0) || !xpdma_isValidId(id))
+        return -ENXIO;
 
-    return (SUCCESS);
-}
+    if ((addr % 4) != 0)
+        return -EINVAL;
 
-ssize_t xpdma_write (struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
-{
-    int id = 0;
-    u32 addr = 0;
-    xpdma_debug(id, "xpdma_write start");
+    size = xpdma_ddrSize(id);
+    if (addr >= size)
+        return (PCI_DMA_FROMDEVICE == direction) ? 0 : -ENOSPC;
 
-    if (!xpdmas[id].used)
-    {
-        printk(KERN_WARNING "%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
-        return (CRIT_ERR);
+    if (count > size - addr) {
+        count = size - addr;
+        iov_iter_truncate(iter, count);
     }
+    if (!count)
+        return 0;
 
-    //down(&gSemDma);
-    dma_block(id, DMA_SIMPLE_MODE, PCI_DMA_TODEVICE, (void *)buf, count, addr);
-    //up(&gSemDma);
-
-    xpdma_debug(id, "xpdma_write finish");
+    xpdma_debug(id, (PCI_DMA_FROMDEVICE == direction) ? "xpdma_read start" : "xpdma_write start");
+    if (dma_block(client, id, direction, iter, (u32)addr, 0))
+        return -EIO;
+    xpdma_debug(id, (PCI_DMA_FROMDEVICE == direction) ? "xpdma_read finish" : "xpdma_write finish");
 
-    return (SUCCESS);
+    iocb->ki_pos += count;
+    return count;
 }
 
-ssize_t xpdma_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t xpdma_write_iter (struct kiocb *iocb, struct iov_iter *from)
 {
-    int id = 0;
-    u32 addr = 0;
-    xpdma_debug(id, "xpdma_read start");
-
-    if (!xpdmas[id].used)
-    {
-        printk(KERN_WARNING "%s: FPGA %d don't initialized!\n", DEVICE_NAME, id);
-        return (CRIT_ERR);
-    }
+    return xpdma_rw_iter(iocb, from, PCI_DMA_TODEVICE);
+}
 
-    //down(&gSemDma);
-    dma_block(id, DMA_SIMPLE_MODE, PCI_DMA_FROMDEVICE, (void *)buf, count, addr);
-    //up(&gSemDma);
+static ssize_t xpdma_read_iter (struct kiocb *iocb, struct iov_iter *to)
+{
+    return xpdma_rw_iter(iocb, to, PCI_DMA_FROMDEVICE);
+}
 
-    xpdma_debug(id, "xpdma_read finish");
+// SEEK_END is the end of DDR of the board the file position is on
+static loff_t xpdma_llseek (struct file *filp, loff_t offset, int whence)
+{
+    int id = (int)(filp->f_pos >> 32);
+    loff_t eof = xpdma_isValidId(id) ? (loff_t)XPDMA_FILE_OFFSET(id, 0) + xpdma_ddrSize(id) : 0;
 
-    return (SUCCESS);
+    return generic_file_llseek_size(filp, offset, whence, (loff_t)XPDMA_NUM_MAX << 32, eof);
 }
 
 int xpdma_release(struct inode *inode, struct file *filp)
 {
+    struct xpdma_client *client = filp->private_data;
+    struct xpdma_mr *mr;
+    struct xpdma_ddr_region *region;
+    unsigned long handle;
+
+    xa_for_each(&client->mrs, handle, mr)
+        xpdma_mr_put(mr);
+    xa_destroy(&client->mrs);
+
+    xa_for_each(&client->ddrs, handle, region)
+        xpdma_ddr_free(client, handle);
+    xa_destroy(&client->ddrs);
+
+    xpdma_irq_release(client);
+
+    spin_lock(&gClientsLock);
+    list_del(&client->node);
+    spin_unlock(&gClientsLock);
+    kfree(client);
+
     printk(KERN_INFO"%s: Release: module released\n", DEVICE_NAME);
     return (SUCCESS);
 }
@@ -871,8 +4123,135 @@ static inline void xpdma_writeReg (int id, u32 reg, u32 val)
     writel(val, (xpdmas[id].baseVirt + reg));
 }
 
+// Bounce buffers off the board node make every copy cross the socket interconnect
+static void xpdma_checkNode(int id, const char *name, void *buffer)
+{
+    int node = xpdma_node(id);
+
+    if ((NUMA_NO_NODE != node) && virt_addr_valid(buffer) && (page_to_nid(virt_to_page(buffer)) != node))
+        printk(KERN_WARNING "%s: getResource: %s on node %d, board on node %d\n",
+               DEVICE_NAME, name, page_to_nid(virt_to_page(buffer)), node);
+}
+
+// Link speed field of LNKCAP/LNKSTA to MT/s
+static u32 xpdma_linkSpeed(u32 field)
+{
+    static const u32 speeds[] = { 0, 2500, 5000, 8000, 16000, 32000 };
+
+    return (field < ARRAY_SIZE(speeds)) ? speeds[field] : 0;
+}
+
+// Log the negotiated link, warn if it trained below expectations and apply
+// MRRS, relaxed ordering and no-snoop settings
+static void xpdma_setupLink(int id)
+{
+    struct pci_dev *dev = xpdmas[id].dev;
+    struct pci_dev *root;
+    u32 capWidth, capSpeed;
+    u32 wantWidth, wantSpeed;
+    u32 lnkcap;
+    u16 lnksta;
+
+    if (!pci_is_pcie(dev)) {
+        printk(KERN_WARNING "%s: getResource: not a PCIe device, link left unconfigured\n", DEVICE_NAME);
+        return;
+    }
+
+    pcie_capability_read_dword(dev, PCI_EXP_LNKCAP, &lnkcap);
+    pcie_capability_read_word(dev, PCI_EXP_LNKSTA, &lnksta);
+    capWidth = (lnkcap & PCI_EXP_LNKCAP_MLW) >> 4;
+    capSpeed = xpdma_linkSpeed(lnkcap & PCI_EXP_LNKCAP_SLS);
+    xpdmas[id].linkWidth = (lnksta & PCI_EXP_LNKSTA_NLW) >> PCI_EXP_LNKSTA_NLW_SHIFT;
+    xpdmas[id].linkSpeed = xpdma_linkSpeed(lnksta & PCI_EXP_LNKSTA_CLS);
+    printk(KERN_INFO "%s: getResource: PCIe link x%u %u MT/s (endpoint x%u %u MT/s), MPS %d\n", DEVICE_NAME,
+           xpdmas[id].linkWidth, xpdmas[id].linkSpeed, capWidth, capSpeed, pcie_get_mps(dev));
+
+    // A x4 link halves the throughput of the x8 design, usually a slot or riser problem
+    wantWidth = expect_width ? expect_width : capWidth;
+    wantSpeed = expect_speed ? expect_speed : capSpeed;
+    if ((xpdmas[id].linkWidth < wantWidth) || (xpdmas[id].linkSpeed < wantSpeed)) {
+        printk(KERN_WARNING "%s: getResource: PCIe link degraded: x%u %u MT/s, expected x%u %u MT/s\n", DEVICE_NAME,
+               xpdmas[id].linkWidth, xpdmas[id].linkSpeed, wantWidth, wantSpeed);
+        pcie_print_link_status(dev);
+    }
+
+    // Larger read requests mean fewer request TLPs for CDMA reads of host memory,
+    // pcie_set_readrq limits it to MPS when the bus is configured for performance
+    if (max_read_request && pcie_set_readrq(dev, max_read_request))
+        printk(KERN_WARNING "%s: getResource: invalid max_read_request %d\n", DEVICE_NAME, max_read_request);
+    printk(KERN_INFO "%s: getResource: PCIe MRRS %d\n", DEVICE_NAME, pcie_get_readrq(dev));
+
+    if (relaxed_ordering) {
+        root = pcie_find_root_port(dev);
+        if (root && (root->dev_flags & PCI_DEV_FLAGS_NO_RELAXED_ORDERING))
+            printk(KERN_WARNING "%s: getResource: root port does not support relaxed ordering\n", DEVICE_NAME);
+        else
+            pcie_capability_set_word(dev, PCI_EXP_DEVCTL, PCI_EXP_DEVCTL_RELAX_EN);
+    }
+    if (no_snoop)
+        pcie_capability_set_word(dev, PCI_EXP_DEVCTL, PCI_EXP_DEVCTL_NOSNOOP_EN);
+    printk(KERN_INFO "%s: getResource: PCIe relaxed ordering %s, no-snoop %s\n", DEVICE_NAME,
+           pcie_relaxed_ordering_enabled(dev) ? "on" : "off", no_snoop ? "on" : "off");
+}
+
+/**
+ * Translation layout from the capability register: vector BRAM size and the
+ * number and size of the data windows. Designs without it (64 KB BAR0) map
+ * host memory through AXIBAR1 in TRANSFER_SIZE windows with the vectors in the
+ * lower half of the translation BRAM.
+ */
+static void xpdma_xlat_init(int id)
+{
+    u32 caps = 0;
+    u32 windows;
+    u32 shift;
+    u32 bram;
+    u32 w;
+
+    xpdmas[id].caps = 0;
+    xpdmas[id].vecBase = BRAM_OFFSET;
+    xpdmas[id].vecSlots = VECTOR_SLOTS;
+    xpdmas[id].nrWindows = 1;
+    xpdmas[id].windowShift = ilog2(TRANSFER_SIZE);
+    xpdmas[id].windowAxi[0] = AXI_PCIE_DM_ADDR;
+    xpdmas[id].windowReg[0] = AXIBAR2PCIEBAR_1U;
+    xpdmas[id].chainMax = BUF_SIZE;
+
+    if (xpdmas[id].baseLen >= CAP_BAR_SIZE)
+        caps = xpdma_readReg(id, CAP_OFFSET);
+    windows = (caps >> 20) & 0xF;
+    shift = (caps >> 8) & 0xFF;
+    bram = caps & 0xFF;
+
+    if ((caps >> 24) != CAP_MAGIC) {
+        printk(KERN_INFO"%s: xlat: no capability register, one %d MB window\n", DEVICE_NAME, TRANSFER_SIZE >> 20);
+    } else if ((windows < 1) || (windows > XLAT_WINDOWS_MAX) || (shift < ilog2(TRANSFER_SIZE)) ||
+               (shift > 28) || ((u64)windows << shift > 0x10000000) || (bram < 12) ||
+               (bram > ilog2(VECTOR_STAGE_SIZE)) || (VECTOR_BRAM_OFFSET + (1UL << bram) > xpdmas[id].baseLen)) {
+        printk(KERN_WARNING"%s: xlat: capability register 0x%08X not supported, one %d MB window\n", DEVICE_NAME, caps, TRANSFER_SIZE >> 20);
+    } else {
+        xpdmas[id].caps = caps;
+        xpdmas[id].vecBase = VECTOR_BRAM_OFFSET;
+        xpdmas[id].vecSlots = (1UL << bram) / BRAM_STEP;
+        xpdmas[id].nrWindows = windows;
+        xpdmas[id].windowShift = shift;
+        for (w = 0; w < windows; ++w) {
+            xpdmas[id].windowAxi[w] = AXI_WINDOW_ADDR + (w << shift);
+            xpdmas[id].windowReg[w] = AXIBAR2PCIEBAR_2U + w * 8;
+        }
+        xpdmas[id].chainMax = clamp_t(ulong, chain_max, BUF_SIZE, CHAIN_MAX_LIMIT);
+        printk(KERN_INFO"%s: xlat: %u windows of %u MB, %u vectors\n", DEVICE_NAME, windows, 1U << (shift - 20), xpdmas[id].vecSlots);
+    }
+
+    // two runs of the longest chain fit the vectors (a run never waits for itself)
+    xpdmas[id].segMax = min_t(u32, SG_SEG_MAX, xpdmas[id].vecSlots / 2);
+}
+
 static int xpdma_getResource(int id) 
 {
+    int dir;
+    int slot;
+
     //dev = pci_get_device(VENDOR_ID, DEVICE_ID, dev);
     if (NULL == xpdmas[id].dev) {
         printk(KERN_WARNING"%s: getResource: Hardware not found.\n", DEVICE_NAME);
@@ -910,6 +4289,34 @@ static int xpdma_getResource(int id)
     xpdmas[id].statFlags |= HAVE_MEM_REGION;
     printk(KERN_INFO"%s: getResource: Initialize Hardware Done..\n", DEVICE_NAME);
 
+    // Map DDR3 window for programmed I/O (optional, older bitstreams have no BAR2)
+    xpdmas[id].pioSendMax = pio_send_max;
+    xpdmas[id].pioRecvMax = pio_recv_max;
+    xpdmas[id].pioLen = pci_resource_len(xpdmas[id].dev, PIO_BAR);
+    if (xpdmas[id].pioLen) {
+        xpdmas[id].pioHdwr = pci_resource_start(xpdmas[id].dev, PIO_BAR);
+        if (request_mem_region(xpdmas[id].pioHdwr, xpdmas[id].pioLen, "Xilinx_PCIe_CDMA_Driver")) {
+            xpdmas[id].statFlags |= HAVE_PIO_REGION;
+            xpdmas[id].pioVirt = ioremap_wc(xpdmas[id].pioHdwr, xpdmas[id].pioLen);
+        }
+        if (NULL == xpdmas[id].pioVirt) {
+            printk(KERN_WARNING"%s: getResource: DDR3 window not mapped, programmed I/O disabled.\n", DEVICE_NAME);
+            if (xpdmas[id].statFlags & HAVE_PIO_REGION)
+                release_mem_region(xpdmas[id].pioHdwr, xpdmas[id].pioLen);
+            xpdmas[id].statFlags &= ~HAVE_PIO_REGION;
+            xpdmas[id].pioLen = 0;
+        } else {
+            printk(KERN_INFO "%s: getResource: DDR3 window 0x%016lX, len %lu\n", DEVICE_NAME, xpdmas[id].pioHdwr, xpdmas[id].pioLen);
+        }
+    }
+
+    // DDR3 the engine may address: the window covers the whole memory, without it the SODIMM size
+    xpdmas[id].ddrMem = ddr_size ? ddr_size : (xpdmas[id].pioLen ? xpdmas[id].pioLen : DDR3_SIZE);
+    if (xpdmas[id].ddrMem > AXI_PCIE_DM_ADDR - AXI_DDR3_ADDR) {
+        printk(KERN_WARNING"%s: getResource: DDR3 size 0x%llX overlaps the PCIe windows, limited\n", DEVICE_NAME, xpdmas[id].ddrMem);
+        xpdmas[id].ddrMem = AXI_PCIE_DM_ADDR - AXI_DDR3_ADDR;
+    }
+
     // Bus Master Enable
     if (0 > pci_enable_device(xpdmas[id].dev)) {
         printk(KERN_CRIT"%s: getResource: Device not enabled.\n", DEVICE_NAME);
@@ -923,6 +4330,15 @@ static int xpdma_getResource(int id)
     }
     pci_set_consistent_dma_mask(xpdmas[id].dev, 0x7FFFFFFFFFFFFFFF);
 
+    xpdma_setupLink(id);
+    xpdma_xlat_init(id);
+
+    // Coherent buffers come from the device node (dma-direct and IOMMU allocators),
+    // without one they would land on the node running module init
+    if ((NUMA_NO_NODE == xpdma_node(id)) && (NUMA_NO_NODE != board_node) && node_online(board_node))
+        set_dev_node(&xpdmas[id].dev->dev, board_node);
+    printk(KERN_INFO "%s: getResource: NUMA node %d\n", DEVICE_NAME, xpdma_node(id));
+
     xpdmas[id].readBuffer = dma_alloc_coherent( &xpdmas[id].dev->dev, BUF_SIZE, &xpdmas[id].readHWAddr, GFP_KERNEL );
     if (NULL == xpdmas[id].readBuffer) {
         printk(KERN_CRIT"%s: getResource: Unable to allocate xpdmas[id].readBuffer\n", DEVICE_NAME);
@@ -939,6 +4355,12 @@ static int xpdma_getResource(int id)
     printk(KERN_INFO "%s: getResource: Write buffer allocated: 0x%016lX, Phy: 0x%016lX\n",
            DEVICE_NAME, (size_t)xpdmas[id].writeBuffer, (size_t)xpdmas[id].writeHWAddr);
 
+    xpdmas[id].segs = kmalloc_array_node(SG_SEG_MAX, sizeof(*xpdmas[id].segs), GFP_KERNEL, xpdma_node(id));
+    if (NULL == xpdmas[id].segs) {
+        printk(KERN_CRIT"%s: getResource: Unable to allocate xpdmas[id].segs\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+
     xpdmas[id].descChain = dma_alloc_coherent( &xpdmas[id].dev->dev, BUF_SIZE, &xpdmas[id].descChainHWAddr, GFP_KERNEL );
     if (NULL == xpdmas[id].descChain) {
         printk(KERN_CRIT"%s: getResource: Unable to allocate xpdmas[id].descChain\n", DEVICE_NAME);
@@ -947,21 +4369,86 @@ static int xpdma_getResource(int id)
     printk(KERN_INFO "%s: getResource: Descriptor chain buffer allocated: 0x%016lX, Phy: 0x%016lX\n",
            DEVICE_NAME, (size_t)(xpdmas[id].descChain), (size_t)xpdmas[id].descChainHWAddr);
 
+    xpdma_ring_init(id);
+
+    xpdmas[id].bounce[0][0] = xpdmas[id].writeBuffer;
+    xpdmas[id].bounceHWAddr[0][0] = xpdmas[id].writeHWAddr;
+    xpdmas[id].bounce[1][0] = xpdmas[id].readBuffer;
+    xpdmas[id].bounceHWAddr[1][0] = xpdmas[id].readHWAddr;
+    for (dir = 0; dir < 2; ++dir) {
+        for (slot = 1; slot < BOUNCE_SLOTS; ++slot) {
+            xpdmas[id].bounce[dir][slot] = dma_alloc_coherent( &xpdmas[id].dev->dev, BUF_SIZE, &xpdmas[id].bounceHWAddr[dir][slot], GFP_KERNEL );
+            if (NULL == xpdmas[id].bounce[dir][slot]) {
+                printk(KERN_CRIT"%s: getResource: Unable to allocate bounce buffer %d/%d\n", DEVICE_NAME, dir, slot);
+                return (CRIT_ERR);
+            }
+            xpdma_checkNode(id, "Bounce buffer", xpdmas[id].bounce[dir][slot]);
+        }
+    }
+
+    xpdma_checkNode(id, "Read buffer", xpdmas[id].readBuffer);
+    xpdma_checkNode(id, "Write buffer", xpdmas[id].writeBuffer);
+    xpdma_checkNode(id, "Descriptor chain buffer", xpdmas[id].descChain);
+
     return (SUCCESS);
 }
 
+// /sys/class/chardev/xpdma/clients: per client limits and throughput
+static ssize_t clients_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct xpdma_client *client;
+    ssize_t len = 0;
+    u64 lifeUs;
+
+    len += scnprintf(buf + len, PAGE_SIZE - len, "%8s %6s %12s %14s %14s %10s %14s %12s\n",
+                     "pid", "weight", "rate", "sent", "recv", "MB/s", "throttle_us", "ddr");
+
+    spin_lock(&gClientsLock);
+    list_for_each_entry(client, &gClients, node) {
+        spin_lock(&client->lock);
+        lifeUs = div_u64(ktime_to_ns(ktime_sub(ktime_get(), client->openTime)), NSEC_PER_USEC);
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%8d %6u %12llu %14llu %14llu %10llu %14llu %12llu\n",
+                         client->stats.pid, client->limit.weight, client->limit.rate,
+                         client->stats.bytesSent, client->stats.bytesRecv,
+                         lifeUs ? div64_u64(client->stats.bytesSent + client->stats.bytesRecv, lifeUs) : 0,
+                         div_u64(client->stats.throttleNs, NSEC_PER_USEC), client->stats.ddrBytes);
+        spin_unlock(&client->lock);
+    }
+    spin_unlock(&gClientsLock);
+
+    return len;
+}
+static DEVICE_ATTR_RO(clients);
+
 static int xpdma_init (void)
 {
     int c = 0;
-    sema_init(&gSemDma, 1);
+    int v;
 
 //     printk(KERN_INFO"%s: Init: set default values\n", DEVICE_NAME);
     for (c = 0; c < XPDMA_NUM_MAX; ++c) {
         xpdmas[c].used = 0;
+        xpdmas[c].wedged = false;
         xpdmas[c].statFlags = 0x00;
         xpdmas[c].baseVirt = NULL;
+        xpdmas[c].pioVirt = NULL;
         xpdmas[c].readBuffer = NULL;
         xpdmas[c].writeBuffer = NULL;
+        xpdmas[c].segs = NULL;
+        memset(xpdmas[c].bounce, 0, sizeof(xpdmas[c].bounce));
+        mutex_init(&xpdmas[c].p2pLock);
+        mutex_init(&xpdmas[c].ddrLock);
+        init_waitqueue_head(&xpdmas[c].irqWait);
+        spin_lock_init(&xpdmas[c].irqLock);
+        INIT_LIST_HEAD(&xpdmas[c].irqEventfds);
+        xpdmas[c].irqVectors = 0;
+        for (v = 0; v < XPDMA_IRQ_MAX; ++v) {
+            xpdmas[c].irqVec[v].id = c;
+            xpdmas[c].irqVec[v].vector = v;
+            atomic64_set(&xpdmas[c].irqVec[v].count, 0);
+        }
+        memset(xpdmas[c].p2pAddr, 0, sizeof(xpdmas[c].p2pAddr));
+        memset(xpdmas[c].p2pState, 0, sizeof(xpdmas[c].p2pState));
     }
 
     printk(KERN_INFO"%s: Init: try to found boards\n", DEVICE_NAME);
@@ -970,9 +4457,16 @@ static int xpdma_init (void)
         xpdmas[c].dev = pci_get_device(VENDOR_ID, DEVICE_ID, (c > 0) ? xpdmas[c-1].dev: NULL);
         if (xpdmas[c].dev) {
             printk(KERN_INFO"%s: Init: found board %d\n", DEVICE_NAME, c);
-            if (xpdma_getResource(c) == SUCCESS)
+            xpdma_sched_init(c);
+            xpdmas[c].pollMode = (poll_mode == XPDMA_POLL_HYBRID) ? XPDMA_POLL_HYBRID : XPDMA_POLL_CLASSIC;
+            xpdmas[c].bandwidth[0] = DEFAULT_BANDWIDTH;
+            xpdmas[c].bandwidth[1] = DEFAULT_BANDWIDTH;
+            xpdmas[c].copyWorkers = clamp_t(uint, copy_workers, 1, COPY_WORKERS_MAX);
+            if (xpdma_getResource(c) == SUCCESS) {
                 xpdmas[c].used = 1;
-            else
+                xpdma_ddr_init(c);
+                xpdma_irq_init(c);
+            } else
                 printk(KERN_WARNING"%s: Init: board %d don't get resources!\n", DEVICE_NAME, c);
         } else {
             printk(KERN_INFO"%s: Init: not found board %d\n", DEVICE_NAME, c);
@@ -982,6 +4476,10 @@ static int xpdma_init (void)
 
     printk(KERN_INFO"%s: Init: finish found boards\n", DEVICE_NAME);
 
+    gCopyWq = alloc_workqueue("xpdma_copy", WQ_UNBOUND | WQ_HIGHPRI, 0);
+    if (NULL == gCopyWq)
+        printk(KERN_WARNING"%s: Init: no copy workqueue, bounce buffer copies are not split\n", DEVICE_NAME);
+
     // Register driver as a character device.
     //if (0 > register_chrdev(gDrvrMajor, DEVICE_NAME, &xpdma_intf)) {
     //    printk(KERN_WARNING"%s: Init: module not register\n", DEVICE_NAME);
@@ -1009,7 +4507,8 @@ static int xpdma_init (void)
     }
     printk(KERN_INFO"%s: Init: module registered\n", DEVICE_NAME);
 
-    if( NULL == device_create( cl, NULL, first, NULL, DEVICE_NAME ))
+    gDevice = device_create( cl, NULL, first, NULL, DEVICE_NAME );
+    if( IS_ERR_OR_NULL(gDevice) )
     {
         printk(KERN_ALERT"%s: Device creation failed\n", DEVICE_NAME);
         class_destroy(cl);
@@ -1028,6 +4527,9 @@ static int xpdma_init (void)
         return (CRIT_ERR);
     }
 
+    if (device_create_file(gDevice, &dev_attr_clients))
+        printk(KERN_WARNING"%s: Init: clients attribute not created\n", DEVICE_NAME);
+
     gKernelRegFlag |= HAVE_KERNEL_REG;
     printk(KERN_INFO"%s: Init: driver is loaded\n", DEVICE_NAME);
 
@@ -1049,8 +4551,20 @@ static int xpdma_init (void)
 static void xpdma_exit (void)
 {
     int id = 0;
+    int peer;
+    int dir;
+    int slot;
 
 //     printk(KERN_INFO"%s: Exit: unload module resources\n", DEVICE_NAME);
+    // peer windows first, they refer to the DDR3 window of other boards
+    for (id = 0; id < XPDMA_NUM_MAX; ++id) {
+        for (peer = 0; peer < XPDMA_NUM_MAX; ++peer) {
+            if (xpdmas[id].p2pAddr[peer])
+                dma_unmap_resource(&xpdmas[id].dev->dev, xpdmas[id].p2pAddr[peer], xpdmas[peer].pioLen, DMA_BIDIRECTIONAL, 0);
+            xpdmas[id].p2pAddr[peer] = 0;
+        }
+    }
+
     for (id = 0; id < XPDMA_NUM_MAX; ++id) {
         if (xpdmas[id].used) {
             // Check if we have a memory region and free it
@@ -1058,6 +4572,14 @@ static void xpdma_exit (void)
                 release_mem_region(xpdmas[id].baseHdwr, xpdmas[id].baseLen);
             }
 
+            if (xpdmas[id].pioVirt != NULL)
+                iounmap(xpdmas[id].pioVirt);
+            xpdmas[id].pioVirt = NULL;
+
+            if (xpdmas[id].statFlags & HAVE_PIO_REGION) {
+                release_mem_region(xpdmas[id].pioHdwr, xpdmas[id].pioLen);
+            }
+
 //             printk(KERN_INFO"%s: xpdma_exit: erase xpdmas[id].readBuffer\n", DEVICE_NAME);
             // Free Write, Read and Descriptor buffers allocated to use
             if (NULL != xpdmas[id].readBuffer)
@@ -1071,9 +4593,22 @@ static void xpdma_exit (void)
             if (NULL != xpdmas[id].descChain)
                 dma_free_coherent( &xpdmas[id].dev->dev, BUF_SIZE, xpdmas[id].descChain, xpdmas[id].descChainHWAddr);
 
+            for (dir = 0; dir < 2; ++dir) {
+                for (slot = 1; slot < BOUNCE_SLOTS; ++slot) {
+                    if (NULL != xpdmas[id].bounce[dir][slot])
+                        dma_free_coherent( &xpdmas[id].dev->dev, BUF_SIZE, xpdmas[id].bounce[dir][slot], xpdmas[id].bounceHWAddr[dir][slot]);
+                    xpdmas[id].bounce[dir][slot] = NULL;
+                }
+            }
+
+            kfree(xpdmas[id].segs);
+            xpdma_ddr_exit(id);
+            xpdma_irq_exit(id);
+
             xpdmas[id].readBuffer = NULL;
             xpdmas[id].writeBuffer = NULL;
             xpdmas[id].descChain = NULL;
+            xpdmas[id].segs = NULL;
 
             // Unmap virtual device address
 //             printk(KERN_INFO"%s: xpdma_exit: unmap xpdmas[id].baseVirt\n", DEVICE_NAME);
@@ -1093,6 +4628,7 @@ static void xpdma_exit (void)
 //        unregister_chrdev(gDrvrMajor, DEVICE_NAME);
 
         cdev_del(&c_dev);
+        device_remove_file(gDevice, &dev_attr_clients);
         device_destroy(cl, first);
         class_destroy(cl);
         unregister_chrdev_region(first, 1);
@@ -1100,6 +4636,10 @@ static void xpdma_exit (void)
     }
 
 
+    if (NULL != gCopyWq)
+        destroy_workqueue(gCopyWq);
+    gCopyWq = NULL;
+
     printk(KERN_ALERT"%s: driver is unloaded\n", DEVICE_NAME);
 }
 
@@ -10,6 +10,11 @@
 #define SUCCESS         0
 #define CRIT_ERR       -1
 
+// mmap offset of board DDR (page aligned address)
+#define XPDMA_MMAP_OFFSET(id, addr) (((uint64_t)(id) << 32) | (uint32_t)(addr))
+// File position of board DDR for pread/pwrite/lseek (dword aligned address)
+#define XPDMA_FILE_OFFSET(id, addr) XPDMA_MMAP_OFFSET(id, addr)
+
 // Struct Used for Read/Write CDMA Register
 typedef struct {
     int id;
@@ -17,14 +22,190 @@ typedef struct {
     uint32_t value;
 } cdmaReg_t;
 
+// Per board tunables (cdmaParam_t.param)
+enum {
+    XPDMA_PARAM_PIO_SEND_MAX,   // Largest send done by programmed I/O, bytes (0 - never)
+    XPDMA_PARAM_PIO_RECV_MAX,   // Largest receive done by programmed I/O, bytes (0 - never)
+    XPDMA_PARAM_PIO_WINDOW,     // DDR BAR window size, bytes (read only, 0 - no window)
+    XPDMA_PARAM_POLL_MODE,      // Default completion polling mode (XPDMA_POLL_*)
+    XPDMA_PARAM_SEND_BANDWIDTH, // Measured send throughput, bytes/s (read only)
+    XPDMA_PARAM_RECV_BANDWIDTH, // Measured receive throughput, bytes/s (read only)
+    XPDMA_PARAM_NUMA_NODE,      // NUMA node of the board (read only, (uint64_t)-1 - none)
+    XPDMA_PARAM_LINK_WIDTH,     // Negotiated PCIe link width, lanes (read only)
+    XPDMA_PARAM_LINK_SPEED,     // Negotiated PCIe link speed, MT/s per lane (read only)
+    XPDMA_PARAM_COPY_WORKERS,   // CPUs sharing a bounce buffer copy of user memory (1..8)
+    XPDMA_PARAM_CHAIN_MAX,      // Bytes moved by one descriptor chain run (4 KB..1 GB)
+    XPDMA_PARAM_CHAIN_SEGS,     // Data descriptors of one chain run (read only)
+    XPDMA_PARAM_XLAT_WINDOWS,   // AXI to PCIe translation windows of the bitstream (read only)
+    XPDMA_PARAM_DDR_SIZE,       // Board DDR3 bytes, board addresses stay below (read only)
+    XPDMA_PARAM_NUM
+};
+
+// Struct Used for Read/Write board tunables
+typedef struct {
+    int id;
+    uint32_t param;
+    uint64_t value;
+} cdmaParam_t;
+
+// Request priority classes (served highest first, FIFO inside a class)
+enum {
+    XPDMA_PRIO_NORMAL,
+    XPDMA_PRIO_HIGH,
+    XPDMA_PRIO_NUM
+};
+
+// Transfer flags (cdmaBuffer_t.flags)
+#define XPDMA_FLAG_PRIO_HIGH    0x00000001  // Latency-critical request, preempts normal ones between chunks
+#define XPDMA_FLAG_FORCE_DMA    0x00000002  // Always use the CDMA engine
+#define XPDMA_FLAG_FORCE_PIO    0x00000004  // Always use programmed I/O through the DDR BAR window
+#define XPDMA_FLAG_POLL_CLASSIC 0x00000008  // Wait for completion with the classic 10 us poll
+#define XPDMA_FLAG_POLL_HYBRID  0x00000010  // Wait for completion with hybrid sleep + busy poll
+#define XPDMA_FLAG_ZERO_COPY    0x00000020  // DMA directly from/to the user buffer (pinned for the call)
+#define XPDMA_FLAG_SIMPLE       0x00000040  // Simple (register programmed) CDMA mode instead of a descriptor chain
+
+// Access of a registered buffer (cdmaRegister_t.access), 0 - both
+#define XPDMA_ACCESS_SEND       0x00000001  // The board reads the buffer (send), read-only memory is fine
+#define XPDMA_ACCESS_RECV       0x00000002  // The board writes the buffer (receive), pinned writable
+
+// Completion polling modes (XPDMA_PARAM_POLL_MODE)
+enum {
+    XPDMA_POLL_CLASSIC,
+    XPDMA_POLL_HYBRID
+};
+
 // Struct Used for send/receive data
 typedef struct {
     int id;
     void *data;
     uint32_t count;
     uint32_t addr;
+    uint32_t flags;
 } cdmaBuffer_t;
 
+// Struct Used for scheduler statistics (per board, per priority class)
+typedef struct {
+    int id;
+    uint64_t requests[XPDMA_PRIO_NUM];  // Engine runs (chunks) granted
+    uint64_t bytes[XPDMA_PRIO_NUM];     // Bytes transferred
+    uint64_t waitNs[XPDMA_PRIO_NUM];    // Total time spent in queue and behind earlier ring runs
+    uint64_t maxWaitNs[XPDMA_PRIO_NUM]; // Longest single queue or ring wait
+} cdmaStats_t;
+
+#define XPDMA_WEIGHT_DEFAULT    100         // Fair share weight of a new client
+#define XPDMA_WEIGHT_MAX        10000
+
+// Struct Used for per client (open file descriptor) bandwidth limit
+typedef struct {
+    uint64_t rate;      // Token bucket rate, bytes per second (0 - unlimited)
+    uint64_t burst;     // Token bucket depth, bytes (0 - one chunk)
+    uint32_t weight;    // Fair share weight inside a priority class (1..XPDMA_WEIGHT_MAX)
+} cdmaLimit_t;
+
+// Struct Used for per client throughput counters
+typedef struct {
+    int pid;
+    cdmaLimit_t limit;
+    uint64_t requests;   // Engine runs (chunks) issued
+    uint64_t bytesSent;
+    uint64_t bytesRecv;
+    uint64_t throttleNs; // Time delayed by the rate limit
+    uint64_t lifeNs;     // Time since open
+    uint64_t mmapFaults;    // DDR mapping page faults
+    uint64_t mmapEvictions; // DDR mapping pages dropped from the host cache
+    uint64_t ddrBytes;      // DDR3 held in allocated regions (IOCTL_DDRALLOC)
+} cdmaClientStats_t;
+
+// Struct Used for pinned buffer registration (IOCTL_REGISTER/IOCTL_UNREGISTER)
+typedef struct {
+    int id;             // Board the buffer is mapped for
+    uint32_t handle;    // Set by IOCTL_REGISTER
+    uint64_t data;      // Buffer address
+    uint64_t length;
+    uint32_t access;    // XPDMA_ACCESS_*, 0 - send and receive
+} cdmaRegister_t;
+
+// Struct Used for send/receive from/to a registered buffer (no pinning per call)
+typedef struct {
+    uint32_t handle;
+    uint32_t count;
+    uint64_t offset;    // Start inside the registered buffer
+    uint32_t addr;
+    uint32_t flags;
+} cdmaRegBuffer_t;
+
+// Struct Used for DDR3 to DDR3 copy between boards (IOCTL_COPYP2P)
+typedef struct {
+    int srcId;          // Board running the copy (its DDR3 is read)
+    int dstId;          // Board written through its DDR3 window
+    uint32_t srcAddr;
+    uint32_t dstAddr;
+    uint64_t count;
+    uint32_t flags;     // XPDMA_FLAG_PRIO_HIGH, XPDMA_FLAG_POLL_*
+} cdmaCopy_t;
+
+// Struct Used for dma-buf sharing (IOCTL_EXPORTBUF/IOCTL_IMPORTBUF)
+typedef struct {
+    int id;             // Board the buffer is allocated near (export) or mapped for (import)
+    int fd;             // dma-buf file descriptor: set by IOCTL_EXPORTBUF, given to IOCTL_IMPORTBUF
+    uint32_t handle;    // Set by IOCTL_IMPORTBUF: registered buffer handle (IOCTL_SENDREG/IOCTL_RECVREG)
+    uint64_t length;    // Export: requested size (rounded up to pages); set to the dma-buf size
+} cdmaDmaBuf_t;
+
+// Struct Used for DDR3 allocation (IOCTL_DDRALLOC/IOCTL_DDRFREE)
+typedef struct {
+    int id;
+    uint32_t handle;    // Set by IOCTL_DDRALLOC, given to IOCTL_DDRFREE
+    uint64_t length;    // Bytes requested
+    uint64_t align;     // Address alignment, power of two (0 - 4 KB); regions are aligned to their block size anyway
+    uint64_t addr;      // Set by IOCTL_DDRALLOC: DDR3 address of the region
+} cdmaDdrAlloc_t;
+
+// Struct Used for DDR3 allocator usage (IOCTL_DDRSTATS)
+typedef struct {
+    int id;
+    uint64_t base;          // DDR3 range managed by the allocator
+    uint64_t size;
+    uint64_t used;          // Bytes in allocated blocks
+    uint64_t requested;     // Bytes requested (used - requested: lost to power of two blocks)
+    uint64_t free;          // Bytes in free blocks
+    uint64_t largestFree;   // Largest region that can be allocated now (1 - largestFree / free: fragmentation)
+    uint32_t regions;       // Allocated regions
+    uint32_t freeBlocks;    // Free blocks of all sizes
+} cdmaDdrStats_t;
+
+// User logic interrupts: lines of the design raise MSI vectors, a line goes to
+// vector (line & (vectors - 1)) when the host grants fewer vectors than lines
+#define XPDMA_IRQ_MAX   8
+
+// Struct Used for user interrupt waits (IOCTL_IRQOPEN): read() of the returned
+// file descriptor blocks until a vector in 'mask' fires and returns cdmaIrqEvents_t
+typedef struct {
+    int id;
+    uint32_t mask;      // Vectors to wait for, bit n - vector n
+    int fd;             // Set by IOCTL_IRQOPEN: poll()/read() file descriptor
+} cdmaIrqOpen_t;
+
+typedef struct {
+    uint32_t fired;     // Vectors that fired since the previous read
+    uint32_t reserved;
+    uint64_t count[XPDMA_IRQ_MAX]; // Interrupts per vector since the driver was loaded
+} cdmaIrqEvents_t;
+
+// Struct Used for eventfd signalling of a vector (IOCTL_IRQEVENTFD)
+typedef struct {
+    int id;
+    uint32_t vector;
+    int fd;             // eventfd to signal, -1 removes the eventfds of the caller on the vector
+} cdmaIrqEventfd_t;
+
+// Struct Used for user interrupt counters (IOCTL_IRQSTATS)
+typedef struct {
+    int id;
+    uint32_t vectors;   // MSI vectors granted (0 - no user interrupts)
+    uint64_t count[XPDMA_IRQ_MAX];
+} cdmaIrqStats_t;
+
 // ioctl commands
 enum {
     IOCTL_RESET, // Reset CDMA
@@ -38,6 +219,24 @@ enum {
     IOCTL_SEND,      // Send data from Host system to AXI CDMA
     IOCTL_RECV,      // Receive data from AXI CDMA to Host system
     IOCTL_INFO,      // Show debug information
+    IOCTL_STATS,     // Read scheduler statistics
+    IOCTL_SETLIMIT,  // Set bandwidth limit and weight of the calling client
+    IOCTL_CLIENTSTATS, // Read counters of the calling client
+    IOCTL_SETPARAM,  // Write board tunable
+    IOCTL_GETPARAM,  // Read board tunable
+    IOCTL_REGISTER,  // Pin and map a user buffer, returns a handle
+    IOCTL_UNREGISTER, // Release a registered buffer
+    IOCTL_SENDREG,   // Send data from a registered buffer
+    IOCTL_RECVREG,   // Receive data to a registered buffer
+    IOCTL_COPYP2P,   // Copy DDR3 to the DDR3 of another board (-EOPNOTSUPP if not possible)
+    IOCTL_EXPORTBUF, // Allocate a host buffer and export it as a dma-buf
+    IOCTL_IMPORTBUF, // Map a dma-buf for the board, returns a registered buffer handle
+    IOCTL_DDRALLOC,  // Allocate a DDR3 region, freed by IOCTL_DDRFREE or when the file is closed
+    IOCTL_DDRFREE,   // Free a DDR3 region
+    IOCTL_DDRSTATS,  // Read DDR3 allocator usage
+    IOCTL_IRQOPEN,   // Open a poll()/read() file descriptor for user interrupts
+    IOCTL_IRQEVENTFD, // Signal an eventfd on a user interrupt
+    IOCTL_IRQSTATS,  // Read user interrupt counters
 };
 
 #endif //XPDMA_DRIVER_H
@@ -2,6 +2,38 @@
 
 VIVADO_PATH='/opt/Xilinx/Vivado/2018.3'
 
+usage() {
+  cat <<EOF
+Usage: $0 [--profile reference|max-throughput] [options] [--impl]
+  --profile NAME         parameter set, options after it override single values
+  --axi-width BITS       CDMA data width (32 64 128 256 512, default 128)
+  --cdma-burst BEATS     CDMA maximum burst length (16 .. 256, default 128)
+  --ic-strategy N        interconnect strategy (0 custom, 1 minimize area, 2 maximize performance, default 2)
+  --ic-fifo N            data FIFOs on the CDMA, DDR3 and PCIe ports (0 none, 1 32 deep, 2 512 deep, default 0)
+  --ic-regslice 0|1      register slices on the same ports (default 0)
+  --pcie-lanes N         PCIe lanes (1 2 4 8, default 8)
+  --pcie-speed GT/s      PCIe lane speed (2.5 5.0, default 5.0)
+  --mig-axi-width BITS   MIG AXI port width (64 128 256 512, default 128)
+  --mig-ordering MODE    MIG request ordering (Normal Strict, default Normal)
+  --mig-arb ALGORITHM    MIG read/write arbitration (default RD_PRI_REG)
+  --impl                 run synthesis and implementation in batch mode, write
+                         reports/<profile>/ (utilization, timing, summary.txt)
+EOF
+}
+
+IMPL=0
+for arg in "$@"; do
+  case "$arg" in
+    -h|--help)
+      usage
+      exit 0
+      ;;
+    --impl)
+      IMPL=1
+      ;;
+  esac
+done
+
 if [ -z "$PATH" ]; then
   PATH=${VIVADO_PATH}/bin
 else
@@ -9,4 +41,8 @@ else
 fi
 export PATH
 
-vivado -source ./kintexSubsystemFiles/kintexGenerationScript.tcl &
+if [ "$IMPL" -eq 1 ]; then
+  vivado -mode batch -source ./kintexSubsystemFiles/kintexGenerationScript.tcl -tclargs "$@"
+else
+  vivado -source ./kintexSubsystemFiles/kintexGenerationScript.tcl -tclargs "$@" &
+fi
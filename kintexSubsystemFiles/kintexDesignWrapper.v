@@ -62,6 +62,26 @@ module design_1_wrapper
   wire ddr_clk_100MHz;
   reg [27:0] ddr_clk_counter;
   wire ddr_rst;
+
+  // User logic interrupts: a rising edge of a line raises its MSI vector
+  // (drivers/xpdma: poll()/read() of IOCTL_IRQOPEN descriptors, eventfds).
+  // Lines are sampled with pcie_clk_125MHz and synchronized in xpdma_user_irq.
+  wire  [7:0] user_irq = 8'h00; // connect user logic here
+  wire        msi_request;
+  wire  [4:0] msi_vector_num;
+  wire        msi_grant;
+  wire        msi_enable;
+  wire  [2:0] msi_vector_width;
+
+  xpdma_user_irq #(.LINES(8)) user_irq_msi
+       (.clk(pcie_clk_125MHz),
+        .rst(~pcie_mmcm_locked),
+        .irq(user_irq),
+        .msi_enable(msi_enable),
+        .msi_vector_width(msi_vector_width),
+        .msi_grant(msi_grant),
+        .msi_request(msi_request),
+        .msi_vector_num(msi_vector_num));
   
   assign EXT_LEDS = {ddr_clk_counter[27:26],pcie_clk_counter[27:26],pcie_mmcm_locked,ddr_mmcm_locked,~ddr_rst,~EXT_SYS_RST}; 
   always @(posedge pcie_clk_125MHz)
@@ -102,5 +122,74 @@ module design_1_wrapper
         .ddr_rst(ddr_rst),
         .pcie_mmcm_locked(pcie_mmcm_locked),
         .reset_logic_mmcm_locked_in(mmcms_locked),
-        .ddr_rdy(ddr_mmcm_locked));
+        .ddr_rdy(ddr_mmcm_locked),
+        .msi_request(msi_request),
+        .msi_vector_num(msi_vector_num),
+        .msi_grant(msi_grant),
+        .msi_enable(msi_enable),
+        .msi_vector_width(msi_vector_width));
+endmodule
+
+// MSI requests for user interrupt lines of the AXI PCIe bridge
+// (INTX_MSI_Request/MSI_Vector_Num, held until INTX_MSI_Grant). Rising edges
+// are latched, so a line pulsing while another vector is sent is not lost;
+// the lowest pending line goes first. Line n raises vector n, folded into the
+// vectors the host granted (MSI_Vector_Width) when there are fewer.
+module xpdma_user_irq #(parameter LINES = 8)
+   (input                  clk,
+    input                  rst,
+    input      [LINES-1:0] irq,
+    input                  msi_enable,
+    input            [2:0] msi_vector_width,
+    input                  msi_grant,
+    output reg             msi_request,
+    output reg       [4:0] msi_vector_num);
+
+  reg [LINES-1:0] irq_meta;
+  reg [LINES-1:0] irq_sync;
+  reg [LINES-1:0] irq_last;
+  reg [LINES-1:0] pending;
+  reg [LINES-1:0] next;
+  reg       [4:0] line;
+  reg             found;
+  integer         i;
+
+  wire [4:0] vector_mask = (5'd1 << msi_vector_width) - 5'd1;
+
+  always @(posedge clk) begin
+    if (rst) begin
+      irq_meta       <= {LINES{1'b0}};
+      irq_sync       <= {LINES{1'b0}};
+      irq_last       <= {LINES{1'b0}};
+      pending        <= {LINES{1'b0}};
+      msi_request    <= 1'b0;
+      msi_vector_num <= 5'd0;
+    end else begin
+      irq_meta <= irq;
+      irq_sync <= irq_meta;
+      irq_last <= irq_sync;
+
+      next = pending | (irq_sync & ~irq_last);
+
+      found = 1'b0;
+      line  = 5'd0;
+      for (i = LINES - 1; i >= 0; i = i - 1) begin
+        if (next[i]) begin
+          found = 1'b1;
+          line  = i;
+        end
+      end
+
+      if (msi_request) begin
+        if (msi_grant)
+          msi_request <= 1'b0;
+      end else if (msi_enable && found) begin
+        next[line]     = 1'b0;
+        msi_request    <= 1'b1;
+        msi_vector_num <= line & vector_mask;
+      end
+
+      pending <= next;
+    end
+  end
 endmodule
@@ -31,6 +31,8 @@ switch $version {
     set BLK_MEM_GEN 8.2
     set AXI_BRAM_CTRL 4.0
     set AXI_PCIE 2.5
+    set AXI_GPIO 2.0
+    set XLCONSTANT 1.1
   } 
   "2015.4" {
     set UTIL_VECTOR_LOGIC 2.0
@@ -38,6 +40,8 @@ switch $version {
     set BLK_MEM_GEN 8.3
     set AXI_BRAM_CTRL 4.0
     set AXI_PCIE 2.7
+    set AXI_GPIO 2.0
+    set XLCONSTANT 1.1
   } 
   "2018.3" {
     set UTIL_VECTOR_LOGIC 2.0
@@ -45,6 +49,8 @@ switch $version {
     set BLK_MEM_GEN 8.4
     set AXI_BRAM_CTRL 4.1
     set AXI_PCIE 2.9
+    set AXI_GPIO 2.0
+    set XLCONSTANT 1.1
   } 
   default {
     puts "Error: unsupported Vivado version!"
@@ -52,6 +58,104 @@ switch $version {
   }
 }
 
+#-------------------------------------------------------
+# Build parameters, set by generate.sh options (Vivado
+# -tclargs). A profile sets several of them, options
+# given after it override single values.
+#   reference      - the tested design: 128 bit AXI,
+#                    128 beat CDMA bursts, no
+#                    interconnect FIFOs, x8 Gen2
+#   max-throughput - 256 bit CDMA and MIG AXI ports,
+#                    256 beat bursts, 512 deep data
+#                    FIFOs and register slices on the
+#                    CDMA, DDR3 and PCIe interconnect
+#                    ports, round robin DDR3 arbitration
+#-------------------------------------------------------
+array set BUILD {
+  profile       reference
+  axi_width     128
+  cdma_burst    128
+  ic_strategy   2
+  ic_fifo       0
+  ic_regslice   0
+  pcie_lanes    8
+  pcie_speed    5.0
+  mig_axi_width 128
+  mig_ordering  Normal
+  mig_arb       RD_PRI_REG
+  impl          0
+}
+
+proc applyProfile {name} {
+  global BUILD
+  switch -- $name {
+    "reference" {
+      array set BUILD {axi_width 128 cdma_burst 128 ic_strategy 2 ic_fifo 0 ic_regslice 0
+                       pcie_lanes 8 pcie_speed 5.0 mig_axi_width 128 mig_ordering Normal mig_arb RD_PRI_REG}
+    }
+    "max-throughput" {
+      array set BUILD {axi_width 256 cdma_burst 256 ic_strategy 2 ic_fifo 2 ic_regslice 1
+                       pcie_lanes 8 pcie_speed 5.0 mig_axi_width 256 mig_ordering Normal mig_arb ROUND_ROBIN}
+    }
+    default {
+      error "unknown profile $name (reference, max-throughput)"
+    }
+  }
+  set BUILD(profile) $name
+}
+
+proc checkParam {name value allowed} {
+  if {[lsearch -exact $allowed $value] < 0} {
+    error "--$name $value: expected one of $allowed"
+  }
+}
+
+proc parseBuildArgs {args} {
+  global BUILD
+  set options {
+    axi-width     axi_width     {32 64 128 256 512}
+    cdma-burst    cdma_burst    {16 32 64 128 256}
+    ic-strategy   ic_strategy   {0 1 2}
+    ic-fifo       ic_fifo       {0 1 2}
+    ic-regslice   ic_regslice   {0 1}
+    pcie-lanes    pcie_lanes    {1 2 4 8}
+    pcie-speed    pcie_speed    {2.5 5.0}
+    mig-axi-width mig_axi_width {64 128 256 512}
+    mig-ordering  mig_ordering  {Normal Strict}
+    mig-arb       mig_arb       {TDM ROUND_ROBIN RD_PRI_REG RD_PRI_REG_STARVE_LIMIT WRITE_PRIORITY WRITE_PRIORITY_REG}
+  }
+
+  for {set i 0} {$i < [llength $args]} {incr i} {
+    set arg [lindex $args $i]
+    if {$arg eq "--impl"} {
+      set BUILD(impl) 1
+      continue
+    }
+    set value [lindex $args [incr i]]
+    if {$arg eq "--profile"} {
+      applyProfile $value
+      continue
+    }
+    set known 0
+    foreach {option key allowed} $options {
+      if {$arg eq "--$option"} {
+        checkParam $option $value $allowed
+        set BUILD($key) $value
+        set known 1
+      }
+    }
+    if {!$known} {
+      error "unknown option $arg"
+    }
+  }
+}
+
+parseBuildArgs {*}$argv
+puts "Build profile: $BUILD(profile)"
+foreach key [lsort [array names BUILD]] {
+  puts "  $key: $BUILD($key)"
+}
+
 #-------------------------------------------------------
 # Procedure:   create_hier_cell_axi_interconnect_block
 # Description: Procedure to create the AXI Interconnect 
@@ -73,6 +177,8 @@ proc create_hier_cell_axi_interconnect_block {} {
   create_bd_intf_pin -mode Master -vlnv xilinx.com:interface:aximm_rtl:1.0 pcie_m_axi
   create_bd_intf_pin -mode Master -vlnv xilinx.com:interface:aximm_rtl:1.0 pcie_m_axi_ctl
   create_bd_intf_pin -mode Master -vlnv xilinx.com:interface:aximm_rtl:1.0 user_m_axi
+  create_bd_intf_pin -mode Master -vlnv xilinx.com:interface:aximm_rtl:1.0 vector_bram_m_axi
+  create_bd_intf_pin -mode Master -vlnv xilinx.com:interface:aximm_rtl:1.0 caps_m_axi
 
   # Create pins
   create_bd_pin -dir I -type clk aclk
@@ -82,10 +188,18 @@ proc create_hier_cell_axi_interconnect_block {} {
   create_bd_pin -dir I -type clk pcie_ctl_aclk
 
   # Create instance: axi_interconnect_1, and set properties
+  # Data FIFOs and register slices (build parameters ic_fifo, ic_regslice) on
+  # the bulk data ports: S00 CDMA data, M02 DDR3, M03 PCIe slave
+  global BUILD
   set axi_interconnect_1 [ create_bd_cell -type ip -vlnv xilinx.com:ip:axi_interconnect:2.1 axi_interconnect_1 ]
   set_property -dict [list CONFIG.NUM_SI {3} \
-                           CONFIG.NUM_MI {5} \
-                           CONFIG.STRATEGY {2}] $axi_interconnect_1
+                           CONFIG.NUM_MI {7} \
+                           CONFIG.STRATEGY $BUILD(ic_strategy)] $axi_interconnect_1
+  set regslice [expr {$BUILD(ic_regslice) ? 4 : 0}]
+  foreach port {S00 M02 M03} {
+    set_property -dict [list CONFIG.${port}_HAS_DATA_FIFO $BUILD(ic_fifo) \
+                             CONFIG.${port}_HAS_REGSLICE $regslice] $axi_interconnect_1
+  }
 
   # Create interface connections
   connect_bd_intf_net -intf_net cdma_data_bus [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/cdma_s_axi] [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S00_AXI]
@@ -96,10 +210,12 @@ proc create_hier_cell_axi_interconnect_block {} {
   connect_bd_intf_net -intf_net pcie_m_axi_bus [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/pcie_m_axi] [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M03_AXI]
   connect_bd_intf_net -intf_net pcie_ctl_bus [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/pcie_m_axi_ctl] [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M04_AXI]
   connect_bd_intf_net -intf_net user_m_axi_bus [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/user_m_axi] [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M02_AXI]
+  connect_bd_intf_net -intf_net vector_bram_axi_bus [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/vector_bram_m_axi] [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M05_AXI]
+  connect_bd_intf_net -intf_net caps_axi_bus [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/caps_m_axi] [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M06_AXI]
 
   # Create port connections
-  connect_bd_net -net aclk [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/aclk] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S00_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M00_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S01_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S02_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M03_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M01_ACLK]
-  connect_bd_net -net aresetn [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/aresetn] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S00_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M00_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M01_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S01_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S02_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M03_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M04_ARESETN]
+  connect_bd_net -net aclk [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/aclk] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S00_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M00_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S01_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S02_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M03_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M01_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M05_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M06_ACLK]
+  connect_bd_net -net aresetn [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/aresetn] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S00_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M00_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M01_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S01_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/S02_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M03_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M04_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M05_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M06_ARESETN]
   connect_bd_net -net user_aclk [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/user_aclk_in] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M02_ACLK]
   connect_bd_net -net user_aresetn [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/user_aresetn_in] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M02_ARESETN]
   connect_bd_net -net pcie_ctl_aclk [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/pcie_ctl_aclk] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/axi_interconnect_1/M04_ACLK]
@@ -139,6 +255,11 @@ proc create_hier_cell_pcie_cdma_subsystem {} {
   create_bd_pin -dir I -type clk pcie_ref_clk_100MHz
   create_bd_pin -dir I -type rst interconnect_aresetn
   create_bd_pin -dir I -type rst peripheral_aresetn
+  create_bd_pin -dir I msi_request
+  create_bd_pin -dir I -from 4 -to 0 msi_vector_num
+  create_bd_pin -dir O msi_grant
+  create_bd_pin -dir O msi_enable
+  create_bd_pin -dir O -from 2 -to 0 msi_vector_width
 
   # Create instance: translation_bram_mem, and set properties
   global BLK_MEM_GEN
@@ -147,26 +268,49 @@ proc create_hier_cell_pcie_cdma_subsystem {} {
 
   # Create instance: axi_cdma_1, and set properties
   set axi_cdma_1 [ create_bd_cell -type ip -vlnv xilinx.com:ip:axi_cdma:4.1 axi_cdma_1 ]
-  set_property -dict [list CONFIG.C_M_AXI_DATA_WIDTH {128} CONFIG.C_M_AXI_MAX_BURST_LEN {128}] $axi_cdma_1
+  global BUILD
+  set_property -dict [list CONFIG.C_M_AXI_DATA_WIDTH $BUILD(axi_width) CONFIG.C_M_AXI_MAX_BURST_LEN $BUILD(cdma_burst)] $axi_cdma_1
 
   # Create instance: axi_pcie_1, and set properties
+  # BAR0 (256K) - translation BRAM, PCIe and CDMA control, capability register,
+  #   vector BRAM (128K, 16384 translation vectors of the descriptor chains)
+  # BAR1 (1G, host BAR 2 with 64 bit BARs) - DDR3 window for programmed I/O of small transfers
+  # Link width and speed from the build parameters (x8 Gen2, 5.0 GT/s, by default),
+  # the driver warns when it trains narrower or slower than the endpoint supports
+  # 8 MSI vectors (2^3) for user logic interrupts, see xpdma_user_irq in the wrapper
+  # AXIBAR2..5 (64M each) - translation windows of the descriptor chains, AXIBAR1
+  #   stays the single 4M window of older drivers
   global AXI_PCIE
   set axi_pcie_1 [ create_bd_cell -type ip -vlnv xilinx.com:ip:axi_pcie:${AXI_PCIE} axi_pcie_1 ]
   set_property -dict [list CONFIG.XLNX_REF_BOARD {KC705_REVC}      \
                            CONFIG.PCIE_CAP_SLOT_IMPLEMENTED {true} \
-                           CONFIG.NO_OF_LANES {X8}                 \
+                           CONFIG.NO_OF_LANES X$BUILD(pcie_lanes)  \
+                           CONFIG.MAX_LINK_SPEED $BUILD(pcie_speed)_GT/s \
                            CONFIG.DEVICE_ID {0x7024}               \
                            CONFIG.BAR_64BIT {true}                 \
                            CONFIG.BAR0_ENABLED {true}              \
                            CONFIG.BAR0_SCALE {Kilobytes}           \
-                           CONFIG.BAR0_SIZE {64}                   \
+                           CONFIG.BAR0_SIZE {256}                  \
                            CONFIG.PCIEBAR2AXIBAR_0 {0x81000000}    \
+                           CONFIG.BAR1_ENABLED {true}              \
+                           CONFIG.BAR1_SCALE {Gigabytes}           \
+                           CONFIG.BAR1_SIZE {1}                    \
+                           CONFIG.PCIEBAR2AXIBAR_1 {0x00000000}    \
                            CONFIG.COMP_TIMEOUT {50ms}              \
-                           CONFIG.AXIBAR_NUM {2}                   \
+                           CONFIG.NUM_MSI_REQ {3}                  \
+                           CONFIG.AXIBAR_NUM {6}                   \
                            CONFIG.AXIBAR_AS_0 {true}               \
                            CONFIG.AXIBAR2PCIEBAR_0 {0xa0000000}    \
                            CONFIG.AXIBAR_AS_1 {true}               \
                            CONFIG.AXIBAR2PCIEBAR_1 {0xc0000000}    \
+                           CONFIG.AXIBAR_AS_2 {true}               \
+                           CONFIG.AXIBAR2PCIEBAR_2 {0x00000000}    \
+                           CONFIG.AXIBAR_AS_3 {true}               \
+                           CONFIG.AXIBAR2PCIEBAR_3 {0x00000000}    \
+                           CONFIG.AXIBAR_AS_4 {true}               \
+                           CONFIG.AXIBAR2PCIEBAR_4 {0x00000000}    \
+                           CONFIG.AXIBAR_AS_5 {true}               \
+                           CONFIG.AXIBAR2PCIEBAR_5 {0x00000000}    \
                            CONFIG.S_AXI_SUPPORTS_NARROW_BURST {true}] $axi_pcie_1
 
   # Create instance: translation_bram, and set properties
@@ -174,13 +318,20 @@ proc create_hier_cell_pcie_cdma_subsystem {} {
   set translation_bram [ create_bd_cell -type ip -vlnv xilinx.com:ip:axi_bram_ctrl:${AXI_BRAM_CTRL} translation_bram ]
   set_property -dict [list CONFIG.DATA_WIDTH {128}] $translation_bram
 
-  # Create instance: Constant block for the PCIe Core
-  set intx_msi_constant [create_bd_cell -type ip -vlnv xilinx.com:ip:xlconstant:1.1 intx_msi_constant]
-  set_property -dict [list CONFIG.CONST_WIDTH {1} CONFIG.CONST_VAL {0}] $intx_msi_constant
-
-  # Create instance: Constant block for the PCIe Core
-  set msi_vector_constant [create_bd_cell -type ip -vlnv xilinx.com:ip:xlconstant:1.1 msi_vector_constant]
-  set_property -dict [list CONFIG.CONST_WIDTH {5} CONFIG.CONST_VAL {0}] $msi_vector_constant
+  # Create instance: vector_bram, vector_bram_mem (translation vectors of long chains)
+  set vector_bram_mem [ create_bd_cell -type ip -vlnv xilinx.com:ip:blk_mem_gen:${BLK_MEM_GEN} vector_bram_mem ]
+  set_property -dict [list CONFIG.Memory_Type {True_Dual_Port_RAM}] $vector_bram_mem
+  set vector_bram [ create_bd_cell -type ip -vlnv xilinx.com:ip:axi_bram_ctrl:${AXI_BRAM_CTRL} vector_bram ]
+  set_property -dict [list CONFIG.DATA_WIDTH {128}] $vector_bram
+
+  # Create instance: caps_reg, caps_value (capability register read by the driver)
+  # 0xC4401A11: magic 0xC4, 4 windows, 2^26 byte windows, 2^17 byte vector BRAM
+  global AXI_GPIO
+  global XLCONSTANT
+  set caps_reg [ create_bd_cell -type ip -vlnv xilinx.com:ip:axi_gpio:${AXI_GPIO} caps_reg ]
+  set_property -dict [list CONFIG.C_GPIO_WIDTH {32} CONFIG.C_ALL_INPUTS {1}] $caps_reg
+  set caps_value [ create_bd_cell -type ip -vlnv xilinx.com:ip:xlconstant:${XLCONSTANT} caps_value ]
+  set_property -dict [list CONFIG.CONST_WIDTH {32} CONFIG.CONST_VAL {0xC4401A11}] $caps_value
 
   # Create instance: axi_interconnect_block
   create_hier_cell_axi_interconnect_block
@@ -197,13 +348,22 @@ proc create_hier_cell_pcie_cdma_subsystem {} {
   connect_bd_intf_net -intf_net translation_bram_bram_portb [get_bd_intf_pins /pcie_cdma_subsystem/translation_bram_mem/BRAM_PORTB] [get_bd_intf_pins /pcie_cdma_subsystem/translation_bram/BRAM_PORTB]
   connect_bd_intf_net -intf_net translation_bram_axi_bus [get_bd_intf_pins /pcie_cdma_subsystem/translation_bram/S_AXI] [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/translation_bram_m_axi]
   connect_bd_intf_net -intf_net user_m_axi_bus [get_bd_intf_pins /pcie_cdma_subsystem/user_m_axi] [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/user_m_axi]
+  connect_bd_intf_net -intf_net vector_bram_bram_porta [get_bd_intf_pins /pcie_cdma_subsystem/vector_bram_mem/BRAM_PORTA] [get_bd_intf_pins /pcie_cdma_subsystem/vector_bram/BRAM_PORTA]
+  connect_bd_intf_net -intf_net vector_bram_bram_portb [get_bd_intf_pins /pcie_cdma_subsystem/vector_bram_mem/BRAM_PORTB] [get_bd_intf_pins /pcie_cdma_subsystem/vector_bram/BRAM_PORTB]
+  connect_bd_intf_net -intf_net vector_bram_axi_bus [get_bd_intf_pins /pcie_cdma_subsystem/vector_bram/S_AXI] [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/vector_bram_m_axi]
+  connect_bd_intf_net -intf_net caps_axi_bus [get_bd_intf_pins /pcie_cdma_subsystem/caps_reg/S_AXI] [get_bd_intf_pins /pcie_cdma_subsystem/axi_interconnect_block/caps_m_axi]
 
   # Create port connections
-  connect_bd_net -net msi_vector_constant_net [get_bd_pins /pcie_cdma_subsystem/msi_vector_constant/dout] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/MSI_Vector_Num]
-  connect_bd_net -net intx_msi_constant_net [get_bd_pins /pcie_cdma_subsystem/intx_msi_constant/dout] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/INTX_MSI_Request]
-  connect_bd_net -net pcie_axi_aclk [get_bd_pins /pcie_cdma_subsystem/user_aclk_out] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/axi_aclk_out] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/axi_aclk] [get_bd_pins /pcie_cdma_subsystem/translation_bram/S_AXI_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_cdma_1/s_axi_lite_aclk] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/aclk] [get_bd_pins /pcie_cdma_subsystem/axi_cdma_1/m_axi_aclk]
+  # MSI requests of the user interrupt arbiter (design wrapper)
+  connect_bd_net -net msi_vector_num [get_bd_pins /pcie_cdma_subsystem/msi_vector_num] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/MSI_Vector_Num]
+  connect_bd_net -net msi_request [get_bd_pins /pcie_cdma_subsystem/msi_request] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/INTX_MSI_Request]
+  connect_bd_net -net msi_grant [get_bd_pins /pcie_cdma_subsystem/msi_grant] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/INTX_MSI_Grant]
+  connect_bd_net -net msi_enable [get_bd_pins /pcie_cdma_subsystem/msi_enable] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/MSI_enable]
+  connect_bd_net -net msi_vector_width [get_bd_pins /pcie_cdma_subsystem/msi_vector_width] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/MSI_Vector_Width]
+  connect_bd_net -net pcie_axi_aclk [get_bd_pins /pcie_cdma_subsystem/user_aclk_out] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/axi_aclk_out] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/axi_aclk] [get_bd_pins /pcie_cdma_subsystem/translation_bram/S_AXI_ACLK] [get_bd_pins /pcie_cdma_subsystem/axi_cdma_1/s_axi_lite_aclk] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/aclk] [get_bd_pins /pcie_cdma_subsystem/axi_cdma_1/m_axi_aclk] [get_bd_pins /pcie_cdma_subsystem/vector_bram/S_AXI_ACLK] [get_bd_pins /pcie_cdma_subsystem/caps_reg/s_axi_aclk]
   connect_bd_net -net pcie_mmcm_lock [get_bd_pins /pcie_cdma_subsystem/mmcm_lock] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/mmcm_lock]
-  connect_bd_net -net axi_peripheral_aresetn [get_bd_pins /pcie_cdma_subsystem/peripheral_aresetn] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/axi_aresetn] [get_bd_pins /pcie_cdma_subsystem/translation_bram/S_AXI_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_cdma_1/s_axi_lite_aresetn]
+  connect_bd_net -net axi_peripheral_aresetn [get_bd_pins /pcie_cdma_subsystem/peripheral_aresetn] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/axi_aresetn] [get_bd_pins /pcie_cdma_subsystem/translation_bram/S_AXI_ARESETN] [get_bd_pins /pcie_cdma_subsystem/axi_cdma_1/s_axi_lite_aresetn] [get_bd_pins /pcie_cdma_subsystem/vector_bram/S_AXI_ARESETN] [get_bd_pins /pcie_cdma_subsystem/caps_reg/s_axi_aresetn]
+  connect_bd_net -net caps_value [get_bd_pins /pcie_cdma_subsystem/caps_value/dout] [get_bd_pins /pcie_cdma_subsystem/caps_reg/gpio_io_i]
   connect_bd_net -net axi_interconnect_aresetn [get_bd_pins /pcie_cdma_subsystem/interconnect_aresetn] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/aresetn]
   connect_bd_net -net sys_clk_1 [get_bd_pins /pcie_cdma_subsystem/pcie_ref_clk_100MHz] [get_bd_pins /pcie_cdma_subsystem/axi_pcie_1/REFCLK]
   connect_bd_net -net user_aclk [get_bd_pins /pcie_cdma_subsystem/user_aclk_in] [get_bd_pins /pcie_cdma_subsystem/axi_interconnect_block/user_aclk_in]
@@ -215,6 +375,30 @@ proc create_hier_cell_pcie_cdma_subsystem {} {
 }
 
 
+#-------------------------------------------------------
+# Procedure:   writeMigConfig
+# Description: Copies the MIG project file with the AXI
+#              port width, ordering and read/write
+#              arbitration of the build parameters
+#-------------------------------------------------------
+proc writeMigConfig {migFile migCopy} {
+  global BUILD
+
+  set in [open $migFile r]
+  set prj [read $in]
+  close $in
+
+  regsub {<C0_S_AXI_DATA_WIDTH>[0-9]+</C0_S_AXI_DATA_WIDTH>} $prj "<C0_S_AXI_DATA_WIDTH>$BUILD(mig_axi_width)</C0_S_AXI_DATA_WIDTH>" prj
+  regsub {<C0_C_RD_WR_ARB_ALGORITHM>[A-Z_]+</C0_C_RD_WR_ARB_ALGORITHM>} $prj "<C0_C_RD_WR_ARB_ALGORITHM>$BUILD(mig_arb)</C0_C_RD_WR_ARB_ALGORITHM>" prj
+  regsub {<Ordering>[A-Za-z]+</Ordering>} $prj "<Ordering>$BUILD(mig_ordering)</Ordering>" prj
+
+  file mkdir [file dirname $migCopy]
+  set out [open $migCopy w]
+  puts -nonewline $out $prj
+  close $out
+}
+
+
 #-------------------------------------------------------
 # Procedure:   generateSubsystem
 # Description: Procedure to generate the block diagram 
@@ -244,6 +428,11 @@ proc generateSubsystem {migFile projName designName} {
   create_bd_port -dir I -type rst reset_logic_mmcm_locked_in
   create_bd_port -dir O pcie_mmcm_locked
   create_bd_port -dir O ddr_rdy
+  create_bd_port -dir I msi_request
+  create_bd_port -dir I -from 4 -to 0 msi_vector_num
+  create_bd_port -dir O msi_grant
+  create_bd_port -dir O msi_enable
+  create_bd_port -dir O -from 2 -to 0 msi_vector_width
 
   # Create instance: proc_sys_reset_1, and set properties
   set proc_sys_reset_1 [ create_bd_cell -type ip -vlnv xilinx.com:ip:proc_sys_reset:5.0 proc_sys_reset_1 ]
@@ -256,7 +445,7 @@ proc generateSubsystem {migFile projName designName} {
   # Create Instance ddr3_mem and set properties
   global MIG_7SERIES
   set ddr_mem [ create_bd_cell -type ip -vlnv xilinx.com:ip:mig_7series:${MIG_7SERIES} ddr3_mem ]
-  file copy ${migFile} ./${projName}/${projName}.srcs/sources_1/bd/${designName}/ip/${designName}_ddr3_mem_0/mig_a.prj
+  writeMigConfig ${migFile} ./${projName}/${projName}.srcs/sources_1/bd/${designName}/ip/${designName}_ddr3_mem_0/mig_a.prj
   set_property CONFIG.XML_INPUT_FILE {mig_a.prj} $ddr_mem
 
   # Create instance: pcie_cdma_subsystem
@@ -280,6 +469,11 @@ proc generateSubsystem {migFile projName designName} {
   connect_bd_net -net sys_reset [get_bd_ports /EXT_SYS_RST] [get_bd_pins /ddr3_mem/sys_rst] [get_bd_pins /proc_sys_reset_1/ext_reset_in]
   connect_bd_net -net ddr_reset_out [get_bd_pins /ddr3_mem/ui_clk_sync_rst] [get_bd_pins /ddr_reset_inv/Op1] [get_bd_ports /ddr_rst]
   connect_bd_net -net ddr3_aresetn [get_bd_pins /ddr_reset_inv/Res] [get_bd_pins /pcie_cdma_subsystem/user_aresetn_in]
+  connect_bd_net -net msi_request [get_bd_ports /msi_request] [get_bd_pins /pcie_cdma_subsystem/msi_request]
+  connect_bd_net -net msi_vector_num [get_bd_ports /msi_vector_num] [get_bd_pins /pcie_cdma_subsystem/msi_vector_num]
+  connect_bd_net -net msi_grant [get_bd_ports /msi_grant] [get_bd_pins /pcie_cdma_subsystem/msi_grant]
+  connect_bd_net -net msi_enable [get_bd_ports /msi_enable] [get_bd_pins /pcie_cdma_subsystem/msi_enable]
+  connect_bd_net -net msi_vector_width [get_bd_ports /msi_vector_width] [get_bd_pins /pcie_cdma_subsystem/msi_vector_width]
 
   # Create address segments
   # DMA Data Port
@@ -289,6 +483,12 @@ proc generateSubsystem {migFile projName designName} {
   create_bd_addr_seg -range 4M  -offset 0x80000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data] [get_bd_addr_segs /pcie_cdma_subsystem/axi_pcie_1/S_AXI/BAR1] DMA_2_PcieDM
   create_bd_addr_seg -range 1G  -offset 0x00000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data] [get_bd_addr_segs /ddr3_mem/memmap/memaddr] DMA_2_Ddr3
   create_bd_addr_seg -range 16K -offset 0x8100C000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data] [get_bd_addr_segs /pcie_cdma_subsystem/axi_cdma_1/S_AXI_LITE/Reg] DMA_2_PCIe
+  create_bd_addr_seg -range 4K  -offset 0x81010000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data] [get_bd_addr_segs /pcie_cdma_subsystem/caps_reg/S_AXI/Reg] DMA_2_Caps
+  create_bd_addr_seg -range 128K -offset 0x81020000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data] [get_bd_addr_segs /pcie_cdma_subsystem/vector_bram/S_AXI/Mem0] DMA_2_VecBram
+  create_bd_addr_seg -range 64M -offset 0x90000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data] [get_bd_addr_segs /pcie_cdma_subsystem/axi_pcie_1/S_AXI/BAR2] DMA_2_PcieWin0
+  create_bd_addr_seg -range 64M -offset 0x94000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data] [get_bd_addr_segs /pcie_cdma_subsystem/axi_pcie_1/S_AXI/BAR3] DMA_2_PcieWin1
+  create_bd_addr_seg -range 64M -offset 0x98000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data] [get_bd_addr_segs /pcie_cdma_subsystem/axi_pcie_1/S_AXI/BAR4] DMA_2_PcieWin2
+  create_bd_addr_seg -range 64M -offset 0x9C000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data] [get_bd_addr_segs /pcie_cdma_subsystem/axi_pcie_1/S_AXI/BAR5] DMA_2_PcieWin3
 
   # DMA SG Port
   create_bd_addr_seg -range 4M  -offset 0x80800000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data_SG] [get_bd_addr_segs /pcie_cdma_subsystem/axi_pcie_1/S_AXI/BAR0] DMAsg_2_PcieSG
@@ -297,6 +497,7 @@ proc generateSubsystem {migFile projName designName} {
   create_bd_addr_seg -range 32K -offset 0x81000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data_SG] [get_bd_addr_segs /pcie_cdma_subsystem/translation_bram/S_AXI/Mem0] DMAsg_2_TransBram
   create_bd_addr_seg -range 1G  -offset 0x00000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data_SG] [get_bd_addr_segs /ddr3_mem/memmap/memaddr] DMAsg_2_Ddr3
   create_bd_addr_seg -range 16K -offset 0x81008000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data_SG] [get_bd_addr_segs /pcie_cdma_subsystem/axi_pcie_1/S_AXI_CTL/CTL0] DMAsg_2_PcieCtl
+  create_bd_addr_seg -range 128K -offset 0x81020000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_cdma_1/Data_SG] [get_bd_addr_segs /pcie_cdma_subsystem/vector_bram/S_AXI/Mem0] DMAsg_2_VecBram
 
   # PCIe Master Port
   create_bd_addr_seg -range 32K -offset 0x81000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_pcie_1/M_AXI] [get_bd_addr_segs /pcie_cdma_subsystem/translation_bram/S_AXI/Mem0] PCIe_2_TransBram
@@ -305,6 +506,8 @@ proc generateSubsystem {migFile projName designName} {
   create_bd_addr_seg -range 4M  -offset 0x80800000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_pcie_1/M_AXI] [get_bd_addr_segs /pcie_cdma_subsystem/axi_pcie_1/S_AXI/BAR0] PCIeSG_2_DMA
   create_bd_addr_seg -range 4M  -offset 0x80000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_pcie_1/M_AXI] [get_bd_addr_segs /pcie_cdma_subsystem/axi_pcie_1/S_AXI/BAR1] PCIeDM_2_DMA
   create_bd_addr_seg -range 1G  -offset 0x00000000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_pcie_1/M_AXI] [get_bd_addr_segs /ddr3_mem/memmap/memaddr] PCIe_2_Ddr3
+  create_bd_addr_seg -range 4K  -offset 0x81010000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_pcie_1/M_AXI] [get_bd_addr_segs /pcie_cdma_subsystem/caps_reg/S_AXI/Reg] PCIe_2_Caps
+  create_bd_addr_seg -range 128K -offset 0x81020000 [get_bd_addr_spaces /pcie_cdma_subsystem/axi_pcie_1/M_AXI] [get_bd_addr_segs /pcie_cdma_subsystem/vector_bram/S_AXI/Mem0] PCIe_2_VecBram
 }
 
 
@@ -371,12 +574,56 @@ proc runSynthAndImpl {constraintsFile designWrapperFile} {
 }
 
 
+#-------------------------------------------------------
+# Procedure:   writeReports
+# Description: Writes utilization and timing reports of
+#              the implemented design and a summary with
+#              the build parameters to
+#              reports/<profile>/
+#-------------------------------------------------------
+proc writeReports {} {
+  global BUILD
+
+  set dir "./reports/$BUILD(profile)"
+  file mkdir $dir
+  open_run impl_1
+
+  report_utilization -file ${dir}/utilization.rpt
+  report_timing_summary -max_paths 10 -file ${dir}/timing_summary.rpt
+  set util [report_utilization -return_string]
+
+  set out [open ${dir}/summary.txt w]
+  puts $out "profile: $BUILD(profile)"
+  foreach key [lsort [array names BUILD]] {
+    puts $out "  $key: $BUILD($key)"
+  }
+  puts $out "timing:"
+  puts $out "  WNS: [get_property STATS.WNS [get_runs impl_1]] ns"
+  puts $out "  TNS: [get_property STATS.TNS [get_runs impl_1]] ns"
+  puts $out "  WHS: [get_property STATS.WHS [get_runs impl_1]] ns"
+  puts $out "utilization (used / available):"
+  foreach site {"Slice LUTs" "Slice Registers" "Block RAM Tile" "DSPs"} {
+    set pattern [string map [list @SITE@ $site] {^\| @SITE@\*? +\| +([0-9.]+) +\| +[0-9.]+ +\| +([0-9.]+) +\|}]
+    if {[regexp -line $pattern $util -> used avail]} {
+      puts $out "  ${site}: $used / $avail"
+    }
+  }
+  close $out
+
+  puts "Reports written to $dir"
+}
+
+
 # Run the procedure to generate the project and block diagram
 generateProject $CONSTRAINTS_FILE $DESIGN_WRAPPER_FILE $MIG_FILE
 
 # Uncomment the following line to run Synthesis and Implementation on 
-# the design during generation
+# the design during generation (generate.sh --impl does it and writes reports)
 #runSynthAndImpl
+if {$BUILD(impl)} {
+  runSynthAndImpl $CONSTRAINTS_FILE $DESIGN_WRAPPER_FILE
+  writeReports
+}
 
 # Print out completion message
 puts "Generation of the subsystem has completed."
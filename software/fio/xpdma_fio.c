@@ -0,0 +1,293 @@
+//
+// fio external ioengine for XPDMA boards: fio jobs read and write board DDR
+// through libxpdma (xpdma_sendEx/xpdma_recvEx), fio measures latency
+// percentiles and bandwidth as for any other device.
+//
+// Usage: ioengine=external:/path/to/xpdma_fio.so, see xpdma.fio
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fio.h"
+#include "optgroup.h"
+
+#include "xpdma.h"
+
+struct xpdma_fio_options {
+    void *pad; // fio keeps the thread_data pointer in the first member
+    unsigned int board;
+    unsigned int mode;
+    unsigned int zeroCopy;
+    unsigned int highPrio;
+    unsigned int regCache;
+    unsigned int numaBind;
+};
+
+struct xpdma_fio_data {
+    xpdma_t *fpga;
+    unsigned int flags;
+};
+
+static struct fio_option options[] = {
+    {
+        .name     = "board",
+        .lname    = "XPDMA board",
+        .type     = FIO_OPT_INT,
+        .off1     = offsetof(struct xpdma_fio_options, board),
+        .def      = "0",
+        .minval   = 0,
+        .maxval   = XPDMA_NUM_MAX - 1,
+        .help     = "Board number (as xpdma_open)",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "xpdma_mode",
+        .lname    = "XPDMA transfer mode",
+        .type     = FIO_OPT_STR,
+        .off1     = offsetof(struct xpdma_fio_options, mode),
+        .def      = "auto",
+        .help     = "How transfers are done",
+        .posval   = {
+            { .ival = "auto",   .oval = 0,                    .help = "Driver picks programmed I/O or DMA by size" },
+            { .ival = "dma",    .oval = XPDMA_FLAG_FORCE_DMA, .help = "Always the CDMA engine (descriptor chain)" },
+            { .ival = "pio",    .oval = XPDMA_FLAG_FORCE_PIO, .help = "Always programmed I/O through the DDR window" },
+            { .ival = "simple", .oval = XPDMA_FLAG_SIMPLE,    .help = "Simple (register programmed) CDMA mode" },
+        },
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "zero_copy",
+        .lname    = "XPDMA zero copy",
+        .type     = FIO_OPT_BOOL,
+        .off1     = offsetof(struct xpdma_fio_options, zeroCopy),
+        .def      = "0",
+        .help     = "DMA directly from/to the fio buffers (XPDMA_FLAG_ZERO_COPY)",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "high_prio",
+        .lname    = "XPDMA high priority",
+        .type     = FIO_OPT_BOOL,
+        .off1     = offsetof(struct xpdma_fio_options, highPrio),
+        .def      = "0",
+        .help     = "Latency-critical requests (XPDMA_FLAG_PRIO_HIGH)",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "reg_cache",
+        .lname    = "XPDMA registration cache",
+        .type     = FIO_OPT_INT,
+        .off1     = offsetof(struct xpdma_fio_options, regCache),
+        .def      = "0",
+        .help     = "Zero copy buffers kept registered (xpdma_setRegCache, 0 - pin per call)",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "numa_bind",
+        .lname    = "XPDMA NUMA bind",
+        .type     = FIO_OPT_BOOL,
+        .off1     = offsetof(struct xpdma_fio_options, numaBind),
+        .def      = "1",
+        .help     = "Run the job and place its buffers on the board NUMA node",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name = NULL,
+    },
+};
+
+/**
+ * Board of the job, opened on first use: fio may allocate I/O buffers before
+ * or after the engine init hook depending on its version
+ */
+static struct xpdma_fio_data *xpdma_fio_board(struct thread_data *td)
+{
+    struct xpdma_fio_options *o = td->eo;
+    struct xpdma_fio_data *xd = td->io_ops_data;
+
+    if (xd != NULL)
+        return xd;
+
+    xd = calloc(1, sizeof(*xd));
+    if (xd == NULL)
+        return NULL;
+
+    xd->fpga = xpdma_open(o->board);
+    if (xd->fpga == NULL) {
+        log_err("xpdma: can't open board %u\n", o->board);
+        free(xd);
+        return NULL;
+    }
+
+    xd->flags = o->mode;
+    if (o->zeroCopy)
+        xd->flags |= XPDMA_FLAG_ZERO_COPY;
+    if (o->highPrio)
+        xd->flags |= XPDMA_FLAG_PRIO_HIGH;
+
+    if (o->numaBind) {
+        xpdma_setNumaBind(xd->fpga, 1);
+        xpdma_bindThread(xd->fpga);
+    }
+    if (o->regCache && xpdma_setRegCache(xd->fpga, o->regCache))
+        log_info("xpdma: registration cache not available, pinning per call\n");
+
+    td->io_ops_data = xd;
+    return xd;
+}
+
+/**
+ * File size is the board DDR3 (XPDMA_PARAM_DDR_SIZE). Called in the fio main
+ * process, so the board is opened only for the query.
+ */
+static int xpdma_fio_setup(struct thread_data *td)
+{
+    struct xpdma_fio_options *o = td->eo;
+    uint64_t size = 0;
+    struct fio_file *f;
+    xpdma_t *fpga;
+    unsigned int i;
+
+    fpga = xpdma_open(o->board);
+    if (fpga == NULL) {
+        log_err("xpdma: can't open board %u\n", o->board);
+        return 1;
+    }
+    if (xpdma_getParam(fpga, XPDMA_PARAM_DDR_SIZE, &size) || size == 0) {
+        log_err("xpdma: can't get the DDR3 size of board %u\n", o->board);
+        xpdma_close(fpga);
+        return 1;
+    }
+    xpdma_close(fpga);
+
+    for_each_file(td, f, i) {
+        f->real_file_size = size;
+        fio_file_set_size_known(f);
+    }
+
+    return 0;
+}
+
+static int xpdma_fio_init(struct thread_data *td)
+{
+    return xpdma_fio_board(td) == NULL;
+}
+
+static void xpdma_fio_cleanup(struct thread_data *td)
+{
+    struct xpdma_fio_data *xd = td->io_ops_data;
+
+    if (xd == NULL)
+        return;
+
+    xpdma_close(xd->fpga);
+    free(xd);
+    td->io_ops_data = NULL;
+}
+
+static int xpdma_fio_prep(struct thread_data *td, struct io_u *io_u)
+{
+    if (io_u->ddir != DDIR_READ && io_u->ddir != DDIR_WRITE)
+        return 0;
+
+    // AXI transfers are word aligned and stay inside the board DDR3
+    if ((io_u->offset % 4) || (io_u->xfer_buflen % 4) ||
+        io_u->offset + io_u->xfer_buflen > io_u->file->real_file_size) {
+        io_u->error = EINVAL;
+        return 1;
+    }
+
+    return 0;
+}
+
+static enum fio_q_status xpdma_fio_queue(struct thread_data *td, struct io_u *io_u)
+{
+    struct xpdma_fio_data *xd = td->io_ops_data;
+    int result;
+
+    fio_ro_check(td, io_u);
+    errno = 0;
+
+    switch (io_u->ddir) {
+    case DDIR_WRITE:
+        result = xpdma_sendEx(xd->fpga, io_u->xfer_buf, io_u->xfer_buflen,
+                              (unsigned int)io_u->offset, xd->flags);
+        break;
+    case DDIR_READ:
+        result = xpdma_recvEx(xd->fpga, io_u->xfer_buf, io_u->xfer_buflen,
+                              (unsigned int)io_u->offset, xd->flags);
+        break;
+    case DDIR_SYNC:
+    case DDIR_DATASYNC:
+        // staged (write coalesced) data
+        result = xpdma_flush(xd->fpga);
+        break;
+    default:
+        io_u->error = EINVAL;
+        return FIO_Q_COMPLETED;
+    }
+
+    if (result) {
+        io_u->error = errno ? errno : EIO;
+        io_u->resid = io_u->xfer_buflen;
+    }
+
+    return FIO_Q_COMPLETED;
+}
+
+static int xpdma_fio_open_file(struct thread_data *td, struct fio_file *f)
+{
+    return 0;
+}
+
+static int xpdma_fio_close_file(struct thread_data *td, struct fio_file *f)
+{
+    return 0;
+}
+
+/**
+ * I/O buffers on the board NUMA node
+ */
+static int xpdma_fio_iomem_alloc(struct thread_data *td, size_t total_mem)
+{
+    struct xpdma_fio_data *xd = xpdma_fio_board(td);
+
+    if (xd == NULL)
+        return 1;
+
+    td->orig_buffer = xpdma_allocBuffer(xd->fpga, total_mem);
+    return td->orig_buffer == NULL;
+}
+
+static void xpdma_fio_iomem_free(struct thread_data *td)
+{
+    if (td->orig_buffer != NULL)
+        xpdma_freeBuffer(td->orig_buffer, td->orig_buffer_size);
+    td->orig_buffer = NULL;
+}
+
+// non static: fio looks the engine up by this symbol name
+struct ioengine_ops ioengine = {
+    .name               = "xpdma",
+    .version            = FIO_IOOPS_VERSION,
+    .flags              = FIO_SYNCIO | FIO_DISKLESSIO | FIO_NOEXTEND,
+    .setup              = xpdma_fio_setup,
+    .init               = xpdma_fio_init,
+    .prep               = xpdma_fio_prep,
+    .queue              = xpdma_fio_queue,
+    .cleanup            = xpdma_fio_cleanup,
+    .open_file          = xpdma_fio_open_file,
+    .close_file         = xpdma_fio_close_file,
+    .iomem_alloc        = xpdma_fio_iomem_alloc,
+    .iomem_free         = xpdma_fio_iomem_free,
+    .options            = options,
+    .option_struct_size = sizeof(struct xpdma_fio_options),
+};
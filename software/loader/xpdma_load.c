@@ -0,0 +1,85 @@
+//
+// Load a file into board DDR or dump DDR to a file through the pipelined
+// streaming of libxpdma (xpdma_loadFile/xpdma_dumpFile), with per stage
+// throughput: the sustained rate should be close to the slower stage.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "xpdma.h"
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-d] [-b board] [-a ddr_addr] [-o file_offset] [-n count] file\n", name);
+    printf("  -d  dump DDR to the file (default: load the file to DDR)\n");
+    printf("  -b  board number (default 0)\n");
+    printf("  -a  DDR address, multiple of 4 (default 0)\n");
+    printf("  -o  file offset (default 0, multiple of 4096 for O_DIRECT)\n");
+    printf("  -n  bytes (default: to the end of the file for a load, required for a dump)\n");
+}
+
+static double rate(uint64_t bytes, double seconds)
+{
+    return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    xpdma_stream_stats_t stats;
+    unsigned long long offset = 0;
+    unsigned long long count = 0;
+    unsigned long addr = 0;
+    int board = 0;
+    int dump = 0;
+    xpdma_t *fpga;
+    int result;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "db:a:o:n:h")) != -1) {
+        switch (opt) {
+        case 'd': dump = 1; break;
+        case 'b': board = atoi(optarg); break;
+        case 'a': addr = strtoul(optarg, NULL, 0); break;
+        case 'o': offset = strtoull(optarg, NULL, 0); break;
+        case 'n': count = strtoull(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1 || (dump && count == 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fpga = xpdma_open(board);
+    if (fpga == NULL) {
+        printf("Can't open board %d\n", board);
+        return 1;
+    }
+
+    if (dump)
+        result = xpdma_dumpFile(fpga, argv[optind], offset, count, addr, &stats);
+    else
+        result = xpdma_loadFile(fpga, argv[optind], offset, count, addr, &stats);
+
+    xpdma_close(fpga);
+
+    if (result) {
+        printf("%s failed\n", dump ? "Dump" : "Load");
+        return 1;
+    }
+
+    printf("%s %llu bytes %s %s (O_DIRECT %s, zero copy %s)\n", dump ? "Dumped" : "Loaded",
+           (unsigned long long)stats.bytes, dump ? "to" : "from", argv[optind],
+           stats.direct ? "on" : "off", stats.zeroCopy ? "on" : "off");
+    printf("%-10s %10s %10s\n", "stage", "busy s", "MB/s");
+    printf("%-10s %10.3f %10.1f\n", "file", stats.fileSeconds, rate(stats.bytes, stats.fileSeconds));
+    printf("%-10s %10.3f %10.1f\n", "dma", stats.dmaSeconds, rate(stats.bytes, stats.dmaSeconds));
+    printf("%-10s %10.3f %10.1f\n", "sustained", stats.seconds, rate(stats.bytes, stats.seconds));
+
+    return 0;
+}
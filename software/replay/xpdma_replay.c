@@ -0,0 +1,562 @@
+//
+// Replay of a libxpdma trace (xpdma_traceStart or XPDMA_TRACE=<file>): the
+// recorded calls are issued again, one replay thread per recorded thread, at
+// the recorded times or back to back, against the boards or an emulated
+// backend that only waits for the recorded (or modelled) call duration.
+// Prints recorded and replayed call latency per operation.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "xpdma.h"
+
+#define REPLAY_DEVICES  65536   // handle numbers of a trace
+#define REPLAY_THREADS  1024    // recorded threads replayed
+
+static const char *opNames[XPDMA_OP_NUM] = {
+    "open", "close", "send", "recv", "send_reg", "recv_reg", "sendv", "recvv", "flush",
+    "copy_p2p", "send_xform", "recv_xform", "load_file", "dump_file", "set_param",
+    "set_coalesce", "set_regcache", "register", "unregister",
+};
+
+struct replay_opts {
+    int fast;                   // back to back instead of the recorded times
+    int emulate;                // no board: wait for the call duration
+    double speed;               // recorded time scale of timed replays
+    double bandwidth;           // emulation model, bytes/ns (0 - recorded durations)
+    uint64_t latencyNs;
+    int board;                  // every handle on this board (-1 - recorded boards)
+};
+
+struct replay_device {
+    int used;
+    int board;
+    xpdma_t *fpga;
+};
+
+// Registered buffer of the trace, replaced by one of the largest size it was used with
+struct replay_reg {
+    uint16_t device;
+    uint32_t reg;
+    size_t size;
+    void *data;
+    uint32_t handle;
+    int registered;
+};
+
+struct replay_stats {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t failures;
+    uint64_t recordedNs;
+    uint64_t recordedMaxNs;
+    uint64_t replayedNs;
+    uint64_t replayedMaxNs;
+};
+
+struct replay_thread {
+    uint32_t tid;
+    uint32_t *recs;             // record indices in trace order
+    size_t n;
+    size_t cap;
+    size_t bufSize;
+    uint16_t bufDevice;         // handle whose board node gets the buffer
+    void *buf;
+    pthread_t thread;
+    struct replay_stats stats[XPDMA_OP_NUM];
+};
+
+static struct replay_opts opts = {0, 0, 1.0, 0, 0, -1};
+static const xpdma_trace_rec_t *recs;
+static size_t nrRecs;
+static struct replay_device *devices;
+static struct replay_reg *regs;
+static size_t nrRegs;
+static struct replay_thread *threads;
+static size_t nrThreads;
+static uint64_t traceBase;      // first recorded call start
+static uint64_t replayBase;     // replay start, CLOCK_MONOTONIC ns
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t ns)
+{
+    struct timespec ts = {(time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int isTransfer(int op)
+{
+    return op >= XPDMA_OP_SEND && op <= XPDMA_OP_DUMP_FILE;
+}
+
+static struct replay_reg *findReg(uint16_t device, uint32_t reg)
+{
+    size_t c;
+
+    for (c = 0; c < nrRegs; ++c)
+        if (regs[c].device == device && regs[c].reg == reg)
+            return &regs[c];
+    return NULL;
+}
+
+static struct replay_thread *findThread(uint32_t tid)
+{
+    size_t c;
+
+    for (c = 0; c < nrThreads; ++c)
+        if (threads[c].tid == tid)
+            return &threads[c];
+    if (nrThreads == REPLAY_THREADS)
+        return NULL;
+    threads[nrThreads].tid = tid;
+    return &threads[nrThreads++];
+}
+
+static int loadTrace(const char *path)
+{
+    xpdma_trace_header_t header;
+    xpdma_trace_rec_t *data;
+    long size;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        printf("Can't open %s\n", path);
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, XPDMA_TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != XPDMA_TRACE_VERSION || header.recordSize != sizeof(xpdma_trace_rec_t)) {
+        printf("%s is not an XPDMA trace of this version\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f) - (long)sizeof(header);
+    fseek(f, sizeof(header), SEEK_SET);
+
+    nrRecs = size / sizeof(xpdma_trace_rec_t);
+    data = (xpdma_trace_rec_t *)malloc(nrRecs ? nrRecs * sizeof(*data) : 1);
+    if (data == NULL || fread(data, sizeof(*data), nrRecs, f) != nrRecs) {
+        printf("Can't read %s\n", path);
+        free(data);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    recs = data;
+    return 0;
+}
+
+// Records are in completion order, replay threads issue them in start order
+static int compareStart(const void *a, const void *b)
+{
+    const xpdma_trace_rec_t *ra = &recs[*(const uint32_t *)a];
+    const xpdma_trace_rec_t *rb = &recs[*(const uint32_t *)b];
+
+    if (ra->start != rb->start)
+        return ra->start < rb->start ? -1 : 1;
+    return 0;
+}
+
+// Handles, registered buffers and per thread buffer sizes used by the trace
+static int scanTrace(void)
+{
+    const xpdma_trace_rec_t *rec;
+    struct replay_thread *th;
+    struct replay_reg *reg;
+    xpdma_transform_t tf;
+    size_t need;
+    size_t c;
+
+    devices = (struct replay_device *)calloc(REPLAY_DEVICES, sizeof(*devices));
+    threads = (struct replay_thread *)calloc(REPLAY_THREADS, sizeof(*threads));
+    regs = (struct replay_reg *)calloc(nrRecs ? nrRecs : 1, sizeof(*regs));
+    if (devices == NULL || threads == NULL || regs == NULL)
+        return -1;
+
+    traceBase = nrRecs ? recs[0].start : 0;
+    for (c = 0; c < nrRecs; ++c) {
+        rec = &recs[c];
+        if (rec->start < traceBase)
+            traceBase = rec->start;
+        if (rec->op >= XPDMA_OP_NUM) {
+            printf("Record %zu: unknown operation %u\n", c, rec->op);
+            return -1;
+        }
+
+        if (rec->device != 0 && !devices[rec->device].used) {
+            devices[rec->device].used = 1;
+            devices[rec->device].board = (opts.board >= 0) ? opts.board : rec->board;
+        }
+
+        th = findThread(rec->thread);
+        if (th == NULL) {
+            printf("More than %d threads in the trace\n", REPLAY_THREADS);
+            return -1;
+        }
+        if (th->n == th->cap) {
+            th->cap = th->cap ? th->cap * 2 : 1024;
+            th->recs = (uint32_t *)realloc(th->recs, th->cap * sizeof(*th->recs));
+            if (th->recs == NULL)
+                return -1;
+        }
+        th->recs[th->n++] = c;
+
+        need = 0;
+        switch (rec->op) {
+        case XPDMA_OP_SEND:
+        case XPDMA_OP_RECV:
+        case XPDMA_OP_SENDV:
+        case XPDMA_OP_RECVV:
+            need = rec->count;
+            break;
+        case XPDMA_OP_SEND_TRANSFORM:
+        case XPDMA_OP_RECV_TRANSFORM:
+            xpdma_trace_unpackTransform(rec->arg, &tf);
+            need = xpdma_transformSize(&tf, rec->count);
+            break;
+        case XPDMA_OP_REGISTER:
+        case XPDMA_OP_SEND_REG:
+        case XPDMA_OP_RECV_REG:
+            // buffers registered before the trace started are only seen in transfers
+            reg = findReg(rec->device, rec->reg);
+            if (reg == NULL) {
+                reg = &regs[nrRegs++];
+                reg->device = rec->device;
+                reg->reg = rec->reg;
+            }
+            need = (rec->op == XPDMA_OP_REGISTER) ? rec->count : rec->arg + rec->count;
+            if (need > reg->size)
+                reg->size = need;
+            need = 0;
+            break;
+        }
+        if (need > th->bufSize) {
+            th->bufSize = need;
+            th->bufDevice = rec->device;
+        }
+    }
+
+    for (c = 0; c < nrThreads; ++c)
+        qsort(threads[c].recs, threads[c].n, sizeof(uint32_t), compareStart);
+    return 0;
+}
+
+static int setup(void)
+{
+    size_t c;
+
+    if (opts.emulate)
+        return 0;
+
+    for (c = 0; c < REPLAY_DEVICES; ++c) {
+        if (!devices[c].used)
+            continue;
+        devices[c].fpga = xpdma_open(devices[c].board);
+        if (devices[c].fpga == NULL) {
+            printf("Can't open board %d\n", devices[c].board);
+            return -1;
+        }
+    }
+
+    for (c = 0; c < nrRegs; ++c) {
+        xpdma_t *fpga = devices[regs[c].device].fpga;
+        if (fpga == NULL || regs[c].size == 0)
+            continue;
+        regs[c].data = xpdma_allocBuffer(fpga, regs[c].size);
+        if (regs[c].data == NULL)
+            return -1;
+        memset(regs[c].data, 0, regs[c].size);
+        if (xpdma_registerBuffer(fpga, regs[c].data, regs[c].size, &regs[c].handle)) {
+            printf("Can't register a %zu byte buffer\n", regs[c].size);
+            return -1;
+        }
+        regs[c].registered = 1;
+    }
+
+    for (c = 0; c < nrThreads; ++c) {
+        if (threads[c].bufSize == 0)
+            continue;
+        threads[c].buf = xpdma_allocBuffer(devices[threads[c].bufDevice].fpga, threads[c].bufSize);
+        if (threads[c].buf == NULL) {
+            printf("Can't allocate a %zu byte buffer\n", threads[c].bufSize);
+            return -1;
+        }
+        memset(threads[c].buf, 0, threads[c].bufSize);
+    }
+    return 0;
+}
+
+static void cleanup(void)
+{
+    size_t c;
+
+    for (c = 0; c < nrThreads; ++c) {
+        if (threads[c].buf != NULL)
+            xpdma_freeBuffer(threads[c].buf, threads[c].bufSize);
+        free(threads[c].recs);
+    }
+    for (c = 0; c < nrRegs; ++c) {
+        if (regs[c].registered)
+            xpdma_unregisterBuffer(devices[regs[c].device].fpga, regs[c].handle);
+        if (regs[c].data != NULL)
+            xpdma_freeBuffer(regs[c].data, regs[c].size);
+    }
+    for (c = 0; c < REPLAY_DEVICES && devices != NULL; ++c)
+        if (devices[c].fpga != NULL)
+            xpdma_close(devices[c].fpga);
+}
+
+static void issueVector(xpdma_t *fpga, const xpdma_trace_rec_t *rec, char *buf, int *result)
+{
+    struct iovec iov[64];
+    size_t pieces = rec->arg < 1 ? 1 : (rec->arg > 64 ? 64 : rec->arg);
+    size_t piece;
+    size_t c;
+
+    if (pieces > rec->count)
+        pieces = rec->count ? rec->count : 1;
+    piece = rec->count / pieces;
+    for (c = 0; c < pieces; ++c) {
+        iov[c].iov_base = buf + c * piece;
+        iov[c].iov_len = (c == pieces - 1) ? rec->count - c * piece : piece;
+    }
+
+    if (rec->op == XPDMA_OP_SENDV)
+        *result = xpdma_sendv(fpga, iov, pieces, rec->addr) < 0;
+    else
+        *result = xpdma_recvv(fpga, iov, pieces, rec->addr) < 0;
+}
+
+// Issue one recorded call, returns 0 if it was not replayed (handle setup)
+static int issue(struct replay_thread *th, const xpdma_trace_rec_t *rec, int *result)
+{
+    xpdma_t *fpga = devices[rec->device].fpga;
+    struct replay_reg *reg;
+    xpdma_transform_t tf;
+    uint64_t ns;
+
+    *result = 0;
+    if (rec->op == XPDMA_OP_OPEN || rec->op == XPDMA_OP_CLOSE ||
+        rec->op == XPDMA_OP_REGISTER || rec->op == XPDMA_OP_UNREGISTER)
+        return 0;
+
+    if (opts.emulate) {
+        if (!isTransfer(rec->op))
+            return 1;
+        if (opts.bandwidth > 0)
+            ns = opts.latencyNs + (uint64_t)(rec->count / opts.bandwidth);
+        else
+            ns = rec->end - rec->start;
+        sleepUntil(now() + ns);
+        return 1;
+    }
+
+    switch (rec->op) {
+    case XPDMA_OP_SEND:
+        *result = xpdma_sendEx(fpga, th->buf, rec->count, rec->addr, rec->flags);
+        break;
+    case XPDMA_OP_RECV:
+        *result = xpdma_recvEx(fpga, th->buf, rec->count, rec->addr, rec->flags);
+        break;
+    case XPDMA_OP_SEND_REG:
+    case XPDMA_OP_RECV_REG:
+        reg = findReg(rec->device, rec->reg);
+        if (rec->op == XPDMA_OP_SEND_REG)
+            *result = xpdma_sendReg(fpga, reg->handle, rec->arg, rec->count, rec->addr, rec->flags);
+        else
+            *result = xpdma_recvReg(fpga, reg->handle, rec->arg, rec->count, rec->addr, rec->flags);
+        break;
+    case XPDMA_OP_SENDV:
+    case XPDMA_OP_RECVV:
+        issueVector(fpga, rec, (char *)th->buf, result);
+        break;
+    case XPDMA_OP_FLUSH:
+        *result = xpdma_flush(fpga);
+        break;
+    case XPDMA_OP_COPY_P2P:
+        *result = xpdma_copyP2P(fpga, rec->addr, devices[rec->peer].fpga, rec->arg, rec->count);
+        break;
+    case XPDMA_OP_SEND_TRANSFORM:
+    case XPDMA_OP_RECV_TRANSFORM:
+        xpdma_trace_unpackTransform(rec->arg, &tf);
+        if (rec->op == XPDMA_OP_SEND_TRANSFORM)
+            *result = xpdma_sendTransform(fpga, th->buf, rec->count, rec->addr, &tf);
+        else
+            *result = xpdma_recvTransform(fpga, th->buf, rec->count, rec->addr, &tf);
+        break;
+    case XPDMA_OP_LOAD_FILE:
+        // file contents are not recorded: the load reads zeros, the dump discards
+        *result = xpdma_loadFile(fpga, "/dev/zero", 0, rec->count, rec->addr, NULL);
+        break;
+    case XPDMA_OP_DUMP_FILE:
+        *result = xpdma_dumpFile(fpga, "/dev/null", 0, rec->count, rec->addr, NULL);
+        break;
+    case XPDMA_OP_SET_PARAM:
+        *result = xpdma_setParam(fpga, rec->addr, rec->count);
+        break;
+    case XPDMA_OP_SET_COALESCING:
+        *result = xpdma_setCoalescing(fpga, rec->count, rec->addr, rec->arg);
+        break;
+    case XPDMA_OP_SET_REGCACHE:
+        *result = xpdma_setRegCache(fpga, rec->count);
+        break;
+    }
+    return 1;
+}
+
+static void *replayThread(void *arg)
+{
+    struct replay_thread *th = (struct replay_thread *)arg;
+    const xpdma_trace_rec_t *rec;
+    struct replay_stats *st;
+    uint64_t start;
+    uint64_t ns;
+    size_t c;
+    int result;
+
+    for (c = 0; c < th->n; ++c) {
+        rec = &recs[th->recs[c]];
+        st = &th->stats[rec->op];
+
+        if (!opts.fast)
+            sleepUntil(replayBase + (uint64_t)((rec->start - traceBase) / opts.speed));
+
+        start = now();
+        if (!issue(th, rec, &result))
+            continue;
+        ns = now() - start;
+
+        st->calls++;
+        st->bytes += isTransfer(rec->op) ? rec->count : 0;
+        st->failures += result != 0;
+        st->recordedNs += rec->end - rec->start;
+        if (rec->end - rec->start > st->recordedMaxNs)
+            st->recordedMaxNs = rec->end - rec->start;
+        st->replayedNs += ns;
+        if (ns > st->replayedMaxNs)
+            st->replayedMaxNs = ns;
+    }
+    return NULL;
+}
+
+static void report(uint64_t replayNs)
+{
+    struct replay_stats total[XPDMA_OP_NUM];
+    uint64_t span = 0;
+    size_t c;
+    int op;
+
+    memset(total, 0, sizeof(total));
+    for (c = 0; c < nrThreads; ++c) {
+        for (op = 0; op < XPDMA_OP_NUM; ++op) {
+            struct replay_stats *st = &threads[c].stats[op];
+            total[op].calls += st->calls;
+            total[op].bytes += st->bytes;
+            total[op].failures += st->failures;
+            total[op].recordedNs += st->recordedNs;
+            total[op].replayedNs += st->replayedNs;
+            if (st->recordedMaxNs > total[op].recordedMaxNs)
+                total[op].recordedMaxNs = st->recordedMaxNs;
+            if (st->replayedMaxNs > total[op].replayedMaxNs)
+                total[op].replayedMaxNs = st->replayedMaxNs;
+        }
+    }
+    for (c = 0; c < nrRecs; ++c)
+        if (recs[c].end - traceBase > span)
+            span = recs[c].end - traceBase;
+
+    printf("%-13s %9s %14s %6s %12s %12s %12s %12s\n", "op", "calls", "bytes", "fail",
+           "rec avg us", "rec max us", "rep avg us", "rep max us");
+    for (op = 0; op < XPDMA_OP_NUM; ++op) {
+        struct replay_stats *st = &total[op];
+        if (st->calls == 0)
+            continue;
+        printf("%-13s %9llu %14llu %6llu %12.1f %12.1f %12.1f %12.1f\n", opNames[op],
+               (unsigned long long)st->calls, (unsigned long long)st->bytes,
+               (unsigned long long)st->failures,
+               st->recordedNs / 1000.0 / st->calls, st->recordedMaxNs / 1000.0,
+               st->replayedNs / 1000.0 / st->calls, st->replayedMaxNs / 1000.0);
+    }
+    printf("%zu records, %zu threads: recorded %.3f s, replayed %.3f s (%s%s)\n", nrRecs, nrThreads,
+           span / 1e9, replayNs / 1e9, opts.fast ? "as fast as possible" : "recorded timing",
+           opts.emulate ? ", emulated" : "");
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-f] [-s speed] [-b board] [-e] [-B MB/s] [-L us] trace\n", name);
+    printf("  -f  issue calls back to back (default: at the recorded times)\n");
+    printf("  -s  time scale of a timed replay, 2 - twice as fast (default 1)\n");
+    printf("  -b  replay every handle on this board (default: recorded boards)\n");
+    printf("  -e  emulated backend: no board, transfers take the recorded time\n");
+    printf("  -B  emulated transfer bandwidth, MB/s (default: recorded durations)\n");
+    printf("  -L  emulated per call latency with -B, us (default 0)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t replayNs;
+    int result = 0;
+    size_t c;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "fs:b:eB:L:h")) != -1) {
+        switch (opt) {
+        case 'f': opts.fast = 1; break;
+        case 's': opts.speed = atof(optarg); break;
+        case 'b': opts.board = atoi(optarg); break;
+        case 'e': opts.emulate = 1; break;
+        case 'B': opts.bandwidth = atof(optarg) * 1024 * 1024 / 1e9; break;
+        case 'L': opts.latencyNs = (uint64_t)(atof(optarg) * 1000); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1 || opts.speed <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (loadTrace(argv[optind]) || scanTrace())
+        return 1;
+
+    if (setup() == 0) {
+        replayBase = now();
+        for (c = 0; c < nrThreads; ++c)
+            if (pthread_create(&threads[c].thread, NULL, replayThread, &threads[c])) {
+                printf("Can't start replay threads\n");
+                nrThreads = c;
+                result = 1;
+                break;
+            }
+        for (c = 0; c < nrThreads; ++c)
+            pthread_join(threads[c].thread, NULL);
+        replayNs = now() - replayBase;
+        report(replayNs);
+    } else
+        result = 1;
+
+    cleanup();
+    return result;
+}
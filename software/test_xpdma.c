@@ -5,6 +5,7 @@
 #include "xpdma.h"
 #include <sys/time.h>
 #include <stdlib.h> // for rand()
+#include <unistd.h>
 
 #define TEST_SIZE   1024*1024*1024 // 1GB test data
 // #define TEST_SIZE   (1024*1024*8) // 1MB test data
@@ -12,6 +13,175 @@
 #define TEST_ADDR   0 // offset of DDR start address
 #define BOARD_ID    0 // board number (for multiple boards)
 
+#define SWEEP_MIN   64          // smallest transfer of the PIO/DMA sweep
+#define SWEEP_MAX   (1024*1024) // largest transfer of the PIO/DMA sweep
+#define SWEEP_LOOPS 1000        // transfers per size and mode
+
+#define WORKERS_SIZE  (256*1024*1024) // transfer of the bounce copy scaling test
+#define IRQ_SECONDS   10                // user interrupt watch time
+
+static double elapsed_us(struct timeval *start, struct timeval *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000.0 + (end->tv_usec - start->tv_usec);
+}
+
+/**
+ * Latency of small transfers by programmed I/O and by DMA, to choose
+ * XPDMA_PARAM_PIO_SEND_MAX/XPDMA_PARAM_PIO_RECV_MAX for this host
+ */
+static int sweep(xpdma_t *fpga)
+{
+    const unsigned int modes[2] = {XPDMA_FLAG_FORCE_PIO, XPDMA_FLAG_FORCE_DMA};
+    double us[2][2]; // [mode][send/recv]
+    uint64_t window = 0;
+    unsigned int size, loop, mode;
+    struct timeval start, end;
+    char *data;
+
+    xpdma_getParam(fpga, XPDMA_PARAM_PIO_WINDOW, &window);
+    if (window == 0) {
+        printf("No DDR window on this board, programmed I/O not available\n");
+        return 1;
+    }
+
+    data = (char *)xpdma_allocBuffer(fpga, SWEEP_MAX);
+    if (NULL == data)
+        return 1;
+    memset(data, 0x5A, SWEEP_MAX);
+
+    printf("%10s %12s %12s %12s %12s\n", "size", "PIO send us", "DMA send us", "PIO recv us", "DMA recv us");
+    for (size = SWEEP_MIN; size <= SWEEP_MAX; size *= 2) {
+        for (mode = 0; mode < 2; ++mode) {
+            gettimeofday(&start, NULL);
+            for (loop = 0; loop < SWEEP_LOOPS; ++loop)
+                xpdma_sendEx(fpga, data, size, TEST_ADDR, modes[mode]);
+            gettimeofday(&end, NULL);
+            us[mode][0] = elapsed_us(&start, &end) / SWEEP_LOOPS;
+
+            gettimeofday(&start, NULL);
+            for (loop = 0; loop < SWEEP_LOOPS; ++loop)
+                xpdma_recvEx(fpga, data, size, TEST_ADDR, modes[mode]);
+            gettimeofday(&end, NULL);
+            us[mode][1] = elapsed_us(&start, &end) / SWEEP_LOOPS;
+        }
+        printf("%10u %12.2f %12.2f %12.2f %12.2f%s%s\n", size, us[0][0], us[1][0], us[0][1], us[1][1],
+               (us[0][0] > us[1][0]) ? " send:DMA" : " send:PIO",
+               (us[0][1] > us[1][1]) ? " recv:DMA" : " recv:PIO");
+    }
+
+    xpdma_freeBuffer(data, SWEEP_MAX);
+    return 0;
+}
+
+/**
+ * Bounce buffer send/receive throughput with the copy split across 1, 2 and 4
+ * CPUs (XPDMA_PARAM_COPY_WORKERS, needs CAP_SYS_ADMIN), the board setting is
+ * restored afterwards. A failed transfer fails the run, no MB/s is printed.
+ */
+static int workers(xpdma_t *fpga)
+{
+    const uint64_t counts[3] = {1, 2, 4};
+    uint64_t saved = 1;
+    struct timeval start, end;
+    double us[2];
+    unsigned int failures = 0;
+    unsigned int c;
+    char *data;
+
+    if (xpdma_getParam(fpga, XPDMA_PARAM_COPY_WORKERS, &saved)) {
+        printf("Driver has no split bounce copy\n");
+        return 1;
+    }
+
+    data = (char *)xpdma_allocBuffer(fpga, WORKERS_SIZE);
+    if (NULL == data)
+        return 1;
+    memset(data, 0x5A, WORKERS_SIZE);
+
+    printf("%8s %14s %14s\n", "workers", "send MB/s", "recv MB/s");
+    for (c = 0; c < 3; ++c) {
+        if (xpdma_setParam(fpga, XPDMA_PARAM_COPY_WORKERS, counts[c])) {
+            printf("%8llu set copy workers failed (CAP_SYS_ADMIN needed)\n", (unsigned long long)counts[c]);
+            failures++;
+            break;
+        }
+
+        gettimeofday(&start, NULL);
+        if (xpdma_sendEx(fpga, data, WORKERS_SIZE, TEST_ADDR, XPDMA_FLAG_FORCE_DMA)) {
+            printf("%8llu send failed\n", (unsigned long long)counts[c]);
+            failures++;
+            continue;
+        }
+        gettimeofday(&end, NULL);
+        us[0] = elapsed_us(&start, &end);
+
+        gettimeofday(&start, NULL);
+        if (xpdma_recvEx(fpga, data, WORKERS_SIZE, TEST_ADDR, XPDMA_FLAG_FORCE_DMA)) {
+            printf("%8llu recv failed\n", (unsigned long long)counts[c]);
+            failures++;
+            continue;
+        }
+        gettimeofday(&end, NULL);
+        us[1] = elapsed_us(&start, &end);
+
+        printf("%8llu %14.1f %14.1f\n", (unsigned long long)counts[c],
+               WORKERS_SIZE / us[0], WORKERS_SIZE / us[1]);
+    }
+
+    xpdma_setParam(fpga, XPDMA_PARAM_COPY_WORKERS, saved);
+    xpdma_freeBuffer(data, WORKERS_SIZE);
+
+    if (failures) {
+        printf("workers: %u failures, run FAILED\n", failures);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Print user logic interrupts of all vectors for IRQ_SECONDS, no CPU is used
+ * between events
+ */
+static int irqWatch(xpdma_t *fpga)
+{
+    xpdma_irq_events_t events;
+    xpdma_irq_stats_t stats;
+    struct timeval start, now;
+    unsigned int v;
+    int fd;
+
+    if (xpdma_getIrqStats(fpga, &stats) || stats.vectors == 0) {
+        printf("No user interrupt vectors on this board\n");
+        return 1;
+    }
+
+    fd = xpdma_irqOpen(fpga, (1u << stats.vectors) - 1);
+    if (fd < 0)
+        return 1;
+
+    printf("Waiting %d s for interrupts on %u vectors\n", IRQ_SECONDS, stats.vectors);
+    gettimeofday(&start, NULL);
+    for (;;) {
+        gettimeofday(&now, NULL);
+        if (elapsed_us(&start, &now) >= IRQ_SECONDS * 1000000.0)
+            break;
+        if (xpdma_irqWait(fd, IRQ_SECONDS * 1000 - (int)(elapsed_us(&start, &now) / 1000), &events))
+            continue;
+        gettimeofday(&now, NULL);
+        for (v = 0; v < stats.vectors; ++v) {
+            if (events.fired & (1u << v))
+                printf("%12.0f us: vector %u, count %llu\n", elapsed_us(&start, &now), v,
+                       (unsigned long long)events.count[v]);
+        }
+    }
+    close(fd);
+
+    xpdma_getIrqStats(fpga, &stats);
+    for (v = 0; v < stats.vectors; ++v)
+        printf("vector %u: %llu\n", v, (unsigned long long)stats.count[v]);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     xpdma_t * fpga;
     uint32_t buf_size = TEST_SIZE;
@@ -36,14 +206,32 @@ int main(int argc, char *argv[]) {
     }
     printf("Successfull\n");
 
-    data_in = (char *)malloc(buf_size);
+    if (argc > 1 && 0 == strcmp(argv[1], "sweep")) {
+        c = sweep(fpga);
+        xpdma_close(fpga);
+        return c;
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "workers")) {
+        c = workers(fpga);
+        xpdma_close(fpga);
+        return c;
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "irq")) {
+        c = irqWatch(fpga);
+        xpdma_close(fpga);
+        return c;
+    }
+
+    data_in = (char *)xpdma_allocBuffer(fpga, buf_size);
     if (NULL == data_in) {
         printf ("Failed to allocate input buffer memory (size: %u bytes)\n", buf_size);
         xpdma_close(fpga);
         return 1;
     }
 
-    data_out = (char *)malloc(buf_size);
+    data_out = (char *)xpdma_allocBuffer(fpga, buf_size);
     if (NULL == data_out) {
         printf ("Failed to allocate output buffer memory (size: %u bytes)\n", buf_size);
         xpdma_close(fpga);
@@ -87,6 +275,17 @@ int main(int argc, char *argv[]) {
     gettimeofday(&_timers[3], NULL);
     printf("Ok\n");
 
+    {
+        xpdma_stats_t stats;
+        const char *className[XPDMA_PRIO_NUM] = {"normal", "high"};
+        if (xpdma_getStats(fpga, &stats) == 0)
+            for (c = 0; c < XPDMA_PRIO_NUM; ++c)
+                printf("Queue wait (%s): %llu runs, avg %f us, max %f us\n", className[c],
+                       (unsigned long long)stats.requests[c],
+                       stats.requests[c] ? stats.waitNs[c] / 1000.0 / stats.requests[c] : 0.0,
+                       stats.maxWaitNs[c] / 1000.0);
+    }
+
     printf("Close FPGA\n");
     xpdma_close(fpga);
 
@@ -104,8 +303,8 @@ int main(int argc, char *argv[]) {
     } else
         printf("Ok\n");
 
-    free(data_in);
-    free(data_out);
+    xpdma_freeBuffer(data_in, buf_size);
+    xpdma_freeBuffer(data_out, buf_size);
 
     for (c = 0; c < 4; ++c)
         time_ms[c] =